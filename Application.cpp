@@ -3,6 +3,10 @@
  * @brief Manages the main application lifecycle, including window management, LLM interaction, and UI rendering.
  */
 #include "Application.h"
+#include "SessionSnapshot.h"
+#include "AgentFanOut.h"
+#include "FileSummarizer.h"
+#include "PromptCompressor.h"
 #include <stdexcept>
 #include <iostream>
 #include <sstream>
@@ -15,6 +19,18 @@
 
 const std::string MODELS_DIR = "/Users/conorrybacki/.models/";
 
+// Conversations of local models are kept here between runs, one snapshot per tab
+const std::string SESSIONS_DIR = MODELS_DIR + "sessions/";
+
+// Summaries of attached files too large for a context window, by content hash
+const std::string SUMMARIES_DIR = MODELS_DIR + "summaries/";
+
+// KV cells set aside for prompt prefixes shared between conversation tabs
+const uint32_t PREFIX_CACHE_CELLS = 2048;
+
+// Replies sampled side by side by the Variants button
+const uint32_t VARIANT_COUNT = 3;
+
 /**
  * @brief Constructor for the Application class
  * 
@@ -24,14 +40,36 @@ Application::Application() :
 m_window(nullptr),
 m_renderer(nullptr),
 m_contextManager(nullptr),
-m_modelManager(nullptr) 
+m_modelManager(nullptr),
+m_currentModelInterface(nullptr)
 {
     initWindow();
     initOpenGL();
     initImGui();
     m_contextManager = std::make_unique<ContextManager>();
+    m_contextManager->setSummaryCacheDirectory(SUMMARIES_DIR);
     m_modelManager = ModelManager::getInstance();
     m_modelManager->setModelDirectory(MODELS_DIR);
+    // Keep llama.cpp out of the GUI process so a crash during inference doesn't take the UI with it
+    m_modelManager->setIsolatedWorkers(true);
+    // Tabs usually open with the same system prompt and files; their shared prefix is copied
+    // into each tab's sequence instead of being prefilled again
+    m_modelManager->setPrefixCacheCells(PREFIX_CACHE_CELLS);
+    // The file tools always see the files attached at the time of the call
+    m_tools.addFileTools([this]() {
+        std::vector<std::pair<std::string, std::string>> files;
+        for (const auto& [name, path] : m_contextManager->getNamedPaths()) {
+            files.emplace_back(name, m_contextManager->getFileContents(path));
+        }
+        return files;
+    });
+    openTab();
+
+    // Prefer a running smart-agentd so models are shared with every other client on this host
+    auto daemon = DaemonClient::connect(DaemonProtocol::defaultSocketPath());
+    if (daemon.has_value()) {
+        m_daemonClient = std::move(daemon.value());
+    }
     fetchLLMs();
 }
 
@@ -55,6 +93,18 @@ Application::~Application() {
  */
 void Application::fetchLLMs() 
 {
+  if(m_daemonClient)
+  {
+    auto daemonResp = m_daemonClient->fetchModels();
+    if(daemonResp.has_value())
+    {
+      m_llms = daemonResp.value();
+      return;
+    }
+    std::cout << "Error fetching model names from smart-agentd!" << std::endl;
+    return;
+  }
+
   auto fetchResp = m_modelManager->fetchModels();
   if(fetchResp.has_value())
   {
@@ -78,8 +128,32 @@ void Application::fetchLLMs()
  */
 void Application::startLLM(const std::string& llmName) 
 {
+  if(m_daemonClient)
+  {
+    // The daemon shares the model if another client already has it resident
+    if(m_daemonClient->loadModel(llmName).has_value())
+    {
+      m_currentModelInterface = nullptr;
+      m_currentLLM = llmName;
+      m_isLLMRunning = true;
+      m_showPromptWindow = true;
+      // The daemon binds one conversation to each client, so there is a single tab
+      while(m_tabs.size() > 1)
+      {
+        closeTab(m_tabs.size() - 1);
+      }
+    }
+    else
+    {
+      std::cout << "Error loading model : " << llmName << " - " << m_daemonClient->getLastError() << std::endl;
+    }
+    return;
+  }
+
   // Start the model specified by the name selected - note this call will
-  // handle appending model directory path and ".gguf" to model name
+  // handle appending model directory path and ".gguf" to model name. A compression model was
+  // chosen for the model running before, it goes first.
+  setCompressionModel("");
   auto loadResp = m_modelManager->loadModel(llmName);
   if(loadResp.has_value())
   {
@@ -87,6 +161,20 @@ void Application::startLLM(const std::string& llmName)
     m_currentLLM = llmName;
     m_isLLMRunning = true;
     m_showPromptWindow = true;
+    m_toolAgent = std::make_unique<ToolAgent>(m_currentModelInterface, &m_tools);
+    // Chunk token counts are cached, so each chunk is tokenized once per model. An isolated model's
+    // vocabulary is in its worker, so chunks are estimated from their length instead.
+    ModelInterface* model = m_currentModelInterface;
+    if (!model->isIsolated()) {
+      m_contextManager->setTokenCounter([model](const std::string& text) { return model->countTokens(text); });
+    }
+    // Files that do not fit in a sequence are summarized in the background on the same model
+    m_contextManager->setSummarizer([model](const std::string& name, const std::vector<std::string>& pieces,
+                                            const std::function<bool()>& keepGoing) {
+      SummaryReport report = FileSummarizer(model).summarize(name, pieces, keepGoing);
+      return FileSummary{std::move(report.summary), report.failedTasks == 0 && !report.cancelled};
+    }, model->getSequenceContext(), FileSummarizer(model).pieceTokens());
+    resumeSession(llmName);
   }
   else
   {
@@ -105,13 +193,213 @@ void Application::stopLLM()
 {
   if(m_isLLMRunning)
   {
-    m_modelManager->unloadModel();
+    if(m_daemonClient)
+    {
+      m_daemonClient->releaseModel();
+    }
+    else
+    {
+      // Keep every tab's conversation, KV cache included, so running this model again resumes them
+      std::error_code ec;
+      std::filesystem::create_directories(SESSIONS_DIR, ec);
+      size_t saved = 0;
+      for(const auto& tab : m_tabs)
+      {
+        if(m_currentModelInterface &&
+           m_currentModelInterface->saveSnapshot(sessionSnapshotPath(m_currentLLM, saved), tab.conversation))
+        {
+          saved++;
+        }
+      }
+      // Drop snapshots of tabs closed since the last save
+      size_t stale = saved;
+      while(std::filesystem::remove(sessionSnapshotPath(m_currentLLM, stale), ec))
+      {
+        stale++;
+      }
+      m_toolAgent.reset();
+      setCompressionModel("");
+      m_contextManager->setTokenCounter(nullptr);
+      m_contextManager->setSummarizer(nullptr);
+      m_modelManager->unloadModel();
+    }
     m_currentModelInterface = nullptr;
     m_currentLLM = "";
     m_isLLMRunning = false;
   }
 }
 
+/**
+ * @brief Path of the snapshot a model's conversation is kept in between runs
+ * 
+ * @param llmName The name of the LLM model the conversation belongs to
+ * @param tab Position of the conversation's tab
+ */
+std::string Application::sessionSnapshotPath(const std::string& llmName, size_t tab) const
+{
+  return SESSIONS_DIR + std::filesystem::path(llmName).filename().string() + "-" + std::to_string(tab) + ".snap";
+}
+
+/**
+ * @brief Resume the conversations saved when the model last stopped
+ * 
+ * @param llmName The name of the LLM model that was just started
+ * 
+ * Restores messages and KV cache from the model's snapshots, one tab per snapshot,
+ * so the next prompt does not prefill a whole conversation again
+ */
+void Application::resumeSession(const std::string& llmName)
+{
+  // Conversations of the previous model are gone with it
+  while(m_tabs.size() > 1)
+  {
+    closeTab(m_tabs.size() - 1);
+  }
+  {
+    std::lock_guard<std::mutex> gLock(m_responseMutex);
+    m_tabs.front().history.clear();
+  }
+
+  std::error_code ec;
+  for(size_t index = 0; std::filesystem::exists(sessionSnapshotPath(llmName, index), ec); index++)
+  {
+    const std::string path = sessionSnapshotPath(llmName, index);
+    auto snapshot = SessionSnapshot::open(path);
+    if(!snapshot.has_value())
+    {
+      continue;
+    }
+    if(index > 0)
+    {
+      openTab();
+    }
+    const int32_t conversation = m_tabs.back().conversation;
+    if(!m_currentModelInterface->restoreSnapshot(path, conversation))
+    {
+      continue;
+    }
+
+    std::string history;
+    for(const auto& [role, content] : snapshot.value()->getMessages())
+    {
+      if(role == "assistant")
+      {
+        history += llmName + ": " + content;
+      }
+      else
+      {
+        history += role + ": " + content + "\n";
+      }
+    }
+    appendToTab(conversation, history);
+  }
+  m_activeTab = 0;
+}
+
+/**
+ * @brief Compress the attached files of every prompt with a second, small model
+ * 
+ * @param llmName The name of the scoring model, empty to stop compressing
+ * 
+ * The scoring model is kept resident as the fallback model next to the running one
+ */
+void Application::setCompressionModel(const std::string& llmName)
+{
+  if(m_currentModelInterface)
+  {
+    m_currentModelInterface->setCompressor(nullptr);
+  }
+  m_compressor.reset();
+  if(!m_compressionLLM.empty())
+  {
+    m_modelManager->unloadFallbackModel();
+    m_compressionLLM.clear();
+  }
+  if(llmName.empty() || !m_currentModelInterface)
+  {
+    return;
+  }
+
+  auto scorerResp = m_modelManager->loadFallbackModel(llmName);
+  if(!scorerResp.has_value())
+  {
+    #ifdef _DEBUG
+      std::cout << "Error loading compression model : " << llmName << std::endl;
+    #endif
+    return;
+  }
+  m_compressor = std::make_shared<PromptCompressor>(scorerResp.value());
+  m_currentModelInterface->setCompressor(m_compressor);
+  m_compressionLLM = llmName;
+}
+
+/**
+ * @brief Open a new conversation tab and make it the active one
+ * 
+ * Each tab is its own conversation with the loaded model, bound to its own KV sequence
+ */
+void Application::openTab()
+{
+  std::lock_guard<std::mutex> gLock(m_responseMutex);
+  const int32_t conversation = m_nextConversation++;
+  m_tabs.push_back({conversation, "Chat " + std::to_string(m_tabs.size() + 1), ""});
+  m_activeTab = m_tabs.size() - 1;
+}
+
+/**
+ * @brief Close a conversation tab and free its KV sequence
+ * 
+ * @param index Position of the tab to close
+ */
+void Application::closeTab(size_t index)
+{
+  int32_t conversation = INTERACTIVE_SESSION;
+  {
+    std::lock_guard<std::mutex> gLock(m_responseMutex);
+    if(index >= m_tabs.size() || m_tabs.size() == 1)
+    {
+      return;
+    }
+    conversation = m_tabs[index].conversation;
+    m_tabs.erase(m_tabs.begin() + index);
+    if(conversation == m_variantConversation)
+    {
+      m_variants.clear();
+    }
+    if(m_activeTab >= index && m_activeTab > 0)
+    {
+      m_activeTab--;
+    }
+  }
+  if(m_currentModelInterface)
+  {
+    m_currentModelInterface->closeConversation(conversation);
+  }
+  if(m_toolAgent)
+  {
+    m_toolAgent->forgetConversation(conversation);
+  }
+}
+
+/**
+ * @brief Append text to the history of a conversation's tab
+ * 
+ * @param conversation The conversation the text belongs to
+ * @param text Text to append, dropped if the tab has been closed
+ */
+void Application::appendToTab(int32_t conversation, const std::string& text)
+{
+  std::lock_guard<std::mutex> gLock(m_responseMutex);
+  for(auto& tab : m_tabs)
+  {
+    if(tab.conversation == conversation)
+    {
+      tab.history += text;
+      return;
+    }
+  }
+}
+
 /**
  * @brief Send a prompt to the currently running LLM
  * 
@@ -126,17 +414,18 @@ void Application::sendPrompt(const std::string& prompt, bool keepAlive)
       std::cout << "Application::sendPrompt entered with prompt : " << prompt << std::endl;
     #endif
 
-    // Add the prompt to the chat history
-    {
-        std::lock_guard<std::mutex> gLock(m_responseMutex);
-        m_conversationHistory += "User: ";
-        m_conversationHistory += prompt;
-        m_conversationHistory += "\n";
+    // Add the prompt to the active tab's history - the reply goes to that tab even if another is
+    // selected while it streams
+    const int32_t conversation = m_tabs[m_activeTab].conversation;
+    // Moving on without picking a variant keeps the first, as the model does
+    if (!m_variants.empty() && m_variantConversation == conversation) {
+        keepVariant(0);
     }
+    appendToTab(conversation, "User: " + prompt + "\n");
 
     // In an async thread - send the prompt to the LLM and stream the response
-    std::thread([this, prompt, keepAlive]() {
-      streamLLMResponse(m_currentLLM, prompt, keepAlive);
+    std::thread([this, prompt, conversation, keepAlive]() {
+      streamLLMResponse(m_currentLLM, prompt, conversation, keepAlive);
     }).detach();
 }
 
@@ -145,11 +434,13 @@ void Application::sendPrompt(const std::string& prompt, bool keepAlive)
  * 
  * @param llmName The name of the LLM model generating the response
  * @param prompt The text prompt sent to the LLM
+ * @param conversation The conversation (tab) the prompt belongs to
  * @param keepAlive Whether to keep the LLM loaded after processing (default: true)
  * 
  * Handles the streaming of tokens from the LLM's response, updating the UI in real-time
  */
-void Application::streamLLMResponse(const std::string& llmName, const std::string& prompt, bool keepAlive)
+void Application::streamLLMResponse(const std::string& llmName, const std::string& prompt, int32_t conversation,
+                                    bool keepAlive)
 {
     m_isWaitingForResponse = true;
     #ifdef _DEBUG
@@ -174,16 +465,30 @@ void Application::streamLLMResponse(const std::string& llmName, const std::strin
         #endif
         return;
     }
-    {
-        std::lock_guard<std::mutex> gLock(m_responseMutex);
-        m_conversationHistory += llmName + ": ";
-    }
+    appendToTab(conversation, llmName + ": ");
     // Send the prompt and generate the response in a separate thread, passing it the pipe FD
     // for writing
     int writeFd = pipeFd[1];
-    std::thread modelThread([this, prompt, writeFd]()
+    // A local model gets as many of the attached file chunks most relevant to this prompt as the
+    // context has room for next to the conversation; their KV blocks are prefilled once and reused
+    // whenever a later prompt selects them again
+    std::vector<std::string> chunks;
+    if (!m_daemonClient) {
+        chunks = m_contextManager->packChunks(prompt, m_currentModelInterface->getContextBudget(prompt, "User", {}, conversation));
+    }
+    std::thread modelThread([this, prompt, writeFd, chunks, conversation]()
     {
-        m_currentModelInterface->sendPrompt(writeFd, prompt, "User");
+        if (m_daemonClient) {
+            m_daemonClient->sendPrompt(writeFd, prompt, "User");
+        } else if (m_useTools && m_toolAgent) {
+            // Tool calls run between the model's turns; only the reply text reaches the pipe
+            m_toolAgent->sendPrompt(prompt, [writeFd](const std::string& piece) {
+                return write(writeFd, piece.data(), piece.size()) != -1;
+            }, chunks, conversation);
+            close(writeFd);
+        } else {
+            m_currentModelInterface->sendPrompt(writeFd, prompt, "User", chunks, {}, conversation);
+        }
     });
     char buffer;
     while(true)
@@ -192,10 +497,7 @@ void Application::streamLLMResponse(const std::string& llmName, const std::strin
         if(bytesRead > 0)
         {
             // add the character to the response
-            {
-                std::lock_guard<std::mutex> gLock(m_responseMutex);
-                m_conversationHistory += buffer;
-            }
+            appendToTab(conversation, std::string(1, buffer));
         }
         else if(bytesRead == -1 && errno == EAGAIN)
         {
@@ -224,6 +526,105 @@ void Application::streamLLMResponse(const std::string& llmName, const std::strin
     m_isWaitingForResponse = false;
 }
 
+/**
+ * @brief Send a prompt and sample several replies to it side by side
+ * 
+ * @param prompt The text prompt to send to the LLM
+ * 
+ * The prompt is prefilled once and forked into a KV sequence per variant; the replies
+ * stream into the Variants panel until one of them is kept
+ */
+void Application::sendPromptVariants(const std::string& prompt)
+{
+    const int32_t conversation = m_tabs[m_activeTab].conversation;
+    if (!m_variants.empty() && m_variantConversation == conversation) {
+        keepVariant(0);
+    }
+    appendToTab(conversation, "User: " + prompt + "\n");
+    {
+        std::lock_guard<std::mutex> gLock(m_responseMutex);
+        m_variants.assign(VARIANT_COUNT, "");
+        m_variantConversation = conversation;
+        m_variantsReady = false;
+    }
+    m_isWaitingForResponse = true;
+
+    std::thread([this, prompt, conversation]() {
+        const std::vector<std::string> chunks = m_contextManager->packChunks(
+            prompt, m_currentModelInterface->getContextBudget(prompt, "User", {}, conversation));
+        const std::vector<GenerationResult> results = m_currentModelInterface->sendPromptVariants(
+            prompt, "User", VARIANT_COUNT, [this](uint32_t variant, const std::string& piece) {
+                std::lock_guard<std::mutex> gLock(m_responseMutex);
+                if (variant < m_variants.size()) {
+                    m_variants[variant] += piece;
+                }
+                return true;
+            }, chunks, conversation);
+        {
+            // The model may have had fewer sequences to spare than variants were asked for
+            std::lock_guard<std::mutex> gLock(m_responseMutex);
+            m_variants.resize(std::min(m_variants.size(), results.size()));
+            m_variantsReady = true;
+        }
+        m_isWaitingForResponse = false;
+    }).detach();
+}
+
+/**
+ * @brief Ask the same question of every attached file through parallel sub-agents
+ * 
+ * @param prompt The question to answer for each file
+ * 
+ * Each file gets a short sub-task of its own, batched behind a shared system prompt; only
+ * the merged answer streams into the conversation
+ */
+void Application::sendPromptPerFile(const std::string& prompt)
+{
+    const int32_t conversation = m_tabs[m_activeTab].conversation;
+    if (!m_variants.empty() && m_variantConversation == conversation) {
+        keepVariant(0);
+    }
+    std::vector<std::pair<std::string, std::string>> files;
+    // Files too large for a sub-agent's sequence are handed over as their summary
+    for (const auto& [name, path] : m_contextManager->getNamedPaths()) {
+        files.emplace_back(name, m_contextManager->getAttachedContents(path));
+    }
+    appendToTab(conversation, "User: " + prompt + "\n");
+    appendToTab(conversation, m_currentLLM + ": ");
+    m_isWaitingForResponse = true;
+
+    std::thread([this, prompt, files, conversation]() {
+        AgentFanOut fanOut(m_currentModelInterface);
+        fanOut.run(prompt, files, [this, conversation](const std::string& piece) {
+            appendToTab(conversation, piece);
+            return true;
+        }, conversation);
+        m_isWaitingForResponse = false;
+    }).detach();
+}
+
+/**
+ * @brief Make one of the sampled variants the reply of its conversation
+ * 
+ * @param index Position of the variant to keep, the others are discarded
+ */
+void Application::keepVariant(size_t index)
+{
+    std::string reply;
+    {
+        std::lock_guard<std::mutex> gLock(m_responseMutex);
+        if (!m_variantsReady || index >= m_variants.size()) {
+            return;
+        }
+        reply = m_variants[index];
+        m_variants.clear();
+    }
+    if (m_currentModelInterface) {
+        m_currentModelInterface->keepVariant(static_cast<uint32_t>(index), m_variantConversation);
+    }
+    appendToTab(m_variantConversation, m_currentLLM + ": " + reply);
+}
+
 /**
  * @brief Initialize the GLFW window
  * 
@@ -373,12 +774,51 @@ void Application::drawUI() {
             m_contextManager->addFile(filePath);
         }
     }
+    // A whole folder, optionally narrowed by a glob such as *.cpp or src/**/*.h
+    static char globBuffer[128] = "";
+    ImGui::SameLine();
+    if (ImGui::Button("+ Folder")) {
+        std::string folderPath = m_contextManager->openFolderDialog();
+        if (!folderPath.empty()) {
+            // Walking and reading a large tree takes a while, the files appear once it is done
+            m_contextManager->addDirectoryAsync(folderPath, globBuffer);
+        }
+    }
+    ImGui::SameLine();
+    ImGui::PushItemWidth(120.0f);
+    ImGui::InputTextWithHint("##glob", "glob, e.g. *.cpp", globBuffer, IM_ARRAYSIZE(globBuffer));
+    ImGui::PopItemWidth();
     float windowWidth = ImGui::GetWindowWidth();
     float buttonWidth = ImGui::CalcTextSize("Clear All").x + ImGui::GetStyle().FramePadding.x * 2.0f;
     ImGui::SameLine(windowWidth - buttonWidth - ImGui::GetStyle().ItemSpacing.x);
     if (ImGui::Button("Clear All")) {
         m_contextManager->clearAll();
     }
+    // Throughput of the last folder read
+    const FileReadStats readStats = m_contextManager->getLastReadStats();
+    if (readStats.files > 0) {
+        ImGui::TextDisabled("Read %zu files in %.0f ms, %.0f files/s (%s)", readStats.files, readStats.ms,
+                            readStats.filesPerSecond(), FileReader::backendName(readStats.backend));
+    }
+    const size_t pendingDirectories = m_contextManager->getPendingDirectories();
+    if (pendingDirectories > 0) {
+        ImGui::TextDisabled("Reading %zu folder(s)...", pendingDirectories);
+    }
+    const size_t pendingSummaries = m_contextManager->getPendingSummaries();
+    if (pendingSummaries > 0) {
+        ImGui::TextDisabled("Summarizing %zu large file(s)...", pendingSummaries);
+    }
+    // How much of the last prompt's room for reference material the attached files filled
+    const ContextPackStats packStats = m_contextManager->getLastPackStats();
+    if (packStats.budget > 0) {
+        const std::string fill = std::to_string(packStats.tokens) + " of " + std::to_string(packStats.budget) +
+                                 " tokens (" + std::to_string(static_cast<int>(packStats.fillRatio() * 100.0)) +
+                                 "%), " + std::to_string(packStats.chunks) + " chunks";
+        ImGui::ProgressBar(static_cast<float>(packStats.fillRatio()), ImVec2(-1.0f, 0.0f), fill.c_str());
+        if (packStats.duplicates > 0) {
+            ImGui::TextDisabled("%zu matching chunks, %zu left out as copies", packStats.candidates, packStats.duplicates);
+        }
+    }
     ImGui::Separator();
     m_contextManager->renderFileList();
     ImGui::End(); // End Context window
@@ -403,6 +843,33 @@ void Application::drawUI() {
             }
         }
     }
+    // A second, small model may shorten the attached files before the running one reads them. It
+    // scores tokens in this process, so isolated models cannot be used for it.
+    if (m_isLLMRunning && !m_daemonClient && m_currentModelInterface && !m_currentModelInterface->isIsolated()) {
+        ImGui::Separator();
+        ImGui::BeginDisabled(m_isWaitingForResponse);
+        const std::string preview = m_compressionLLM.empty() ? "None" : m_compressionLLM;
+        if (ImGui::BeginCombo("Compress files with", preview.c_str())) {
+            if (ImGui::Selectable("None", m_compressionLLM.empty()) && !m_compressionLLM.empty()) {
+                setCompressionModel("");
+            }
+            for (const auto& llm : m_llms) {
+                if (llm.first != m_currentLLM &&
+                    ImGui::Selectable(llm.first.c_str(), m_compressionLLM == llm.first) && m_compressionLLM != llm.first) {
+                    setCompressionModel(llm.first);
+                }
+            }
+            ImGui::EndCombo();
+        }
+        ImGui::EndDisabled();
+        if (m_compressor) {
+            const CompressionStats stats = m_compressor->getStats();
+            if (stats.originalTokens > 0) {
+                ImGui::TextDisabled("Kept %zu of %zu tokens (%.0f%%), %.0f ms scoring", stats.keptTokens,
+                                    stats.originalTokens, stats.keptRatio() * 100.0, stats.scoringMs);
+            }
+        }
+    }
     ImGui::End(); // End LLMs window
 
     // Prompt window - show only when an LLM is running
@@ -446,30 +913,61 @@ void Application::drawUI() {
         }
         
         // Show file context status
-        std::vector<std::string> contextFiles = m_contextManager->getFilePaths();
-        if (!contextFiles.empty()) {
+        const size_t contextFiles = m_contextManager->getFileCount();
+        if (contextFiles > 0) {
             if (m_isWaitingForResponse) {
                 ImGui::SameLine();
             }
             ImGui::TextColored(ImVec4(0.0f, 0.8f, 0.0f, 1.0f), 
-                              "Using %zu file(s) as context", contextFiles.size());
+                              "Using %zu file(s) as context", contextFiles);
         }
         
-        if (m_isWaitingForResponse || !contextFiles.empty()) {
+        if (m_isWaitingForResponse || contextFiles > 0) {
             ImGui::Separator();
         }
         
+        // One tab per conversation; switching tabs only changes which history is shown and
+        // which KV sequence the next prompt continues
+        if (ImGui::BeginTabBar("Conversations", ImGuiTabBarFlags_AutoSelectNewTabs)) {
+            size_t closeIndex = m_tabs.size();
+            for (size_t i = 0; i < m_tabs.size(); ++i) {
+                bool open = true;
+                const std::string label = m_tabs[i].title + "##" + std::to_string(m_tabs[i].conversation);
+                // The tab streaming a reply stays open until the reply is done
+                bool* closable = (m_tabs.size() > 1 && !m_isWaitingForResponse) ? &open : nullptr;
+                if (ImGui::BeginTabItem(label.c_str(), closable)) {
+                    m_activeTab = i;
+                    ImGui::EndTabItem();
+                }
+                if (!open) {
+                    closeIndex = i;
+                }
+            }
+            // The daemon binds one conversation to each client, so it gets no extra tabs
+            if (!m_daemonClient && ImGui::TabItemButton("+", ImGuiTabItemFlags_Trailing)) {
+                openTab();
+            }
+            ImGui::EndTabBar();
+            if (closeIndex < m_tabs.size()) {
+                closeTab(closeIndex);
+            }
+        }
+
         // Calculate the height for the conversation history
         float inputHeight = 30.0f; // Approximate height of input area
-        float statusHeight = (m_isWaitingForResponse || !contextFiles.empty()) ? 40.0f : 0.0f;
+        float statusHeight = (m_isWaitingForResponse || contextFiles > 0) ? 40.0f : 0.0f;
         float historyHeight = ImGui::GetContentRegionAvail().y - inputHeight - statusHeight;
+        // Variants of the active tab's last prompt share the space with its history
+        const bool showVariants = !m_variants.empty() && m_variantConversation == m_tabs[m_activeTab].conversation;
+        float variantsHeight = showVariants ? historyHeight * 0.5f : 0.0f;
+        historyHeight -= variantsHeight;
         
         // Display conversation history in a scrollable area
         ImGui::BeginChild("ConversationHistory", ImVec2(0, historyHeight), true);
         {
             std::lock_guard<std::mutex> lock(m_responseMutex);
             // Display the conversation history in Green color
-            std::stringstream ss(m_conversationHistory);
+            std::stringstream ss(m_tabs[m_activeTab].history);
             std::string line;
             while(std::getline(ss, line))
             {
@@ -491,6 +989,31 @@ void Application::drawUI() {
             ImGui::SetScrollHereY(1.0f);
         
         ImGui::EndChild();
+
+        if (showVariants) {
+            ImGui::BeginChild("Variants", ImVec2(0, variantsHeight), true);
+            size_t keep = m_variants.size();
+            {
+                std::lock_guard<std::mutex> lock(m_responseMutex);
+                if (ImGui::BeginTable("VariantTable", static_cast<int>(m_variants.size()),
+                                      ImGuiTableFlags_Borders | ImGuiTableFlags_Resizable)) {
+                    for (size_t i = 0; i < m_variants.size(); ++i) {
+                        ImGui::TableNextColumn();
+                        ImGui::PushID(static_cast<int>(i));
+                        if (m_variantsReady && ImGui::SmallButton("Keep")) {
+                            keep = i;
+                        }
+                        ImGui::TextWrapped("%s", m_variants[i].c_str());
+                        ImGui::PopID();
+                    }
+                    ImGui::EndTable();
+                }
+            }
+            ImGui::EndChild();
+            if (keep < m_variants.size()) {
+                keepVariant(keep);
+            }
+        }
         
         // Input area for user prompt
         ImGui::PushItemWidth(-1);
@@ -517,6 +1040,38 @@ void Application::drawUI() {
             m_userPrompt.clear();
             inputBuffer[0] = '\0'; // Clear the buffer
         }
+
+        // Several replies to compare, sampled from one prefill of the prompt (local models only)
+        if (!m_daemonClient) {
+            ImGui::SameLine();
+            ImGui::BeginDisabled(m_isWaitingForResponse);
+            if (ImGui::Button("Variants") && inputBuffer[0] != '\0') {
+                m_userPrompt = inputBuffer;
+                sendPromptVariants(m_userPrompt);
+                m_userPrompt.clear();
+                inputBuffer[0] = '\0'; // Clear the buffer
+            }
+            ImGui::EndDisabled();
+        }
+
+        // One sub-agent per attached file, merged into a single answer (local models only)
+        if (!m_daemonClient && contextFiles > 1) {
+            ImGui::SameLine();
+            ImGui::BeginDisabled(m_isWaitingForResponse);
+            if (ImGui::Button("Each file") && inputBuffer[0] != '\0') {
+                m_userPrompt = inputBuffer;
+                sendPromptPerFile(m_userPrompt);
+                m_userPrompt.clear();
+                inputBuffer[0] = '\0'; // Clear the buffer
+            }
+            ImGui::EndDisabled();
+        }
+
+        // Let the model look through the attached files with tools (local models only)
+        if (!m_daemonClient) {
+            ImGui::SameLine();
+            ImGui::Checkbox("Tools", &m_useTools);
+        }
         
         ImGui::End(); // End Prompt window
     } else {
@@ -583,7 +1138,7 @@ void Application::drawShutdownWindow() {
  * Adds the file to the current LLM's context when available.
  */
 void Application::handleFileAdded(const std::string& filePath) {
-    if (!m_isLLMRunning || !m_currentModelInterface) {
+    if (!m_isLLMRunning || (!m_currentModelInterface && !m_daemonClient)) {
         return; // No LLM running, can't send file
     }
     
@@ -591,6 +1146,11 @@ void Application::handleFileAdded(const std::string& filePath) {
       std::cout << "File added to context: " << filePath << std::endl;
     #endif
     
+    // A local model receives the file chunk by chunk alongside each prompt instead
+    if (!m_daemonClient) {
+        return;
+    }
+    
     // Get the file content
     std::string fileContent = m_contextManager->getFileContents(filePath);
     
@@ -610,7 +1170,7 @@ void Application::handleFileAdded(const std::string& filePath) {
     
     // Send the file context to the model in a separate thread
     std::thread([this, contextPrompt, pipeFd]() {
-        m_currentModelInterface->sendPrompt(pipeFd[1], contextPrompt, "System");
+        m_daemonClient->sendPrompt(pipeFd[1], contextPrompt, "System");
         close(pipeFd[1]); // Close write end when done
     }).detach();
     
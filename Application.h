@@ -9,6 +9,9 @@
 #include "ContextManager.h"
 #include "ModelManager.h"
 #include "ModelInterface.h"
+#include "DaemonClient.h"
+#include "ToolRegistry.h"
+#include "ToolAgent.h"
 #include <memory>
 #include <string>
 #include <vector>
@@ -107,6 +110,55 @@ private:
      */
     void stopLLM();
     
+    /**
+     * @brief Path of the snapshot a model's conversation is kept in between runs
+     * 
+     * @param llmName The name of the LLM model the conversation belongs to
+     * @param tab Position of the conversation's tab
+     */
+    std::string sessionSnapshotPath(const std::string& llmName, size_t tab) const;
+
+    /**
+     * @brief Resume the conversations saved when the model last stopped
+     * 
+     * @param llmName The name of the LLM model that was just started
+     * 
+     * Restores messages and KV cache from the model's snapshots, one tab per snapshot,
+     * so the next prompt does not prefill a whole conversation again
+     */
+    void resumeSession(const std::string& llmName);
+
+    /**
+     * @brief Compress the attached files of every prompt with a second, small model
+     * 
+     * @param llmName The name of the scoring model, empty to stop compressing
+     * 
+     * The scoring model is kept resident as the fallback model next to the running one
+     */
+    void setCompressionModel(const std::string& llmName);
+
+    /**
+     * @brief Open a new conversation tab and make it the active one
+     * 
+     * Each tab is its own conversation with the loaded model, bound to its own KV sequence
+     */
+    void openTab();
+
+    /**
+     * @brief Close a conversation tab and free its KV sequence
+     * 
+     * @param index Position of the tab to close
+     */
+    void closeTab(size_t index);
+
+    /**
+     * @brief Append text to the history of a conversation's tab
+     * 
+     * @param conversation The conversation the text belongs to
+     * @param text Text to append, dropped if the tab has been closed
+     */
+    void appendToTab(int32_t conversation, const std::string& text);
+
     /**
      * @brief Send a prompt to the currently running LLM
      * 
@@ -116,17 +168,46 @@ private:
      * Sends the user's prompt to the LLM and initiates response streaming
      */
     void sendPrompt(const std::string& prompt, bool keepAlive = true);
+
+    /**
+     * @brief Send a prompt and sample several replies to it side by side
+     * 
+     * @param prompt The text prompt to send to the LLM
+     * 
+     * The prompt is prefilled once and forked into a KV sequence per variant; the replies
+     * stream into the Variants panel until one of them is kept
+     */
+    void sendPromptVariants(const std::string& prompt);
+
+    /**
+     * @brief Ask the same question of every attached file through parallel sub-agents
+     * 
+     * @param prompt The question to answer for each file
+     * 
+     * Each file gets a short sub-task of its own, batched behind a shared system prompt; only
+     * the merged answer streams into the conversation
+     */
+    void sendPromptPerFile(const std::string& prompt);
+
+    /**
+     * @brief Make one of the sampled variants the reply of its conversation
+     * 
+     * @param index Position of the variant to keep, the others are discarded
+     */
+    void keepVariant(size_t index);
     
     /**
      * @brief Stream the LLM's response to a prompt
      * 
      * @param llmName The name of the LLM model generating the response
      * @param prompt The text prompt sent to the LLM
+     * @param conversation The conversation (tab) the prompt belongs to
      * @param keepAlive Whether to keep the LLM loaded after processing (default: true)
      * 
      * Handles the streaming of tokens from the LLM's response, updating the UI in real-time
      */
-    void streamLLMResponse(const std::string& llmName, const std::string& prompt, bool keepAlive = true);
+    void streamLLMResponse(const std::string& llmName, const std::string& prompt, int32_t conversation,
+                           bool keepAlive = true);
     
     /**
      * @brief Handle the addition of a file to the context
@@ -145,6 +226,8 @@ private:
     // Model management
     ModelManager* m_modelManager;
     ModelInterface* m_currentModelInterface;
+    // Connection to a shared smart-agentd, when one is running the GUI loads nothing itself
+    std::unique_ptr<DaemonClient> m_daemonClient;
 
     // Window dimensions and application name
     const int m_WIDTH = 1000;
@@ -156,10 +239,20 @@ private:
     std::string m_currentLLM; // Currently running LLM
     bool m_isLLMRunning = false;
     
+    // One conversation per tab of the Prompt window
+    struct ConversationTab
+    {
+        int32_t conversation;
+        std::string title;
+        std::string history;
+    };
+
     // Prompt and response handling
     std::string m_userPrompt;
     std::string m_llmResponse;
-    std::string m_conversationHistory;
+    std::vector<ConversationTab> m_tabs;
+    size_t m_activeTab = 0;
+    int32_t m_nextConversation = INTERACTIVE_SESSION;
     bool m_showPromptWindow = false;
     
     // Threading for LLM communication
@@ -167,6 +260,20 @@ private:
     std::atomic<bool> m_stopRequested{false};
     std::mutex m_responseMutex;
 
+    // Replies of the last variants prompt, shown side by side until one is kept
+    std::vector<std::string> m_variants;
+    int32_t m_variantConversation = INTERACTIVE_SESSION;
+    bool m_variantsReady = false;
+
+    // Tools over the attached files the local model may call while answering
+    ToolRegistry m_tools;
+    std::unique_ptr<ToolAgent> m_toolAgent;
+    bool m_useTools = false;
+
+    // Leaves the least informative parts of attached files out before they are prefilled
+    std::shared_ptr<PromptCompressor> m_compressor;
+    std::string m_compressionLLM;
+
     // Response tracking
     bool m_isWaitingForResponse = false;
     
@@ -3,18 +3,293 @@
  * @brief Manages file context for the application, including file loading, listing, and content retrieval.
  */
 #include "ContextManager.h"
+#include "ThreadPool.h"
+#include "TextScan.h"
+#include "SourceChunker.h"
 #include <imgui.h>
 #include <filesystem>
 #include <algorithm>
 #include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <condition_variable>
+#include <future>
+#include <iostream>
+#include <thread>
+#include <cmath>
+#include <cctype>
+#include <cstdio>
+#include <numeric>
+#include <string_view>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <commdlg.h>
+#include <shlobj.h>
 #else
 #include <gtk/gtk.h>
 #endif
 
+namespace {
+    // Token estimate for text when no model counts it
+    const size_t CHARS_PER_TOKEN = 4;
+
+    // Budget left over below which no chunk is worth looking for
+    const size_t MIN_PACKED_TOKENS = 16;
+
+    // Shell-style match of a whole text: * and ? stop at '/', ** also crosses directories and
+    // [...] is a character class
+    bool globMatch(const char* pattern, const char* text) {
+        while (*pattern) {
+            if (pattern[0] == '*' && pattern[1] == '*') {
+                pattern += 2;
+                // "**/" also matches no directory at all
+                if (*pattern == '/' && globMatch(pattern + 1, text)) {
+                    return true;
+                }
+                for (;; text++) {
+                    if (globMatch(pattern, text)) {
+                        return true;
+                    }
+                    if (!*text) {
+                        return false;
+                    }
+                }
+            }
+            if (*pattern == '*') {
+                pattern++;
+                for (;; text++) {
+                    if (globMatch(pattern, text)) {
+                        return true;
+                    }
+                    if (!*text || *text == '/') {
+                        return false;
+                    }
+                }
+            }
+            if (!*text) {
+                return false;
+            }
+            if (*pattern == '?') {
+                if (*text == '/') {
+                    return false;
+                }
+                pattern++;
+                text++;
+                continue;
+            }
+            if (*pattern == '[') {
+                const char* cursor = pattern + 1;
+                const bool negate = *cursor == '!' || *cursor == '^';
+                if (negate) {
+                    cursor++;
+                }
+                // A ']' right after the opening bracket is part of the class
+                const char* first = cursor;
+                bool matched = false;
+                while (*cursor && (*cursor != ']' || cursor == first)) {
+                    if (cursor[1] == '-' && cursor[2] && cursor[2] != ']') {
+                        matched = matched || (*text >= cursor[0] && *text <= cursor[2]);
+                        cursor += 3;
+                    } else {
+                        matched = matched || *cursor == *text;
+                        cursor++;
+                    }
+                }
+                if (*cursor) {
+                    if (matched == negate || *text == '/') {
+                        return false;
+                    }
+                    pattern = cursor + 1;
+                    text++;
+                    continue;
+                }
+                // No closing bracket - the '[' is literal
+            }
+            if (*pattern == '\\' && pattern[1]) {
+                pattern++;
+            }
+            if (*pattern != *text) {
+                return false;
+            }
+            pattern++;
+            text++;
+        }
+        return !*text;
+    }
+
+    // One pattern line of a .gitignore
+    struct IgnoreRule {
+        std::string pattern;
+        bool negated = false;
+        bool directoryOnly = false;
+        // Patterns with a '/' are matched against the path below the .gitignore's directory,
+        // the others against the name alone at any depth
+        bool anchored = false;
+    };
+
+    // The rules of one .gitignore and the directory they apply to, relative to the attached directory
+    struct IgnoreFile {
+        std::string base;
+        std::vector<IgnoreRule> rules;
+    };
+
+    // Every .gitignore from the attached directory down to the one being walked, outermost first
+    using IgnoreChain = std::vector<std::shared_ptr<const IgnoreFile>>;
+
+    // Parses a directory's .gitignore, nullptr when it has none or no rules
+    std::shared_ptr<const IgnoreFile> readIgnoreFile(const std::filesystem::path& directory, const std::string& base) {
+        std::ifstream file(directory / ".gitignore");
+        if (!file.is_open()) {
+            return nullptr;
+        }
+        auto ignore = std::make_shared<IgnoreFile>();
+        ignore->base = base;
+        std::string line;
+        while (std::getline(file, line)) {
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) {
+                line.pop_back();
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            IgnoreRule rule;
+            if (line[0] == '!') {
+                rule.negated = true;
+                line.erase(0, 1);
+            } else if (line[0] == '\\') {
+                line.erase(0, 1);
+            }
+            if (!line.empty() && line.back() == '/') {
+                rule.directoryOnly = true;
+                line.pop_back();
+            }
+            rule.anchored = line.find('/') != std::string::npos;
+            if (!line.empty() && line[0] == '/') {
+                line.erase(0, 1);
+            }
+            if (line.empty()) {
+                continue;
+            }
+            rule.pattern = line;
+            ignore->rules.push_back(std::move(rule));
+        }
+        return ignore->rules.empty() ? nullptr : ignore;
+    }
+
+    // Applies the rules in order, the last one that matches decides
+    bool isIgnored(const IgnoreChain& chain, const std::string& relative, const std::string& name, bool isDirectory) {
+        bool ignored = false;
+        for (const auto& ignore : chain) {
+            const std::string local = ignore->base.empty() ? relative : relative.substr(ignore->base.size() + 1);
+            for (const auto& rule : ignore->rules) {
+                if (rule.directoryOnly && !isDirectory) {
+                    continue;
+                }
+                if (globMatch(rule.pattern.c_str(), rule.anchored ? local.c_str() : name.c_str())) {
+                    ignored = !rule.negated;
+                }
+            }
+        }
+        return ignored;
+    }
+
+    // 64-bit FNV-1a, cheap enough to run on every file as it is read
+    uint64_t hashContents(std::string_view contents) {
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : contents) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Lower-cased identifier-like words of a text, used for lexical chunk selection
+    std::vector<std::string> extractTerms(const std::string& text) {
+        std::vector<std::string> terms;
+        std::string current;
+        for (char c : text) {
+            if (std::isalnum(static_cast<unsigned char>(c)) || c == '_') {
+                current += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            } else if (!current.empty()) {
+                if (current.size() > 2) {
+                    terms.push_back(current);
+                }
+                current.clear();
+            }
+        }
+        if (current.size() > 2) {
+            terms.push_back(current);
+        }
+        return terms;
+    }
+
+    // Hashed terms of a text with their counts, sorted by hash for binary search
+    std::vector<std::pair<uint64_t, uint32_t>> countTerms(const std::string& text) {
+        std::vector<uint64_t> hashes;
+        for (const auto& term : extractTerms(text)) {
+            hashes.push_back(hashContents(term));
+        }
+        std::sort(hashes.begin(), hashes.end());
+        std::vector<std::pair<uint64_t, uint32_t>> counts;
+        for (uint64_t hash : hashes) {
+            if (counts.empty() || counts.back().first != hash) {
+                counts.emplace_back(hash, 0);
+            }
+            counts.back().second++;
+        }
+        return counts;
+    }
+
+    // Idf-weighted overlap of every chunk with a question's terms, looked up in the chunks' own
+    // term index
+    std::vector<double> scoreChunks(const std::string& question, const std::vector<ContextChunk*>& chunks) {
+        std::vector<uint64_t> questionTerms;
+        for (const auto& term : extractTerms(question)) {
+            questionTerms.push_back(hashContents(term));
+        }
+        std::sort(questionTerms.begin(), questionTerms.end());
+        questionTerms.erase(std::unique(questionTerms.begin(), questionTerms.end()), questionTerms.end());
+
+        // Counts of the question's terms in every chunk, and the number of chunks holding each term
+        std::vector<uint32_t> frequencies(chunks.size() * questionTerms.size(), 0);
+        std::vector<size_t> documentFrequency(questionTerms.size(), 0);
+        for (size_t i = 0; i < chunks.size(); i++) {
+            const auto& terms = chunks[i]->terms;
+            for (size_t t = 0; t < questionTerms.size(); t++) {
+                auto found = std::lower_bound(terms.begin(), terms.end(), std::make_pair(questionTerms[t], uint32_t(0)));
+                if (found != terms.end() && found->first == questionTerms[t]) {
+                    frequencies[i * questionTerms.size() + t] = found->second;
+                    documentFrequency[t]++;
+                }
+            }
+        }
+
+        std::vector<double> scores(chunks.size(), 0.0);
+        for (size_t i = 0; i < chunks.size(); i++) {
+            for (size_t t = 0; t < questionTerms.size(); t++) {
+                const uint32_t count = frequencies[i * questionTerms.size() + t];
+                if (count == 0) {
+                    continue;
+                }
+                const double idf = std::log(1.0 + static_cast<double>(chunks.size()) / documentFrequency[t]);
+                scores[i] += idf * (1.0 + std::log(static_cast<double>(count)));
+            }
+        }
+        return scores;
+    }
+
+    // Reads a file's bytes as they are on disk, false if it cannot be read
+    bool readFileBytes(const std::string& path, std::string& contents) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return !file.bad();
+    }
+}
+
 ContextManager::ContextManager() {
 #ifndef _WIN32
     if (!gtk_init_check(nullptr, nullptr)) {
@@ -23,9 +298,26 @@ ContextManager::ContextManager() {
 #endif
     // Initialize callback as empty
     onFileAddedCallback = nullptr;
+    watcher = std::make_unique<FileWatcher>([this](const std::string& path) { refreshFile(path); });
+    summaryThread = std::thread(&ContextManager::runSummaries, this);
+    directoryThread = std::thread(&ContextManager::runDirectories, this);
 }
 
 ContextManager::~ContextManager() {
+    // A directory being read is finished first, its files may still queue summaries
+    {
+        std::lock_guard<std::mutex> lock(directoryMutex);
+        stoppingDirectories = true;
+        directoryQueue.clear();
+    }
+    directoryWake.notify_all();
+    directoryThread.join();
+    {
+        std::lock_guard<std::mutex> lock(summaryMutex);
+        stoppingSummaries = true;
+    }
+    summaryWake.notify_all();
+    summaryThread.join();
 }
 
 void ContextManager::render() {
@@ -45,41 +337,302 @@ void ContextManager::render() {
     
     ImGui::Separator();
     
-    for (size_t i = 0; i < fileNames.size(); i++) {
-        ImGui::Text("%s", fileNames[i].c_str());
-        ImGui::SameLine();
-        
-        std::string buttonLabel = "Remove##" + std::to_string(i);
-        if (ImGui::Button(buttonLabel.c_str())) {
-            removeFile(i);
-            // Exit the loop early since we modified the vector
-            break;
-        }
-    }
+    renderFileList();
     
     ImGui::EndChild();
 }
 
-void ContextManager::addFile(const std::string& filePath) {
-    files.push_back(filePath);
-    fileNames.push_back(getFileNameFromPath(filePath));
+ContextManager::FileId ContextManager::addFile(const std::string& filePath) {
+    ContextFile file;
+    file.path = filePath;
+    file.name = getFileNameFromPath(filePath);
+    ChunkOptions options;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        options = chunkOptions;
+    }
+    std::string contents;
+    if (readFileBytes(filePath, contents)) {
+        file.contentHash = hashContents(contents);
+        file.bytes = contents.size();
+        file.chunks = chunkFile(file.name, TextScan::sanitize(file.name, contents), options);
+    } else {
+        file.chunks = chunkFile(file.name, "Error: Could not open file " + filePath, options);
+    }
+    FileId id = 0;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        id = registerFile(std::move(file));
+    }
     
     // Notify callback if set
     if (onFileAddedCallback) {
         onFileAddedCallback(filePath);
     }
+    return id;
+}
+
+size_t ContextManager::addDirectory(const std::string& directory, const std::string& glob) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    const fs::path root = fs::canonical(directory, ec);
+    if (ec || !fs::is_directory(root, ec)) {
+        return 0;
+    }
+    const std::string rootName = root.filename().string();
+    const bool globHasDirectories = glob.find('/') != std::string::npos;
+    ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()));
+
+    // Walk the tree with one pool task per directory, each queueing the subdirectories it finds.
+    // Tasks never wait on each other; the caller waits for the count of unfinished ones to drop to 0.
+    std::vector<std::pair<std::string, std::string>> found; // (path, path below the root)
+    std::mutex walkMutex;
+    std::condition_variable walked;
+    size_t unfinished = 0;
+    std::function<void(fs::path, std::string, IgnoreChain)> walk;
+    auto queueDirectory = [&](fs::path path, std::string relative, IgnoreChain chain) {
+        {
+            std::lock_guard<std::mutex> lock(walkMutex);
+            unfinished++;
+        }
+        pool.submit([&walk, path = std::move(path), relative = std::move(relative), chain = std::move(chain)]() mutable {
+            walk(std::move(path), std::move(relative), std::move(chain));
+        });
+    };
+    walk = [&](fs::path path, std::string relative, IgnoreChain chain) {
+        if (auto ignore = readIgnoreFile(path, relative)) {
+            chain.push_back(std::move(ignore));
+        }
+        std::vector<std::pair<std::string, std::string>> files;
+        std::error_code walkError;
+        for (fs::directory_iterator entry(path, fs::directory_options::skip_permission_denied, walkError), end;
+             !walkError && entry != end; entry.increment(walkError)) {
+            std::error_code statusError;
+            const fs::file_status status = entry->symlink_status(statusError);
+            if (statusError || fs::is_symlink(status)) {
+                // Links are not followed, they may lead out of the tree or around in a cycle
+                continue;
+            }
+            const std::string name = entry->path().filename().string();
+            const std::string childRelative = relative.empty() ? name : relative + "/" + name;
+            if (fs::is_directory(status)) {
+                if (name != ".git" && !isIgnored(chain, childRelative, name, true)) {
+                    queueDirectory(entry->path(), childRelative, chain);
+                }
+            } else if (fs::is_regular_file(status) && !isIgnored(chain, childRelative, name, false) &&
+                       (glob.empty() || globMatch(glob.c_str(), globHasDirectories ? childRelative.c_str() : name.c_str()))) {
+                files.emplace_back(entry->path().string(), childRelative);
+            }
+        }
+        std::lock_guard<std::mutex> lock(walkMutex);
+        found.insert(found.end(), std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()));
+        if (--unfinished == 0) {
+            walked.notify_all();
+        }
+    };
+    queueDirectory(root, "", {});
+    {
+        std::unique_lock<std::mutex> lock(walkMutex);
+        walked.wait(lock, [&]() { return unfinished == 0; });
+    }
+
+    // Each file is hashed, checked and chunked on the pool as soon as its read completes, so
+    // processing overlaps with the reads still in flight
+    std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+    std::vector<std::string> paths;
+    paths.reserve(found.size());
+    for (const auto& [path, relative] : found) {
+        paths.push_back(path);
+    }
+    std::vector<ContextFile> loaded(found.size());
+    std::vector<std::future<void>> processing;
+    std::mutex processingMutex;
+    FileReadOptions reading;
+    ChunkOptions chunking;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        reading = readOptions;
+        chunking = chunkOptions;
+    }
+    const FileReadStats stats = FileReader(reading).read(paths, pool, [&](size_t index, std::string contents) {
+        std::future<void> processed = pool.submit([&, index, contents = std::move(contents)]() {
+            // Binaries below a directory are skipped rather than described, there may be many
+            const TextScan::TextProfile profile = TextScan::profile(contents);
+            if (TextScan::isBinary(profile)) {
+                return;
+            }
+            ContextFile& file = loaded[index];
+            file.path = found[index].first;
+            file.name = rootName + "/" + found[index].second;
+            file.contentHash = hashContents(contents);
+            file.bytes = contents.size();
+            file.chunks = chunkFile(file.name, profile.invalidBytes > 0 ? TextScan::repairUtf8(contents) : contents,
+                                    chunking);
+        });
+        std::lock_guard<std::mutex> lock(processingMutex);
+        processing.push_back(std::move(processed));
+    });
+    for (auto& processed : processing) {
+        processed.wait();
+    }
+
+    size_t attached = 0;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        lastReadStats = stats;
+        for (auto& file : loaded) {
+            if (!file.path.empty() && !idsByPath.contains(file.path)) {
+                registerFile(std::move(file));
+                attached++;
+            }
+        }
+    }
+    return attached;
+}
+
+void ContextManager::addDirectoryAsync(const std::string& directory, const std::string& glob) {
+    {
+        std::lock_guard<std::mutex> lock(directoryMutex);
+        directoryQueue.emplace_back(directory, glob);
+    }
+    directoryWake.notify_one();
 }
 
-void ContextManager::removeFile(size_t index) {
-    if (index < files.size()) {
-        files.erase(files.begin() + index);
-        fileNames.erase(fileNames.begin() + index);
+size_t ContextManager::getPendingDirectories() const {
+    std::lock_guard<std::mutex> lock(directoryMutex);
+    return directoryQueue.size() + (readingDirectory ? 1 : 0);
+}
+
+void ContextManager::runDirectories() {
+    std::unique_lock<std::mutex> lock(directoryMutex);
+    while (true) {
+        directoryWake.wait(lock, [this]() { return stoppingDirectories || !directoryQueue.empty(); });
+        if (stoppingDirectories) {
+            return;
+        }
+        const auto [directory, glob] = directoryQueue.front();
+        directoryQueue.pop_front();
+        readingDirectory = true;
+        lock.unlock();
+        addDirectory(directory, glob);
+        lock.lock();
+        readingDirectory = false;
+    }
+}
+
+void ContextManager::setReadOptions(const FileReadOptions& options) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    readOptions = options;
+}
+
+void ContextManager::setChunkOptions(const ChunkOptions& options) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    chunkOptions = options;
+}
+
+FileReadStats ContextManager::getLastReadStats() const {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    return lastReadStats;
+}
+
+void ContextManager::refreshFile(const std::string& filePath) {
+    std::string name;
+    uint64_t previousHash = 0;
+    std::vector<ContextChunk> previous;
+    ChunkOptions options;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        auto id = idsByPath.find(filePath);
+        if (id == idsByPath.end()) {
+            return;
+        }
+        const ContextFile& file = files.at(id->second);
+        options = chunkOptions;
+        name = file.name;
+        previousHash = file.contentHash;
+        previous = file.chunks;
+    }
+
+    // A file that is gone or unreadable keeps its chunks, editors briefly remove files while saving
+    std::string contents;
+    if (!readFileBytes(filePath, contents)) {
+        return;
+    }
+    const uint64_t hash = hashContents(contents);
+    if (hash == previousHash) {
+        return;
+    }
+    std::vector<ContextChunk> chunks = chunkFile(name, TextScan::sanitize(name, contents), options, previous);
+
+#ifdef _DEBUG
+    std::unordered_set<uint64_t> kept;
+    for (const auto& chunk : previous) {
+        kept.insert(chunk.hash);
+    }
+    const size_t unchanged = std::count_if(chunks.begin(), chunks.end(), [&](const ContextChunk& chunk) {
+        return kept.contains(chunk.hash);
+    });
+    std::cout << "Refreshed " << name << ": " << chunks.size() - unchanged << " of " << chunks.size()
+              << " chunks changed" << std::endl;
+#endif
+
+    // The file may have been removed while it was being read
+    std::lock_guard<std::mutex> lock(registryMutex);
+    auto id = idsByPath.find(filePath);
+    if (id == idsByPath.end()) {
+        return;
+    }
+    ContextFile& file = files.at(id->second);
+    file.contentHash = hash;
+    file.bytes = contents.size();
+    file.chunks = std::move(chunks);
+    // The summary described the old contents; the new one comes from the cache or the pipeline
+    file.summary.reset();
+    queueSummary(file);
+}
+
+void ContextManager::removeFile(FileId id) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    auto file = files.find(id);
+    if (file == files.end()) {
+        return;
+    }
+    watcher->unwatch(file->second.path);
+    idsByPath.erase(file->second.path);
+    files.erase(file);
+    // The slot in the order is found lazily - it is compacted once removed files make up half of it
+    removedSlots++;
+    if (removedSlots * 2 > order.size()) {
+        compactOrder();
     }
 }
 
 void ContextManager::clearAll() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    watcher->clear();
     files.clear();
-    fileNames.clear();
+    idsByPath.clear();
+    order.clear();
+    removedSlots = 0;
+}
+
+ContextManager::FileId ContextManager::registerFile(ContextFile file) {
+    auto existing = idsByPath.find(file.path);
+    if (existing != idsByPath.end()) {
+        return existing->second;
+    }
+    const FileId id = nextId++;
+    file.id = id;
+    watcher->watch(file.path);
+    idsByPath.emplace(file.path, id);
+    queueSummary(files.emplace(id, std::move(file)).first->second);
+    order.push_back(id);
+    return id;
+}
+
+void ContextManager::compactOrder() {
+    std::erase_if(order, [this](FileId id) { return !files.contains(id); });
+    removedSlots = 0;
 }
 
 void ContextManager::setOnFileAddedCallback(FileChangeCallback callback) {
@@ -135,28 +688,114 @@ std::string ContextManager::openFileDialog() {
     return filePath;
 }
 
+std::string ContextManager::openFolderDialog() {
+    std::string folderPath;
+    
+#ifdef _WIN32
+    BROWSEINFOA bi;
+    ZeroMemory(&bi, sizeof(bi));
+    bi.lpszTitle = "Attach Folder";
+    bi.ulFlags = BIF_RETURNONLYFSDIRS | BIF_NEWDIALOGSTYLE;
+    
+    LPITEMIDLIST item = SHBrowseForFolderA(&bi);
+    if (item) {
+        char szFolder[MAX_PATH] = {0};
+        if (SHGetPathFromIDListA(item, szFolder)) {
+            folderPath = szFolder;
+        }
+        CoTaskMemFree(item);
+    }
+#else
+    GtkWidget *dialog = gtk_file_chooser_dialog_new("Attach Folder",
+                                                   nullptr,
+                                                   GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+                                                   "_Cancel", GTK_RESPONSE_CANCEL,
+                                                   "_Attach", GTK_RESPONSE_ACCEPT,
+                                                   nullptr);
+    
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        char *foldername = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+        folderPath = foldername;
+        g_free(foldername);
+    }
+    
+    gtk_widget_destroy(dialog);
+    while (gtk_events_pending()) {
+        gtk_main_iteration();
+    }
+#endif
+    
+    return folderPath;
+}
+
 void ContextManager::renderFileList() {
-    for (size_t i = 0; i < fileNames.size(); i++) {
-        // Display file name
-        ImGui::Text("%s", fileNames[i].c_str());
-        
-        // Calculate position for the Remove button to align with Clear All
-        float windowWidth = ImGui::GetWindowWidth();
-        float buttonWidth = ImGui::CalcTextSize("Remove").x + ImGui::GetStyle().FramePadding.x * 2.0f;
-        ImGui::SameLine(windowWidth - buttonWidth - ImGui::GetStyle().ItemSpacing.x);
+    FileId removed = 0;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        if (removedSlots > 0) {
+            compactOrder();
+        }
         
-        // Create and handle Remove button
-        std::string buttonLabel = "Remove##" + std::to_string(i);
-        if (ImGui::Button(buttonLabel.c_str())) {
-            removeFile(i);
-            // Exit the loop early since we modified the vector
-            break;
+        // Only the rows in view are drawn, a whole repository can be attached
+        ImGuiListClipper clipper;
+        clipper.Begin(static_cast<int>(order.size()));
+        while (clipper.Step()) {
+            for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+                const ContextFile& file = files.at(order[i]);
+                // Display file name
+                ImGui::Text("%s", file.name.c_str());
+                if (file.summary) {
+                    ImGui::SameLine();
+                    ImGui::TextDisabled("(summarized)");
+                }
+                
+                // Calculate position for the Remove button to align with Clear All
+                float windowWidth = ImGui::GetWindowWidth();
+                float buttonWidth = ImGui::CalcTextSize("Remove").x + ImGui::GetStyle().FramePadding.x * 2.0f;
+                ImGui::SameLine(windowWidth - buttonWidth - ImGui::GetStyle().ItemSpacing.x);
+                
+                // Create and handle Remove button
+                std::string buttonLabel = "Remove##" + std::to_string(file.id);
+                if (ImGui::Button(buttonLabel.c_str())) {
+                    removed = file.id;
+                }
+            }
         }
     }
+    if (removed != 0) {
+        removeFile(removed);
+    }
 }
 
 std::vector<std::string> ContextManager::getFilePaths() const {
-    return files;
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::vector<std::string> paths;
+    paths.reserve(files.size());
+    for (FileId id : order) {
+        auto file = files.find(id);
+        if (file != files.end()) {
+            paths.push_back(file->second.path);
+        }
+    }
+    return paths;
+}
+
+size_t ContextManager::getFileCount() const {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    return files.size();
+}
+
+std::vector<std::pair<std::string, std::string>> ContextManager::getNamedPaths() const {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::vector<std::pair<std::string, std::string>> named;
+    named.reserve(files.size());
+    for (FileId id : order) {
+        auto file = files.find(id);
+        if (file != files.end()) {
+            named.emplace_back(file->second.name, file->second.path);
+        }
+    }
+    return named;
 }
 
 std::string ContextManager::getFileContents(const std::string& filePath) const {
@@ -167,17 +806,415 @@ std::string ContextManager::getFileContents(const std::string& filePath) const {
     
     std::string content((std::istreambuf_iterator<char>(file)),
                         std::istreambuf_iterator<char>());
-    return content;
+    // Only text the tokenizer can use leaves here: binaries are described, broken UTF-8 is repaired
+    return TextScan::sanitize(std::filesystem::path(filePath).filename().string(), content);
+}
+
+std::string ContextManager::getAttachedContents(const std::string& filePath) const {
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        auto id = idsByPath.find(filePath);
+        if (id != idsByPath.end()) {
+            const ContextFile& file = files.at(id->second);
+            if (file.summary) {
+                return file.summary->text;
+            }
+        }
+    }
+    return getFileContents(filePath);
 }
 
 std::string ContextManager::getAllFilesContents() const {
     std::string allContents;
     
-    for (size_t i = 0; i < files.size(); i++) {
-        allContents += "=== File: " + fileNames[i] + " ===\n";
-        allContents += getFileContents(files[i]);
+    for (const auto& [name, path] : getNamedPaths()) {
+        allContents += "=== File: " + name + " ===\n";
+        allContents += getAttachedContents(path);
         allContents += "\n\n";
     }
     
     return allContents;
 }
+
+std::vector<ContextChunk> ContextManager::getChunks() const {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::vector<ContextChunk> chunks;
+    for (FileId id : order) {
+        auto file = files.find(id);
+        if (file != files.end()) {
+            chunks.insert(chunks.end(), file->second.chunks.begin(), file->second.chunks.end());
+        }
+    }
+    return chunks;
+}
+
+std::vector<std::string> ContextManager::packChunks(const std::string& question, size_t tokenBudget) {
+    // Tokenizing a large tree takes a while, the file list must not wait on it
+    if (tokenBudget > 0) {
+        countChunkTokens();
+    }
+    std::lock_guard<std::mutex> lock(registryMutex);
+    lastPackStats = ContextPackStats();
+    lastPackStats.budget = tokenBudget;
+    if (tokenBudget == 0) {
+        return {};
+    }
+    // Scored in place, copying every chunk of a large tree for each prompt would dominate
+    std::vector<ContextChunk*> chunks;
+    for (FileId id : order) {
+        auto file = files.find(id);
+        if (file != files.end()) {
+            for (auto& chunk : file->second.chunks) {
+                chunks.push_back(&chunk);
+            }
+            if (file->second.summary) {
+                chunks.push_back(&file->second.summary.value());
+            }
+        }
+    }
+    if (chunks.empty()) {
+        return {};
+    }
+    const std::vector<double> scores = scoreChunks(question, chunks);
+
+    // Chunks that share a term with the question; nothing matched - fall back to the start of the
+    // attached files
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (scores[i] > 0.0) {
+            candidates.push_back(i);
+        }
+    }
+    const bool matched = !candidates.empty();
+    if (!matched) {
+        candidates.resize(chunks.size());
+        std::iota(candidates.begin(), candidates.end(), 0);
+    }
+    lastPackStats.candidates = matched ? candidates.size() : 0;
+
+    // Chunks attached since the counts were taken are estimated from their length until the next prompt
+    const auto tokensOf = [&](ContextChunk& chunk) {
+        return chunk.tokens > 0 ? chunk.tokens
+                                : std::max<size_t>(1, (chunk.text.size() + CHARS_PER_TOKEN - 1) / CHARS_PER_TOKEN);
+    };
+
+    // Most relevance per token first, ties in file order. Without a match every chunk is worth the
+    // same.
+    if (matched) {
+        std::vector<double> density(chunks.size(), 0.0);
+        for (size_t index : candidates) {
+            density[index] = scores[index] / tokensOf(*chunks[index]);
+        }
+        std::stable_sort(candidates.begin(), candidates.end(), [&](size_t a, size_t b) {
+            return density[a] > density[b];
+        });
+    }
+
+    // Greedy fill, moving on past chunks too large for what is left
+    std::vector<size_t> picked;
+    std::unordered_set<uint64_t> packedBodies;
+    size_t remaining = tokenBudget;
+    double packedScore = 0.0;
+    for (size_t index : candidates) {
+        if (remaining < MIN_PACKED_TOKENS) {
+            break;
+        }
+        ContextChunk& chunk = *chunks[index];
+        if (packedBodies.contains(chunk.bodyHash)) {
+            lastPackStats.duplicates++;
+            continue;
+        }
+        const size_t tokens = tokensOf(chunk);
+        if (tokens > remaining) {
+            continue;
+        }
+        picked.push_back(index);
+        packedBodies.insert(chunk.bodyHash);
+        remaining -= tokens;
+        packedScore += scores[index];
+    }
+
+    // Filling by density alone can trade one chunk that answers the question for several that
+    // touch on it; the most relevant chunk on its own is kept if it is worth more
+    if (matched) {
+        size_t best = candidates.front();
+        for (size_t index : candidates) {
+            if (scores[index] > scores[best] && tokensOf(*chunks[index]) <= tokenBudget) {
+                best = index;
+            }
+        }
+        if (scores[best] > packedScore && tokensOf(*chunks[best]) <= tokenBudget) {
+            picked.assign(1, best);
+            remaining = tokenBudget - tokensOf(*chunks[best]);
+        }
+    }
+    std::sort(picked.begin(), picked.end());
+
+    std::vector<std::string> selected;
+    for (size_t index : picked) {
+        selected.push_back(chunks[index]->text);
+    }
+    lastPackStats.tokens = tokenBudget - remaining;
+    lastPackStats.chunks = selected.size();
+    return selected;
+}
+
+ContextPackStats ContextManager::getLastPackStats() const {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    return lastPackStats;
+}
+
+void ContextManager::countChunkTokens() {
+    std::lock_guard<std::mutex> counterLock(counterMutex);
+    std::unordered_map<uint64_t, std::string> uncounted;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (const auto& [id, file] : files) {
+            for (const auto& chunk : file.chunks) {
+                if (chunk.tokens == 0) {
+                    uncounted.try_emplace(chunk.hash, chunk.text);
+                }
+            }
+            if (file.summary && file.summary->tokens == 0) {
+                uncounted.try_emplace(file.summary->hash, file.summary->text);
+            }
+        }
+    }
+    if (uncounted.empty()) {
+        return;
+    }
+
+    std::unordered_map<uint64_t, size_t> counts;
+    for (const auto& [hash, text] : uncounted) {
+        counts[hash] = std::max<size_t>(1, tokenCounter ? tokenCounter(text)
+                                                        : (text.size() + CHARS_PER_TOKEN - 1) / CHARS_PER_TOKEN);
+    }
+
+    // Chunks are matched by hash, one edited in the meantime is counted next time
+    std::lock_guard<std::mutex> lock(registryMutex);
+    const auto store = [&](ContextChunk& chunk) {
+        auto count = counts.find(chunk.hash);
+        if (chunk.tokens == 0 && count != counts.end()) {
+            chunk.tokens = count->second;
+        }
+    };
+    for (auto& [id, file] : files) {
+        for (auto& chunk : file.chunks) {
+            store(chunk);
+        }
+        if (file.summary) {
+            store(file.summary.value());
+        }
+    }
+}
+
+void ContextManager::setTokenCounter(TokenCounter counter) {
+    std::lock_guard<std::mutex> counterLock(counterMutex);
+    std::lock_guard<std::mutex> lock(registryMutex);
+    tokenCounter = std::move(counter);
+    for (auto& [id, file] : files) {
+        for (auto& chunk : file.chunks) {
+            chunk.tokens = 0;
+        }
+        if (file.summary) {
+            file.summary->tokens = 0;
+        }
+    }
+}
+
+void ContextManager::setSummarizer(Summarizer summarizer, size_t windowTokens, size_t pieceTokens) {
+    const bool summarizing = static_cast<bool>(summarizer);
+    {
+        std::unique_lock<std::mutex> lock(summaryMutex);
+        this->summarizer = std::move(summarizer);
+        summaryWindowTokens = windowTokens;
+        summaryPieceTokens = pieceTokens;
+        summaryGeneration++;
+        summaryQueue.clear();
+        // The summary in progress stops after its current step; its model must outlive it
+        summaryIdle.wait(lock, [this]() { return !this->summarizing; });
+    }
+    if (!summarizing) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (FileId id : order) {
+        auto file = files.find(id);
+        if (file != files.end()) {
+            queueSummary(file->second);
+        }
+    }
+}
+
+void ContextManager::setSummaryCacheDirectory(const std::string& directory) {
+    std::lock_guard<std::mutex> lock(summaryMutex);
+    summaryCacheDirectory = directory;
+}
+
+size_t ContextManager::getPendingSummaries() const {
+    std::lock_guard<std::mutex> lock(summaryMutex);
+    return summaryQueue.size() + (summarizing ? 1 : 0);
+}
+
+void ContextManager::queueSummary(ContextFile& file) {
+    std::lock_guard<std::mutex> lock(summaryMutex);
+    if (!summarizer || file.summary || file.bytes <= summaryWindowTokens * CHARS_PER_TOKEN) {
+        return;
+    }
+    auto cached = summaryCache.find(file.contentHash);
+    if (cached != summaryCache.end()) {
+        file.summary = summaryChunk(file, cached->second);
+        return;
+    }
+    summaryQueue.push_back(file.id);
+    summaryWake.notify_one();
+}
+
+void ContextManager::runSummaries() {
+    std::unique_lock<std::mutex> lock(summaryMutex);
+    while (true) {
+        summaryWake.wait(lock, [this]() { return stoppingSummaries || (summarizer && !summaryQueue.empty()); });
+        if (stoppingSummaries) {
+            return;
+        }
+        const FileId id = summaryQueue.front();
+        summaryQueue.pop_front();
+        const Summarizer summarize = summarizer;
+        const size_t pieceTokens = summaryPieceTokens;
+        const uint64_t generation = summaryGeneration;
+        summarizing = true;
+        lock.unlock();
+        summarizeFile(id, summarize, pieceTokens, generation);
+        lock.lock();
+        summarizing = false;
+        summaryIdle.notify_all();
+    }
+}
+
+void ContextManager::summarizeFile(FileId id, const Summarizer& summarize, size_t pieceTokens, uint64_t generation) {
+    std::string path;
+    std::string name;
+    uint64_t contentHash = 0;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        auto file = files.find(id);
+        if (file == files.end() || file->second.summary) {
+            return;
+        }
+        path = file->second.path;
+        name = file->second.name;
+        contentHash = file->second.contentHash;
+    }
+
+    // Another file with the same contents may have been summarized since this one was queued, or an
+    // earlier run may have left the summary on disk
+    std::string summary;
+    bool complete = true;
+    std::string cachePath;
+    {
+        std::lock_guard<std::mutex> lock(summaryMutex);
+        auto cached = summaryCache.find(contentHash);
+        if (cached != summaryCache.end()) {
+            summary = cached->second;
+        }
+        if (!summaryCacheDirectory.empty()) {
+            char hex[17];
+            std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(contentHash));
+            cachePath = (std::filesystem::path(summaryCacheDirectory) / (std::string(hex) + ".summary")).string();
+        }
+    }
+    if (summary.empty() && !cachePath.empty() && readFileBytes(cachePath, summary) && !summary.empty()) {
+#ifdef _DEBUG
+        std::cout << "Loaded the summary of " << name << " from " << cachePath << std::endl;
+#endif
+    } else if (summary.empty()) {
+        // The file changed since it was queued - its refresh queues it again
+        std::string contents;
+        if (!readFileBytes(path, contents) || hashContents(contents) != contentHash) {
+            return;
+        }
+        contents = TextScan::sanitize(name, contents);
+        std::vector<std::string> pieces;
+        for (const ChunkSpan& span : SourceChunker(ChunkOptions{pieceTokens}).split(name, contents)) {
+            pieces.push_back(contents.substr(span.begin, span.end - span.begin));
+        }
+        const auto keepGoing = [this, generation]() {
+            std::lock_guard<std::mutex> lock(summaryMutex);
+            return !stoppingSummaries && summaryGeneration == generation;
+        };
+        FileSummary made = summarize(name, pieces, keepGoing);
+        summary = std::move(made.text);
+        complete = made.complete;
+        if (summary.empty() || !keepGoing()) {
+            return;
+        }
+#ifdef _DEBUG
+        std::cout << "Summarized " << name << " from " << pieces.size() << " pieces into " << summary.size()
+                  << " characters" << (complete ? "" : ", incomplete") << std::endl;
+#endif
+        if (complete && !cachePath.empty()) {
+            std::error_code ec;
+            std::filesystem::create_directories(std::filesystem::path(cachePath).parent_path(), ec);
+            std::ofstream(cachePath, std::ios::binary) << summary;
+        }
+    }
+    if (complete) {
+        std::lock_guard<std::mutex> lock(summaryMutex);
+        summaryCache[contentHash] = summary;
+    }
+
+    // Every attached copy of these contents gets the summary
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (auto& [fileId, file] : files) {
+        if (file.contentHash == contentHash && !file.summary) {
+            file.summary = summaryChunk(file, summary);
+        }
+    }
+}
+
+ContextChunk ContextManager::summaryChunk(const ContextFile& file, const std::string& summary) {
+    ContextChunk chunk;
+    chunk.firstLine = file.chunks.empty() ? 0 : file.chunks.front().firstLine;
+    chunk.lastLine = file.chunks.empty() ? 0 : file.chunks.back().lastLine;
+    chunk.scope = "summary";
+    chunk.text = "=== File: " + file.name + " | summary ===\n" + summary;
+    if (chunk.text.back() != '\n') {
+        chunk.text += '\n';
+    }
+    chunk.hash = hashContents(chunk.text);
+    chunk.bodyHash = hashContents(summary);
+    chunk.terms = countTerms(chunk.text);
+    return chunk;
+}
+
+std::vector<ContextChunk> ContextManager::chunkFile(const std::string& fileName, const std::string& contents,
+                                                     const ChunkOptions& options,
+                                                     const std::vector<ContextChunk>& previous) {
+    std::unordered_map<uint64_t, const ContextChunk*> previousByHash;
+    for (const auto& chunk : previous) {
+        previousByHash.emplace(chunk.hash, &chunk);
+    }
+    std::vector<ContextChunk> chunks;
+    for (const ChunkSpan& span : SourceChunker(options).split(fileName, contents)) {
+        ContextChunk chunk;
+        chunk.firstLine = span.firstLine;
+        chunk.lastLine = span.lastLine;
+        chunk.scope = span.scope;
+        // No line numbers in the header, they would change every chunk below an inserted line
+        chunk.text = "=== File: " + fileName + (span.scope.empty() ? "" : " | " + span.scope) + " ===\n" +
+                     contents.substr(span.begin, span.end - span.begin);
+        if (chunk.text.back() != '\n') {
+            chunk.text += '\n';
+        }
+        chunk.hash = hashContents(chunk.text);
+        chunk.bodyHash = hashContents(std::string_view(contents).substr(span.begin, span.end - span.begin));
+        auto same = previousByHash.find(chunk.hash);
+        if (same != previousByHash.end() && same->second->text == chunk.text) {
+            chunk.terms = same->second->terms;
+        } else {
+            chunk.terms = countTerms(chunk.text);
+        }
+        chunks.push_back(std::move(chunk));
+    }
+    return chunks;
+}
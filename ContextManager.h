@@ -5,39 +5,243 @@
 #ifndef CONTEXT_MANAGER_H
 #define CONTEXT_MANAGER_H
 
+#include "FileReader.h"
+#include "FileWatcher.h"
+#include "SourceChunker.h"
 #include <vector>
 #include <string>
 #include <functional>
+#include <unordered_map>
+#include <utility>
+#include <mutex>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+
+// What a summarizer made of a file. An incomplete summary is used but not cached, so the file is
+// summarized again the next time it is attached.
+struct FileSummary {
+    std::string text;
+    bool complete = true;
+};
+
+// A contiguous run of lines from one attached file, sized to be selected on its own
+struct ContextChunk {
+    size_t firstLine;
+    size_t lastLine;
+    // Chunk text including its "=== File: ... ===" header, so it reads the same wherever it is placed
+    std::string text;
+    // Enclosing scopes and declarations of source code, e.g. "class Foo > bar", empty for other text
+    std::string scope;
+    // FNV-1a of the text, an unchanged chunk keeps it across edits elsewhere in the file
+    uint64_t hash = 0;
+    // FNV-1a of the lines without the header, the same for identical code attached under two names
+    uint64_t bodyHash = 0;
+    // Tokens the text encodes to, counted the first time it is packed and kept until the model changes
+    size_t tokens = 0;
+    // Hashed terms of the text with their counts, sorted by hash - what packChunks scores against
+    std::vector<std::pair<uint64_t, uint32_t>> terms;
+};
+
+// One attached file, found by an id that stays the same for as long as it is attached
+struct ContextFile {
+    uint64_t id = 0;
+    std::string path;
+    // Shown in the file list and chunk headers - the path below an attached directory, else the file name
+    std::string name;
+    // FNV-1a and size of the contents as read when attached
+    uint64_t contentHash = 0;
+    size_t bytes = 0;
+    std::vector<ContextChunk> chunks;
+    // Summary of a file too large for one context window, once the background pipeline has made it.
+    // It is packed like any other chunk, the file's own chunks stay available next to it.
+    std::optional<ContextChunk> summary;
+};
+
+// How the token budget of the last prompt was filled from the attached files
+struct ContextPackStats {
+    // Tokens left for chunks once the history, the prompt and the expected reply are counted
+    size_t budget = 0;
+    size_t tokens = 0;
+    size_t chunks = 0;
+    // Chunks that matched the question, and those left out as copies of a packed one
+    size_t candidates = 0;
+    size_t duplicates = 0;
+
+    inline double fillRatio() const {
+        return budget > 0 ? static_cast<double>(tokens) / budget : 0.0;
+    }
+};
 
 class ContextManager {
 public:
     // Define a callback type for file changes
     using FileChangeCallback = std::function<void(const std::string&)>;
+    // Number of tokens a text encodes to under the running model
+    using TokenCounter = std::function<size_t(const std::string&)>;
+    // Condenses a file's consecutive pieces into one summary, asking keepGoing between steps; empty
+    // when it failed or was stopped, incomplete when some of its steps failed
+    using Summarizer = std::function<FileSummary(const std::string& name, const std::vector<std::string>& pieces,
+                                                 const std::function<bool()>& keepGoing)>;
+    using FileId = uint64_t;
     
     ContextManager();
     ~ContextManager();
     
     void render();
     void renderFileList();
-    void addFile(const std::string& filePath);
-    void removeFile(size_t index);
+    FileId addFile(const std::string& filePath);
+    
+    // Attaches every text file below a directory that no .gitignore on the way excludes and, given a
+    // glob such as "*.cpp" or "src/**/*.h", that matches it. The tree is walked and the files are read
+    // on a thread pool; binary and oversized files are skipped. Returns the number of files attached.
+    size_t addDirectory(const std::string& directory, const std::string& glob = "");
+    
+    // Attaches a directory as addDirectory does, on a background thread so the UI keeps drawing;
+    // directories queued together are read one after the other
+    void addDirectoryAsync(const std::string& directory, const std::string& glob = "");
+    
+    // Directories waiting to be read or being read
+    size_t getPendingDirectories() const;
+    
+    // How addDirectory reads files, and the throughput of its last run
+    void setReadOptions(const FileReadOptions& options);
+    FileReadStats getLastReadStats() const;
+    
+    // Chunk size limit for files attached or refreshed from now on
+    void setChunkOptions(const ChunkOptions& options);
+    
+    // Re-reads an attached file and re-chunks it; chunks whose text did not change keep their index.
+    // Called by the watcher when an attached file is saved.
+    void refreshFile(const std::string& filePath);
+    
+    void removeFile(FileId id);
     void clearAll();
     std::string openFileDialog();
+    std::string openFolderDialog();
     
     // New methods to access file information
     std::vector<std::string> getFilePaths() const;
+    size_t getFileCount() const;
+    
+    // (display name, path) of every attached file, in the order they were attached
+    std::vector<std::pair<std::string, std::string>> getNamedPaths() const;
+    
     std::string getFileContents(const std::string& filePath) const;
     std::string getAllFilesContents() const;
     
+    // Returns the chunks of every attached file, in file order
+    std::vector<ContextChunk> getChunks() const;
+    
+    // Fills a token budget with the chunks that share the most terms with a question for their size,
+    // leaving out copies of chunks already packed. Chunks come back in file order so the same
+    // selection always yields the same prompt. With no chunk matching, the budget is filled from the
+    // start of the attached files.
+    std::vector<std::string> packChunks(const std::string& question, size_t tokenBudget);
+    ContextPackStats getLastPackStats() const;
+    
+    // Counts chunk tokens from now on; cached counts are dropped as they belong to another tokenizer.
+    // Without a counter a token is taken to be four characters.
+    void setTokenCounter(TokenCounter counter);
+    
+    // Files of more than windowTokens are summarized on a background thread from now on, cut at
+    // declaration boundaries into pieces of at most pieceTokens. A summary in progress is stopped
+    // after its current step and waited for, so the summarizer's model may be unloaded afterwards;
+    // pass nullptr to stop summarizing.
+    void setSummarizer(Summarizer summarizer, size_t windowTokens = 0, size_t pieceTokens = 0);
+    
+    // Summaries are kept in memory by content hash, and in this directory too when one is set so
+    // they survive restarts
+    void setSummaryCacheDirectory(const std::string& directory);
+    
+    // Files waiting to be summarized or being summarized
+    size_t getPendingSummaries() const;
+    
+    // The summary of a file too large for one context window if it has one, else its contents
+    std::string getAttachedContents(const std::string& filePath) const;
+    
     // Set callback for file changes
     void setOnFileAddedCallback(FileChangeCallback callback);
     
 private:
     std::string getFileNameFromPath(const std::string& filePath);
     
-    std::vector<std::string> files;
-    std::vector<std::string> fileNames;
+    // Splits a file into chunks of whole lines, source code at declaration boundaries. Boundaries
+    // depend on the nearby contents only, so an edit changes the chunks around it; chunks found among
+    // previous reuse their index.
+    static std::vector<ContextChunk> chunkFile(const std::string& fileName, const std::string& contents,
+                                               const ChunkOptions& options,
+                                               const std::vector<ContextChunk>& previous = {});
+    
+    // Adds a file to the registry unless its path is attached already; must be called with registryMutex held
+    FileId registerFile(ContextFile file);
+    
+    // Drops the slots of removed files from the attachment order; must be called with registryMutex held
+    void compactOrder();
+    
+    // Attaches a cached summary to an oversized file or queues the file for summarizing; must be
+    // called with registryMutex held
+    void queueSummary(ContextFile& file);
+    
+    // Body of the directory thread
+    void runDirectories();
+    
+    // Body of the summary thread, and the pipeline for one file outside of any lock
+    void runSummaries();
+    void summarizeFile(FileId id, const Summarizer& summarize, size_t pieceTokens, uint64_t generation);
+    
+    // Summary chunk of a file, read like the file's other chunks
+    static ContextChunk summaryChunk(const ContextFile& file, const std::string& summary);
+    
+    // Counts the tokens of every chunk without a count yet, holding registryMutex only to collect the
+    // texts and to store the counts
+    void countChunkTokens();
+    
+    // Attached files by id, and ids by path so a file is attached once
+    std::unordered_map<FileId, ContextFile> files;
+    std::unordered_map<std::string, FileId> idsByPath;
+    // Ids in attachment order; a removed file leaves a 0 behind until the order is compacted
+    std::vector<FileId> order;
+    size_t removedSlots = 0;
+    FileId nextId = 1;
+    FileReadOptions readOptions;
+    FileReadStats lastReadStats;
+    ChunkOptions chunkOptions;
+    ContextPackStats lastPackStats;
+    // Only called with counterMutex held, so the model it counts with outlives every call.
+    // counterMutex is taken before registryMutex, never the other way round.
+    TokenCounter tokenCounter;
+    std::mutex counterMutex;
+    // Summary pipeline state; summaryMutex may be taken with registryMutex held, never the other way round
+    mutable std::mutex summaryMutex;
+    std::condition_variable summaryWake;
+    std::condition_variable summaryIdle;
+    Summarizer summarizer;
+    size_t summaryWindowTokens = 0;
+    size_t summaryPieceTokens = 0;
+    // Bumped whenever the summarizer changes, a summary made under an older one is discarded
+    uint64_t summaryGeneration = 0;
+    std::deque<FileId> summaryQueue;
+    bool summarizing = false;
+    bool stoppingSummaries = false;
+    std::unordered_map<uint64_t, std::string> summaryCache;
+    std::string summaryCacheDirectory;
+    std::thread summaryThread;
+    // Directories queued by addDirectoryAsync as (directory, glob)
+    mutable std::mutex directoryMutex;
+    std::condition_variable directoryWake;
+    std::deque<std::pair<std::string, std::string>> directoryQueue;
+    bool readingDirectory = false;
+    bool stoppingDirectories = false;
+    std::thread directoryThread;
+    // Tools and prompts read the files from other threads than the UI
+    mutable std::mutex registryMutex;
     FileChangeCallback onFileAddedCallback;
+    // Last, so it stops before the registry it refreshes is destroyed
+    std::unique_ptr<FileWatcher> watcher;
 };
 
 #endif // CONTEXT_MANAGER_H
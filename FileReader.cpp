@@ -0,0 +1,520 @@
+/**
+ * @file FileReader.cpp
+ * @brief Bulk file reading for context ingestion through ifstreams on a pool or through io_uring.
+ */
+#include "FileReader.h"
+#include "ThreadPool.h"
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+#ifdef __linux__
+namespace {
+    // Minimal io_uring over the raw system calls: one submission and one completion ring
+    class IoUring {
+    public:
+        IoUring() = default;
+        IoUring(const IoUring&) = delete;
+        IoUring& operator=(const IoUring&) = delete;
+
+        ~IoUring() {
+            if (sqes) {
+                munmap(sqes, sqeBytes);
+            }
+            if (cqRing && cqRing != sqRing) {
+                munmap(cqRing, cqRingBytes);
+            }
+            if (sqRing) {
+                munmap(sqRing, sqRingBytes);
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        bool init(unsigned entries) {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            if (fd < 0) {
+                return false;
+            }
+            sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (singleMap) {
+                sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+            }
+            sqRing = mmap(nullptr, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (sqRing == MAP_FAILED) {
+                sqRing = nullptr;
+                return false;
+            }
+            cqRing = singleMap ? sqRing
+                               : mmap(nullptr, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) {
+                cqRing = nullptr;
+                return false;
+            }
+            sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+            if (sqes == MAP_FAILED) {
+                sqes = nullptr;
+                return false;
+            }
+
+            char* sq = static_cast<char*>(sqRing);
+            sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+            sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+            sqEntries = params.sq_entries;
+            char* cq = static_cast<char*>(cqRing);
+            cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+            localTail = *sqTail;
+            return true;
+        }
+
+        // Free submission entries, queued but unsubmitted ones included
+        unsigned space() const {
+            return sqEntries - (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE));
+        }
+
+        // Next submission entry, zeroed; the caller checks space() first
+        io_uring_sqe* next() {
+            const unsigned index = localTail & sqMask;
+            sqArray[index] = index;
+            localTail++;
+            io_uring_sqe* sqe = &sqes[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            return sqe;
+        }
+
+        // Submits everything queued, entries an earlier call left behind included, and waits for at
+        // least waitFor completions
+        bool submit(unsigned waitFor) {
+            __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+            const unsigned toSubmit = localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            return enter(toSubmit, waitFor);
+        }
+
+        // Waits for at least one completion without submitting anything
+        bool wait() {
+            return enter(0, 1);
+        }
+
+        // Entries queued that the kernel has not taken; they never complete unless submitted
+        template <typename Handler>
+        void unsubmitted(Handler&& handle) const {
+            for (unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE); head != localTail; head++) {
+                handle(sqes[sqArray[head & sqMask]]);
+            }
+        }
+
+        template <typename Handler>
+        void reap(Handler&& handle) {
+            unsigned head = *cqHead;
+            const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            while (head != tail) {
+                const io_uring_cqe cqe = cqes[head & cqMask];
+                head++;
+                __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+                handle(cqe);
+            }
+        }
+
+    private:
+        bool enter(unsigned toSubmit, unsigned waitFor) {
+            while (true) {
+                const long result = syscall(__NR_io_uring_enter, fd, toSubmit, waitFor,
+                                            waitFor > 0 ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0);
+                if (result >= 0 || errno == EBUSY) {
+                    // EBUSY: the completion ring is full, reaping it makes room
+                    return true;
+                }
+                if (errno != EINTR) {
+                    return false;
+                }
+            }
+        }
+
+        int fd = -1;
+        void* sqRing = nullptr;
+        void* cqRing = nullptr;
+        io_uring_sqe* sqes = nullptr;
+        size_t sqRingBytes = 0;
+        size_t cqRingBytes = 0;
+        size_t sqeBytes = 0;
+        unsigned* sqHead = nullptr;
+        unsigned* sqTail = nullptr;
+        unsigned* sqArray = nullptr;
+        unsigned sqMask = 0;
+        unsigned sqEntries = 0;
+        unsigned localTail = 0;
+        unsigned* cqHead = nullptr;
+        unsigned* cqTail = nullptr;
+        unsigned cqMask = 0;
+        io_uring_cqe* cqes = nullptr;
+    };
+
+    // Operation a completion belongs to, kept in the low bits of its user data
+    enum Operation : uint64_t {
+        OpOpen = 0,
+        OpStat = 1,
+        OpRead = 2,
+        OpClose = 3
+    };
+
+    // One file on its way through open + statx, reads and close
+    struct Transfer {
+        size_t index = 0;
+        int fd = -1;
+        // Holds a file, and that file has been handed on or given up on
+        bool active = false;
+        bool settled = false;
+        bool opened = false;
+        bool statted = false;
+        bool failed = false;
+        // The kernel lacks an operation, the file is read through the stream backend instead
+        bool unsupported = false;
+        struct statx status;
+        std::string contents;
+        size_t received = 0;
+        // Operations submitted and not completed yet
+        int inFlight = 0;
+    };
+
+    uint64_t userData(size_t slot, Operation operation) {
+        return (static_cast<uint64_t>(slot) << 2) | operation;
+    }
+}
+#endif
+
+FileReader::FileReader(FileReadOptions options) :
+    options(options) {
+}
+
+FileReadStats FileReader::read(const std::vector<std::string>& paths, ThreadPool& pool, const ReadCallback& onRead) const {
+    const auto start = std::chrono::steady_clock::now();
+    FileReadStats stats;
+    std::vector<size_t> streamed;
+    if (options.backend == FileReadBackend::IoUring && ioUringAvailable()) {
+        stats.backend = FileReadBackend::IoUring;
+        streamed = readIoUring(paths, onRead, stats);
+    } else {
+        streamed.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); i++) {
+            streamed[i] = i;
+        }
+    }
+    if (!streamed.empty()) {
+        readStream(paths, streamed, pool, onRead, stats);
+    }
+    stats.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+#ifdef _DEBUG
+    std::cout << "Read " << stats.files << " file(s), " << stats.bytes << " bytes in " << stats.ms << " ms through "
+              << backendName(stats.backend) << " - " << stats.filesPerSecond() << " files/s, " << stats.skipped
+              << " skipped" << std::endl;
+#endif
+    return stats;
+}
+
+bool FileReader::ioUringAvailable() {
+#ifdef __linux__
+    // Containers and hardened kernels commonly refuse io_uring_setup, it is probed once
+    static const bool available = []() {
+        IoUring ring;
+        return ring.init(2);
+    }();
+    return available;
+#else
+    return false;
+#endif
+}
+
+const char* FileReader::backendName(FileReadBackend backend) {
+    return backend == FileReadBackend::IoUring ? "io_uring" : "ifstream";
+}
+
+void FileReader::readStream(const std::vector<std::string>& paths, const std::vector<size_t>& indices, ThreadPool& pool,
+                            const ReadCallback& onRead, FileReadStats& stats) const {
+    std::atomic<size_t> files = 0;
+    std::atomic<size_t> bytes = 0;
+    std::atomic<size_t> skipped = 0;
+    std::vector<std::future<void>> slices;
+    const size_t threads = pool.getThreadCount();
+    for (size_t slice = 0; slice < threads; slice++) {
+        slices.push_back(pool.submit([&, slice]() {
+            for (size_t i = slice; i < indices.size(); i += threads) {
+                const std::string& path = paths[indices[i]];
+                std::error_code ec;
+                const uintmax_t size = std::filesystem::file_size(path, ec);
+                std::ifstream file(path, std::ios::binary);
+                if (ec || size > options.maxBytes || !file.is_open()) {
+                    skipped++;
+                    continue;
+                }
+                std::string contents(std::istreambuf_iterator<char>(file), {});
+                if (file.bad()) {
+                    skipped++;
+                    continue;
+                }
+                files++;
+                bytes += contents.size();
+                onRead(indices[i], std::move(contents));
+            }
+        }));
+    }
+    for (auto& slice : slices) {
+        slice.wait();
+    }
+    stats.files += files;
+    stats.bytes += bytes;
+    stats.skipped += skipped;
+}
+
+std::vector<size_t> FileReader::readIoUring(const std::vector<std::string>& paths, const ReadCallback& onRead,
+                                            FileReadStats& stats) const {
+    std::vector<size_t> unsupported;
+#ifdef __linux__
+    const unsigned depth = std::clamp(options.queueDepth, 4u, 4096u);
+    IoUring ring;
+    if (!ring.init(depth)) {
+        unsupported.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); i++) {
+            unsupported[i] = i;
+        }
+        return unsupported;
+    }
+
+    // A file has at most two operations in flight, so half the depth in files keeps the ring from overfilling
+    std::vector<Transfer> transfers(std::max(1u, depth / 2));
+    std::vector<size_t> freeSlots;
+    for (size_t slot = transfers.size(); slot > 0; slot--) {
+        freeSlots.push_back(slot - 1);
+    }
+    size_t nextFile = 0;
+    size_t active = 0;
+    // The ring stopped taking submissions; what is in flight is drained and the rest read as streams
+    bool ringFailed = false;
+
+    // The kernel normally takes every queued entry on submit; should it not, this makes room first
+    auto nextSqe = [&]() -> io_uring_sqe* {
+        if (ring.space() == 0 && (!ring.submit(0) || ring.space() == 0)) {
+            ringFailed = true;
+            return nullptr;
+        }
+        return ring.next();
+    };
+    auto submitClose = [&](size_t slot) {
+        Transfer& transfer = transfers[slot];
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) {
+            close(transfer.fd);
+            transfer.fd = -1;
+            return;
+        }
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = transfer.fd;
+        sqe->user_data = userData(slot, OpClose);
+        transfer.fd = -1;
+        transfer.inFlight++;
+    };
+    auto submitRead = [&](size_t slot) {
+        Transfer& transfer = transfers[slot];
+        io_uring_sqe* sqe = nextSqe();
+        if (!sqe) {
+            return;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = transfer.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(transfer.contents.data() + transfer.received);
+        sqe->len = static_cast<uint32_t>(std::min<size_t>(transfer.contents.size() - transfer.received, UINT32_MAX));
+        sqe->off = transfer.received;
+        sqe->user_data = userData(slot, OpRead);
+        transfer.inFlight++;
+    };
+    // Hands a finished file on, closes its descriptor and frees the slot once nothing is in flight
+    auto settle = [&](size_t slot, bool deliver) {
+        Transfer& transfer = transfers[slot];
+        transfer.settled = true;
+        if (deliver) {
+            transfer.contents.resize(transfer.received);
+            stats.files++;
+            stats.bytes += transfer.received;
+            onRead(transfer.index, std::move(transfer.contents));
+        } else if (transfer.unsupported) {
+            unsupported.push_back(transfer.index);
+        } else {
+            stats.skipped++;
+        }
+        transfer.contents = std::string();
+        if (transfer.fd >= 0) {
+            submitClose(slot);
+        }
+    };
+    // Both the open and the statx have completed - start reading or give up on the file
+    auto opened = [&](size_t slot) {
+        Transfer& transfer = transfers[slot];
+        const bool regular = S_ISREG(transfer.status.stx_mode);
+        if (transfer.failed || !regular || transfer.status.stx_size > options.maxBytes) {
+            settle(slot, false);
+            return;
+        }
+        if (transfer.status.stx_size == 0) {
+            settle(slot, true);
+            return;
+        }
+        transfer.contents.resize(transfer.status.stx_size);
+        submitRead(slot);
+    };
+
+    while ((nextFile < paths.size() || active > 0) && !ringFailed) {
+        // Open and stat new files together while there are free slots
+        while (nextFile < paths.size() && !freeSlots.empty() && ring.space() >= 2) {
+            const size_t slot = freeSlots.back();
+            freeSlots.pop_back();
+            Transfer& transfer = transfers[slot];
+            transfer = Transfer();
+            transfer.index = nextFile++;
+            transfer.active = true;
+
+            io_uring_sqe* open = ring.next();
+            open->opcode = IORING_OP_OPENAT;
+            open->fd = AT_FDCWD;
+            open->addr = reinterpret_cast<uint64_t>(paths[transfer.index].c_str());
+            open->open_flags = O_RDONLY | O_CLOEXEC;
+            open->user_data = userData(slot, OpOpen);
+
+            io_uring_sqe* stat = ring.next();
+            stat->opcode = IORING_OP_STATX;
+            stat->fd = AT_FDCWD;
+            stat->addr = reinterpret_cast<uint64_t>(paths[transfer.index].c_str());
+            stat->len = STATX_TYPE | STATX_SIZE;
+            stat->off = reinterpret_cast<uint64_t>(&transfer.status);
+            stat->user_data = userData(slot, OpStat);
+
+            transfer.inFlight = 2;
+            active++;
+        }
+
+        if (!ring.submit(1)) {
+            ringFailed = true;
+            break;
+        }
+
+        ring.reap([&](const io_uring_cqe& cqe) {
+            const size_t slot = static_cast<size_t>(cqe.user_data >> 2);
+            const Operation operation = static_cast<Operation>(cqe.user_data & 3);
+            Transfer& transfer = transfers[slot];
+            transfer.inFlight--;
+            const bool notSupported = cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP;
+
+            switch (operation) {
+            case OpOpen:
+            case OpStat:
+                if (cqe.res < 0) {
+                    transfer.failed = true;
+                    transfer.unsupported = transfer.unsupported || notSupported;
+                } else if (operation == OpOpen) {
+                    transfer.fd = cqe.res;
+                }
+                transfer.opened = transfer.opened || operation == OpOpen;
+                transfer.statted = transfer.statted || operation == OpStat;
+                if (transfer.opened && transfer.statted) {
+                    opened(slot);
+                }
+                break;
+            case OpRead:
+                if (cqe.res < 0) {
+                    transfer.unsupported = notSupported;
+                    settle(slot, false);
+                } else if (cqe.res == 0 || transfer.received + cqe.res >= transfer.contents.size()) {
+                    // Done, or the file shrank since it was stat'ed
+                    transfer.received += cqe.res;
+                    settle(slot, true);
+                } else {
+                    transfer.received += cqe.res;
+                    submitRead(slot);
+                }
+                break;
+            case OpClose:
+                break;
+            }
+
+            if (transfer.inFlight == 0 && transfer.fd < 0) {
+                transfer.active = false;
+                freeSlots.push_back(slot);
+                active--;
+            }
+        });
+    }
+
+    if (ringFailed) {
+        // The kernel may still write into transfers for operations it took, so those complete before the
+        // ring and the buffers go away. Entries it never took are dropped, their descriptors closed here.
+        ring.unsubmitted([&](const io_uring_sqe& sqe) {
+            transfers[static_cast<size_t>(sqe.user_data >> 2)].inFlight--;
+            if ((sqe.user_data & 3) == OpClose) {
+                close(sqe.fd);
+            }
+        });
+        auto inFlight = [&]() {
+            return std::any_of(transfers.begin(), transfers.end(), [](const Transfer& transfer) { return transfer.inFlight > 0; });
+        };
+        while (inFlight()) {
+            if (!ring.wait()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            ring.reap([&](const io_uring_cqe& cqe) {
+                Transfer& transfer = transfers[static_cast<size_t>(cqe.user_data >> 2)];
+                transfer.inFlight--;
+                if (static_cast<Operation>(cqe.user_data & 3) == OpOpen && cqe.res >= 0) {
+                    transfer.fd = cqe.res;
+                }
+            });
+        }
+        // Files not finished, and those never started, go to the stream backend
+        const size_t retried = unsupported.size();
+        for (Transfer& transfer : transfers) {
+            if (transfer.fd >= 0) {
+                close(transfer.fd);
+            }
+            if (transfer.active && !transfer.settled) {
+                unsupported.push_back(transfer.index);
+            }
+        }
+        for (; nextFile < paths.size(); nextFile++) {
+            unsupported.push_back(nextFile);
+        }
+        std::cerr << "Error : io_uring stopped taking submissions, " << unsupported.size() - retried
+                  << " file(s) are read through the stream backend" << std::endl;
+    }
+#else
+    (void)paths;
+    (void)onRead;
+    (void)stats;
+#endif
+    return unsupported;
+}
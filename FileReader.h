@@ -0,0 +1,75 @@
+/**
+ * @file FileReader.h
+ * @brief Bulk file reading for context ingestion, either one blocking ifstream per file spread over a
+ *        thread pool or batched opens, stats and reads through io_uring with a bounded queue depth.
+ */
+#ifndef FILE_READER_H
+#define FILE_READER_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+class ThreadPool;
+
+// How files are read
+enum class FileReadBackend {
+    // std::ifstream per file on the pool's threads
+    Stream,
+    // openat/statx/read/close submitted in batches from one thread, Linux only
+    IoUring
+};
+
+struct FileReadOptions {
+    FileReadBackend backend = FileReadBackend::IoUring;
+    // Operations kept in flight by the io_uring backend
+    unsigned queueDepth = 64;
+    // Larger files are skipped
+    uintmax_t maxBytes = 1024 * 1024;
+};
+
+// Throughput of one bulk read
+struct FileReadStats {
+    FileReadBackend backend = FileReadBackend::Stream;
+    size_t files = 0;
+    size_t bytes = 0;
+    // Files that could not be read, were not regular files or were too large
+    size_t skipped = 0;
+    double ms = 0.0;
+
+    inline double filesPerSecond() const {
+        return ms > 0.0 ? files * 1000.0 / ms : 0.0;
+    }
+};
+
+class FileReader {
+public:
+    // Called once for every file read in full, as soon as its read completes. The io_uring backend
+    // calls it from the reading thread, the stream backend from the pool's threads.
+    using ReadCallback = std::function<void(size_t index, std::string contents)>;
+
+    explicit FileReader(FileReadOptions options = {});
+
+    // Reads the files, pool runs the stream backend's reads. Falls back to the stream backend when
+    // io_uring is unavailable, and rereads files whose io_uring operations the kernel does not support.
+    FileReadStats read(const std::vector<std::string>& paths, ThreadPool& pool, const ReadCallback& onRead) const;
+
+    // True if the kernel lets this process create an io_uring
+    static bool ioUringAvailable();
+
+    static const char* backendName(FileReadBackend backend);
+
+private:
+    // Reads the given files with one ifstream each, spread over the pool
+    void readStream(const std::vector<std::string>& paths, const std::vector<size_t>& indices, ThreadPool& pool,
+                    const ReadCallback& onRead, FileReadStats& stats) const;
+
+    // Reads the files through io_uring; indices of files to retry with the stream backend are returned
+    std::vector<size_t> readIoUring(const std::vector<std::string>& paths, const ReadCallback& onRead,
+                                    FileReadStats& stats) const;
+
+    FileReadOptions options;
+};
+
+#endif // FILE_READER_H
@@ -0,0 +1,209 @@
+/**
+ * @file FileWatcher.cpp
+ * @brief Change notification for attached files through inotify, or by polling modification times.
+ */
+#include "FileWatcher.h"
+#include <chrono>
+#include <vector>
+#include <iostream>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <climits>
+#include <cerrno>
+#include <cstdint>
+#endif
+
+namespace {
+    // A file is reported once no change to it has arrived for this long, so an editor's write,
+    // rename and attribute updates are read once and never half-written
+    const auto SETTLE_TIME = std::chrono::milliseconds(200);
+
+#ifndef __linux__
+    // How often modification times are compared without inotify
+    const auto POLL_INTERVAL = std::chrono::seconds(1);
+#endif
+}
+
+FileWatcher::FileWatcher(ChangeCallback onChange) : onChange(std::move(onChange)) {
+#ifdef __linux__
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotifyFd < 0 || wakeFd < 0) {
+#ifdef _DEBUG
+        std::cout << "inotify unavailable, attached files will not be refreshed" << std::endl;
+#endif
+        return;
+    }
+#endif
+    thread = std::thread(&FileWatcher::run, this);
+}
+
+FileWatcher::~FileWatcher() {
+    stopping = true;
+#ifdef __linux__
+    if (wakeFd >= 0) {
+        const uint64_t one = 1;
+        [[maybe_unused]] ssize_t written = write(wakeFd, &one, sizeof(one));
+    }
+#else
+    wake.notify_all();
+#endif
+    if (thread.joinable()) {
+        thread.join();
+    }
+#ifdef __linux__
+    if (inotifyFd >= 0) {
+        close(inotifyFd);
+    }
+    if (wakeFd >= 0) {
+        close(wakeFd);
+    }
+#endif
+}
+
+void FileWatcher::watch(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!paths.insert(path).second) {
+        return;
+    }
+#ifdef __linux__
+    if (inotifyFd < 0) {
+        return;
+    }
+    // Editors often save by writing a new file and renaming it over the old one, which only the
+    // directory sees
+    const std::string directory = std::filesystem::path(path).parent_path().string();
+    DirectoryWatch& watched = directories[directory];
+    if (watched.files++ == 0) {
+        watched.wd = inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO);
+        if (watched.wd >= 0) {
+            directoriesByWd[watched.wd] = directory;
+        }
+    }
+#else
+    std::error_code ec;
+    modified[path] = std::filesystem::last_write_time(path, ec);
+#endif
+}
+
+void FileWatcher::unwatch(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (paths.erase(path) == 0) {
+        return;
+    }
+    pending.erase(path);
+#ifdef __linux__
+    auto watched = directories.find(std::filesystem::path(path).parent_path().string());
+    if (watched != directories.end() && --watched->second.files == 0) {
+        if (watched->second.wd >= 0) {
+            inotify_rm_watch(inotifyFd, watched->second.wd);
+            directoriesByWd.erase(watched->second.wd);
+        }
+        directories.erase(watched);
+    }
+#else
+    modified.erase(path);
+#endif
+}
+
+void FileWatcher::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+#ifdef __linux__
+    for (const auto& [directory, watched] : directories) {
+        if (watched.wd >= 0) {
+            inotify_rm_watch(inotifyFd, watched.wd);
+        }
+    }
+    directories.clear();
+    directoriesByWd.clear();
+#else
+    modified.clear();
+#endif
+    paths.clear();
+    pending.clear();
+}
+
+void FileWatcher::flushPending() {
+    std::unordered_set<std::string> changed;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        changed.swap(pending);
+    }
+    for (const auto& path : changed) {
+        onChange(path);
+    }
+}
+
+#ifdef __linux__
+void FileWatcher::run() {
+    alignas(inotify_event) char buffer[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+    auto lastChange = std::chrono::steady_clock::now();
+    while (!stopping) {
+        bool waiting = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            waiting = !pending.empty();
+        }
+        int timeout = -1;
+        if (waiting) {
+            const auto settled = lastChange + SETTLE_TIME - std::chrono::steady_clock::now();
+            timeout = static_cast<int>(std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(settled).count()));
+        }
+        pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {wakeFd, POLLIN, 0}};
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            break;
+        }
+        if (stopping) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            ssize_t length = 0;
+            while ((length = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (char* next = buffer; next < buffer + length;) {
+                    const auto* event = reinterpret_cast<const inotify_event*>(next);
+                    next += sizeof(inotify_event) + event->len;
+                    auto directory = directoriesByWd.find(event->wd);
+                    if (directory == directoriesByWd.end() || event->len == 0) {
+                        continue;
+                    }
+                    const std::string path = (std::filesystem::path(directory->second) / event->name).string();
+                    if (paths.contains(path)) {
+                        pending.insert(path);
+                        lastChange = std::chrono::steady_clock::now();
+                    }
+                }
+            }
+        }
+        if (waiting && std::chrono::steady_clock::now() - lastChange >= SETTLE_TIME) {
+            flushPending();
+        }
+    }
+}
+#else
+void FileWatcher::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        wake.wait_for(lock, POLL_INTERVAL, [this]() { return stopping.load(); });
+        if (stopping) {
+            break;
+        }
+        for (auto& [path, time] : modified) {
+            std::error_code ec;
+            const auto current = std::filesystem::last_write_time(path, ec);
+            if (!ec && current != time) {
+                time = current;
+                pending.insert(path);
+            }
+        }
+        // A poll interval is longer than a save takes, so changes found here have settled
+        lock.unlock();
+        flushPending();
+        lock.lock();
+    }
+}
+#endif
@@ -0,0 +1,66 @@
+/**
+ * @file FileWatcher.h
+ * @brief Reports changes to a set of files from a background thread. On Linux the files' directories
+ *        are watched with inotify, so saves that replace a file by renaming over it are seen too;
+ *        elsewhere modification times are polled. Bursts of changes to a file are reported once.
+ */
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <filesystem>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+class FileWatcher {
+public:
+    // Called on the watcher's thread with the path as it was passed to watch
+    using ChangeCallback = std::function<void(const std::string& path)>;
+
+    explicit FileWatcher(ChangeCallback onChange);
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    void watch(const std::string& path);
+    void unwatch(const std::string& path);
+    void clear();
+
+private:
+    // Waits for changes and reports them until the watcher is destroyed
+    void run();
+
+    // Reports every pending change, must be called without mutex held
+    void flushPending();
+
+    ChangeCallback onChange;
+    std::mutex mutex;
+    // Watched paths, and the changed ones waiting for the burst they belong to to end
+    std::unordered_set<std::string> paths;
+    std::unordered_set<std::string> pending;
+    std::atomic<bool> stopping{false};
+#ifdef __linux__
+    // inotify watch per directory holding watched files, with the number of files it serves
+    struct DirectoryWatch {
+        int wd = -1;
+        size_t files = 0;
+    };
+    std::unordered_map<std::string, DirectoryWatch> directories;
+    std::unordered_map<int, std::string> directoriesByWd;
+    int inotifyFd = -1;
+    // Written to wake the thread when the watcher is destroyed
+    int wakeFd = -1;
+#else
+    std::unordered_map<std::string, std::filesystem::file_time_type> modified;
+    std::condition_variable wake;
+#endif
+    std::thread thread;
+};
+
+#endif // FILE_WATCHER_H
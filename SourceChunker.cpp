@@ -0,0 +1,876 @@
+/**
+ * @file SourceChunker.cpp
+ * @brief Structural chunking of source code by brace depth or indentation, with content-defined
+ *        line chunking for everything else.
+ */
+#include "SourceChunker.h"
+#include <filesystem>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+
+namespace {
+    using Language = SourceChunker::Language;
+
+    const size_t CHARS_PER_TOKEN = 4;
+
+    // Line chunks end at the first line boundary past this many lines, or past the size limit
+    const size_t CHUNK_MAX_LINES = 40;
+
+    // Past a quarter of the size limit a line chunk also ends after a blank line or a line whose hash
+    // has these bits clear. The cut points depend on the lines themselves, not on where the chunk
+    // started, so after an edit the boundaries fall back in step with the old ones within a chunk or two.
+    const uint64_t CHUNK_CUT_MASK = 0xF;
+
+    // Declarations named in one chunk's scope before the rest are elided
+    const size_t MAX_SCOPE_NAMES = 4;
+
+    // Characters of a declaration looked at for its name
+    const size_t MAX_HEADER_CHARS = 400;
+
+    // Python counts a tab to the next multiple of 8 columns
+    const int TAB_WIDTH = 8;
+
+    // One line of the file, described from its masked text where comments and string contents are
+    // blanked out
+    struct Line {
+        size_t begin = 0;
+        size_t end = 0;
+        // Brace depth at the start and end of the line
+        int depthBefore = 0;
+        int depthAfter = 0;
+        int indent = 0;
+        // Holds something other than comments and whitespace
+        bool code = false;
+        // Starts inside a string, a comment or open brackets, or after a backslash continuation
+        bool continued = false;
+        char first = 0;
+        char last = 0;
+    };
+
+    // A run of whole lines, [first, last) as line indices
+    struct Unit {
+        size_t first;
+        size_t last;
+        std::string name;
+        // The unit is a function, whose statements are not named after the calls they make
+        bool function = false;
+    };
+
+    bool isIdentifierChar(char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+    }
+
+    bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+    }
+
+    // 64-bit FNV-1a of a line
+    uint64_t hashLine(const char* data, size_t size) {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // The first word of a line, as far as it is an identifier
+    std::string firstWord(const std::string& mask, const Line& line) {
+        size_t i = line.begin;
+        while (i < line.end && isSpace(mask[i])) {
+            i++;
+        }
+        size_t start = i;
+        while (i < line.end && isIdentifierChar(mask[i])) {
+            i++;
+        }
+        return mask.substr(start, i - start);
+    }
+
+    // Walks the file once, blanking comments and string contents in mask and describing every line
+    class Scanner {
+    public:
+        Scanner(const std::string& text, Language language) : text(text), language(language), mask(text) {}
+
+        std::vector<Line> scan() {
+            const bool python = language == Language::Python;
+            Line line;
+            for (size_t i = 0; i < text.size(); i++) {
+                const char c = text[i];
+                if (c == '\n') {
+                    size_t lineEnd = i;
+                    if (lineEnd > line.begin && text[lineEnd - 1] == '\r') {
+                        lineEnd--;
+                    }
+                    const bool escaped = lineEnd > line.begin && text[lineEnd - 1] == '\\';
+                    if (state == State::LineComment || ((state == State::String || state == State::Char) && !escaped)) {
+                        // Strings do not span lines without a backslash; ending one here also recovers
+                        // from a quote read the wrong way
+                        state = State::Code;
+                    }
+                    line.end = i;
+                    finishLine(line);
+                    Line next;
+                    next.begin = i + 1;
+                    next.depthBefore = depth;
+                    next.continued = state != State::Code || (python && (brackets > 0 || depth > 0 || escaped));
+                    line = next;
+                    continue;
+                }
+                switch (state) {
+                case State::Code:
+                    i += code(i);
+                    break;
+                case State::LineComment:
+                    mask[i] = ' ';
+                    break;
+                case State::BlockComment:
+                    if (c == '*' && next(i) == '/') {
+                        mask[i] = mask[i + 1] = ' ';
+                        i++;
+                        state = State::Code;
+                    } else {
+                        mask[i] = ' ';
+                    }
+                    break;
+                case State::String:
+                case State::Char:
+                case State::Template:
+                    if (c == '\\' && escapes && i + 1 < text.size() && text[i + 1] != '\n') {
+                        mask[i] = mask[i + 1] = ' ';
+                        i++;
+                    } else if (c == quote) {
+                        state = State::Code;
+                    } else {
+                        mask[i] = ' ';
+                    }
+                    break;
+                case State::TripleString:
+                    if (c == '\\' && i + 1 < text.size() && text[i + 1] != '\n') {
+                        mask[i] = mask[i + 1] = ' ';
+                        i++;
+                    } else if (text.compare(i, 3, std::string(3, quote)) == 0) {
+                        i += 2;
+                        state = State::Code;
+                    } else {
+                        mask[i] = ' ';
+                    }
+                    break;
+                case State::Raw:
+                    if (text.compare(i, rawEnd.size(), rawEnd) == 0) {
+                        i += rawEnd.size() - 1;
+                        state = State::Code;
+                    } else {
+                        mask[i] = ' ';
+                    }
+                    break;
+                }
+            }
+            if (line.begin < text.size()) {
+                line.end = text.size();
+                finishLine(line);
+            }
+            return std::move(lines);
+        }
+
+        std::string takeMask() {
+            return std::move(mask);
+        }
+
+    private:
+        enum class State {
+            Code,
+            LineComment,
+            BlockComment,
+            String,
+            Char,
+            Template,
+            TripleString,
+            Raw
+        };
+
+        char next(size_t i) const {
+            return i + 1 < text.size() ? text[i + 1] : '\0';
+        }
+
+        char previous(size_t i) const {
+            return i > 0 ? text[i - 1] : '\0';
+        }
+
+        // Handles one byte of code: comment and string openers, braces and brackets. Returns the number
+        // of following bytes that belong to the same token and were handled with it.
+        size_t code(size_t i) {
+            const char c = text[i];
+            const bool python = language == Language::Python;
+            if (language == Language::Text) {
+                return 0;
+            }
+            if (python ? c == '#' : (c == '/' && next(i) == '/')) {
+                mask[i] = ' ';
+                state = State::LineComment;
+            } else if (!python && c == '/' && next(i) == '*') {
+                // The opener's '*' must not also close the comment
+                mask[i] = mask[i + 1] = ' ';
+                state = State::BlockComment;
+                return 1;
+            } else if (c == '"' || c == '\'' || c == '`') {
+                return quoteAt(i);
+            } else if (c == '{') {
+                depth++;
+            } else if (c == '}') {
+                depth = std::max(0, depth - 1);
+            } else if (c == '(' || c == '[') {
+                brackets++;
+            } else if (c == ')' || c == ']') {
+                brackets = std::max(0, brackets - 1);
+            }
+            return 0;
+        }
+
+        // Opens the string, character literal or raw string a quote starts, if it starts one. Returns
+        // the number of further quote bytes the opener took.
+        size_t quoteAt(size_t i) {
+            const char c = text[i];
+            quote = c;
+            escapes = true;
+            if (language == Language::Python) {
+                if (text.compare(i, 3, std::string(3, c)) == 0) {
+                    state = State::TripleString;
+                    return 2;
+                }
+                if (c != '`') {
+                    state = State::String;
+                }
+                return 0;
+            }
+            if (c == '`') {
+                if (language == Language::JavaScript || language == Language::Go) {
+                    // Go raw strings have no escapes
+                    escapes = language == Language::JavaScript;
+                    state = State::Template;
+                }
+                return 0;
+            }
+            if (c == '"') {
+                if (language == Language::CFamily && previous(i) == 'R') {
+                    // R"delimiter( ... )delimiter"
+                    const size_t open = text.find('(', i);
+                    if (open != std::string::npos && open - i <= 17) {
+                        rawEnd = ")" + text.substr(i + 1, open - i - 1) + "\"";
+                        state = State::Raw;
+                        return 0;
+                    }
+                }
+                if (language == Language::Rust) {
+                    // r"..." or r#"..."#
+                    size_t hashes = 0;
+                    while (hashes < i && text[i - 1 - hashes] == '#') {
+                        hashes++;
+                    }
+                    if (i > hashes && text[i - 1 - hashes] == 'r' && (i == hashes + 1 || !isIdentifierChar(text[i - 2 - hashes]))) {
+                        rawEnd = "\"" + std::string(hashes, '#');
+                        state = State::Raw;
+                        return 0;
+                    }
+                }
+                state = State::String;
+                return 0;
+            }
+            // A single quote
+            if (language == Language::JavaScript) {
+                state = State::String;
+            } else if (language == Language::Rust) {
+                // 'a' and '\n' are characters, 'a on its own is a lifetime
+                if (next(i) == '\\') {
+                    state = State::Char;
+                } else {
+                    for (size_t k = i + 2; k < std::min(text.size(), i + 6); k++) {
+                        if (text[k] == '\'') {
+                            if (k == i + 2 || static_cast<unsigned char>(text[i + 1]) >= 0x80) {
+                                state = State::Char;
+                            }
+                            break;
+                        }
+                        if (static_cast<unsigned char>(text[k]) < 0x80) {
+                            break;
+                        }
+                    }
+                }
+            } else if (language == Language::CFamily && std::isxdigit(static_cast<unsigned char>(previous(i))) &&
+                       std::isxdigit(static_cast<unsigned char>(next(i)))) {
+                // A digit separator as in 1'000'000 when the number starts with a digit
+                size_t start = i;
+                while (start > 0 && (std::isalnum(static_cast<unsigned char>(text[start - 1])) || text[start - 1] == '\'')) {
+                    start--;
+                }
+                if (!std::isdigit(static_cast<unsigned char>(text[start]))) {
+                    state = State::Char;
+                }
+            } else {
+                state = State::Char;
+            }
+            return 0;
+        }
+
+        void finishLine(Line& line) {
+            line.depthAfter = depth;
+            int column = 0;
+            bool leading = true;
+            for (size_t i = line.begin; i < line.end; i++) {
+                const char c = mask[i];
+                if (leading) {
+                    if (c == ' ') {
+                        column++;
+                        continue;
+                    }
+                    if (c == '\t') {
+                        column = (column / TAB_WIDTH + 1) * TAB_WIDTH;
+                        continue;
+                    }
+                    leading = false;
+                }
+                if (!isSpace(c)) {
+                    if (!line.code) {
+                        line.first = c;
+                        line.code = true;
+                    }
+                    line.last = c;
+                }
+            }
+            line.indent = column;
+            lines.push_back(line);
+        }
+
+        const std::string& text;
+        Language language;
+        std::string mask;
+        std::vector<Line> lines;
+        State state = State::Code;
+        char quote = 0;
+        bool escapes = true;
+        std::string rawEnd;
+        int depth = 0;
+        int brackets = 0;
+    };
+}
+
+namespace {
+    // Words that start a named scope, and words that start a function
+    const std::vector<std::string> SCOPE_KEYWORDS = {"class", "struct", "union", "enum", "namespace", "interface",
+                                                     "trait", "impl", "mod", "object", "type"};
+    const std::vector<std::string> FUNCTION_KEYWORDS = {"def", "fn", "func", "function"};
+
+    // Words after a scope keyword that are not its name, and words that end the name
+    const std::vector<std::string> NAME_SKIPPED = {"final", "sealed", "abstract", "class", "struct", "interface"};
+    const std::vector<std::string> NAME_STOPS = {"extends", "implements", "where", "for"};
+
+    // Words that precede a parenthesis without naming a function
+    const std::vector<std::string> CONTROL_KEYWORDS = {"if", "for", "while", "switch", "catch", "return", "sizeof", "else",
+                                                       "do", "try", "throw", "case", "new", "delete", "alignof", "decltype",
+                                                       "static_assert", "defined", "typeof", "await", "match", "loop",
+                                                       "select", "go", "defer", "import", "package"};
+
+    // Words that start a declaration in Go and JavaScript, where a line may end one without a semicolon
+    const std::vector<std::string> DECLARATION_STARTS = {"func", "type", "var", "const", "import", "package",
+                                                         "export", "function", "class", "interface", "let"};
+
+    bool contains(const std::vector<std::string>& words, const std::string& word) {
+        return std::find(words.begin(), words.end(), word) != words.end();
+    }
+
+    // Reads an identifier, with :: joining qualified names, starting at i
+    std::string readName(const std::string& header, size_t& i) {
+        std::string name;
+        while (i < header.size()) {
+            if (isIdentifierChar(header[i])) {
+                name += header[i++];
+            } else if (header.compare(i, 2, "::") == 0 && !name.empty()) {
+                name += "::";
+                i += 2;
+            } else {
+                break;
+            }
+        }
+        return name;
+    }
+
+    void skipSpaces(const std::string& header, size_t& i) {
+        while (i < header.size() && (isSpace(header[i]) || header[i] == '\n')) {
+            i++;
+        }
+    }
+
+    // Name of the scope keyword's declaration: the last word before the body, a base list or
+    // template parameters
+    std::string scopeName(const std::string& header, size_t i) {
+        std::string name;
+        while (i < header.size()) {
+            skipSpaces(header, i);
+            if (i >= header.size() || !isIdentifierChar(header[i])) {
+                break;
+            }
+            const std::string word = readName(header, i);
+            if (contains(NAME_STOPS, word)) {
+                break;
+            }
+            if (!contains(NAME_SKIPPED, word)) {
+                name = word;
+            }
+        }
+        return name;
+    }
+
+    // Name of the function a header with a parameter list declares, "" for calls and control statements
+    std::string functionName(const std::string& header) {
+        // The first parenthesis outside template arguments, so std::function<void()> is skipped
+        size_t open = std::string::npos;
+        int angles = 0;
+        for (size_t i = 0; i < header.size() && open == std::string::npos; i++) {
+            if (header[i] == '<') {
+                angles++;
+            } else if (header[i] == '>' && angles > 0) {
+                angles--;
+            } else if (header[i] == '(' && angles == 0) {
+                open = i;
+            }
+        }
+        if (open == std::string::npos) {
+            return "";
+        }
+        size_t end = open;
+        while (end > 0 && isSpace(header[end - 1])) {
+            end--;
+        }
+        // operator==, operator() and the like
+        const size_t op = header.rfind("operator", end);
+        if (op != std::string::npos && header.find_first_of("=;", op) >= open) {
+            size_t start = op;
+            while (start > 0 && (isIdentifierChar(header[start - 1]) || header[start - 1] == ':' || header[start - 1] == '~')) {
+                start--;
+            }
+            std::string name;
+            for (size_t i = start; i < end; i++) {
+                if (!isSpace(header[i])) {
+                    name += header[i];
+                }
+            }
+            return name;
+        }
+        // An initializer such as x = call(...), not a function
+        const size_t assignment = header.find('=');
+        if (assignment < open) {
+            return "";
+        }
+        size_t start = end;
+        while (start > 0 && (isIdentifierChar(header[start - 1]) || header[start - 1] == ':' || header[start - 1] == '~')) {
+            start--;
+        }
+        std::string name = header.substr(start, end - start);
+        while (!name.empty() && name.front() == ':') {
+            name.erase(0, 1);
+        }
+        if (name.empty() || contains(CONTROL_KEYWORDS, name) || std::isdigit(static_cast<unsigned char>(name.front()))) {
+            return "";
+        }
+        return name;
+    }
+
+    struct Declaration {
+        std::string name;
+        bool function = false;
+    };
+
+    // The declaration a masked header starts, with an empty name if it is not one worth naming. Inside
+    // a function only keywords name declarations, everything else is a statement.
+    Declaration declare(const std::string& header, Language language, bool inFunction) {
+        size_t i = 0;
+        skipSpaces(header, i);
+        // A template parameter list's "class T" names nothing
+        if (header.compare(i, 8, "template") == 0) {
+            const size_t open = header.find('<', i);
+            int angles = 0;
+            for (i = open; i != std::string::npos && i < header.size(); i++) {
+                angles += header[i] == '<' ? 1 : header[i] == '>' ? -1 : 0;
+                if (angles == 0) {
+                    break;
+                }
+            }
+            i = i == std::string::npos ? header.size() : i + 1;
+        }
+        const size_t start = i;
+        while (i < header.size()) {
+            if (!isIdentifierChar(header[i])) {
+                i++;
+                continue;
+            }
+            const size_t wordStart = i;
+            const std::string word = readName(header, i);
+            if (wordStart > 0 && (isIdentifierChar(header[wordStart - 1]) || header[wordStart - 1] == '.')) {
+                continue;
+            }
+            if (contains(SCOPE_KEYWORDS, word)) {
+                if (word == "impl") {
+                    // impl Trait for Type reads best whole
+                    std::string rest;
+                    for (size_t k = i; k < header.size() && rest.size() < MAX_HEADER_CHARS / 8; k++) {
+                        if (!isSpace(header[k]) && header[k] != '\n') {
+                            rest += header[k];
+                        } else if (!rest.empty() && rest.back() != ' ') {
+                            rest += ' ';
+                        }
+                    }
+                    while (!rest.empty() && rest.back() == ' ') {
+                        rest.pop_back();
+                    }
+                    return {rest.empty() ? word : word + " " + rest};
+                }
+                const std::string name = scopeName(header, i);
+                return {name.empty() ? word : word + " " + name};
+            }
+            if (contains(FUNCTION_KEYWORDS, word)) {
+                skipSpaces(header, i);
+                if (i < header.size() && header[i] == '(') {
+                    // A Go method's receiver
+                    i = header.find(')', i);
+                    i = i == std::string::npos ? header.size() : i + 1;
+                    skipSpaces(header, i);
+                }
+                return {readName(header, i), true};
+            }
+        }
+        if (language == Language::Python || inFunction) {
+            return {};
+        }
+        const std::string rest = header.substr(start);
+        // JavaScript functions assigned to a name: name = (...) => or name = function
+        const size_t arrow = rest.find("=>");
+        if (arrow != std::string::npos) {
+            size_t assignment = rest.find('=');
+            while (assignment != std::string::npos && assignment < arrow &&
+                   (rest[assignment + 1] == '=' || rest[assignment + 1] == '>' ||
+                    (assignment > 0 && std::string("=!<>").find(rest[assignment - 1]) != std::string::npos))) {
+                assignment = rest.find('=', assignment + 2);
+            }
+            if (assignment != std::string::npos && assignment < arrow) {
+                size_t end = assignment;
+                while (end > 0 && isSpace(rest[end - 1])) {
+                    end--;
+                }
+                size_t begin = end;
+                while (begin > 0 && (isIdentifierChar(rest[begin - 1]) || rest[begin - 1] == '.')) {
+                    begin--;
+                }
+                return {rest.substr(begin, end - begin), true};
+            }
+        }
+        std::string name = functionName(rest);
+        return {name, !name.empty()};
+    }
+
+    // Cuts a range of lines into chunks, structurally or line by line
+    class Splitter {
+    public:
+        Splitter(const std::string& text, const std::string& mask, const std::vector<Line>& lines, Language language,
+                 size_t maxChars)
+            : text(text), mask(mask), lines(lines), language(language), maxChars(maxChars), minChars(maxChars / 4) {}
+
+        // Chunks at declaration boundaries at a brace depth or indentation, recursing into
+        // declarations too large for one chunk
+        void splitStructure(size_t first, size_t last, int level, const std::string& scope) {
+            pack(units(first, last, level, false), level, scope, false);
+        }
+
+        // Chunks at content-defined line boundaries
+        void splitLines(size_t first, size_t last, const std::string& scope) {
+            size_t chunkFirst = first;
+            size_t chars = 0;
+            for (size_t i = first; i < last; i++) {
+                const Line& line = lines[i];
+                chars += endOf(i + 1) - line.begin;
+                const size_t content = text.find_first_not_of(" \t\r", line.begin);
+                const bool blank = content == std::string::npos || content >= line.end;
+                const bool cut = chars >= minChars &&
+                                 (blank || (hashLine(text.data() + line.begin, line.end - line.begin) & CHUNK_CUT_MASK) == 0);
+                if (cut || i + 1 - chunkFirst >= CHUNK_MAX_LINES || chars >= maxChars) {
+                    emit(chunkFirst, i + 1, scope);
+                    chunkFirst = i + 1;
+                    chars = 0;
+                }
+            }
+            if (chunkFirst < last) {
+                emit(chunkFirst, last, scope);
+            }
+        }
+
+        std::vector<ChunkSpan> spans;
+
+    private:
+        // Byte offset just past line last - 1 and its line break
+        size_t endOf(size_t last) const {
+            return std::min(lines[last - 1].end + 1, text.size());
+        }
+
+        void emit(size_t first, size_t last, const std::string& scope) {
+            spans.push_back({first + 1, last, lines[first].begin, endOf(last), scope});
+        }
+
+        // Groups small neighbouring units up to the size limit and splits those over it. A group
+        // closes once it reaches a quarter of the limit, so where groups end depends on the units
+        // near it, not on the whole file before it.
+        void pack(const std::vector<Unit>& found, int level, const std::string& scope, bool inFunction) {
+            size_t groupFirst = 0;
+            size_t groupLast = 0;
+            size_t groupChars = 0;
+            std::vector<std::string> names;
+            auto flush = [&]() {
+                if (groupChars == 0) {
+                    return;
+                }
+                emit(groupFirst, groupLast, withNames(scope, names));
+                groupChars = 0;
+                names.clear();
+            };
+            for (const Unit& unit : found) {
+                const size_t size = endOf(unit.last) - lines[unit.first].begin;
+                if (size > maxChars) {
+                    flush();
+                    const std::string inner = unit.name.empty() ? scope : withNames(scope, {unit.name});
+                    const int innerLevel = nestedLevel(unit, level);
+                    const bool innerInFunction = inFunction || unit.function;
+                    std::vector<Unit> parts;
+                    if (innerLevel > level) {
+                        parts = units(unit.first, unit.last, innerLevel, innerInFunction);
+                    }
+                    if (parts.size() > 1) {
+                        pack(parts, innerLevel, inner, innerInFunction);
+                    } else {
+                        splitLines(unit.first, unit.last, inner);
+                    }
+                    continue;
+                }
+                if (groupChars > 0 && groupChars + size > maxChars) {
+                    flush();
+                }
+                if (groupChars == 0) {
+                    groupFirst = unit.first;
+                }
+                groupLast = unit.last;
+                groupChars += size;
+                if (!unit.name.empty()) {
+                    names.push_back(unit.name);
+                }
+                if (groupChars >= minChars) {
+                    flush();
+                }
+            }
+            flush();
+        }
+
+        static std::string withNames(const std::string& scope, const std::vector<std::string>& names) {
+            std::string joined;
+            for (size_t i = 0; i < names.size() && i < MAX_SCOPE_NAMES; i++) {
+                joined += (i > 0 ? ", " : "") + names[i];
+            }
+            if (names.size() > MAX_SCOPE_NAMES) {
+                joined += ", ...";
+            }
+            if (scope.empty() || joined.empty()) {
+                return scope.empty() ? joined : scope;
+            }
+            return scope + " > " + joined;
+        }
+
+        // Next code line from i on before last, last if there is none
+        size_t nextCode(size_t i, size_t last) const {
+            while (i < last && !lines[i].code) {
+                i++;
+            }
+            return i;
+        }
+
+        // Splits a range into declarations or statements at one level; every line belongs to one unit
+        std::vector<Unit> units(size_t first, size_t last, int level, bool inFunction) const {
+            std::vector<Unit> found;
+            size_t start = first;
+            auto close = [&](size_t end) {
+                found.push_back({start, end, {}});
+                start = end;
+            };
+            if (language == Language::Python) {
+                size_t lastCode = last;
+                size_t previousStatement = last;
+                for (size_t i = first; i < last; i++) {
+                    const Line& line = lines[i];
+                    if (!line.code) {
+                        continue;
+                    }
+                    if (!line.continued && line.indent <= level) {
+                        // Comments and blank lines before a statement go with it
+                        const std::string word = firstWord(mask, line);
+                        const bool joins = word == "elif" || word == "else" || word == "except" || word == "finally" ||
+                                           (previousStatement < last && lines[previousStatement].first == '@');
+                        if (lastCode < last && !joins) {
+                            close(lastCode + 1);
+                        }
+                        previousStatement = i;
+                    }
+                    lastCode = i;
+                }
+            } else {
+                for (size_t i = first; i < last; i++) {
+                    const Line& line = lines[i];
+                    if (!line.code || line.depthAfter != level || line.depthBefore < level) {
+                        continue;
+                    }
+                    const size_t next = nextCode(i + 1, last);
+                    const std::string nextWord = next < last ? firstWord(mask, lines[next]) : "";
+                    bool ends = line.last == ';' || line.last == '}' ||
+                                (language == Language::CFamily && line.first == '#' && line.last != '\\');
+                    if (!ends && (language == Language::Go || language == Language::JavaScript) && line.depthBefore == level) {
+                        // A statement without a semicolon ends where the next declaration starts
+                        ends = contains(DECLARATION_STARTS, nextWord) && std::string(",([{=+-*/%&|^<>!?:.").find(line.last) == std::string::npos;
+                    }
+                    if (!ends) {
+                        continue;
+                    }
+                    if (next < last && (nextWord == "else" || nextWord == "catch" || nextWord == "finally" ||
+                                        std::string(".?:)],").find(lines[next].first) != std::string::npos)) {
+                        continue;
+                    }
+                    close(i + 1);
+                }
+            }
+            if (start < last) {
+                if (found.empty()) {
+                    close(last);
+                } else {
+                    found.back().last = last;
+                }
+            }
+            for (Unit& unit : found) {
+                const Declaration declaration = declarationOf(unit, level, inFunction);
+                unit.name = declaration.name;
+                unit.function = declaration.function;
+            }
+            return found;
+        }
+
+        // The declaration a unit opens at this level, unnamed if it opens none
+        Declaration declarationOf(const Unit& unit, int level, bool inFunction) const {
+            const size_t first = nextCode(unit.first, unit.last);
+            if (first >= unit.last) {
+                return {};
+            }
+            size_t begin = lines[first].begin;
+            size_t end = begin;
+            if (language == Language::Python) {
+                size_t header = first;
+                while (header < unit.last && (!lines[header].code || lines[header].first == '@' || lines[header].continued ||
+                                              lines[header].indent < level)) {
+                    header++;
+                }
+                if (header >= unit.last) {
+                    return {};
+                }
+                begin = lines[header].begin;
+                end = lines[header].end;
+            } else {
+                // The enclosing declaration's opening lines belong to its first unit but are not part of
+                // that unit's header
+                size_t opening = first;
+                while (opening < unit.last && (lines[opening].depthAfter <= level || lines[opening].depthBefore < level)) {
+                    opening++;
+                }
+                if (opening >= unit.last) {
+                    return {};
+                }
+                for (size_t i = first; i < opening; i++) {
+                    if (lines[i].depthBefore < level) {
+                        begin = lines[i + 1].begin;
+                    }
+                }
+                end = mask.find('{', lines[opening].begin);
+                end = end == std::string::npos || end > lines[opening].end ? lines[opening].end : end;
+            }
+            // Comments are blank in the mask; squeezing whitespace keeps a long comment from pushing the
+            // declaration out of the header
+            std::string header;
+            for (size_t i = begin; i < end && header.size() < MAX_HEADER_CHARS; i++) {
+                const bool space = isSpace(mask[i]) || mask[i] == '\n';
+                if (!space || (!header.empty() && header.back() != ' ')) {
+                    header += space ? ' ' : mask[i];
+                }
+            }
+            return declare(header, language, inFunction);
+        }
+
+        // Level the statements inside a unit are at, -1 if it has no body to recurse into
+        int nestedLevel(const Unit& unit, int level) const {
+            if (language != Language::Python) {
+                for (size_t i = unit.first; i < unit.last; i++) {
+                    if (lines[i].depthAfter > level) {
+                        return level + 1;
+                    }
+                }
+                return -1;
+            }
+            size_t header = unit.first;
+            while (header < unit.last && (!lines[header].code || lines[header].first == '@' || lines[header].continued ||
+                                          lines[header].indent < level)) {
+                header++;
+            }
+            for (size_t i = header + 1; i < unit.last; i++) {
+                if (lines[i].code && !lines[i].continued && lines[i].indent > lines[header].indent) {
+                    return lines[i].indent;
+                }
+            }
+            return -1;
+        }
+
+        const std::string& text;
+        const std::string& mask;
+        const std::vector<Line>& lines;
+        Language language;
+        size_t maxChars;
+        size_t minChars;
+    };
+}
+
+SourceChunker::SourceChunker(ChunkOptions options) : options(options) {}
+
+SourceChunker::Language SourceChunker::detectLanguage(const std::string& fileName) {
+    std::string extension = std::filesystem::path(fileName).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    static const std::vector<std::pair<std::vector<std::string>, Language>> extensions = {
+        {{".c", ".h", ".cc", ".cpp", ".cxx", ".c++", ".hpp", ".hh", ".hxx", ".h++", ".inl", ".ipp", ".tpp",
+          ".cu", ".cuh", ".m", ".mm", ".java", ".cs"}, Language::CFamily},
+        {{".py", ".pyi", ".pyw"}, Language::Python},
+        {{".js", ".jsx", ".mjs", ".cjs", ".ts", ".tsx", ".mts", ".cts"}, Language::JavaScript},
+        {{".go"}, Language::Go},
+        {{".rs"}, Language::Rust}
+    };
+    for (const auto& [known, language] : extensions) {
+        if (std::find(known.begin(), known.end(), extension) != known.end()) {
+            return language;
+        }
+    }
+    return Language::Text;
+}
+
+std::vector<ChunkSpan> SourceChunker::split(const std::string& fileName, const std::string& contents) const {
+    const Language language = detectLanguage(fileName);
+    Scanner scanner(contents, language);
+    const std::vector<Line> lines = scanner.scan();
+    if (lines.empty()) {
+        return {};
+    }
+    const std::string mask = scanner.takeMask();
+    Splitter splitter(contents, mask, lines, language, std::max<size_t>(options.maxTokens, 16) * CHARS_PER_TOKEN);
+    if (language == Language::Text) {
+        splitter.splitLines(0, lines.size(), "");
+    } else {
+        splitter.splitStructure(0, lines.size(), 0, "");
+    }
+    return std::move(splitter.spans);
+}
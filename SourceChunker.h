@@ -0,0 +1,55 @@
+/**
+ * @file SourceChunker.h
+ * @brief Splits attached files into chunks for retrieval. Source code in C-family languages, Python,
+ *        JavaScript/TypeScript, Go and Rust is cut at function and class boundaries found from braces
+ *        or indentation after comments and strings are masked out, so a chunk holds whole
+ *        declarations and carries the names of the scopes it sits in. Other text, and declarations
+ *        too large for one chunk, are cut at line boundaries chosen by the lines' contents.
+ */
+#ifndef SOURCE_CHUNKER_H
+#define SOURCE_CHUNKER_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+struct ChunkOptions {
+    // Largest chunk, estimated at 4 characters per token
+    size_t maxTokens = 400;
+};
+
+// Where one chunk lies in a file
+struct ChunkSpan {
+    size_t firstLine;
+    size_t lastLine;
+    // Byte range in the file contents, ending after the last line's line break
+    size_t begin;
+    size_t end;
+    // Enclosing scopes and the declarations the chunk holds, e.g. "class Foo > bar, baz"
+    std::string scope;
+};
+
+class SourceChunker {
+public:
+    enum class Language {
+        Text,
+        CFamily,
+        Python,
+        JavaScript,
+        Go,
+        Rust
+    };
+
+    explicit SourceChunker(ChunkOptions options = {});
+
+    // Picks the language from the file extension, Text if it is not one the chunker knows
+    static Language detectLanguage(const std::string& fileName);
+
+    // Splits a file into chunks covering all of it, in order
+    std::vector<ChunkSpan> split(const std::string& fileName, const std::string& contents) const;
+
+private:
+    ChunkOptions options;
+};
+
+#endif // SOURCE_CHUNKER_H
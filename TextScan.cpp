@@ -0,0 +1,234 @@
+/**
+ * @file TextScan.cpp
+ * @brief Vectorized classification and UTF-8 repair of ingested file contents.
+ */
+#include "TextScan.h"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TEXT_SCAN_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define TEXT_SCAN_NEON
+#endif
+
+namespace {
+    // Bytes inspected for a NUL when deciding whether a file is binary, as git does
+    const size_t BINARY_PROBE_BYTES = 8000;
+
+    // Below this share of printable bytes a buffer is not text, whatever its first bytes say
+    const double MIN_PRINTABLE_RATIO = 0.9;
+
+    // U+FFFD REPLACEMENT CHARACTER
+    const char REPLACEMENT[] = "\xEF\xBF\xBD";
+
+    // Blocks a byte-wide counter can add up before it may overflow
+    const size_t BLOCKS_PER_FLUSH = 255;
+
+    inline bool isControl(unsigned char c) {
+        return (c != 0 && c < 0x20 && (c < 0x09 || c > 0x0D) && c != 0x1B) || c == 0x7F;
+    }
+
+    // Counts NUL and control bytes from a block onwards, one byte at a time
+    void countScalar(const unsigned char* data, size_t begin, size_t end, TextScan::TextProfile& profile) {
+        for (size_t i = begin; i < end; i++) {
+            if (data[i] == 0) {
+                if (profile.firstNul == std::string::npos) {
+                    profile.firstNul = i;
+                }
+                profile.nulBytes++;
+            } else if (isControl(data[i])) {
+                profile.controlBytes++;
+            }
+        }
+    }
+
+    // Counts NUL and control bytes 16 at a time. Each lane keeps a byte-wide count that is summed
+    // up every 255 blocks, so the loop has no per-block horizontal work
+    void countBytes(const unsigned char* data, size_t size, TextScan::TextProfile& profile) {
+        size_t i = 0;
+#if defined(TEXT_SCAN_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i space = _mm_set1_epi8(0x20);
+        const __m128i tab = _mm_set1_epi8(0x08);
+        const __m128i carriageReturn = _mm_set1_epi8(0x0E);
+        const __m128i escape = _mm_set1_epi8(0x1B);
+        const __m128i del = _mm_set1_epi8(0x7F);
+        size_t firstNul = profile.firstNul;
+        while (i + 16 <= size) {
+            __m128i nuls = zero;
+            __m128i controls = zero;
+            const size_t blocks = std::min(BLOCKS_PER_FLUSH, (size - i) / 16);
+            for (size_t block = 0; block < blocks; block++, i += 16) {
+                const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                const __m128i nul = _mm_cmpeq_epi8(bytes, zero);
+                if (firstNul == std::string::npos) {
+                    if (const unsigned mask = _mm_movemask_epi8(nul)) {
+                        firstNul = i + std::countr_zero(mask);
+                    }
+                }
+                // Compares are signed, bytes from 0x80 up are negative and so never below 0x01
+                const __m128i low = _mm_and_si128(_mm_cmplt_epi8(bytes, space), _mm_cmpgt_epi8(bytes, zero));
+                const __m128i whitespace = _mm_and_si128(_mm_cmpgt_epi8(bytes, tab), _mm_cmplt_epi8(bytes, carriageReturn));
+                const __m128i allowed = _mm_or_si128(whitespace, _mm_cmpeq_epi8(bytes, escape));
+                const __m128i control = _mm_or_si128(_mm_andnot_si128(allowed, low), _mm_cmpeq_epi8(bytes, del));
+                // Matching lanes are 0xFF, so subtracting them adds one
+                nuls = _mm_sub_epi8(nuls, nul);
+                controls = _mm_sub_epi8(controls, control);
+            }
+            const __m128i nulSums = _mm_sad_epu8(nuls, zero);
+            const __m128i controlSums = _mm_sad_epu8(controls, zero);
+            profile.nulBytes += _mm_cvtsi128_si32(nulSums) + _mm_extract_epi16(nulSums, 4);
+            profile.controlBytes += _mm_cvtsi128_si32(controlSums) + _mm_extract_epi16(controlSums, 4);
+        }
+        profile.firstNul = firstNul;
+#elif defined(TEXT_SCAN_NEON)
+        const uint8x16_t space = vdupq_n_u8(0x20);
+        const uint8x16_t tab = vdupq_n_u8(0x08);
+        const uint8x16_t carriageReturn = vdupq_n_u8(0x0E);
+        const uint8x16_t escape = vdupq_n_u8(0x1B);
+        const uint8x16_t del = vdupq_n_u8(0x7F);
+        const uint8x16_t one = vdupq_n_u8(1);
+        while (i + 16 <= size) {
+            uint8x16_t nuls = vdupq_n_u8(0);
+            uint8x16_t controls = vdupq_n_u8(0);
+            const size_t blocks = std::min(BLOCKS_PER_FLUSH, (size - i) / 16);
+            for (size_t block = 0; block < blocks; block++, i += 16) {
+                const uint8x16_t bytes = vld1q_u8(data + i);
+                const uint8x16_t nul = vceqq_u8(bytes, vdupq_n_u8(0));
+                if (profile.firstNul == std::string::npos && vmaxvq_u8(nul) != 0) {
+                    profile.firstNul = i + std::find(data + i, data + i + 16, 0) - (data + i);
+                }
+                const uint8x16_t low = vandq_u8(vcltq_u8(bytes, space), vcgtq_u8(bytes, vdupq_n_u8(0)));
+                const uint8x16_t whitespace = vandq_u8(vcgtq_u8(bytes, tab), vcltq_u8(bytes, carriageReturn));
+                const uint8x16_t allowed = vorrq_u8(whitespace, vceqq_u8(bytes, escape));
+                const uint8x16_t control = vorrq_u8(vbicq_u8(low, allowed), vceqq_u8(bytes, del));
+                nuls = vaddq_u8(nuls, vandq_u8(nul, one));
+                controls = vaddq_u8(controls, vandq_u8(control, one));
+            }
+            profile.nulBytes += vaddlvq_u8(nuls);
+            profile.controlBytes += vaddlvq_u8(controls);
+        }
+#endif
+        countScalar(data, i, size, profile);
+    }
+
+    // First offset from i on holding a byte of 0x80 or above, checking 16 bytes at a time
+    size_t skipAscii(const unsigned char* data, size_t i, size_t size) {
+#if defined(TEXT_SCAN_SSE2)
+        for (; i + 16 <= size; i += 16) {
+            if (const unsigned mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)))) {
+                return i + std::countr_zero(mask);
+            }
+        }
+#elif defined(TEXT_SCAN_NEON)
+        for (; i + 16 <= size && vmaxvq_u8(vld1q_u8(data + i)) < 0x80; i += 16) {
+        }
+#endif
+        while (i < size && data[i] < 0x80) {
+            i++;
+        }
+        return i;
+    }
+
+    // Length of the well-formed UTF-8 sequence starting at data, or 0 with the length of its maximal
+    // ill-formed prefix in bad. Overlong forms, surrogates and code points past U+10FFFF are ill-formed.
+    size_t sequenceLength(const unsigned char* data, size_t available, size_t& bad) {
+        const unsigned char lead = data[0];
+        size_t length = 0;
+        unsigned char low = 0x80;
+        unsigned char high = 0xBF;
+        if (lead >= 0xC2 && lead <= 0xDF) {
+            length = 2;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            length = 3;
+            low = lead == 0xE0 ? 0xA0 : 0x80;
+            high = lead == 0xED ? 0x9F : 0xBF;
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            length = 4;
+            low = lead == 0xF0 ? 0x90 : 0x80;
+            high = lead == 0xF4 ? 0x8F : 0xBF;
+        } else {
+            bad = 1;
+            return 0;
+        }
+        for (size_t k = 1; k < length; k++) {
+            if (k >= available || data[k] < low || data[k] > high) {
+                bad = k;
+                return 0;
+            }
+            low = 0x80;
+            high = 0xBF;
+        }
+        return length;
+    }
+}
+
+namespace TextScan {
+    TextProfile profile(std::string_view text) {
+        const auto* data = reinterpret_cast<const unsigned char*>(text.data());
+        TextProfile result;
+        result.bytes = text.size();
+        countBytes(data, text.size(), result);
+        for (size_t i = skipAscii(data, 0, text.size()); i < text.size(); i = skipAscii(data, i, text.size())) {
+            size_t bad = 0;
+            if (const size_t length = sequenceLength(data + i, text.size() - i, bad)) {
+                i += length;
+            } else {
+                result.invalidBytes += bad;
+                i += bad;
+            }
+        }
+        return result;
+    }
+
+    bool isBinary(const TextProfile& profile) {
+        return profile.firstNul < BINARY_PROBE_BYTES || profile.printableRatio() < MIN_PRINTABLE_RATIO;
+    }
+
+    std::string repairUtf8(std::string_view text) {
+        const auto* data = reinterpret_cast<const unsigned char*>(text.data());
+        std::string repaired;
+        // Start of the bytes not yet copied to repaired, only used once something needs repair
+        size_t copied = 0;
+        for (size_t i = skipAscii(data, 0, text.size()); i < text.size(); i = skipAscii(data, i, text.size())) {
+            size_t bad = 0;
+            if (const size_t length = sequenceLength(data + i, text.size() - i, bad)) {
+                i += length;
+                continue;
+            }
+            if (repaired.empty()) {
+                repaired.reserve(text.size() + 16);
+            }
+            repaired.append(text.data() + copied, i - copied);
+            repaired += REPLACEMENT;
+            i += bad;
+            copied = i;
+        }
+        if (copied == 0) {
+            return std::string(text);
+        }
+        repaired.append(text.data() + copied, text.size() - copied);
+        return repaired;
+    }
+
+    std::string describeBinary(const std::string& name, const TextProfile& profile) {
+        const auto percent = [&](size_t count) {
+            return std::to_string(profile.bytes > 0 ? count * 100 / profile.bytes : 0) + "%";
+        };
+        return "[Binary file " + name + ": " + std::to_string(profile.bytes) + " bytes, " +
+               percent(profile.nulBytes) + " NUL, " + percent(profile.controlBytes) + " control, " +
+               percent(profile.invalidBytes) + " invalid UTF-8 - contents omitted]";
+    }
+
+    std::string sanitize(const std::string& name, std::string_view text) {
+        const TextProfile scanned = profile(text);
+        if (isBinary(scanned)) {
+            return describeBinary(name, scanned);
+        }
+        return scanned.invalidBytes > 0 ? repairUtf8(text) : std::string(text);
+    }
+}
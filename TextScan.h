@@ -0,0 +1,50 @@
+/**
+ * @file TextScan.h
+ * @brief Classifies file contents before they reach the tokenizer. One vectorized pass counts NUL and
+ *        control bytes and another validates UTF-8, skipping ASCII runs 16 bytes at a time, so a
+ *        buffer is profiled at close to memory bandwidth. Binaries are told apart from text and
+ *        ill-formed UTF-8 is repaired.
+ */
+#ifndef TEXT_SCAN_H
+#define TEXT_SCAN_H
+
+#include <string>
+#include <string_view>
+#include <cstddef>
+
+namespace TextScan {
+    // What one scan found in a buffer
+    struct TextProfile {
+        size_t bytes = 0;
+        size_t nulBytes = 0;
+        // Offset of the first NUL, npos if there is none
+        size_t firstNul = std::string::npos;
+        // Bytes below 0x20 and DEL, not counting NULs, tabs, line breaks, form feeds and escapes
+        size_t controlBytes = 0;
+        // Bytes that are not part of a well-formed UTF-8 sequence
+        size_t invalidBytes = 0;
+
+        // Share of bytes that are neither NUL, control nor ill-formed, 1 for an empty buffer
+        inline double printableRatio() const {
+            return bytes > 0 ? 1.0 - double(nulBytes + controlBytes + invalidBytes) / bytes : 1.0;
+        }
+    };
+
+    // Scans a buffer once for NULs and control bytes and once for ill-formed UTF-8
+    TextProfile profile(std::string_view text);
+
+    // A NUL in the first 8000 bytes, as git decides, or too few printable bytes to be worth tokenizing
+    bool isBinary(const TextProfile& profile);
+
+    // Replaces every maximal ill-formed subsequence with U+FFFD, as Unicode recommends; valid text is
+    // returned unchanged
+    std::string repairUtf8(std::string_view text);
+
+    // One-line stand-in for a binary file's contents, so the model learns it exists without its bytes
+    std::string describeBinary(const std::string& name, const TextProfile& profile);
+
+    // Text ready for the tokenizer: repaired text, or the description if the contents are binary
+    std::string sanitize(const std::string& name, std::string_view text);
+}
+
+#endif // TEXT_SCAN_H
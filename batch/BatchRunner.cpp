@@ -0,0 +1,515 @@
+/**
+ * @file BatchRunner.cpp
+ * @brief Offline driver behind smart-agent-batch. The main thread reads, tokenizes and queues
+ *        prompts and writes results; the engine's worker thread only hands finished requests back.
+ *        The output doubles as a journal - a resumed run skips every line it already has a result
+ *        for, and the checkpoint lets it seek past the finished head of the input.
+ */
+
+#include "BatchRunner.h"
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <chrono>
+
+namespace
+{
+   // Results written between checkpoints
+   const uint64_t CHECKPOINT_EVERY = 64;
+
+   // Times an item is queued again after the engine ended it to free KV cells for the others
+   const uint32_t MAX_CONTEXT_RETRIES = 3;
+
+   // How long the main thread sleeps waiting for a result before checking for stop()
+   const std::chrono::milliseconds DRAIN_INTERVAL(100);
+
+   std::string finishReason(GenerationStopReason reason)
+   {
+      switch(reason)
+      {
+         case GenerationStopReason::MaxTokens:
+         case GenerationStopReason::Deadline:
+            return "length";
+         case GenerationStopReason::ContextFull:
+            return "context_full";
+         case GenerationStopReason::DecodeError:
+            return "error";
+         default:
+            return "stop";
+      }
+   }
+
+   // Dumps JSON replacing any invalid UTF-8 instead of throwing
+   std::string dumpJson(const nlohmann::json& j)
+   {
+      return j.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+   }
+}
+
+/**
+ * @brief Prepares a run, nothing is read until run() is called
+ *
+ * @param model Loaded, in-process model the prompts are answered by
+ * @param options Input, output and scheduling settings
+ */
+BatchRunner::BatchRunner(ModelInterface* model, BatchOptions options) :
+ m_model(model),
+ m_options(std::move(options)),
+ m_stop(false),
+ m_nextLine(0),
+ m_nextOffset(0),
+ m_resumeLine(0),
+ m_resumeOffset(0),
+ m_sinceCheckpoint(0),
+ m_outstanding(0)
+{
+   if(m_options.checkpointPath.empty())
+   {
+      m_options.checkpointPath = m_options.outputPath + ".ckpt";
+   }
+   m_options.window = std::max<size_t>(1, m_options.window);
+   m_options.inFlight = std::max<size_t>(1, m_options.inFlight);
+}
+
+/**
+ * @brief Asks the run to finish early; safe to call from a signal handler
+ */
+void BatchRunner::stop()
+{
+   m_stop = true;
+}
+
+/**
+ * @brief Returns the counters of the last run
+ */
+BatchSummary BatchRunner::getSummary() const
+{
+   return m_summary;
+}
+
+/**
+ * @brief Processes the input until it is exhausted or stop() is called
+ *
+ * @return true Every item read has a result or was left for the next run
+ * @return false The input, output or checkpoint could not be opened
+ */
+bool BatchRunner::run()
+{
+   const auto started = std::chrono::steady_clock::now();
+   m_summary = BatchSummary();
+   if(m_model->getEngine() == nullptr)
+   {
+      std::cerr << "Error : batch mode needs a model loaded in this process" << std::endl;
+      return false;
+   }
+   if(!resume())
+   {
+      return false;
+   }
+
+   std::ifstream input(m_options.inputPath, std::ios::binary);
+   if(!input)
+   {
+      std::cerr << "Error : could not open " << m_options.inputPath << std::endl;
+      return false;
+   }
+   input.seekg(static_cast<std::streamoff>(m_resumeOffset));
+   m_nextLine = m_resumeLine;
+   m_nextOffset = m_resumeOffset;
+
+   m_output.open(m_options.outputPath, std::ios::binary | std::ios::app);
+   if(!m_output)
+   {
+      std::cerr << "Error : could not open " << m_options.outputPath << std::endl;
+      return false;
+   }
+
+   while(!m_stop)
+   {
+      std::vector<Item> window = readWindow(input);
+      if(window.empty())
+      {
+         break;
+      }
+      // Longest first - long prefills start while there is still work to overlap them with, prompts
+      // of similar length decode side by side and the window ends on short requests, not stragglers
+      std::stable_sort(window.begin(), window.end(), [](const Item& a, const Item& b)
+      {
+         return a.request.promptTokens.size() > b.request.promptTokens.size();
+      });
+      for(auto& item : window)
+      {
+         while(!m_stop && m_outstanding >= m_options.inFlight)
+         {
+            drain(true);
+         }
+         if(m_stop)
+         {
+            break;
+         }
+         submit(std::move(item));
+      }
+      // Whatever finished while this window was queued goes out before the next one is read
+      drain(false);
+   }
+
+   // Anything cancelled by stop() comes back without a record and is left for the next run
+   while(m_outstanding > 0)
+   {
+      drain(true);
+   }
+   m_output.flush();
+   writeCheckpoint();
+
+   m_summary.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+   return true;
+}
+
+// Restores the checkpoint and collects items already present in the output
+bool BatchRunner::resume()
+{
+   m_open.clear();
+   m_doneAhead.clear();
+   m_resumeLine = 0;
+   m_resumeOffset = 0;
+
+   std::error_code ec;
+   if(std::filesystem::exists(m_options.checkpointPath, ec))
+   {
+      std::ifstream file(m_options.checkpointPath);
+      nlohmann::json checkpoint = nlohmann::json::parse(file, nullptr, false);
+      const bool sameInput = checkpoint.is_object() && checkpoint.contains("input") && checkpoint["input"].is_string() &&
+                             checkpoint["input"].get<std::string>() == m_options.inputPath;
+      if(sameInput && checkpoint.contains("line") && checkpoint["line"].is_number_unsigned() &&
+         checkpoint.contains("offset") && checkpoint["offset"].is_number_unsigned() &&
+         checkpoint["offset"].get<uint64_t>() <= std::filesystem::file_size(m_options.inputPath, ec))
+      {
+         m_resumeLine = checkpoint["line"].get<uint64_t>();
+         m_resumeOffset = checkpoint["offset"].get<uint64_t>();
+      }
+      else
+      {
+         std::cerr << "Warning : ignoring checkpoint " << m_options.checkpointPath << ", it is for another input" << std::endl;
+      }
+   }
+
+   if(!std::filesystem::exists(m_options.outputPath, ec))
+   {
+      return true;
+   }
+
+   // Lines finished out of order past the checkpoint are only recorded in the output itself
+   std::ifstream output(m_options.outputPath, std::ios::binary);
+   if(!output)
+   {
+      std::cerr << "Error : could not read " << m_options.outputPath << std::endl;
+      return false;
+   }
+   uint64_t complete = 0;
+   std::string text;
+   while(std::getline(output, text))
+   {
+      if(output.eof())
+      {
+         // Cut off mid-write - dropped below so the item runs again
+         break;
+      }
+      complete += text.size() + 1;
+      nlohmann::json record = nlohmann::json::parse(text, nullptr, false);
+      if(record.is_object() && record.contains("line") && record["line"].is_number_unsigned())
+      {
+         const uint64_t line = record["line"].get<uint64_t>();
+         if(line >= m_resumeLine)
+         {
+            m_doneAhead.insert(line);
+         }
+      }
+   }
+   output.close();
+   if(complete < std::filesystem::file_size(m_options.outputPath, ec))
+   {
+      std::filesystem::resize_file(m_options.outputPath, complete, ec);
+      if(ec)
+      {
+         std::cerr << "Error : could not drop the partial record at the end of " << m_options.outputPath << std::endl;
+         return false;
+      }
+   }
+
+   #ifdef _DEBUG
+      std::cout << "Resuming at line " << m_resumeLine << " with " << m_doneAhead.size() << " later lines done" << std::endl;
+   #endif
+   return true;
+}
+
+// Reads up to a window of unfinished items; malformed lines get an error record straight away
+std::vector<BatchRunner::Item> BatchRunner::readWindow(std::ifstream& input)
+{
+   std::vector<Item> items;
+   std::string text;
+   while(items.size() < m_options.window && !m_stop && std::getline(input, text))
+   {
+      const uint64_t line = m_nextLine++;
+      const uint64_t offset = m_nextOffset;
+      // The last line may end without a newline
+      m_nextOffset += text.size() + (input.eof() ? 0 : 1);
+
+      if(m_doneAhead.erase(line) > 0)
+      {
+         m_summary.skipped++;
+         continue;
+      }
+      if(text.find_first_not_of(" \t\r") == std::string::npos)
+      {
+         continue;
+      }
+
+      m_open[line] = offset;
+      Item item;
+      item.line = line;
+      std::string error;
+      if(!parseItem(text, item, error))
+      {
+         writeResult(line, {{"id", item.id}, {"line", line}, {"error", error}}, true);
+         continue;
+      }
+      items.push_back(std::move(item));
+   }
+   return items;
+}
+
+// Parses and tokenizes one input line
+bool BatchRunner::parseItem(const std::string& text, Item& item, std::string& error) const
+{
+   nlohmann::json body = nlohmann::json::parse(text, nullptr, false);
+   if(body.is_discarded() || !body.is_object())
+   {
+      item.id = item.line;
+      error = "line is not a JSON object";
+      return false;
+   }
+   item.id = body.contains("id") ? body["id"] : nlohmann::json(item.line);
+
+   // Either a chat-completions style "messages" array or a bare "prompt" with an optional "system"
+   std::vector<std::pair<std::string, std::string>> messages;
+   if(body.contains("messages") && body["messages"].is_array())
+   {
+      for(const auto& msg : body["messages"])
+      {
+         if(!msg.is_object() || !msg.contains("role") || !msg["role"].is_string() ||
+            !msg.contains("content") || !msg["content"].is_string())
+         {
+            error = "every message needs a 'role' and a 'content' string";
+            return false;
+         }
+         messages.emplace_back(msg["role"].get<std::string>(), msg["content"].get<std::string>());
+      }
+   }
+   else if(body.contains("prompt") && body["prompt"].is_string())
+   {
+      if(body.contains("system") && body["system"].is_string())
+      {
+         messages.emplace_back("system", body["system"].get<std::string>());
+      }
+      messages.emplace_back("user", body["prompt"].get<std::string>());
+   }
+   if(messages.empty())
+   {
+      error = "item needs a 'prompt' string or a 'messages' array";
+      return false;
+   }
+
+   // Reference material goes in front of the last message, laid out as the interactive turns do
+   if(body.contains("context") && body["context"].is_string())
+   {
+      const std::string context = m_options.compressor ? m_options.compressor->compress(body["context"].get<std::string>())
+                                                        : body["context"].get<std::string>();
+      messages.back().second = "Reference material:\n" + context + "\n" + messages.back().second;
+   }
+
+   std::vector<llama_chat_message> chat;
+   for(const auto& [role, content] : messages)
+   {
+      chat.push_back({role.c_str(), content.c_str()});
+   }
+   auto formatted = m_model->applyChatTemplate(chat, true);
+   if(!formatted.has_value())
+   {
+      error = "could not apply the model's chat template";
+      return false;
+   }
+   auto tokens = m_model->tokenize(formatted.value(), true);
+   if(!tokens.has_value())
+   {
+      error = "could not tokenize the prompt";
+      return false;
+   }
+
+   GenerationRequest& request = item.request;
+   request.promptTokens = std::move(tokens.value());
+   request.sessionId = -1;
+   request.maxTokens = m_options.maxTokens;
+   request.sampling = m_options.sampling;
+   request.trackConfidence = m_options.trackConfidence;
+   if(body.contains("max_tokens") && body["max_tokens"].is_number_integer())
+   {
+      request.maxTokens = body["max_tokens"].get<int32_t>();
+   }
+   if(body.contains("temperature") && body["temperature"].is_number())
+   {
+      request.sampling.temperature = body["temperature"].get<float>();
+   }
+   if(body.contains("seed") && body["seed"].is_number_integer())
+   {
+      request.sampling.seed = body["seed"].get<uint32_t>();
+   }
+   return true;
+}
+
+// Queues an item on the engine
+void BatchRunner::submit(Item item)
+{
+   m_submitted[item.line] = item;
+   GenerationRequest& request = item.request;
+   // Checked between tokens, so stop() does not wait for long replies to finish
+   request.onToken = [this](const std::string&)
+   {
+      return !m_stop;
+   };
+   request.onComplete = [this, line = item.line, id = item.id](const GenerationResult& result)
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_finished.push_back({line, id, result});
+      }
+      m_cv.notify_one();
+   };
+
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_outstanding++;
+   }
+   m_model->getEngine()->submit(std::move(request));
+}
+
+// Writes finished results, waiting briefly for one when wait is set
+void BatchRunner::drain(bool wait)
+{
+   std::deque<Finished> finished;
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if(wait && m_finished.empty())
+      {
+         m_cv.wait_for(lock, DRAIN_INTERVAL, [this]() { return !m_finished.empty(); });
+      }
+      finished.swap(m_finished);
+      m_outstanding -= finished.size();
+   }
+
+   const size_t sequenceContext = m_model->getEngine()->getSequenceContext();
+   for(const auto& done : finished)
+   {
+      const GenerationResult& result = done.result;
+      auto submitted = m_submitted.find(done.line);
+      if(submitted == m_submitted.end())
+      {
+         continue;
+      }
+      Item item = std::move(submitted->second);
+      m_submitted.erase(submitted);
+      if(result.stopReason == GenerationStopReason::Cancelled)
+      {
+         continue;
+      }
+      // Ended short of its own sequence's limit, the engine ran out of cells shared with other requests
+      const bool transient = result.stopReason == GenerationStopReason::ContextFull &&
+                             static_cast<size_t>(result.promptTokens + result.generatedTokens) < sequenceContext;
+      if(transient && item.retries < MAX_CONTEXT_RETRIES && !m_stop)
+      {
+         item.retries++;
+         submit(std::move(item));
+         continue;
+      }
+      m_summary.promptTokens += result.promptTokens;
+      m_summary.generatedTokens += result.generatedTokens;
+
+      // A prompt longer than a slot's context never produced a token, that is an error not a reply
+      if(result.stopReason == GenerationStopReason::DecodeError ||
+         (result.stopReason == GenerationStopReason::ContextFull && result.generatedTokens == 0))
+      {
+         const std::string error = result.stopReason == GenerationStopReason::DecodeError
+                                      ? "generation failed" : "prompt does not fit the context";
+         writeResult(done.line, {{"id", done.id}, {"line", done.line}, {"error", error}}, true);
+         continue;
+      }
+      nlohmann::json record = {
+         {"id", done.id},
+         {"line", done.line},
+         {"text", result.text},
+         {"finish_reason", finishReason(result.stopReason)},
+         {"prompt_tokens", result.promptTokens},
+         {"completion_tokens", result.generatedTokens}
+      };
+      if(result.confidence.scoredTokens > 0)
+      {
+         record["mean_logprob"] = result.confidence.meanLogProb;
+         m_summary.logProbSum += result.confidence.meanLogProb;
+         m_summary.scoredReplies++;
+      }
+      writeResult(done.line, record, false);
+   }
+}
+
+// Appends a line's result record and moves the resume point past every leading finished line
+void BatchRunner::writeResult(uint64_t line, const nlohmann::json& record, bool failed)
+{
+   m_output << dumpJson(record) << '\n';
+   m_open.erase(line);
+   m_summary.completed++;
+   m_summary.failed += failed ? 1 : 0;
+
+   if(++m_sinceCheckpoint >= CHECKPOINT_EVERY)
+   {
+      // The records the checkpoint vouches for must be on disk first
+      m_output.flush();
+      writeCheckpoint();
+      std::cout << "[batch] " << m_summary.completed << " done, " << m_summary.generatedTokens << " tokens generated" << std::endl;
+   }
+}
+
+// Atomically replaces the checkpoint with the current resume point
+void BatchRunner::writeCheckpoint()
+{
+   m_sinceCheckpoint = 0;
+
+   // Everything before the oldest open line is finished; with none open, everything read is
+   uint64_t line = m_nextLine;
+   uint64_t offset = m_nextOffset;
+   if(!m_open.empty())
+   {
+      line = m_open.begin()->first;
+      offset = m_open.begin()->second;
+   }
+   const nlohmann::json checkpoint = {
+      {"input", m_options.inputPath},
+      {"line", line},
+      {"offset", offset}
+   };
+
+   const std::string temp = m_options.checkpointPath + ".tmp";
+   {
+      std::ofstream file(temp, std::ios::trunc);
+      file << checkpoint.dump() << '\n';
+      if(!file.flush())
+      {
+         std::cerr << "Warning : could not write " << temp << std::endl;
+         return;
+      }
+   }
+   std::error_code ec;
+   std::filesystem::rename(temp, m_options.checkpointPath, ec);
+   if(ec)
+   {
+      std::cerr << "Warning : could not replace " << m_options.checkpointPath << std::endl;
+   }
+}
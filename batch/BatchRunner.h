@@ -0,0 +1,174 @@
+/**
+ * @file BatchRunner.h
+ * @brief Offline driver behind smart-agent-batch. Streams a JSONL file of prompts through a model's
+ *        InferenceEngine, keeping every sequence slot busy, and appends one JSONL result per prompt.
+ *        Prompts are read in windows and sorted by length so sequences decoding together finish
+ *        together. Progress is checkpointed so an interrupted run resumes where it stopped.
+ */
+#ifndef BATCH_RUNNER_H
+#define BATCH_RUNNER_H
+
+#include "ModelInterface.h"
+#include "PromptCompressor.h"
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * @brief Settings of one batch run
+ */
+struct BatchOptions
+{
+   // JSONL prompts, one object per line with "prompt" or "messages", an optional "context" and "id"
+   std::string inputPath;
+   // JSONL results, appended to when resuming
+   std::string outputPath;
+   // Progress file, defaults to outputPath + ".ckpt"
+   std::string checkpointPath;
+   // Prompts read ahead and sorted by length together
+   size_t window = 1024;
+   // Requests queued on the engine at once - enough to refill slots without waiting on this thread
+   size_t inFlight = 32;
+   // Reply limit for items without their own "max_tokens"
+   int32_t maxTokens = 512;
+   // Sampling for items without their own "temperature"
+   SamplingParams sampling;
+   // Shortens every item's "context" before it is tokenized, nullptr to pass it as it is
+   PromptCompressor* compressor = nullptr;
+   // Scores every reply's tokens so runs with and without compression can be compared
+   bool trackConfidence = false;
+};
+
+/**
+ * @brief Counters reported at the end of a run
+ */
+struct BatchSummary
+{
+   // Items given a result in this run, failures included
+   uint64_t completed = 0;
+   // Items that produced an error record
+   uint64_t failed = 0;
+   // Items a previous run had already finished
+   uint64_t skipped = 0;
+   uint64_t promptTokens = 0;
+   uint64_t generatedTokens = 0;
+   // Sum of the replies' mean log-probabilities and the replies scored, with trackConfidence
+   double logProbSum = 0.0;
+   uint64_t scoredReplies = 0;
+   double seconds = 0.0;
+
+   inline double meanLogProb() const
+   {
+      return scoredReplies > 0 ? logProbSum / scoredReplies : 0.0;
+   }
+};
+
+class BatchRunner
+{
+public:
+   /**
+    * @brief Prepares a run, nothing is read until run() is called
+    *
+    * @param model Loaded, in-process model the prompts are answered by
+    * @param options Input, output and scheduling settings
+    */
+   BatchRunner(ModelInterface* model, BatchOptions options);
+
+   /**
+    * @brief Processes the input until it is exhausted or stop() is called
+    *
+    * @return true Every item read has a result or was left for the next run
+    * @return false The input, output or checkpoint could not be opened
+    */
+   bool run();
+
+   /**
+    * @brief Asks the run to finish early; safe to call from a signal handler
+    *
+    * Requests still decoding are cancelled and left for the next run.
+    */
+   void stop();
+
+   /**
+    * @brief Returns the counters of the last run
+    */
+   BatchSummary getSummary() const;
+
+private:
+   // One prompt read from the input
+   struct Item
+   {
+      uint64_t line = 0;
+      nlohmann::json id;
+      GenerationRequest request;
+      // Times the engine gave up on it for lack of KV cells
+      uint32_t retries = 0;
+   };
+
+   // A result waiting to be written by the main thread
+   struct Finished
+   {
+      uint64_t line = 0;
+      nlohmann::json id;
+      GenerationResult result;
+   };
+
+   // Restores the checkpoint and collects items already present in the output
+   bool resume();
+
+   // Reads up to a window of unfinished items; malformed lines get an error record straight away
+   std::vector<Item> readWindow(std::ifstream& input);
+
+   // Parses and tokenizes one input line
+   bool parseItem(const std::string& text, Item& item, std::string& error) const;
+
+   // Queues an item on the engine
+   void submit(Item item);
+
+   // Writes finished results, waiting briefly for one when wait is set
+   void drain(bool wait);
+
+   // Appends a line's result record and moves the resume point past every leading finished line
+   void writeResult(uint64_t line, const nlohmann::json& record, bool failed);
+
+   // Atomically replaces the checkpoint with the current resume point
+   void writeCheckpoint();
+
+   ModelInterface* m_model;
+   BatchOptions m_options;
+   BatchSummary m_summary;
+   std::atomic<bool> m_stop;
+
+   std::ofstream m_output;
+
+   // Lines read but without a result yet, mapped to the offset they start at
+   std::map<uint64_t, uint64_t> m_open;
+   // Items on the engine, kept to be queued again if the engine ran out of KV cells for them
+   std::map<uint64_t, Item> m_submitted;
+   // Lines past the resume point that already have a result in the output
+   std::set<uint64_t> m_doneAhead;
+   // Next line to read and the offset it starts at
+   uint64_t m_nextLine;
+   uint64_t m_nextOffset;
+   // Where the last checkpoint told the input to resume
+   uint64_t m_resumeLine;
+   uint64_t m_resumeOffset;
+   // Results written since the checkpoint was last replaced
+   uint64_t m_sinceCheckpoint;
+
+   // Results handed over by the engine's worker thread
+   std::mutex m_mutex;
+   std::condition_variable m_cv;
+   std::deque<Finished> m_finished;
+   size_t m_outstanding;
+};
+
+#endif
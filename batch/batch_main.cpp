@@ -0,0 +1,169 @@
+/**
+ * @file batch_main.cpp
+ * @brief Entry point for smart-agent-batch, which answers a JSONL file of prompts offline with as
+ *        many sequences decoding at once as the model's context is sized for.
+ */
+#include "BatchRunner.h"
+#include "ModelManager.h"
+#include <iostream>
+#include <string>
+#include <csignal>
+#include <cstdlib>
+#include <memory>
+
+namespace
+{
+   BatchRunner* g_runner = nullptr;
+
+   void handleSignal(int)
+   {
+      if(g_runner)
+      {
+         g_runner->stop();
+      }
+   }
+
+   void printUsage(const char* argv0)
+   {
+      std::cerr << "Usage: " << argv0 << " --models-dir <dir> --model <file.gguf> --input <prompts.jsonl> --output <results.jsonl> [options]\n"
+                << "  --checkpoint <path> Progress file (default <output>.ckpt)\n"
+                << "  --slots <n>       Concurrent sequences decoded per batch (default 16)\n"
+                << "  --prefix-cache <n> Tokens of shared prompt prefixes kept resident (default 8192, 0 disables)\n"
+                << "  --rpc <host:port,...> Split models across llama.cpp rpc-server processes by free memory\n"
+                << "  --rpc-profile     Time compute and transfer per RPC node (slows decoding)\n"
+                << "  --window <n>      Prompts read ahead and sorted by length together (default 1024)\n"
+                << "  --max-tokens <n>  Reply limit for items without \"max_tokens\" (default 512)\n"
+                << "  --temperature <x> Sampling temperature for items without \"temperature\" (default 0, greedy)\n"
+                << "  --compress-model <file.gguf> Small model that scores items' \"context\" to leave its least informative parts out\n"
+                << "  --compress-ratio <x> Share of the context's tokens kept when compressing (default 0.5)\n"
+                << "  --confidence      Record every reply's mean log-probability, to compare runs by\n"
+                << "Input lines are objects with \"prompt\" (and optional \"system\") or \"messages\", plus an optional\n"
+                << "\"context\" of reference material and \"id\".\n"
+                << "Interrupted runs resume from the checkpoint when started again with the same arguments.\n";
+   }
+}
+
+int main(int argc, char** argv)
+{
+   std::string modelsDir;
+   std::string modelName;
+   BatchOptions options;
+   options.sampling.temperature = 0.0f;
+   int slots = 16;
+   int prefixCache = 8192;
+   std::string rpcEndpoints;
+   bool rpcProfile = false;
+   long window = static_cast<long>(options.window);
+   std::string compressModel;
+   CompressionOptions compression;
+
+   for(int i = 1; i < argc; ++i)
+   {
+      const std::string arg = argv[i];
+      const bool hasValue = i + 1 < argc;
+      if(arg == "--models-dir" && hasValue)      modelsDir = argv[++i];
+      else if(arg == "--model" && hasValue)      modelName = argv[++i];
+      else if(arg == "--input" && hasValue)      options.inputPath = argv[++i];
+      else if(arg == "--output" && hasValue)     options.outputPath = argv[++i];
+      else if(arg == "--checkpoint" && hasValue) options.checkpointPath = argv[++i];
+      else if(arg == "--slots" && hasValue)      slots = std::atoi(argv[++i]);
+      else if(arg == "--prefix-cache" && hasValue) prefixCache = std::atoi(argv[++i]);
+      else if(arg == "--rpc" && hasValue)        rpcEndpoints = argv[++i];
+      else if(arg == "--rpc-profile")            rpcProfile = true;
+      else if(arg == "--window" && hasValue)     window = std::atol(argv[++i]);
+      else if(arg == "--max-tokens" && hasValue) options.maxTokens = std::atoi(argv[++i]);
+      else if(arg == "--temperature" && hasValue) options.sampling.temperature = static_cast<float>(std::atof(argv[++i]));
+      else if(arg == "--compress-model" && hasValue) compressModel = argv[++i];
+      else if(arg == "--compress-ratio" && hasValue) compression.keepRatio = std::atof(argv[++i]);
+      else if(arg == "--confidence")             options.trackConfidence = true;
+      else
+      {
+         printUsage(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+   if(modelsDir.empty() || modelName.empty() || options.inputPath.empty() || options.outputPath.empty() ||
+      slots <= 0 || prefixCache < 0 || window <= 0 || compression.keepRatio <= 0.0 || compression.keepRatio > 1.0)
+   {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+   }
+   options.window = static_cast<size_t>(window);
+   // Two per slot keeps a finished sequence's slot refilled without waiting on the writer thread
+   options.inFlight = static_cast<size_t>(slots) * 2;
+
+   ModelManager* manager = ModelManager::getInstance();
+   manager->setModelDirectory(modelsDir);
+   manager->setSequenceSlots(static_cast<uint32_t>(slots));
+   // Batch prompts tend to share an instruction prefix; it is prefilled once for the whole run
+   manager->setPrefixCacheCells(static_cast<uint32_t>(prefixCache));
+   #ifdef SMART_AGENT_RPC
+      manager->setRpcEndpoints(RpcCluster::parseEndpoints(rpcEndpoints), rpcProfile);
+   #else
+      if(!rpcEndpoints.empty() || rpcProfile)
+      {
+         std::cerr << "Error : --rpc and --rpc-profile need a build with GGML_RPC on" << std::endl;
+         return EXIT_FAILURE;
+      }
+   #endif
+   auto loadResp = manager->loadModel(modelName);
+   if(!loadResp.has_value())
+   {
+      std::cerr << "Error : failed to load model " << modelName << std::endl;
+      return EXIT_FAILURE;
+   }
+
+   // The scoring model stays resident beside the answering one for the whole run
+   std::unique_ptr<PromptCompressor> compressor;
+   if(!compressModel.empty())
+   {
+      auto scorerResp = manager->loadFallbackModel(compressModel);
+      if(!scorerResp.has_value())
+      {
+         std::cerr << "Error : failed to load compression model " << compressModel << std::endl;
+         manager->unloadModel();
+         return EXIT_FAILURE;
+      }
+      compressor = std::make_unique<PromptCompressor>(scorerResp.value(), compression);
+      options.compressor = compressor.get();
+   }
+
+   int status = EXIT_SUCCESS;
+   {
+      BatchRunner runner(loadResp.value(), options);
+      g_runner = &runner;
+      std::signal(SIGINT, handleSignal);
+      std::signal(SIGTERM, handleSignal);
+      if(!runner.run())
+      {
+         status = EXIT_FAILURE;
+      }
+      g_runner = nullptr;
+
+      const BatchSummary summary = runner.getSummary();
+      std::cout << "smart-agent-batch: " << summary.completed << " completed (" << summary.failed << " failed), "
+                << summary.skipped << " already done, " << summary.generatedTokens << " tokens in "
+                << summary.seconds << "s";
+      if(summary.seconds > 0.0)
+      {
+         std::cout << " (" << summary.generatedTokens / summary.seconds << " tokens/s)";
+      }
+      if(summary.scoredReplies > 0)
+      {
+         std::cout << ", mean log-prob " << summary.meanLogProb();
+      }
+      std::cout << std::endl;
+      if(compressor)
+      {
+         const CompressionStats stats = compressor->getStats();
+         std::cout << "smart-agent-batch: context compressed from " << stats.originalTokens << " to " << stats.keptTokens
+                   << " tokens (" << stats.keptRatio() * 100.0 << "%) over " << stats.texts << " item(s), "
+                   << stats.passedThrough << " left as they were, " << stats.scoringMs << " ms scoring" << std::endl;
+      }
+
+      // Stop the worker while the runner (which its callbacks reference) is still alive
+      manager->unloadModel();
+   }
+
+   return status;
+}
@@ -0,0 +1,116 @@
+/**
+ * @file cli_main.cpp
+ * @brief Entry point for smart-agent-cli, a terminal client for a running smart-agentd.
+ */
+#include "DaemonClient.h"
+#include "DaemonProtocol.h"
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+namespace
+{
+   void printUsage(const char* argv0)
+   {
+      std::cerr << "Usage: " << argv0 << " [options]\n"
+                << "  --socket <path>   Daemon socket (default " << DaemonProtocol::defaultSocketPath() << ")\n"
+                << "  --list            List the models the daemon can load and exit\n"
+                << "  --model <name>    Model to load (or share if already resident)\n"
+                << "  --prompt <text>   Send a single prompt and exit, otherwise read prompts from stdin\n"
+                << "  --max-tokens <n>  Generation limit per reply\n";
+   }
+}
+
+int main(int argc, char** argv)
+{
+   std::string socketPath = DaemonProtocol::defaultSocketPath();
+   std::string modelName;
+   std::string prompt;
+   bool list = false;
+   int maxTokens = -1;
+
+   for(int i = 1; i < argc; ++i)
+   {
+      const std::string arg = argv[i];
+      const bool hasValue = i + 1 < argc;
+      if(arg == "--socket" && hasValue)          socketPath = argv[++i];
+      else if(arg == "--model" && hasValue)      modelName = argv[++i];
+      else if(arg == "--prompt" && hasValue)     prompt = argv[++i];
+      else if(arg == "--max-tokens" && hasValue) maxTokens = std::atoi(argv[++i]);
+      else if(arg == "--list")                   list = true;
+      else
+      {
+         printUsage(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+
+   auto connected = DaemonClient::connect(socketPath);
+   if(!connected.has_value())
+   {
+      std::cerr << "Error : could not connect to smart-agentd at " << socketPath << std::endl;
+      return EXIT_FAILURE;
+   }
+   DaemonClient& client = *connected.value();
+
+   if(list)
+   {
+      auto models = client.fetchModels();
+      if(!models.has_value())
+      {
+         std::cerr << "Error : failed to list models" << std::endl;
+         return EXIT_FAILURE;
+      }
+      for(const auto& [name, size] : models.value())
+      {
+         std::cout << name << "\t" << size << " GB" << std::endl;
+      }
+      return EXIT_SUCCESS;
+   }
+
+   if(modelName.empty())
+   {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+   }
+   if(!client.loadModel(modelName).has_value())
+   {
+      std::cerr << "Error : " << client.getLastError() << std::endl;
+      return EXIT_FAILURE;
+   }
+
+   auto ask = [&](const std::string& text)
+   {
+      auto result = client.generate(text, "User", [](const std::string& piece)
+      {
+         std::cout << piece << std::flush;
+      }, maxTokens);
+      std::cout << std::endl;
+      if(!result.has_value())
+      {
+         std::cerr << "Error : " << client.getLastError() << std::endl;
+         return false;
+      }
+      return true;
+   };
+
+   if(!prompt.empty())
+   {
+      return ask(prompt) ? EXIT_SUCCESS : EXIT_FAILURE;
+   }
+
+   std::string line;
+   while(std::cout << "> " << std::flush, std::getline(std::cin, line))
+   {
+      if(line.empty())
+      {
+         continue;
+      }
+      if(!ask(line))
+      {
+         return EXIT_FAILURE;
+      }
+   }
+   client.releaseModel();
+   return EXIT_SUCCESS;
+}
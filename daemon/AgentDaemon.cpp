@@ -0,0 +1,770 @@
+/**
+ * @file AgentDaemon.cpp
+ * @brief smart-agentd - owns the ModelManager and inference engine for the whole host so a model
+ *        is loaded once and shared by every GUI / CLI client connected over the Unix socket.
+ */
+
+#include "AgentDaemon.h"
+#include <iostream>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using DaemonProtocol::MessageType;
+using DaemonProtocol::StreamRecord;
+
+namespace
+{
+   // Output a client may fall behind by before its reply is cancelled; the worker never waits on it
+   const size_t MAX_BACKLOG_BYTES = 8 * 1024 * 1024;
+
+   // How often the event loop moves backlogged output into rings that have made room
+   const int BACKLOG_FLUSH_MS = 10;
+
+   // Replies a client may leave unread on its socket before it is dropped
+   const size_t MAX_OUTPUT_BYTES = 1024 * 1024;
+
+   bool setNonBlocking(int fd)
+   {
+      const int flags = fcntl(fd, F_GETFL, 0);
+      return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+   }
+
+   std::string roleName(PromptRoleType role)
+   {
+      return role == PromptRoleType::SystemRole ? "system" : "user";
+   }
+}
+
+/**
+ * @brief Constructs the daemon
+ *
+ * @param socketPath Filesystem path of the Unix domain socket to listen on
+ * @param ringCapacity Size of each client's token ring in bytes
+ */
+AgentDaemon::AgentDaemon(std::string socketPath, size_t ringCapacity) :
+ m_socketPath(std::move(socketPath)),
+ m_ringCapacity(ringCapacity),
+ m_listenFd(-1),
+ m_running(false),
+ m_nextClientId(1),
+ m_clientRate(0.0),
+ m_accessGroup(-1),
+ m_modelManager(ModelManager::getInstance()),
+ m_loadResult(std::unexpected(ModelErrorType::MODEL_NOT_LOADED)),
+ m_loadFinished(false)
+{
+   m_wakePipe[0] = -1;
+   m_wakePipe[1] = -1;
+}
+
+/**
+ * @brief Disconnects every client and removes the socket file
+ */
+AgentDaemon::~AgentDaemon()
+{
+   if(m_loader.joinable())
+   {
+      m_loader.join();
+   }
+   while(!m_clients.empty())
+   {
+      dropClient(m_clients.begin()->first);
+   }
+   // The model is unloaded by now, nothing will call back into these clients
+   m_retired.clear();
+   if(m_listenFd != -1)
+   {
+      close(m_listenFd);
+      unlink(m_socketPath.c_str());
+   }
+   if(m_wakePipe[0] != -1)
+   {
+      close(m_wakePipe[0]);
+      close(m_wakePipe[1]);
+   }
+}
+
+/**
+ * @brief Binds and listens on the Unix socket
+ *
+ * @return bool True on success
+ */
+bool AgentDaemon::listen()
+{
+   if(pipe(m_wakePipe) == -1 || !setNonBlocking(m_wakePipe[0]) || !setNonBlocking(m_wakePipe[1]))
+   {
+      std::cerr << "Error : failed to create the daemon wake pipe" << std::endl;
+      return false;
+   }
+
+   sockaddr_un addr{};
+   addr.sun_family = AF_UNIX;
+   if(m_socketPath.size() >= sizeof(addr.sun_path))
+   {
+      std::cerr << "Error : socket path is too long - " << m_socketPath << std::endl;
+      return false;
+   }
+   std::strncpy(addr.sun_path, m_socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+   m_listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(m_listenFd == -1)
+   {
+      std::cerr << "Error : failed to create the daemon socket" << std::endl;
+      return false;
+   }
+
+   // A socket file left behind by a daemon that crashed would make bind fail. Only remove it if
+   // nobody answers on it, so a second daemon can't steal a live one's path.
+   if(connect(m_listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+   {
+      std::cerr << "Error : another smart-agentd is already listening on " << m_socketPath << std::endl;
+      close(m_listenFd);
+      m_listenFd = -1;
+      return false;
+   }
+   close(m_listenFd);
+   unlink(m_socketPath.c_str());
+   m_listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+   if(m_listenFd == -1 ||
+      bind(m_listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+      ::listen(m_listenFd, SOMAXCONN) == -1 ||
+      !setNonBlocking(m_listenFd))
+   {
+      std::cerr << "Error : failed to listen on " << m_socketPath << " - " << std::strerror(errno) << std::endl;
+      if(m_listenFd != -1)
+      {
+         close(m_listenFd);
+         m_listenFd = -1;
+      }
+      return false;
+   }
+   // Sessions are private to the user running the daemon and, if one is set, the access group
+   if(m_accessGroup >= 0)
+   {
+      if(chown(m_socketPath.c_str(), static_cast<uid_t>(-1), static_cast<gid_t>(m_accessGroup)) == -1 ||
+         chmod(m_socketPath.c_str(), 0660) == -1)
+      {
+         std::cerr << "Error : failed to give the access group " << m_socketPath << " - " << std::strerror(errno) << std::endl;
+         return false;
+      }
+   }
+   else
+   {
+      chmod(m_socketPath.c_str(), 0600);
+   }
+   return true;
+}
+
+/**
+ * @brief Runs the event loop until stop() is called
+ */
+void AgentDaemon::run()
+{
+   m_running = true;
+   std::vector<pollfd> fds;
+   std::vector<int> toDrop;
+   bool backlogged = false;
+
+   while(m_running)
+   {
+      fds.clear();
+      fds.push_back({m_listenFd, POLLIN, 0});
+      fds.push_back({m_wakePipe[0], POLLIN, 0});
+      for(const auto& [fd, client] : m_clients)
+      {
+         fds.push_back({fd, static_cast<short>(client->outBuf.empty() ? POLLIN : (POLLIN | POLLOUT)), 0});
+      }
+
+      if(poll(fds.data(), fds.size(), backlogged ? BACKLOG_FLUSH_MS : -1) == -1)
+      {
+         if(errno == EINTR)
+         {
+            continue;
+         }
+         std::cerr << "Error : poll failed - " << std::strerror(errno) << std::endl;
+         break;
+      }
+
+      if(fds[1].revents & POLLIN)
+      {
+         char drain[64];
+         while(read(m_wakePipe[0], drain, sizeof(drain)) > 0)
+         {
+         }
+      }
+      if(fds[0].revents & POLLIN)
+      {
+         acceptClients();
+      }
+      if(m_loadingClient && m_loadFinished)
+      {
+         finishLoad();
+      }
+
+      toDrop.clear();
+      for(size_t i = 2; i < fds.size(); ++i)
+      {
+         auto iter = m_clients.find(fds[i].fd);
+         if(iter == m_clients.end())
+         {
+            continue;
+         }
+         if((fds[i].revents & POLLOUT) && !flushOutput(*iter->second))
+         {
+            toDrop.push_back(fds[i].fd);
+            continue;
+         }
+         if((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !serviceClient(iter->second))
+         {
+            toDrop.push_back(fds[i].fd);
+         }
+      }
+      // A client that scribbled over its ring can not be streamed to anymore
+      for(const auto& [fd, client] : m_clients)
+      {
+         if(client->ringBroken)
+         {
+            toDrop.push_back(fd);
+         }
+      }
+      for(int fd : toDrop)
+      {
+         dropClient(fd);
+      }
+      releaseRetired();
+      backlogged = flushBacklogs();
+   }
+
+   // The caller unloads the model next, a load still running must not race it
+   if(m_loader.joinable())
+   {
+      m_loader.join();
+   }
+}
+
+/**
+ * @brief Asks the event loop to exit; safe to call from a signal handler
+ */
+void AgentDaemon::stop()
+{
+   m_running = false;
+   wake();
+}
+
+// Wakes the event loop from another thread
+void AgentDaemon::wake()
+{
+   if(m_wakePipe[1] != -1)
+   {
+      const char byte = 1;
+      if(write(m_wakePipe[1], &byte, 1) == -1)
+      {
+      }
+   }
+}
+
+// Accepts every pending connection
+void AgentDaemon::acceptClients()
+{
+   while(true)
+   {
+      const int fd = accept(m_listenFd, nullptr, nullptr);
+      if(fd == -1)
+      {
+         return;
+      }
+      if(!setNonBlocking(fd))
+      {
+         close(fd);
+         continue;
+      }
+      auto client = std::make_shared<Client>();
+      client->fd = fd;
+      m_clients[fd] = client;
+   }
+}
+
+// Reads and dispatches frames, returns false when the client should be dropped
+bool AgentDaemon::serviceClient(const std::shared_ptr<Client>& client)
+{
+   char buf[8192];
+   while(true)
+   {
+      const ssize_t n = read(client->fd, buf, sizeof(buf));
+      if(n > 0)
+      {
+         client->inBuf.append(buf, n);
+         continue;
+      }
+      if(n == 0)
+      {
+         return false;
+      }
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+         break;
+      }
+      if(errno != EINTR)
+      {
+         return false;
+      }
+   }
+   return dispatchFrames(client);
+}
+
+// Dispatches the complete frames buffered for a client, returns false when it should be dropped
+bool AgentDaemon::dispatchFrames(const std::shared_ptr<Client>& client)
+{
+   MessageType type;
+   std::string payload;
+   while(!client->loading)
+   {
+      const int extracted = DaemonProtocol::extractFrame(client->inBuf, type, payload);
+      if(extracted == 0)
+      {
+         return true;
+      }
+      if(extracted < 0 || !handleFrame(client, type, payload))
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+// Dispatches a single frame, returns false on a protocol violation
+bool AgentDaemon::handleFrame(const std::shared_ptr<Client>& client, MessageType type, const std::string& payload)
+{
+   // Everything but Hello requires the handshake to have happened
+   if(type != MessageType::Hello && !client->ring)
+   {
+      return false;
+   }
+
+   switch(type)
+   {
+      case MessageType::Hello:
+         return handleHello(client, payload);
+      case MessageType::ListModels:
+         return handleListModels(client);
+      case MessageType::LoadModel:
+         return handleLoadModel(client, payload);
+      case MessageType::ReleaseModel:
+         return handleReleaseModel(client);
+      case MessageType::Prompt:
+         return handlePrompt(client, payload);
+      case MessageType::ResetSession:
+         if(client->session)
+         {
+            client->session->reset();
+         }
+         return sendStatus(*client, true, 0, "");
+      default:
+         return false;
+   }
+}
+
+bool AgentDaemon::handleHello(const std::shared_ptr<Client>& client, const std::string& payload)
+{
+   WireReader reader(payload);
+   uint16_t version = 0;
+   if(!reader.u16(version) || client->ring)
+   {
+      return false;
+   }
+   if(version != DaemonProtocol::PROTOCOL_VERSION)
+   {
+      sendStatus(*client, false, 0, "Unsupported protocol version");
+      return false;
+   }
+
+   client->id = m_nextClientId++;
+   // The ring has no name another member of the access group could open - only this client gets its descriptor
+   auto ring = ShmRing::createShared(m_ringCapacity);
+   if(!ring.has_value())
+   {
+      sendStatus(*client, false, 0, "Failed to create the token ring");
+      return false;
+   }
+   client->ring = std::move(ring.value());
+
+   WireWriter writer;
+   writer.u32(client->id);
+   return sendFrame(*client, MessageType::HelloAck, writer.data(), client->ring->getFd());
+}
+
+bool AgentDaemon::handleListModels(const std::shared_ptr<Client>& client)
+{
+   WireWriter writer;
+   auto models = m_modelManager->fetchModels();
+   if(models.has_value())
+   {
+      writer.u32(static_cast<uint32_t>(models.value().size()));
+      for(const auto& [name, size] : models.value())
+      {
+         writer.str(name).str(size);
+      }
+   }
+   else
+   {
+      writer.u32(0);
+   }
+   // The manager is not to be touched while the loader thread uses it
+   ModelInterface* loaded = m_loadingClient ? nullptr : m_modelManager->getLoadedModel();
+   writer.str(loaded ? loaded->getModelName() : "");
+   return sendFrame(*client, MessageType::ModelList, writer.data());
+}
+
+bool AgentDaemon::handleLoadModel(const std::shared_ptr<Client>& client, const std::string& payload)
+{
+   WireReader reader(payload);
+   std::string name;
+   if(!reader.str(name))
+   {
+      return false;
+   }
+
+   if(m_loadingClient)
+   {
+      return sendStatus(*client, false, static_cast<uint32_t>(ModelErrorType::MODEL_IN_USE),
+                        "Another client's model is being loaded");
+   }
+
+   // Switching models would pull the rug out from under every other client
+   ModelInterface* loaded = m_modelManager->getLoadedModel();
+   if(loaded != nullptr && loaded->getModelName() != name)
+   {
+      for(const auto& [fd, other] : m_clients)
+      {
+         if(other != client && other->usesModel)
+         {
+            return sendStatus(*client, false, static_cast<uint32_t>(ModelErrorType::MODEL_IN_USE),
+                              loaded->getModelName() + " is in use by another client");
+         }
+      }
+   }
+   if(client->usesModel && loaded != nullptr && loaded->getModelName() == name)
+   {
+      return sendStatus(*client, true, 0, "");
+   }
+   // The session's callbacks are still running on the worker
+   if(client->session && client->session->isBusy())
+   {
+      return sendStatus(*client, false, 0, "A response is still being generated");
+   }
+   releaseModel(*client);
+
+   // Loading takes seconds to minutes; the Status is sent once it is done
+   if(m_loader.joinable())
+   {
+      m_loader.join();
+   }
+   client->loading = true;
+   m_loadingClient = client;
+   m_loadingName = name;
+   m_loadFinished = false;
+   m_loader = std::thread([this, name]()
+   {
+      m_loadResult = m_modelManager->loadModel(name);
+      m_loadFinished = true;
+      wake();
+   });
+   return true;
+}
+
+// Hands the result of the loader thread to the client that asked for the model
+void AgentDaemon::finishLoad()
+{
+   m_loader.join();
+   std::shared_ptr<Client> client = std::move(m_loadingClient);
+   m_loadingClient.reset();
+   client->loading = false;
+   auto loadResp = m_loadResult;
+
+   if(loadResp.has_value())
+   {
+      client->usesModel = true;
+      if(InferenceEngine* engine = loadResp.value()->getEngine())
+      {
+         ClientLimits limits;
+         limits.tokensPerSecond = m_clientRate;
+         engine->setDefaultClientLimits(limits);
+      }
+      client->session = std::make_unique<ChatSession>(loadResp.value(), static_cast<int32_t>(client->id));
+   }
+   // Dropped while the model loaded - nobody else may want it
+   if(client->closed)
+   {
+      releaseModel(*client);
+      return;
+   }
+
+   const bool sent = loadResp.has_value()
+                        ? sendStatus(*client, true, 0, "")
+                        : sendStatus(*client, false, static_cast<uint32_t>(loadResp.error()), "Failed to load " + m_loadingName);
+   // Frames that arrived during the load were left buffered
+   if(!sent || !dispatchFrames(client))
+   {
+      dropClient(client->fd);
+   }
+}
+
+bool AgentDaemon::handleReleaseModel(const std::shared_ptr<Client>& client)
+{
+   if(client->session && client->session->isBusy())
+   {
+      return sendStatus(*client, false, 0, "A response is still being generated");
+   }
+   releaseModel(*client);
+   return sendStatus(*client, true, 0, "");
+}
+
+bool AgentDaemon::handlePrompt(const std::shared_ptr<Client>& client, const std::string& payload)
+{
+   WireReader reader(payload);
+   uint8_t role = 0;
+   std::string text;
+   int32_t maxTokens = -1;
+   if(!reader.u8(role) || !reader.str(text) || !reader.i32(maxTokens))
+   {
+      return false;
+   }
+   if(!client->session)
+   {
+      return sendStatus(*client, false, static_cast<uint32_t>(ModelErrorType::MODEL_NOT_LOADED), "No model loaded");
+   }
+
+   // Tokens go straight from the worker thread into the client's ring, or its backlog while the ring
+   // is full - the worker is shared by every client and never waits on one
+   auto onToken = [this, client](const std::string& piece)
+   {
+      if(client->closed)
+      {
+         return false;
+      }
+      std::string record(1, static_cast<char>(StreamRecord::Piece));
+      record += piece;
+      return deliver(*client, std::move(record), false);
+   };
+   auto onComplete = [this, client](const GenerationResult& result)
+   {
+      WireWriter writer;
+      writer.u8(static_cast<uint8_t>(StreamRecord::Done))
+            .u8(static_cast<uint8_t>(result.stopReason))
+            .i32(result.promptTokens)
+            .i32(result.cachedTokens)
+            .i32(result.generatedTokens);
+      if(!client->closed)
+      {
+         deliver(*client, writer.data(), true);
+      }
+      else
+      {
+         // A dropped client's model is released by the event loop once the reply has ended
+         wake();
+      }
+   };
+
+   // System prompts carry attached files - ingesting them yields to clients waiting on a reply
+   const PromptRoleType roleType = static_cast<PromptRoleType>(role);
+   const RequestPriority priority = roleType == PromptRoleType::SystemRole ? RequestPriority::Background
+                                                                          : RequestPriority::Interactive;
+   if(!client->session->submitPrompt(roleName(roleType), text, maxTokens, onToken, onComplete, priority))
+   {
+      return sendStatus(*client, false, static_cast<uint32_t>(ModelErrorType::SendPromptError),
+                        "A response is already being generated");
+   }
+   return sendStatus(*client, true, 0, "");
+}
+
+// Sends a Status frame
+bool AgentDaemon::sendStatus(Client& client, bool ok, uint32_t code, const std::string& message)
+{
+   WireWriter writer;
+   writer.u8(ok ? 1 : 0).u32(code).str(message);
+   return sendFrame(client, MessageType::Status, writer.data());
+}
+
+// Queues a frame for a client and sends what the socket takes; false if the client has stopped
+// reading its replies
+bool AgentDaemon::sendFrame(Client& client, MessageType type, const std::string& payload, int passFd /* -1 */)
+{
+   // The descriptor must ride on the frame's own first byte
+   if(passFd != -1 && !client.outBuf.empty())
+   {
+      return false;
+   }
+   const std::string frame = DaemonProtocol::encodeFrame(type, payload);
+   if(client.outBuf.size() + frame.size() > MAX_OUTPUT_BYTES)
+   {
+      return false;
+   }
+   const bool idle = client.outBuf.empty();
+   client.outBuf += frame;
+   if(passFd != -1)
+   {
+      client.outFd = passFd;
+   }
+   // A socket with frames already waiting is flushed on POLLOUT
+   return !idle || flushOutput(client);
+}
+
+// Sends queued frames until the socket is full, returns false when the client should be dropped
+bool AgentDaemon::flushOutput(Client& client)
+{
+   while(!client.outBuf.empty())
+   {
+      const ssize_t n = DaemonProtocol::sendSome(client.fd, client.outBuf.data(), client.outBuf.size(), client.outFd);
+      if(n > 0)
+      {
+         client.outBuf.erase(0, static_cast<size_t>(n));
+         client.outFd = -1;
+         continue;
+      }
+      if(n == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+   }
+   return true;
+}
+
+// Queues a stream record for a client without blocking the worker
+bool AgentDaemon::deliver(Client& client, std::string record, bool force)
+{
+   std::lock_guard<std::mutex> lock(client.outMutex);
+   flushBacklog(client);
+   if(client.backlog.empty() && client.ring->tryWrite(record.data(), static_cast<uint32_t>(record.size())))
+   {
+      return true;
+   }
+   if(client.ring->isBroken())
+   {
+      client.ringBroken = true;
+      wake();
+      return false;
+   }
+   // A reader this far behind is not reading; its reply is cancelled rather than buffered without end
+   if(!force && client.backlogBytes + record.size() > MAX_BACKLOG_BYTES)
+   {
+      return false;
+   }
+   const bool first = client.backlog.empty();
+   client.backlogBytes += record.size();
+   client.backlog.push_back(std::move(record));
+   // The event loop may be asleep with nothing to flush
+   if(first)
+   {
+      wake();
+   }
+   return true;
+}
+
+// Moves backlogged records into the ring while it has room; outMutex must be held
+void AgentDaemon::flushBacklog(Client& client)
+{
+   while(!client.backlog.empty() &&
+         client.ring->tryWrite(client.backlog.front().data(), static_cast<uint32_t>(client.backlog.front().size())))
+   {
+      client.backlogBytes -= client.backlog.front().size();
+      client.backlog.pop_front();
+   }
+   if(client.ring->isBroken())
+   {
+      client.ringBroken = true;
+   }
+}
+
+// Flushes every client's backlog from the event loop, returns true if any is left
+bool AgentDaemon::flushBacklogs()
+{
+   bool left = false;
+   for(const auto& [fd, client] : m_clients)
+   {
+      if(client->backlogBytes > 0)
+      {
+         std::lock_guard<std::mutex> lock(client->outMutex);
+         flushBacklog(*client);
+         left = left || !client->backlog.empty();
+      }
+   }
+   return left;
+}
+
+// Stops a client's use of the model, unloading it once nobody uses it anymore
+void AgentDaemon::releaseModel(Client& client)
+{
+   if(!client.usesModel)
+   {
+      return;
+   }
+   client.session.reset();
+   client.usesModel = false;
+   for(const auto& [fd, other] : m_clients)
+   {
+      if(other->usesModel)
+      {
+         return;
+      }
+   }
+   for(const auto& other : m_retired)
+   {
+      if(other->usesModel)
+      {
+         return;
+      }
+   }
+   // The loader thread is about to hand the model to another client
+   if(m_loadingClient)
+   {
+      return;
+   }
+   m_modelManager->unloadModel();
+}
+
+// Closes and forgets a client
+void AgentDaemon::dropClient(int fd)
+{
+   auto iter = m_clients.find(fd);
+   if(iter == m_clients.end())
+   {
+      return;
+   }
+   std::shared_ptr<Client> client = iter->second;
+   client->closed = true;
+   close(fd);
+   m_clients.erase(iter);
+
+   // A generation in flight still calls into the session - the model is released once it has finished
+   if(client->session && client->session->isBusy())
+   {
+      m_retired.push_back(std::move(client));
+      return;
+   }
+   releaseModel(*client);
+}
+
+// Releases the model for dropped clients whose last generation has finished
+void AgentDaemon::releaseRetired()
+{
+   for(size_t i = 0; i < m_retired.size();)
+   {
+      if(m_retired[i]->session && m_retired[i]->session->isBusy())
+      {
+         ++i;
+         continue;
+      }
+      std::shared_ptr<Client> client = std::move(m_retired[i]);
+      m_retired.erase(m_retired.begin() + static_cast<std::ptrdiff_t>(i));
+      releaseModel(*client);
+   }
+}
@@ -0,0 +1,180 @@
+/**
+ * @file AgentDaemon.h
+ * @brief smart-agentd - owns the ModelManager and inference engine for the whole host so a model
+ *        is loaded once and shared by every GUI / CLI client connected over the Unix socket.
+ */
+#ifndef AGENT_DAEMON_H
+#define AGENT_DAEMON_H
+
+#include "ModelManager.h"
+#include "ChatSession.h"
+#include "DaemonProtocol.h"
+#include "ShmRing.h"
+#include <string>
+#include <map>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <expected>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+class AgentDaemon
+{
+public:
+   /**
+    * @brief Constructs the daemon
+    *
+    * @param socketPath Filesystem path of the Unix domain socket to listen on
+    * @param ringCapacity Size of each client's token ring in bytes
+    */
+   AgentDaemon(std::string socketPath, size_t ringCapacity = DaemonProtocol::DEFAULT_RING_CAPACITY);
+
+   /**
+    * @brief Disconnects every client and removes the socket file
+    */
+   ~AgentDaemon();
+
+   /**
+    * @brief Binds and listens on the Unix socket
+    *
+    * @return bool True on success
+    */
+   bool listen();
+
+   /**
+    * @brief Runs the event loop until stop() is called
+    */
+   void run();
+
+   /**
+    * @brief Asks the event loop to exit; safe to call from a signal handler
+    */
+   void stop();
+
+   /**
+    * @brief Caps the prompt plus generated tokens per second each client may use
+    *
+    * @param tokensPerSecond Limit applied to every client, 0 for none
+    */
+   inline void setClientRateLimit(double tokensPerSecond)
+   {
+      m_clientRate = tokensPerSecond;
+   }
+
+   /**
+    * @brief Lets members of a group connect as well as the user running the daemon
+    *
+    * Must be called before listen().
+    *
+    * @param group Group id given access to the socket, -1 for the owner alone. Token rings are never
+    *              shared with the group, each is handed to its client alone as a descriptor
+    */
+   inline void setAccessGroup(int group)
+   {
+      m_accessGroup = group;
+   }
+
+private:
+   // A connected client. Generation callbacks hold a reference so the ring and the session stay
+   // valid until the worker is done with them, even if the socket closes mid-stream.
+   struct Client
+   {
+      int fd = -1;
+      uint32_t id = 0;
+      std::string inBuf;
+      std::unique_ptr<ShmRing> ring;
+      std::unique_ptr<ChatSession> session;
+      bool usesModel = false;
+      std::atomic<bool> closed{false};
+      // A LoadModel is running on the loader thread; the client's further frames wait for its Status
+      bool loading = false;
+      // Frames the socket had no room for, sent on POLLOUT; only the event loop touches them
+      std::string outBuf;
+      // Descriptor to attach to the first byte of outBuf, -1 for none
+      int outFd = -1;
+      // Stream records the ring had no room for, written before any newer one
+      std::mutex outMutex;
+      std::deque<std::string> backlog;
+      std::atomic<size_t> backlogBytes{0};
+      // The client corrupted its ring; it is dropped by the event loop
+      std::atomic<bool> ringBroken{false};
+   };
+
+   // Accepts every pending connection
+   void acceptClients();
+
+   // Reads and dispatches frames, returns false when the client should be dropped
+   bool serviceClient(const std::shared_ptr<Client>& client);
+
+   // Dispatches the complete frames buffered for a client, returns false when it should be dropped
+   bool dispatchFrames(const std::shared_ptr<Client>& client);
+
+   // Dispatches a single frame, returns false on a protocol violation
+   bool handleFrame(const std::shared_ptr<Client>& client, DaemonProtocol::MessageType type, const std::string& payload);
+
+   // Individual message handlers
+   bool handleHello(const std::shared_ptr<Client>& client, const std::string& payload);
+   bool handleListModels(const std::shared_ptr<Client>& client);
+   bool handleLoadModel(const std::shared_ptr<Client>& client, const std::string& payload);
+   bool handleReleaseModel(const std::shared_ptr<Client>& client);
+   bool handlePrompt(const std::shared_ptr<Client>& client, const std::string& payload);
+
+   // Sends a Status frame
+   bool sendStatus(Client& client, bool ok, uint32_t code, const std::string& message);
+
+   // Queues a frame for a client and sends what the socket takes; false if the client has stopped
+   // reading its replies
+   bool sendFrame(Client& client, DaemonProtocol::MessageType type, const std::string& payload, int passFd = -1);
+
+   // Sends queued frames until the socket is full, returns false when the client should be dropped
+   static bool flushOutput(Client& client);
+
+   // Hands the result of the loader thread to the client that asked for the model
+   void finishLoad();
+
+   // Queues a stream record for a client without blocking the worker; false if the client has fallen
+   // too far behind to keep buffering for, unless force is set
+   bool deliver(Client& client, std::string record, bool force);
+
+   // Moves backlogged records into the ring while it has room; outMutex must be held
+   static void flushBacklog(Client& client);
+
+   // Flushes every client's backlog from the event loop, returns true if any is left
+   bool flushBacklogs();
+
+   // Stops a client's use of the model, unloading it once nobody uses it anymore
+   void releaseModel(Client& client);
+
+   // Closes and forgets a client
+   void dropClient(int fd);
+
+   // Releases the model for dropped clients whose last generation has finished
+   void releaseRetired();
+
+   // Wakes the event loop from another thread
+   void wake();
+
+   std::string m_socketPath;
+   size_t m_ringCapacity;
+   int m_listenFd;
+   int m_wakePipe[2];
+   std::atomic<bool> m_running;
+   uint32_t m_nextClientId;
+   double m_clientRate;
+   int m_accessGroup;
+   ModelManager* m_modelManager;
+   std::map<int, std::shared_ptr<Client>> m_clients;
+   // Dropped clients still generating - they keep their hold on the model until the reply ends
+   std::vector<std::shared_ptr<Client>> m_retired;
+   // Loads run here so the event loop keeps serving other clients; one at a time
+   std::thread m_loader;
+   std::shared_ptr<Client> m_loadingClient;
+   std::string m_loadingName;
+   std::expected<ModelInterface*, ModelErrorType> m_loadResult;
+   std::atomic<bool> m_loadFinished;
+};
+
+#endif
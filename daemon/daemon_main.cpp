@@ -0,0 +1,130 @@
+/**
+ * @file daemon_main.cpp
+ * @brief Entry point for smart-agentd, the per-host daemon that owns model loading and inference
+ *        for every local smart-agent client.
+ */
+#include "AgentDaemon.h"
+#include "ModelManager.h"
+#include <iostream>
+#include <string>
+#include <csignal>
+#include <cstdlib>
+#include <grp.h>
+
+namespace
+{
+   AgentDaemon* g_daemon = nullptr;
+
+   void handleSignal(int)
+   {
+      if(g_daemon)
+      {
+         g_daemon->stop();
+      }
+   }
+
+   void printUsage(const char* argv0)
+   {
+      std::cerr << "Usage: " << argv0 << " --models-dir <dir> [options]\n"
+                << "  --socket <path>   Unix socket to listen on (default " << DaemonProtocol::defaultSocketPath() << ")\n"
+                << "  --slots <n>       Concurrent sequences decoded per batch (default 4)\n"
+                << "  --ring-kb <n>     Per-client token ring size in KiB (default 1024)\n"
+                << "  --prefix-cache <n> Tokens of shared prompt prefixes kept resident (default 8192, 0 disables)\n"
+                << "  --rpc <host:port,...> Split models across llama.cpp rpc-server processes by free memory\n"
+                << "  --rpc-profile     Time compute and transfer per RPC node (slows decoding)\n"
+                << "  --client-rate <n> Prompt plus generated tokens per second per client (default 0, unlimited)\n"
+                << "  --group <name>    Let members of this group connect too (default: only the daemon's user)\n";
+   }
+}
+
+int main(int argc, char** argv)
+{
+   std::string modelsDir;
+   std::string socketPath = DaemonProtocol::defaultSocketPath();
+   int slots = 4;
+   int prefixCache = 8192;
+   std::string rpcEndpoints;
+   bool rpcProfile = false;
+   double clientRate = 0.0;
+   std::string groupName;
+   long ringKb = static_cast<long>(DaemonProtocol::DEFAULT_RING_CAPACITY / 1024);
+
+   for(int i = 1; i < argc; ++i)
+   {
+      const std::string arg = argv[i];
+      const bool hasValue = i + 1 < argc;
+      if(arg == "--models-dir" && hasValue)      modelsDir = argv[++i];
+      else if(arg == "--socket" && hasValue)     socketPath = argv[++i];
+      else if(arg == "--slots" && hasValue)      slots = std::atoi(argv[++i]);
+      else if(arg == "--ring-kb" && hasValue)    ringKb = std::atol(argv[++i]);
+      else if(arg == "--prefix-cache" && hasValue) prefixCache = std::atoi(argv[++i]);
+      else if(arg == "--rpc" && hasValue)        rpcEndpoints = argv[++i];
+      else if(arg == "--rpc-profile")            rpcProfile = true;
+      else if(arg == "--client-rate" && hasValue) clientRate = std::atof(argv[++i]);
+      else if(arg == "--group" && hasValue)      groupName = argv[++i];
+      else
+      {
+         printUsage(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+   if(modelsDir.empty() || slots <= 0 || ringKb <= 0 || prefixCache < 0 || clientRate < 0.0)
+   {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   int accessGroup = -1;
+   if(!groupName.empty())
+   {
+      const group* entry = getgrnam(groupName.c_str());
+      if(entry == nullptr)
+      {
+         std::cerr << "Error : unknown group " << groupName << std::endl;
+         return EXIT_FAILURE;
+      }
+      accessGroup = static_cast<int>(entry->gr_gid);
+   }
+
+   ModelManager* manager = ModelManager::getInstance();
+   manager->setModelDirectory(modelsDir);
+   // Up to this many clients decode together, further sessions wait for a free sequence
+   manager->setSequenceSlots(static_cast<uint32_t>(slots));
+   // Clients opening with the same system prompt / files share its KV cells
+   manager->setPrefixCacheCells(static_cast<uint32_t>(prefixCache));
+   #ifdef SMART_AGENT_RPC
+      manager->setRpcEndpoints(RpcCluster::parseEndpoints(rpcEndpoints), rpcProfile);
+   #else
+      if(!rpcEndpoints.empty() || rpcProfile)
+      {
+         std::cerr << "Error : --rpc and --rpc-profile need a build with GGML_RPC on" << std::endl;
+         return EXIT_FAILURE;
+      }
+   #endif
+
+   std::signal(SIGPIPE, SIG_IGN);
+
+   int status = EXIT_SUCCESS;
+   {
+      AgentDaemon daemon(socketPath, static_cast<size_t>(ringKb) * 1024);
+      daemon.setClientRateLimit(clientRate);
+      daemon.setAccessGroup(accessGroup);
+      if(daemon.listen())
+      {
+         g_daemon = &daemon;
+         std::signal(SIGINT, handleSignal);
+         std::signal(SIGTERM, handleSignal);
+         std::cout << "smart-agentd listening on " << socketPath << std::endl;
+         daemon.run();
+         g_daemon = nullptr;
+      }
+      else
+      {
+         status = EXIT_FAILURE;
+      }
+      // Stop the worker while the clients its callbacks reference are still alive
+      manager->unloadModel();
+   }
+
+   return status;
+}
@@ -0,0 +1,296 @@
+/**
+ * @file DaemonClient.cpp
+ * @brief Thin client for smart-agentd. Mirrors the subset of ModelManager / ModelInterface the GUI
+ *        uses so a front end can talk to a shared daemon instead of loading its own model.
+ */
+
+#include "DaemonClient.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using DaemonProtocol::MessageType;
+using DaemonProtocol::StreamRecord;
+
+namespace
+{
+   // Interval at which a blocked stream reader checks whether the daemon is still there
+   const std::chrono::milliseconds LIVENESS_INTERVAL(250);
+
+   // True if the peer has closed the socket
+   bool peerClosed(int fd)
+   {
+      char c;
+      const ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+      return n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+   }
+}
+
+DaemonClient::DaemonClient(int fd, uint32_t clientId, std::unique_ptr<ShmRing> ring) :
+ m_fd(fd),
+ m_clientId(clientId),
+ m_ring(std::move(ring))
+{
+}
+
+/**
+ * @brief Closes the connection; the daemon releases this client's session
+ */
+DaemonClient::~DaemonClient()
+{
+   close(m_fd);
+}
+
+/**
+ * @brief Connects and performs the handshake
+ */
+std::expected<std::unique_ptr<DaemonClient>, IpcErrorType> DaemonClient::connect(const std::string& socketPath)
+{
+   sockaddr_un addr{};
+   addr.sun_family = AF_UNIX;
+   if(socketPath.size() >= sizeof(addr.sun_path))
+   {
+      return std::unexpected(IpcErrorType::CONNECT_ERROR);
+   }
+   std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+   const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(fd == -1)
+   {
+      return std::unexpected(IpcErrorType::SOCKET_ERROR);
+   }
+   if(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1)
+   {
+      close(fd);
+      return std::unexpected(IpcErrorType::CONNECT_ERROR);
+   }
+
+   WireWriter hello;
+   hello.u16(DaemonProtocol::PROTOCOL_VERSION);
+   if(!DaemonProtocol::writeFrame(fd, MessageType::Hello, hello.data()))
+   {
+      close(fd);
+      return std::unexpected(IpcErrorType::SOCKET_ERROR);
+   }
+   int ringFd = -1;
+   auto reply = DaemonProtocol::readFrame(fd, &ringFd);
+   if(!reply.has_value() || reply.value().first != MessageType::HelloAck)
+   {
+      if(ringFd != -1)
+      {
+         close(ringFd);
+      }
+      close(fd);
+      return std::unexpected(reply.has_value() ? IpcErrorType::PROTOCOL_ERROR : reply.error());
+   }
+
+   WireReader reader(reply.value().second);
+   uint32_t clientId = 0;
+   if(!reader.u32(clientId) || ringFd == -1)
+   {
+      if(ringFd != -1)
+      {
+         close(ringFd);
+      }
+      close(fd);
+      return std::unexpected(IpcErrorType::PROTOCOL_ERROR);
+   }
+   auto ring = ShmRing::openFd(ringFd);
+   if(!ring.has_value())
+   {
+      close(fd);
+      return std::unexpected(ring.error());
+   }
+
+   return std::unique_ptr<DaemonClient>(new DaemonClient(fd, clientId, std::move(ring.value())));
+}
+
+/**
+ * @brief Lists the models the daemon can load as (name, size) pairs
+ */
+std::expected<std::vector<std::pair<std::string, std::string>>, IpcErrorType> DaemonClient::fetchModels()
+{
+   std::lock_guard<std::mutex> lock(m_socketMutex);
+   if(!DaemonProtocol::writeFrame(m_fd, MessageType::ListModels, ""))
+   {
+      return std::unexpected(IpcErrorType::SOCKET_ERROR);
+   }
+   auto reply = DaemonProtocol::readFrame(m_fd);
+   if(!reply.has_value())
+   {
+      return std::unexpected(reply.error());
+   }
+   if(reply.value().first != MessageType::ModelList)
+   {
+      return std::unexpected(IpcErrorType::PROTOCOL_ERROR);
+   }
+
+   WireReader reader(reply.value().second);
+   uint32_t count = 0;
+   if(!reader.u32(count))
+   {
+      return std::unexpected(IpcErrorType::PROTOCOL_ERROR);
+   }
+   std::vector<std::pair<std::string, std::string>> models;
+   for(uint32_t i = 0; i < count; ++i)
+   {
+      std::string name, size;
+      if(!reader.str(name) || !reader.str(size))
+      {
+         return std::unexpected(IpcErrorType::PROTOCOL_ERROR);
+      }
+      models.emplace_back(std::move(name), std::move(size));
+   }
+   return models;
+}
+
+/**
+ * @brief Asks the daemon to load (or share an already loaded) model
+ */
+std::expected<void, IpcErrorType> DaemonClient::loadModel(const std::string& modelName)
+{
+   WireWriter writer;
+   writer.str(modelName);
+   return request(MessageType::LoadModel, writer.data());
+}
+
+/**
+ * @brief Gives up this client's use of the loaded model
+ */
+std::expected<void, IpcErrorType> DaemonClient::releaseModel()
+{
+   return request(MessageType::ReleaseModel, "");
+}
+
+/**
+ * @brief Clears this client's conversation on the daemon
+ */
+std::expected<void, IpcErrorType> DaemonClient::resetSession()
+{
+   return request(MessageType::ResetSession, "");
+}
+
+/**
+ * @brief Sends a prompt and streams the reply through a callback
+ */
+std::expected<DaemonClient::StreamResult, IpcErrorType> DaemonClient::generate(const std::string& prompt, const std::string& role,
+                                                                              const std::function<void(const std::string&)>& onPiece,
+                                                                              int32_t maxTokens /* -1 */)
+{
+   std::lock_guard<std::mutex> streamLock(m_streamMutex);
+
+   WireWriter writer;
+   const bool system = role == "System" || role == "system";
+   writer.u8(static_cast<uint8_t>(system ? 1 : 0)).str(prompt).i32(maxTokens);
+   auto accepted = request(MessageType::Prompt, writer.data());
+   if(!accepted.has_value())
+   {
+      return std::unexpected(accepted.error());
+   }
+
+   // The reply arrives through the shared-memory ring, not the socket
+   std::string record;
+   while(true)
+   {
+      if(!m_ring->read(record, LIVENESS_INTERVAL))
+      {
+         if(m_ring->isBroken())
+         {
+            return std::unexpected(IpcErrorType::PROTOCOL_ERROR);
+         }
+         std::lock_guard<std::mutex> lock(m_socketMutex);
+         if(peerClosed(m_fd))
+         {
+            return std::unexpected(IpcErrorType::SOCKET_ERROR);
+         }
+         continue;
+      }
+      if(record.empty())
+      {
+         return std::unexpected(IpcErrorType::PROTOCOL_ERROR);
+      }
+
+      const StreamRecord kind = static_cast<StreamRecord>(static_cast<uint8_t>(record[0]));
+      if(kind == StreamRecord::Piece)
+      {
+         if(onPiece)
+         {
+            onPiece(record.substr(1));
+         }
+         continue;
+      }
+
+      WireReader reader(record);
+      uint8_t tag = 0;
+      StreamResult result;
+      if(kind != StreamRecord::Done || !reader.u8(tag) || !reader.u8(result.stopReason) ||
+         !reader.i32(result.promptTokens) || !reader.i32(result.cachedTokens) || !reader.i32(result.generatedTokens))
+      {
+         return std::unexpected(IpcErrorType::PROTOCOL_ERROR);
+      }
+      return result;
+   }
+}
+
+/**
+ * @brief Same contract as ModelInterface::sendPrompt - streams the reply into writeFd and closes it
+ */
+void DaemonClient::sendPrompt(const int writeFd, std::string prompt, std::string role /* User */)
+{
+   auto result = generate(prompt, role, [writeFd](const std::string& piece)
+   {
+      if(write(writeFd, piece.data(), piece.size()) == -1)
+      {
+         #ifdef _DEBUG
+            std::cout << "Daemon client write to pipe failed..." << std::endl;
+         #endif
+      }
+   });
+   #ifdef _DEBUG
+      if(!result.has_value())
+      {
+         std::cout << "Daemon client prompt failed : " << m_lastError << std::endl;
+      }
+   #endif
+   close(writeFd);
+}
+
+// Sends a request and waits for its Status reply
+std::expected<void, IpcErrorType> DaemonClient::request(MessageType type, const std::string& payload)
+{
+   std::lock_guard<std::mutex> lock(m_socketMutex);
+   if(!DaemonProtocol::writeFrame(m_fd, type, payload))
+   {
+      return std::unexpected(IpcErrorType::SOCKET_ERROR);
+   }
+   return readStatus();
+}
+
+// Reads a Status frame
+std::expected<void, IpcErrorType> DaemonClient::readStatus()
+{
+   auto reply = DaemonProtocol::readFrame(m_fd);
+   if(!reply.has_value())
+   {
+      return std::unexpected(reply.error());
+   }
+   if(reply.value().first != MessageType::Status)
+   {
+      return std::unexpected(IpcErrorType::PROTOCOL_ERROR);
+   }
+   WireReader reader(reply.value().second);
+   uint8_t ok = 0;
+   uint32_t code = 0;
+   if(!reader.u8(ok) || !reader.u32(code) || !reader.str(m_lastError))
+   {
+      return std::unexpected(IpcErrorType::PROTOCOL_ERROR);
+   }
+   if(!ok)
+   {
+      return std::unexpected(IpcErrorType::DAEMON_ERROR);
+   }
+   return {};
+}
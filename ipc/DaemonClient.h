@@ -0,0 +1,112 @@
+/**
+ * @file DaemonClient.h
+ * @brief Thin client for smart-agentd. Mirrors the subset of ModelManager / ModelInterface the GUI
+ *        uses so a front end can talk to a shared daemon instead of loading its own model.
+ */
+#ifndef DAEMON_CLIENT_H
+#define DAEMON_CLIENT_H
+
+#include "IpcConstants.h"
+#include "DaemonProtocol.h"
+#include "ShmRing.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <expected>
+#include <cstdint>
+
+class DaemonClient
+{
+public:
+   /**
+    * @brief Summary of a finished generation as reported by the daemon
+    */
+   struct StreamResult
+   {
+      uint8_t stopReason = 0;
+      int32_t promptTokens = 0;
+      int32_t cachedTokens = 0;
+      int32_t generatedTokens = 0;
+   };
+
+   /**
+    * @brief Connects and performs the handshake
+    *
+    * @param socketPath Path of the daemon's Unix socket
+    * @return std::expected<std::unique_ptr<DaemonClient>, IpcErrorType> The client or the failure reason
+    */
+   static std::expected<std::unique_ptr<DaemonClient>, IpcErrorType> connect(const std::string& socketPath);
+
+   /**
+    * @brief Closes the connection; the daemon releases this client's session
+    */
+   ~DaemonClient();
+
+   /**
+    * @brief Lists the models the daemon can load as (name, size) pairs
+    */
+   std::expected<std::vector<std::pair<std::string, std::string>>, IpcErrorType> fetchModels();
+
+   /**
+    * @brief Asks the daemon to load (or share an already loaded) model
+    */
+   std::expected<void, IpcErrorType> loadModel(const std::string& modelName);
+
+   /**
+    * @brief Gives up this client's use of the loaded model
+    */
+   std::expected<void, IpcErrorType> releaseModel();
+
+   /**
+    * @brief Clears this client's conversation on the daemon
+    */
+   std::expected<void, IpcErrorType> resetSession();
+
+   /**
+    * @brief Sends a prompt and streams the reply through a callback
+    *
+    * @param prompt Message content
+    * @param role "User" or "System"
+    * @param onPiece Called for each streamed piece
+    * @param maxTokens Generation limit, -1 for none
+    */
+   std::expected<StreamResult, IpcErrorType> generate(const std::string& prompt, const std::string& role,
+                                                      const std::function<void(const std::string&)>& onPiece,
+                                                      int32_t maxTokens = -1);
+
+   /**
+    * @brief Same contract as ModelInterface::sendPrompt - streams the reply into writeFd and closes it
+    */
+   void sendPrompt(const int writeFd, std::string prompt, std::string role = "User");
+
+   /**
+    * @brief Returns the last error message reported by the daemon
+    */
+   inline const std::string& getLastError() const
+   {
+      return m_lastError;
+   }
+
+private:
+   DaemonClient(int fd, uint32_t clientId, std::unique_ptr<ShmRing> ring);
+
+   // Sends a request and waits for its Status reply
+   std::expected<void, IpcErrorType> request(DaemonProtocol::MessageType type, const std::string& payload);
+
+   // Reads a Status frame
+   std::expected<void, IpcErrorType> readStatus();
+
+   int m_fd;
+   uint32_t m_clientId;
+   std::unique_ptr<ShmRing> m_ring;
+   std::string m_lastError;
+   // Serializes request/response pairs on the socket
+   std::mutex m_socketMutex;
+   // Only one streamed reply may be read from the ring at a time
+   std::mutex m_streamMutex;
+};
+
+#endif
@@ -0,0 +1,389 @@
+/**
+ * @file DaemonProtocol.cpp
+ * @brief Compact binary protocol spoken between smart-agentd and its clients over a Unix domain
+ *        socket. Control traffic uses length-prefixed frames on the socket; generated tokens are
+ *        streamed through a per-client ShmRing instead.
+ */
+
+#include "DaemonProtocol.h"
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+namespace
+{
+   // Encodes an unsigned value little endian regardless of host order
+   template<typename T>
+   void putLE(std::string& out, T v)
+   {
+      for(size_t i = 0; i < sizeof(T); ++i)
+      {
+         out.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+      }
+   }
+
+   template<typename T>
+   T getLE(const unsigned char* p)
+   {
+      T v = 0;
+      for(size_t i = 0; i < sizeof(T); ++i)
+      {
+         v |= static_cast<T>(p[i]) << (8 * i);
+      }
+      return v;
+   }
+
+   // Blocks until the descriptor is ready for the requested events
+   bool waitFd(int fd, short events)
+   {
+      pollfd pfd{fd, events, 0};
+      while(poll(&pfd, 1, -1) == -1)
+      {
+         if(errno != EINTR)
+         {
+            return false;
+         }
+      }
+      return (pfd.revents & (POLLERR | POLLNVAL)) == 0;
+   }
+
+   // Sends bytes, with a descriptor attached to the first of them when passFd is not -1
+   ssize_t sendWithFd(int fd, const char* data, size_t size, int passFd)
+   {
+      if(passFd == -1)
+      {
+         return send(fd, data, size, MSG_NOSIGNAL);
+      }
+      iovec iov{const_cast<char*>(data), size};
+      alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+      msghdr msg{};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      std::memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+      return sendmsg(fd, &msg, MSG_NOSIGNAL);
+   }
+
+   // Receives bytes, keeping a descriptor that came along with them in passedFd
+   ssize_t recvWithFd(int fd, char* data, size_t size, int& passedFd)
+   {
+      iovec iov{data, size};
+      alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+      msghdr msg{};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      const ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+      for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); n >= 0 && cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+      {
+         if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+         {
+            int received;
+            std::memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+            if(passedFd != -1)
+            {
+               close(passedFd);
+            }
+            passedFd = received;
+         }
+      }
+      return n;
+   }
+
+   bool writeAll(int fd, const char* data, size_t size, int passFd)
+   {
+      while(size > 0)
+      {
+         const ssize_t n = sendWithFd(fd, data, size, passFd);
+         if(n > 0)
+         {
+            data += n;
+            size -= n;
+            // The descriptor went out with the first byte
+            passFd = -1;
+            continue;
+         }
+         if(n == -1 && errno == EINTR)
+         {
+            continue;
+         }
+         if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && waitFd(fd, POLLOUT))
+         {
+            continue;
+         }
+         return false;
+      }
+      return true;
+   }
+
+   bool readAll(int fd, char* data, size_t size, int& passedFd)
+   {
+      while(size > 0)
+      {
+         const ssize_t n = recvWithFd(fd, data, size, passedFd);
+         if(n > 0)
+         {
+            data += n;
+            size -= n;
+            continue;
+         }
+         if(n == -1 && errno == EINTR)
+         {
+            continue;
+         }
+         if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && waitFd(fd, POLLIN))
+         {
+            continue;
+         }
+         return false;
+      }
+      return true;
+   }
+}
+
+/**
+ * @brief Returns the socket path used when none is configured
+ */
+std::string DaemonProtocol::defaultSocketPath()
+{
+   const char* runtimeDir = std::getenv("XDG_RUNTIME_DIR");
+   if(runtimeDir != nullptr && runtimeDir[0] != '\0')
+   {
+      return std::string(runtimeDir) + "/smart-agentd.sock";
+   }
+   return "/tmp/smart-agentd-" + std::to_string(getuid()) + ".sock";
+}
+
+/**
+ * @brief Encodes one frame for a caller that sends it itself
+ */
+std::string DaemonProtocol::encodeFrame(MessageType type, const std::string& payload)
+{
+   std::string frame;
+   frame.reserve(5 + payload.size());
+   putLE<uint32_t>(frame, static_cast<uint32_t>(payload.size() + 1));
+   frame.push_back(static_cast<char>(type));
+   frame += payload;
+   return frame;
+}
+
+/**
+ * @brief Sends as much of a buffer as the socket takes without blocking
+ */
+ssize_t DaemonProtocol::sendSome(int fd, const char* data, size_t size, int passFd)
+{
+   return sendWithFd(fd, data, size, passFd);
+}
+
+/**
+ * @brief Writes one frame, blocking until it is fully sent
+ */
+bool DaemonProtocol::writeFrame(int fd, MessageType type, const std::string& payload, int passFd /* -1 */)
+{
+   const std::string frame = encodeFrame(type, payload);
+   return writeAll(fd, frame.data(), frame.size(), passFd);
+}
+
+/**
+ * @brief Reads one frame, blocking until it is fully received
+ */
+std::expected<std::pair<DaemonProtocol::MessageType, std::string>, IpcErrorType> DaemonProtocol::readFrame(int fd, int* passedFd /* nullptr */)
+{
+   // A descriptor nobody asked for is not leaked
+   int received = -1;
+   auto fail = [&received](IpcErrorType error)
+   {
+      if(received != -1)
+      {
+         close(received);
+      }
+      return std::unexpected(error);
+   };
+
+   unsigned char lenBuf[4];
+   if(!readAll(fd, reinterpret_cast<char*>(lenBuf), sizeof(lenBuf), received))
+   {
+      return fail(IpcErrorType::SOCKET_ERROR);
+   }
+   const uint32_t length = getLE<uint32_t>(lenBuf);
+   if(length == 0 || length > MAX_FRAME_SIZE)
+   {
+      return fail(IpcErrorType::PROTOCOL_ERROR);
+   }
+   std::string body(length, '\0');
+   if(!readAll(fd, body.data(), length, received))
+   {
+      return fail(IpcErrorType::SOCKET_ERROR);
+   }
+   if(passedFd != nullptr)
+   {
+      *passedFd = received;
+   }
+   else if(received != -1)
+   {
+      close(received);
+   }
+   const MessageType type = static_cast<MessageType>(static_cast<uint8_t>(body[0]));
+   return std::make_pair(type, body.substr(1));
+}
+
+/**
+ * @brief Pops one complete frame off the front of a receive buffer
+ */
+int DaemonProtocol::extractFrame(std::string& buffer, MessageType& type, std::string& payload)
+{
+   if(buffer.size() < 4)
+   {
+      return 0;
+   }
+   const uint32_t length = getLE<uint32_t>(reinterpret_cast<const unsigned char*>(buffer.data()));
+   if(length == 0 || length > MAX_FRAME_SIZE)
+   {
+      return -1;
+   }
+   if(buffer.size() < 4 + static_cast<size_t>(length))
+   {
+      return 0;
+   }
+   type = static_cast<MessageType>(static_cast<uint8_t>(buffer[4]));
+   payload.assign(buffer, 5, length - 1);
+   buffer.erase(0, 4 + static_cast<size_t>(length));
+   return 1;
+}
+
+WireWriter& WireWriter::u8(uint8_t v)
+{
+   m_data.push_back(static_cast<char>(v));
+   return *this;
+}
+
+WireWriter& WireWriter::u16(uint16_t v)
+{
+   putLE(m_data, v);
+   return *this;
+}
+
+WireWriter& WireWriter::u32(uint32_t v)
+{
+   putLE(m_data, v);
+   return *this;
+}
+
+WireWriter& WireWriter::i32(int32_t v)
+{
+   putLE(m_data, static_cast<uint32_t>(v));
+   return *this;
+}
+
+WireWriter& WireWriter::u64(uint64_t v)
+{
+   putLE(m_data, v);
+   return *this;
+}
+
+WireWriter& WireWriter::f64(double v)
+{
+   uint64_t bits;
+   std::memcpy(&bits, &v, sizeof(bits));
+   putLE(m_data, bits);
+   return *this;
+}
+
+WireWriter& WireWriter::str(const std::string& v)
+{
+   putLE(m_data, static_cast<uint32_t>(v.size()));
+   m_data += v;
+   return *this;
+}
+
+bool WireReader::raw(void* dst, size_t n)
+{
+   if(m_data.size() - m_pos < n)
+   {
+      return false;
+   }
+   std::memcpy(dst, m_data.data() + m_pos, n);
+   m_pos += n;
+   return true;
+}
+
+bool WireReader::u8(uint8_t& v)
+{
+   return raw(&v, 1);
+}
+
+bool WireReader::u16(uint16_t& v)
+{
+   unsigned char b[2];
+   if(!raw(b, sizeof(b)))
+   {
+      return false;
+   }
+   v = getLE<uint16_t>(b);
+   return true;
+}
+
+bool WireReader::u32(uint32_t& v)
+{
+   unsigned char b[4];
+   if(!raw(b, sizeof(b)))
+   {
+      return false;
+   }
+   v = getLE<uint32_t>(b);
+   return true;
+}
+
+bool WireReader::i32(int32_t& v)
+{
+   uint32_t u;
+   if(!u32(u))
+   {
+      return false;
+   }
+   v = static_cast<int32_t>(u);
+   return true;
+}
+
+bool WireReader::u64(uint64_t& v)
+{
+   unsigned char b[8];
+   if(!raw(b, sizeof(b)))
+   {
+      return false;
+   }
+   v = getLE<uint64_t>(b);
+   return true;
+}
+
+bool WireReader::f64(double& v)
+{
+   uint64_t bits;
+   if(!u64(bits))
+   {
+      return false;
+   }
+   std::memcpy(&v, &bits, sizeof(v));
+   return true;
+}
+
+bool WireReader::str(std::string& v)
+{
+   uint32_t len;
+   if(!u32(len) || m_data.size() - m_pos < len)
+   {
+      return false;
+   }
+   v.assign(m_data, m_pos, len);
+   m_pos += len;
+   return true;
+}
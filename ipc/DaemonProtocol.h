@@ -0,0 +1,150 @@
+/**
+ * @file DaemonProtocol.h
+ * @brief Compact binary protocol spoken between smart-agentd and its clients over a Unix domain
+ *        socket. Control traffic uses length-prefixed frames on the socket; generated tokens are
+ *        streamed through a per-client ShmRing instead.
+ *
+ *        Frame layout: [u32 length][u8 MessageType][payload], little endian, where length counts
+ *        the type byte and the payload.
+ */
+#ifndef DAEMON_PROTOCOL_H
+#define DAEMON_PROTOCOL_H
+
+#include "IpcConstants.h"
+#include <string>
+#include <cstdint>
+#include <expected>
+#include <utility>
+#include <sys/types.h>
+
+namespace DaemonProtocol
+{
+   const uint16_t PROTOCOL_VERSION = 2;
+
+   // Upper bound on a single frame, protects both sides from garbage lengths
+   const uint32_t MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+   // Default capacity of the per-client token ring
+   const size_t DEFAULT_RING_CAPACITY = 1024 * 1024;
+
+   enum class MessageType : uint8_t
+   {
+      // client -> daemon
+      Hello = 1,        // u16 version
+      ListModels,       // (empty)
+      LoadModel,        // str name
+      ReleaseModel,     // (empty)
+      Prompt,           // u8 PromptRoleType, str text, i32 maxTokens
+      ResetSession,     // (empty)
+
+      // daemon -> client
+      HelloAck = 64,    // u32 clientId, the token ring's descriptor rides along as SCM_RIGHTS
+      ModelList,        // u32 count, count x (str name, str size), str loadedModel
+      Status            // u8 ok, u32 error code, str message
+   };
+
+   // Records written to the client's token ring
+   enum class StreamRecord : uint8_t
+   {
+      Piece = 1,        // raw piece bytes
+      Done              // u8 GenerationStopReason, i32 promptTokens, i32 cachedTokens, i32 generatedTokens
+   };
+
+   /**
+    * @brief Returns the socket path used when none is configured
+    *
+    * $XDG_RUNTIME_DIR/smart-agentd.sock when available, otherwise /tmp/smart-agentd-<uid>.sock
+    */
+   std::string defaultSocketPath();
+
+   /**
+    * @brief Encodes one frame for a caller that sends it itself
+    */
+   std::string encodeFrame(MessageType type, const std::string& payload);
+
+   /**
+    * @brief Sends as much of a buffer as the socket takes without blocking
+    *
+    * @param passFd Descriptor sent along with the first byte, -1 for none
+    * @return ssize_t Bytes sent, or -1 with errno set (EAGAIN when the socket is full)
+    */
+   ssize_t sendSome(int fd, const char* data, size_t size, int passFd);
+
+   /**
+    * @brief Writes one frame, blocking until it is fully sent
+    *
+    * @param passFd Descriptor sent along with the frame's first byte, -1 for none
+    * @return bool False if the peer went away
+    */
+   bool writeFrame(int fd, MessageType type, const std::string& payload, int passFd = -1);
+
+   /**
+    * @brief Reads one frame, blocking until it is fully received
+    *
+    * @param passedFd Receives a descriptor sent along with the frame, -1 if there was none; when null
+    *                 any descriptor that arrives is closed
+    */
+   std::expected<std::pair<MessageType, std::string>, IpcErrorType> readFrame(int fd, int* passedFd = nullptr);
+
+   /**
+    * @brief Pops one complete frame off the front of a receive buffer
+    *
+    * @return int 1 when a frame was extracted, 0 if more bytes are needed, -1 if the buffer is corrupt
+    */
+   int extractFrame(std::string& buffer, MessageType& type, std::string& payload);
+}
+
+/**
+ * @brief Appends little-endian primitives to a payload
+ */
+class WireWriter
+{
+public:
+   WireWriter& u8(uint8_t v);
+   WireWriter& u16(uint16_t v);
+   WireWriter& u32(uint32_t v);
+   WireWriter& i32(int32_t v);
+   WireWriter& u64(uint64_t v);
+   WireWriter& f64(double v);
+   WireWriter& str(const std::string& v);
+
+   inline const std::string& data() const
+   {
+      return m_data;
+   }
+
+private:
+   std::string m_data;
+};
+
+/**
+ * @brief Reads little-endian primitives from a payload; every accessor fails once the data runs out
+ */
+class WireReader
+{
+public:
+   explicit WireReader(const std::string& data) : m_data(data), m_pos(0)
+   {
+   }
+
+   bool u8(uint8_t& v);
+   bool u16(uint16_t& v);
+   bool u32(uint32_t& v);
+   bool i32(int32_t& v);
+   bool u64(uint64_t& v);
+   bool f64(double& v);
+   bool str(std::string& v);
+
+   inline bool atEnd() const
+   {
+      return m_pos == m_data.size();
+   }
+
+private:
+   bool raw(void* dst, size_t n);
+
+   const std::string& m_data;
+   size_t m_pos;
+};
+
+#endif
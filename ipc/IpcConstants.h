@@ -0,0 +1,22 @@
+/**
+ * @file IpcConstants.h
+ * @brief Contains constants shared by the inter-process transports (shared-memory rings and the
+ *        daemon socket protocol)
+ */
+#ifndef IPC_CONSTANTS_H
+#define IPC_CONSTANTS_H
+
+enum class IpcErrorType
+{
+   SHM_CREATE_ERROR,
+   SHM_OPEN_ERROR,
+   SHM_MAP_ERROR,
+   SHM_BAD_HEADER,
+   SOCKET_ERROR,
+   CONNECT_ERROR,
+   PROTOCOL_ERROR,
+   DAEMON_ERROR,
+   TIMEOUT
+};
+
+#endif
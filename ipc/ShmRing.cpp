@@ -0,0 +1,436 @@
+/**
+ * @file ShmRing.cpp
+ * @brief Lock-free single-producer / single-consumer message ring living in shared memory.
+ *        Used to move streamed tokens (and other hot-path payloads) between processes without
+ *        a syscall per message.
+ */
+
+#include "ShmRing.h"
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace
+{
+   const uint32_t RING_MAGIC = 0x534d5247; // "SMRG"
+   const uint32_t RING_VERSION = 1;
+
+   // Messages are prefixed with their length
+   const size_t RECORD_HEADER = sizeof(uint32_t);
+
+   // Set in the length of every fragment but the last of a message too large for the ring
+   const uint32_t MORE_FRAGMENTS = 0x80000000u;
+
+   // Largest message a reader joins from fragments; anything longer is from a misbehaving producer
+   const size_t MAX_MESSAGE_SIZE = 256 * 1024 * 1024;
+
+   size_t roundUpPow2(size_t v)
+   {
+      size_t p = 64;
+      while(p < v)
+      {
+         p <<= 1;
+      }
+      return p;
+   }
+
+   // Spin briefly, then yield, then sleep with a growing interval - keeps latency low while a
+   // stream is active without burning a core when it is idle
+   void backoff(uint32_t& attempt)
+   {
+      if(attempt < 64)
+      {
+         // busy spin
+      }
+      else if(attempt < 128)
+      {
+         std::this_thread::yield();
+      }
+      else
+      {
+         const uint32_t us = std::min<uint32_t>(1000, 50u << std::min<uint32_t>(attempt - 128, 4));
+         std::this_thread::sleep_for(std::chrono::microseconds(us));
+      }
+      ++attempt;
+   }
+}
+
+ShmRing::ShmRing(std::string name, void* mapping, size_t mappingSize, bool owner) :
+ m_name(std::move(name)),
+ m_mapping(mapping),
+ m_mappingSize(mappingSize),
+ m_owner(owner),
+ m_fd(-1),
+ m_broken(false)
+{
+   m_header = static_cast<Header*>(mapping);
+   m_data = static_cast<uint8_t*>(mapping) + sizeof(Header);
+   // Sized from our own mapping; the header's copy may be rewritten by the other process at any time
+   m_capacity = mappingSize - sizeof(Header);
+   m_mask = m_capacity - 1;
+}
+
+/**
+ * @brief Unmaps the ring, unlinking the shared-memory object if this process created it
+ */
+ShmRing::~ShmRing()
+{
+   munmap(m_mapping, m_mappingSize);
+   if(m_fd != -1)
+   {
+      close(m_fd);
+   }
+   if(m_owner && !m_name.empty())
+   {
+      shm_unlink(m_name.c_str());
+   }
+}
+
+/**
+ * @brief Creates a named ring with shm_open; the creator unlinks it on destruction
+ */
+std::expected<std::unique_ptr<ShmRing>, IpcErrorType> ShmRing::create(const std::string& name, size_t capacity)
+{
+   capacity = roundUpPow2(capacity);
+   shm_unlink(name.c_str()); // stale ring from a crashed process
+   const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+   if(fd == -1)
+   {
+      return std::unexpected(IpcErrorType::SHM_CREATE_ERROR);
+   }
+   if(ftruncate(fd, sizeof(Header) + capacity) == -1)
+   {
+      close(fd);
+      shm_unlink(name.c_str());
+      return std::unexpected(IpcErrorType::SHM_CREATE_ERROR);
+   }
+   auto ring = map(fd, name, capacity, true, true);
+   close(fd);
+   if(!ring.has_value())
+   {
+      shm_unlink(name.c_str());
+   }
+   return ring;
+}
+
+/**
+ * @brief Maps a ring that another process created with create()
+ */
+std::expected<std::unique_ptr<ShmRing>, IpcErrorType> ShmRing::open(const std::string& name)
+{
+   const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+   if(fd == -1)
+   {
+      return std::unexpected(IpcErrorType::SHM_OPEN_ERROR);
+   }
+   struct stat st;
+   if(fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) <= sizeof(Header))
+   {
+      close(fd);
+      return std::unexpected(IpcErrorType::SHM_BAD_HEADER);
+   }
+   auto ring = map(fd, name, static_cast<size_t>(st.st_size) - sizeof(Header), false, false);
+   close(fd);
+   return ring;
+}
+
+/**
+ * @brief Creates an unnamed ring whose mapping is inherited by children created with fork()
+ */
+std::expected<std::unique_ptr<ShmRing>, IpcErrorType> ShmRing::createAnonymous(size_t capacity)
+{
+   return map(-1, "", roundUpPow2(capacity), true, true);
+}
+
+/**
+ * @brief Creates a nameless ring backed by a memfd, handed to another process by passing getFd()
+ *        over a Unix domain socket - nobody else can open it
+ */
+std::expected<std::unique_ptr<ShmRing>, IpcErrorType> ShmRing::createShared(size_t capacity)
+{
+   capacity = roundUpPow2(capacity);
+   const int fd = memfd_create("smart-agent-ring", MFD_CLOEXEC);
+   if(fd == -1)
+   {
+      return std::unexpected(IpcErrorType::SHM_CREATE_ERROR);
+   }
+   if(ftruncate(fd, sizeof(Header) + capacity) == -1)
+   {
+      close(fd);
+      return std::unexpected(IpcErrorType::SHM_CREATE_ERROR);
+   }
+   auto ring = map(fd, "", capacity, true, true);
+   if(!ring.has_value())
+   {
+      close(fd);
+      return ring;
+   }
+   ring.value()->m_fd = fd;
+   return ring;
+}
+
+/**
+ * @brief Maps a ring received as a descriptor from the process that called createShared()
+ */
+std::expected<std::unique_ptr<ShmRing>, IpcErrorType> ShmRing::openFd(int fd)
+{
+   struct stat st;
+   if(fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) <= sizeof(Header))
+   {
+      close(fd);
+      return std::unexpected(IpcErrorType::SHM_BAD_HEADER);
+   }
+   auto ring = map(fd, "", static_cast<size_t>(st.st_size) - sizeof(Header), false, false);
+   close(fd);
+   return ring;
+}
+
+// Maps a header + payload area, initializing the header when requested
+std::expected<std::unique_ptr<ShmRing>, IpcErrorType> ShmRing::map(int fd, std::string name, size_t capacity, bool init, bool owner)
+{
+   const size_t size = sizeof(Header) + capacity;
+   const int flags = fd == -1 ? (MAP_SHARED | MAP_ANONYMOUS) : MAP_SHARED;
+   void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+   if(mapping == MAP_FAILED)
+   {
+      return std::unexpected(IpcErrorType::SHM_MAP_ERROR);
+   }
+
+   if(init)
+   {
+      Header* header = new (mapping) Header();
+      header->capacity = capacity;
+      header->head.store(0, std::memory_order_relaxed);
+      header->tail.store(0, std::memory_order_relaxed);
+      header->producerClosed.store(0, std::memory_order_relaxed);
+      header->version = RING_VERSION;
+      std::atomic_thread_fence(std::memory_order_release);
+      header->magic = RING_MAGIC;
+   }
+   else
+   {
+      const Header* header = static_cast<const Header*>(mapping);
+      if(header->magic != RING_MAGIC || header->version != RING_VERSION || header->capacity != capacity ||
+         (capacity & (capacity - 1)) != 0)
+      {
+         munmap(mapping, size);
+         return std::unexpected(IpcErrorType::SHM_BAD_HEADER);
+      }
+   }
+
+   return std::unique_ptr<ShmRing>(new ShmRing(std::move(name), mapping, size, owner));
+}
+
+// Copies bytes into the payload area, handling wrap-around
+void ShmRing::copyIn(uint64_t pos, const void* src, size_t size)
+{
+   const size_t offset = pos & m_mask;
+   const size_t first = std::min<size_t>(size, m_capacity - offset);
+   std::memcpy(m_data + offset, src, first);
+   std::memcpy(m_data, static_cast<const uint8_t*>(src) + first, size - first);
+}
+
+// Copies bytes out of the payload area, handling wrap-around
+void ShmRing::copyOut(uint64_t pos, void* dst, size_t size) const
+{
+   const size_t offset = pos & m_mask;
+   const size_t first = std::min<size_t>(size, m_capacity - offset);
+   std::memcpy(dst, m_data + offset, first);
+   std::memcpy(static_cast<uint8_t*>(dst) + first, m_data, size - first);
+}
+
+/**
+ * @brief Appends one message if there is room for it right now
+ */
+bool ShmRing::tryWrite(const void* data, uint32_t size)
+{
+   return size < MORE_FRAGMENTS && tryWriteRecord(data, size, 0);
+}
+
+// Appends one record if there is room for it right now, flags are or-ed into its length
+bool ShmRing::tryWriteRecord(const void* data, uint32_t size, uint32_t flags)
+{
+   const uint64_t needed = RECORD_HEADER + size;
+   if(needed > m_capacity || !intact())
+   {
+      return false;
+   }
+   const uint64_t head = m_header->head.load(std::memory_order_relaxed);
+   const uint64_t tail = m_header->tail.load(std::memory_order_acquire);
+   // A tail moved past head or more than a ring behind it was not written by an honest consumer
+   if(head - tail > m_capacity)
+   {
+      m_broken = true;
+      return false;
+   }
+   if(m_capacity - (head - tail) < needed)
+   {
+      return false;
+   }
+   const uint32_t length = size | flags;
+   copyIn(head, &length, RECORD_HEADER);
+   copyIn(head + RECORD_HEADER, data, size);
+   // Publish the record - the consumer's acquire load of head makes the bytes visible
+   m_header->head.store(head + needed, std::memory_order_release);
+   return true;
+}
+
+/**
+ * @brief Appends one message, backing off until there is room or the timeout expires
+ */
+bool ShmRing::write(const void* data, uint32_t size, std::chrono::milliseconds timeout)
+{
+   if(size >= MORE_FRAGMENTS || size > MAX_MESSAGE_SIZE)
+   {
+      return false;
+   }
+   // Fragments of half the ring keep the reader draining one while the next is written
+   const uint64_t fragment = RECORD_HEADER + size <= m_capacity ? size : m_capacity / 2 - RECORD_HEADER;
+   const uint8_t* bytes = static_cast<const uint8_t*>(data);
+   uint32_t offset = 0;
+   do
+   {
+      const uint32_t length = static_cast<uint32_t>(std::min<uint64_t>(fragment, size - offset));
+      const uint32_t flags = offset + length < size ? MORE_FRAGMENTS : 0;
+      // The timeout is on progress - a large message may take several to get through
+      const auto deadline = std::chrono::steady_clock::now() + timeout;
+      uint32_t attempt = 0;
+      while(!tryWriteRecord(bytes + offset, length, flags))
+      {
+         if(m_broken || std::chrono::steady_clock::now() >= deadline)
+         {
+            return false;
+         }
+         backoff(attempt);
+      }
+      offset += length;
+   }
+   while(offset < size);
+   return true;
+}
+
+/**
+ * @brief Pops the oldest message if one is available
+ */
+bool ShmRing::tryRead(std::string& out)
+{
+   while(intact())
+   {
+      const uint64_t tail = m_header->tail.load(std::memory_order_relaxed);
+      const uint64_t head = m_header->head.load(std::memory_order_acquire);
+      if(head == tail)
+      {
+         // A message still being written in fragments stays in m_partial until its last one
+         return false;
+      }
+      // The other process may have crashed mid-write or scribbled over the ring; a length that does
+      // not fit what was published would copy out past the payload area. The ring is given up on,
+      // with any message being joined.
+      uint32_t length = 0;
+      const uint64_t available = head - tail;
+      if(available <= m_capacity && available >= RECORD_HEADER)
+      {
+         copyOut(tail, &length, RECORD_HEADER);
+      }
+      const uint32_t size = length & ~MORE_FRAGMENTS;
+      if(available > m_capacity || available < RECORD_HEADER ||
+         size > m_capacity || RECORD_HEADER + static_cast<uint64_t>(size) > available ||
+         m_partial.size() + size > MAX_MESSAGE_SIZE)
+      {
+         m_partial.clear();
+         m_broken = true;
+         return false;
+      }
+
+      std::string& target = m_partial.empty() && (length & MORE_FRAGMENTS) == 0 ? out : m_partial;
+      const size_t offset = &target == &out ? 0 : m_partial.size();
+      target.resize(offset + size);
+      copyOut(tail + RECORD_HEADER, target.data() + offset, size);
+      // Hand the space back to the producer only after the bytes were copied out
+      m_header->tail.store(tail + RECORD_HEADER + size, std::memory_order_release);
+
+      if(length & MORE_FRAGMENTS)
+      {
+         continue;
+      }
+      if(&target == &m_partial)
+      {
+         out = std::move(m_partial);
+         m_partial.clear();
+      }
+      return true;
+   }
+   m_partial.clear();
+   return false;
+}
+
+// Marks the ring broken if the other process changed its capacity, returns false once it is
+bool ShmRing::intact()
+{
+   if(!m_broken && m_header->capacity != m_capacity)
+   {
+      m_broken = true;
+   }
+   return !m_broken;
+}
+
+/**
+ * @brief Pops the oldest message, backing off until one arrives, the producer closes or the timeout expires
+ */
+bool ShmRing::read(std::string& out, std::chrono::milliseconds timeout)
+{
+   const auto deadline = std::chrono::steady_clock::now() + timeout;
+   uint32_t attempt = 0;
+   while(!tryRead(out))
+   {
+      if(m_broken)
+      {
+         return false;
+      }
+      // Re-check after seeing the close flag, the last record may have been published just before it
+      if(isProducerClosed())
+      {
+         return tryRead(out);
+      }
+      if(std::chrono::steady_clock::now() >= deadline)
+      {
+         return false;
+      }
+      backoff(attempt);
+   }
+   return true;
+}
+
+/**
+ * @brief Marks the producer side as finished; readers drain what is left and then stop waiting
+ */
+void ShmRing::closeProducer()
+{
+   m_header->producerClosed.store(1, std::memory_order_release);
+}
+
+/**
+ * @brief Returns true once the producer has called closeProducer()
+ */
+bool ShmRing::isProducerClosed() const
+{
+   return m_header->producerClosed.load(std::memory_order_acquire) != 0;
+}
+
+/**
+ * @brief Empties the ring and reopens the producer side - only valid while neither side is active
+ */
+void ShmRing::reset()
+{
+   m_partial.clear();
+   m_broken = false;
+   m_header->capacity = m_capacity;
+   m_header->head.store(0, std::memory_order_relaxed);
+   m_header->tail.store(0, std::memory_order_relaxed);
+   m_header->producerClosed.store(0, std::memory_order_release);
+}
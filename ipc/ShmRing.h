@@ -0,0 +1,192 @@
+/**
+ * @file ShmRing.h
+ * @brief Lock-free single-producer / single-consumer message ring living in shared memory.
+ *        Used to move streamed tokens (and other hot-path payloads) between processes without
+ *        a syscall per message.
+ */
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include "IpcConstants.h"
+#include <string>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <expected>
+#include <cstdint>
+#include <cstddef>
+
+class ShmRing
+{
+public:
+   /**
+    * @brief Creates a named ring with shm_open; the creator unlinks it on destruction
+    *
+    * @param name POSIX shared-memory name, must start with '/'
+    * @param capacity Payload capacity in bytes, rounded up to a power of two
+    * @return std::expected<std::unique_ptr<ShmRing>, IpcErrorType> The ring or the failure reason
+    */
+   static std::expected<std::unique_ptr<ShmRing>, IpcErrorType> create(const std::string& name, size_t capacity);
+
+   /**
+    * @brief Maps a ring that another process created with create()
+    *
+    * @param name POSIX shared-memory name of the ring
+    * @return std::expected<std::unique_ptr<ShmRing>, IpcErrorType> The ring or the failure reason
+    */
+   static std::expected<std::unique_ptr<ShmRing>, IpcErrorType> open(const std::string& name);
+
+   /**
+    * @brief Creates an unnamed ring whose mapping is inherited by children created with fork()
+    *
+    * @param capacity Payload capacity in bytes, rounded up to a power of two
+    * @return std::expected<std::unique_ptr<ShmRing>, IpcErrorType> The ring or the failure reason
+    */
+   static std::expected<std::unique_ptr<ShmRing>, IpcErrorType> createAnonymous(size_t capacity);
+
+   /**
+    * @brief Creates a nameless ring backed by a memfd, handed to another process by passing getFd()
+    *        over a Unix domain socket - nobody else can open it
+    *
+    * @param capacity Payload capacity in bytes, rounded up to a power of two
+    * @return std::expected<std::unique_ptr<ShmRing>, IpcErrorType> The ring or the failure reason
+    */
+   static std::expected<std::unique_ptr<ShmRing>, IpcErrorType> createShared(size_t capacity);
+
+   /**
+    * @brief Maps a ring received as a descriptor from the process that called createShared()
+    *
+    * @param fd Descriptor of the ring, closed by this call
+    * @return std::expected<std::unique_ptr<ShmRing>, IpcErrorType> The ring or the failure reason
+    */
+   static std::expected<std::unique_ptr<ShmRing>, IpcErrorType> openFd(int fd);
+
+   /**
+    * @brief Unmaps the ring, unlinking the shared-memory object if this process created it
+    */
+   ~ShmRing();
+
+   /**
+    * @brief Appends one message if there is room for it right now
+    *
+    * @param data Message bytes
+    * @param size Number of bytes
+    * @return bool False if the ring is currently too full (or the message is larger than the ring, see write)
+    */
+   bool tryWrite(const void* data, uint32_t size);
+
+   /**
+    * @brief Appends one message, backing off until there is room or the timeout expires
+    *
+    * A message larger than the ring goes in fragments the reader joins again; the timeout then applies
+    * to each fragment. A message cut short by a timeout leaves a partial message behind, the ring must
+    * be reset() before it is used again.
+    *
+    * @return bool False on timeout or once the ring is broken
+    */
+   bool write(const void* data, uint32_t size, std::chrono::milliseconds timeout);
+
+   /**
+    * @brief Pops the oldest message if one is available
+    *
+    * A record whose length does not fit what the producer published is never copied; the ring is
+    * marked broken instead, as nothing after it can be trusted either.
+    *
+    * @param out Receives the message bytes
+    * @return bool True if a message was read
+    */
+   bool tryRead(std::string& out);
+
+   /**
+    * @brief Pops the oldest message, backing off until one arrives, the producer closes or the timeout expires
+    *
+    * @return bool True if a message was read, false at once when the ring is broken
+    */
+   bool read(std::string& out, std::chrono::milliseconds timeout);
+
+   /**
+    * @brief Marks the producer side as finished; readers drain what is left and then stop waiting
+    */
+   void closeProducer();
+
+   /**
+    * @brief Returns true once the producer has called closeProducer()
+    */
+   bool isProducerClosed() const;
+
+   /**
+    * @brief Empties the ring and reopens the producer side - only valid while neither side is active
+    */
+   void reset();
+
+   /**
+    * @brief Returns true once the other process was caught corrupting the shared header or a record;
+    *        every read and write fails from then on until reset()
+    */
+   inline bool isBroken() const
+   {
+      return m_broken;
+   }
+
+   /**
+    * @brief Returns the shared-memory name, empty for anonymous rings
+    */
+   inline const std::string& getName() const
+   {
+      return m_name;
+   }
+
+   /**
+    * @brief Returns the descriptor of a ring made by createShared(), -1 for the others
+    */
+   inline int getFd() const
+   {
+      return m_fd;
+   }
+
+private:
+   // Control block at the start of the mapping. Head and tail are monotonically increasing byte
+   // counters, kept on separate cache lines so producer and consumer don't false-share. The other
+   // process can write all of it; only the capacity taken from our own mapping is trusted.
+   struct Header
+   {
+      uint32_t magic;
+      uint32_t version;
+      uint64_t capacity;
+      alignas(64) std::atomic<uint64_t> head;
+      alignas(64) std::atomic<uint64_t> tail;
+      alignas(64) std::atomic<uint32_t> producerClosed;
+   };
+
+   static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared-memory ring requires lock-free 64-bit atomics");
+
+   ShmRing(std::string name, void* mapping, size_t mappingSize, bool owner);
+
+   // Maps a header + payload area, initializing the header when requested
+   static std::expected<std::unique_ptr<ShmRing>, IpcErrorType> map(int fd, std::string name, size_t capacity, bool init, bool owner);
+
+   // Appends one record if there is room for it right now, flags are or-ed into its length
+   bool tryWriteRecord(const void* data, uint32_t size, uint32_t flags);
+
+   // Marks the ring broken if the other process changed its capacity, returns false once it is
+   bool intact();
+
+   // Copies bytes in or out of the payload area, handling wrap-around
+   void copyIn(uint64_t pos, const void* src, size_t size);
+   void copyOut(uint64_t pos, void* dst, size_t size) const;
+
+   std::string m_name;
+   void* m_mapping;
+   size_t m_mappingSize;
+   bool m_owner;
+   int m_fd;
+   Header* m_header;
+   uint8_t* m_data;
+   uint64_t m_capacity;
+   uint64_t m_mask;
+   bool m_broken;
+   // Fragments read so far of a message larger than the ring
+   std::string m_partial;
+};
+
+#endif
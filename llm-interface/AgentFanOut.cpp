@@ -0,0 +1,106 @@
+/**
+ * @file AgentFanOut.cpp
+ * @brief Sub-agent orchestration for questions about several files. One short sub-task per file
+ *        runs batched behind a shared system prompt, and their notes are merged in a final turn.
+ */
+
+#include "AgentFanOut.h"
+#include <iostream>
+#include <chrono>
+
+namespace
+{
+   double elapsedMs(std::chrono::steady_clock::time_point since)
+   {
+      return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+   }
+}
+
+/**
+ * @brief Orchestrates sub-agents on a loaded model, in-process or isolated
+ *
+ * @param model Model the sub-agents and the synthesis turn run on
+ * @param options Prompts and budgets of the sub-tasks
+ */
+AgentFanOut::AgentFanOut(ModelInterface* model, FanOutOptions options /* {} */) :
+ m_model(model),
+ m_options(std::move(options))
+{
+}
+
+/**
+ * @brief Answers a question about several files with one sub-agent per file
+ *
+ * @param question What to find out about each file
+ * @param files Files as (name, contents) pairs
+ * @param onToken Called for every piece of the synthesis; returning false stops it
+ * @param conversation Conversation the synthesis turn belongs to
+ * @return FanOutReport The notes, the synthesis and their timings
+ */
+FanOutReport AgentFanOut::run(const std::string& question, const std::vector<std::pair<std::string, std::string>>& files,
+                              const std::function<bool(const std::string&)>& onToken,
+                              int32_t conversation /* INTERACTIVE_SESSION */)
+{
+   FanOutReport report;
+
+   std::vector<std::string> prompts;
+   prompts.reserve(files.size());
+   for(const auto& [name, contents] : files)
+   {
+      prompts.push_back(taskPrompt(question, name, contents));
+   }
+
+   // All sub-tasks go to the engine at once; it prefills the shared prefix once and batches the rest
+   const auto fanOutStart = std::chrono::steady_clock::now();
+   const std::vector<GenerationResult> results = m_model->fanOut(m_options.systemPrompt, prompts, m_options.noteTokens);
+   report.fanOutMs = elapsedMs(fanOutStart);
+   for(size_t i = 0; i < files.size(); ++i)
+   {
+      const GenerationResult& result = results[i];
+      if(result.stopReason != GenerationStopReason::EndOfGeneration &&
+         result.stopReason != GenerationStopReason::MaxTokens)
+      {
+         report.failedTasks++;
+      }
+      report.notes.emplace_back(files[i].first, result.text);
+   }
+
+   #ifdef _DEBUG
+      std::cout << "Fanned out " << files.size() << " sub-task(s) in " << report.fanOutMs << " ms, "
+                << report.failedTasks << " failed" << std::endl;
+   #endif
+
+   const auto synthesisStart = std::chrono::steady_clock::now();
+   report.synthesis = m_model->sendPrompt(synthesisPrompt(question, report.notes), "User", onToken, {}, {}, conversation);
+   report.synthesisMs = elapsedMs(synthesisStart);
+   return report;
+}
+
+// User message of one sub-task - the question first, so it joins the shared prefix
+std::string AgentFanOut::taskPrompt(const std::string& question, const std::string& name, const std::string& contents) const
+{
+   std::string prompt = "Question: " + question + "\n\n=== File: " + name + " ===\n";
+   if(contents.size() > m_options.maxFileChars)
+   {
+      prompt.append(contents, 0, m_options.maxFileChars);
+      prompt += "\n[... rest of the file omitted ...]\n";
+   }
+   else
+   {
+      prompt += contents;
+   }
+   return prompt;
+}
+
+// User message of the synthesis turn
+std::string AgentFanOut::synthesisPrompt(const std::string& question,
+                                         const std::vector<std::pair<std::string, std::string>>& notes)
+{
+   std::string prompt = question + "\n\nA reviewer went through each file on its own and left these notes:\n";
+   for(const auto& [name, text] : notes)
+   {
+      prompt += "\n=== " + name + " ===\n" + (text.empty() ? std::string("(no notes)") : text) + "\n";
+   }
+   prompt += "\nAnswer the question for all of the files together, based on these notes.";
+   return prompt;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file AgentFanOut.h
+ * @brief Sub-agent orchestration for questions about several files. Instead of reading every file
+ *        in one ever-growing context, one short sub-task per file runs on its own KV sequence behind
+ *        a shared system prompt (prefilled once, then forked), the sub-tasks are batched together,
+ *        and their notes are merged in a final synthesis turn of the conversation.
+ */
+#ifndef AGENT_FAN_OUT_H
+#define AGENT_FAN_OUT_H
+
+#include "ModelInterface.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <cstdint>
+
+/**
+ * @brief Shape of the sub-tasks and of the synthesis turn
+ */
+struct FanOutOptions
+{
+   // System message of every sub-task, identical across them so it is prefilled once
+   std::string systemPrompt = "You are a careful reviewer. Answer the question for the single file you are given, "
+                              "in at most a few short bullet points. Only report what is in the file.";
+   // Reply budget of each sub-agent, its notes are all the synthesis turn sees of the file
+   int32_t noteTokens = 192;
+   // Characters of a file handed to its sub-agent, keeps each sub-context inside one sequence
+   size_t maxFileChars = 6000;
+};
+
+/**
+ * @brief Outcome of a fanned out question
+ */
+struct FanOutReport
+{
+   // Notes of each sub-agent as (file name, notes), in file order
+   std::vector<std::pair<std::string, std::string>> notes;
+   // Sub-tasks that did not finish cleanly; their notes may be partial or empty
+   size_t failedTasks = 0;
+   // The answer merged from the notes
+   GenerationResult synthesis;
+   // Wall time of the batched sub-tasks and of the synthesis turn
+   double fanOutMs = 0.0;
+   double synthesisMs = 0.0;
+};
+
+class AgentFanOut
+{
+public:
+   /**
+    * @brief Orchestrates sub-agents on a loaded model, in-process or isolated
+    *
+    * @param model Model the sub-agents and the synthesis turn run on
+    * @param options Prompts and budgets of the sub-tasks
+    */
+   AgentFanOut(ModelInterface* model, FanOutOptions options = {});
+
+   /**
+    * @brief Answers a question about several files with one sub-agent per file
+    *
+    * The sub-tasks are stateless; only the synthesis turn - the question and the notes - joins the
+    * conversation, so its context stays small however many files there are.
+    *
+    * @param question What to find out about each file
+    * @param files Files as (name, contents) pairs
+    * @param onToken Called for every piece of the synthesis; returning false stops it
+    * @param conversation Conversation the synthesis turn belongs to
+    * @return FanOutReport The notes, the synthesis and their timings
+    */
+   FanOutReport run(const std::string& question, const std::vector<std::pair<std::string, std::string>>& files,
+                    const std::function<bool(const std::string&)>& onToken,
+                    int32_t conversation = INTERACTIVE_SESSION);
+
+private:
+   // User message of one sub-task - the question first, so it joins the shared prefix
+   std::string taskPrompt(const std::string& question, const std::string& name, const std::string& contents) const;
+
+   // User message of the synthesis turn
+   static std::string synthesisPrompt(const std::string& question,
+                                      const std::vector<std::pair<std::string, std::string>>& notes);
+
+   ModelInterface* m_model;
+   FanOutOptions m_options;
+};
+
+#endif
@@ -0,0 +1,113 @@
+/**
+ * @file ChatSession.cpp
+ * @brief A single conversation against a loaded model. Owns its message history and is bound to
+ *        one InferenceEngine session so its KV cache survives between turns.
+ */
+
+#include "ChatSession.h"
+#include <iostream>
+
+/**
+ * @brief Creates an empty conversation
+ */
+ChatSession::ChatSession(ModelInterface* model, int32_t sessionId) :
+ m_model(model),
+ m_sessionId(sessionId),
+ m_busy(false)
+{
+}
+
+/**
+ * @brief Releases the engine session
+ */
+ChatSession::~ChatSession()
+{
+   if(m_model->getEngine())
+   {
+      m_model->getEngine()->releaseSession(m_sessionId);
+   }
+}
+
+/**
+ * @brief Appends a message and queues generation of the reply
+ */
+bool ChatSession::submitPrompt(const std::string& role, const std::string& text, int32_t maxTokens,
+                               std::function<bool(const std::string&)> onToken,
+                               std::function<void(const GenerationResult&)> onComplete,
+                               RequestPriority priority /* Interactive */)
+{
+   InferenceEngine* engine = m_model->getEngine();
+   if(engine == nullptr || m_busy.exchange(true))
+   {
+      return false;
+   }
+
+   GenerationRequest request;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_messages.emplace_back(role, text);
+
+      std::vector<llama_chat_message> chat;
+      chat.reserve(m_messages.size());
+      for(const auto& [r, c] : m_messages)
+      {
+         chat.push_back({r.c_str(), c.c_str()});
+      }
+      auto formatted = m_model->applyChatTemplate(chat, true);
+      auto tokens = formatted.has_value() ? m_model->tokenize(formatted.value(), true)
+                                          : std::unexpected(formatted.error());
+      if(!tokens.has_value())
+      {
+         #ifdef _DEBUG
+            std::cout << "ChatSession failed to prepare the prompt..." << std::endl;
+         #endif
+         m_messages.pop_back();
+         m_busy = false;
+         return false;
+      }
+      request.promptTokens = std::move(tokens.value());
+   }
+
+   request.sessionId = m_sessionId;
+   // Each conversation is its own tenant for fair queuing
+   request.clientId = static_cast<uint32_t>(m_sessionId);
+   request.priority = priority;
+   request.maxTokens = maxTokens;
+   request.onToken = std::move(onToken);
+   request.onComplete = [this, onComplete = std::move(onComplete)](const GenerationResult& result)
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_messages.emplace_back("assistant", result.text);
+      }
+      m_busy = false;
+      if(onComplete)
+      {
+         onComplete(result);
+      }
+   };
+   engine->submit(std::move(request));
+   return true;
+}
+
+/**
+ * @brief Forgets the history and the cached KV sequence
+ */
+void ChatSession::reset()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_messages.clear();
+   if(m_model->getEngine())
+   {
+      m_model->getEngine()->releaseSession(m_sessionId);
+   }
+}
+
+/**
+ * @brief Returns a copy of the message history as (role, content) pairs
+ */
+std::vector<std::pair<std::string, std::string>> ChatSession::getMessages()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_messages;
+}
@@ -0,0 +1,86 @@
+/**
+ * @file ChatSession.h
+ * @brief A single conversation against a loaded model. Owns its message history and is bound to
+ *        one InferenceEngine session so its KV cache survives between turns.
+ */
+#ifndef CHAT_SESSION_H
+#define CHAT_SESSION_H
+
+#include "ModelInterface.h"
+#include "InferenceEngine.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+class ChatSession
+{
+public:
+   /**
+    * @brief Creates an empty conversation
+    *
+    * @param model The loaded model to converse with
+    * @param sessionId Engine session the conversation's KV sequence is bound to
+    */
+   ChatSession(ModelInterface* model, int32_t sessionId);
+
+   /**
+    * @brief Releases the engine session
+    */
+   ~ChatSession();
+
+   /**
+    * @brief Appends a message and queues generation of the reply
+    *
+    * The reply is appended to the history once generation completes.
+    *
+    * @param role Chat template role, e.g. "user" or "system"
+    * @param text Message content
+    * @param maxTokens Generation limit, -1 for none
+    * @param onToken Called on the worker thread for each piece, return false to cancel
+    * @param onComplete Called on the worker thread when the turn ends
+    * @param priority Scheduling class of the turn, background turns yield to interactive ones
+    * @return bool False if a turn is already in flight or the prompt could not be prepared
+    */
+   bool submitPrompt(const std::string& role, const std::string& text, int32_t maxTokens,
+                     std::function<bool(const std::string&)> onToken,
+                     std::function<void(const GenerationResult&)> onComplete,
+                     RequestPriority priority = RequestPriority::Interactive);
+
+   /**
+    * @brief Forgets the history and the cached KV sequence
+    */
+   void reset();
+
+   /**
+    * @brief Returns true while a turn is being generated
+    */
+   inline bool isBusy() const
+   {
+      return m_busy;
+   }
+
+   /**
+    * @brief Returns the engine session id
+    */
+   inline int32_t getSessionId() const
+   {
+      return m_sessionId;
+   }
+
+   /**
+    * @brief Returns a copy of the message history as (role, content) pairs
+    */
+   std::vector<std::pair<std::string, std::string>> getMessages();
+
+private:
+   ModelInterface* m_model;
+   int32_t m_sessionId;
+   std::vector<std::pair<std::string, std::string>> m_messages;
+   std::mutex m_mutex;
+   std::atomic<bool> m_busy;
+};
+
+#endif
@@ -0,0 +1,203 @@
+/**
+ * @file FileSummarizer.cpp
+ * @brief Map-reduce summaries of files too large for one context window. Pieces are summarized
+ *        batched behind a shared system prompt, and the summaries merged the same way until one is left.
+ */
+
+#include "FileSummarizer.h"
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <utility>
+
+namespace
+{
+   // Tokens a summary's "=== Part ... ===" heading takes in a merge task
+   const size_t PART_HEADING_TOKENS = 12;
+
+   // Share of a sequence pieces are sized to when tokens can only be estimated from length, as with an
+   // isolated model whose vocabulary is in its worker; dense code runs well under four characters a token
+   const double ESTIMATED_PIECE_SHARE = 0.75;
+
+   double elapsedMs(std::chrono::steady_clock::time_point since)
+   {
+      return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+   }
+}
+
+/**
+ * @brief Summarizes files on a loaded model, in-process or isolated
+ *
+ * @param model Model the tasks run on
+ * @param options Prompts and budgets of the tasks
+ */
+FileSummarizer::FileSummarizer(ModelInterface* model, SummaryOptions options /* {} */) :
+ m_model(model),
+ m_options(std::move(options))
+{
+}
+
+/**
+ * @brief Returns the tokens of file text one piece may hold so its task fits in a sequence
+ */
+size_t FileSummarizer::pieceTokens() const
+{
+   const size_t systemTokens = std::max(m_model->countTokens(m_options.pieceSystemPrompt),
+                                        m_model->countTokens(m_options.mergeSystemPrompt));
+   const size_t reserved = systemTokens + m_options.promptOverheadTokens +
+                           static_cast<size_t>(std::max(m_options.summaryTokens, 0));
+   const size_t context = m_model->getSequenceContext();
+   // A task too small to hold a useful piece still gets a quarter of the sequence
+   const size_t tokens = std::max(context / 4, context > reserved ? context - reserved : 0);
+   return m_model->isIsolated() ? static_cast<size_t>(tokens * ESTIMATED_PIECE_SHARE) : tokens;
+}
+
+/**
+ * @brief Summarizes a file given as consecutive pieces of at most pieceTokens each
+ *
+ * @param name Name of the file, shown to the model
+ * @param pieces The file's contents in order
+ * @param keepGoing Asked before every round; returning false stops with what is done so far
+ * @return SummaryReport The summary and how it was made
+ */
+SummaryReport FileSummarizer::summarize(const std::string& name, const std::vector<std::string>& pieces,
+                                        const std::function<bool()>& keepGoing /* {} */)
+{
+   SummaryReport report;
+   report.pieces = pieces.size();
+   if(pieces.empty())
+   {
+      return report;
+   }
+   const auto start = std::chrono::steady_clock::now();
+
+   // Map: every piece on its own
+   std::vector<std::string> prompts;
+   prompts.reserve(pieces.size());
+   for(size_t i = 0; i < pieces.size(); ++i)
+   {
+      prompts.push_back(piecePrompt(name, pieces[i], i, pieces.size()));
+   }
+   std::vector<std::string> summaries = runRound(m_options.pieceSystemPrompt, prompts, report);
+
+   // Reduce: consecutive summaries as many at a time as fit in a sequence, at least two so every
+   // round shrinks the list. A summary is cut to half the window first, so any two of them fit.
+   const size_t window = pieceTokens();
+   const size_t partTokens = window / 2 > PART_HEADING_TOKENS ? window / 2 - PART_HEADING_TOKENS : 1;
+   while(summaries.size() > 1)
+   {
+      if(keepGoing && !keepGoing())
+      {
+         report.cancelled = true;
+         break;
+      }
+      std::vector<size_t> sizes;
+      sizes.reserve(summaries.size());
+      for(std::string& summary : summaries)
+      {
+         sizes.push_back(clip(summary, partTokens) + PART_HEADING_TOKENS);
+      }
+      // Groups of the round as [begin, end) ranges; a lone summary left at the end is carried into
+      // the next round unchanged rather than costing a task
+      std::vector<std::pair<size_t, size_t>> groups;
+      for(size_t begin = 0; begin < summaries.size();)
+      {
+         size_t end = begin;
+         size_t tokens = 0;
+         while(end < summaries.size())
+         {
+            const size_t next = sizes[end];
+            if(end - begin >= 2 && tokens + next > window)
+            {
+               break;
+            }
+            tokens += next;
+            end++;
+         }
+         groups.emplace_back(begin, end);
+         begin = end;
+      }
+      prompts.clear();
+      for(const auto& [begin, end] : groups)
+      {
+         if(end - begin > 1)
+         {
+            prompts.push_back(mergePrompt(name, summaries, begin, end));
+         }
+      }
+      const std::vector<std::string> replies = runRound(m_options.mergeSystemPrompt, prompts, report);
+      std::vector<std::string> merged;
+      size_t reply = 0;
+      for(const auto& [begin, end] : groups)
+      {
+         merged.push_back(end - begin > 1 ? replies[reply++] : std::move(summaries[begin]));
+      }
+      summaries = std::move(merged);
+      report.levels++;
+   }
+
+   // More than one summary is only left when stopped early
+   for(const auto& summary : summaries)
+   {
+      report.summary += report.summary.empty() ? summary : "\n" + summary;
+   }
+   report.ms = elapsedMs(start);
+
+   #ifdef _DEBUG
+      std::cout << "Summarized " << name << " from " << report.pieces << " piece(s) in " << report.levels
+                << " merge round(s), " << report.ms << " ms, " << report.failedTasks << " failed" << std::endl;
+   #endif
+   return report;
+}
+
+// Runs one round of tasks and collects their replies, counting failures into the report
+std::vector<std::string> FileSummarizer::runRound(const std::string& systemPrompt, const std::vector<std::string>& prompts,
+                                                  SummaryReport& report)
+{
+   const std::vector<GenerationResult> results = m_model->fanOut(systemPrompt, prompts, m_options.summaryTokens);
+   std::vector<std::string> replies;
+   replies.reserve(results.size());
+   for(const GenerationResult& result : results)
+   {
+      if(result.stopReason != GenerationStopReason::EndOfGeneration &&
+         result.stopReason != GenerationStopReason::MaxTokens)
+      {
+         report.failedTasks++;
+      }
+      replies.push_back(result.text);
+   }
+   return replies;
+}
+
+// Cuts a summary down to at most maxTokens, from the end; returns the tokens it has left
+size_t FileSummarizer::clip(std::string& summary, size_t maxTokens) const
+{
+   size_t tokens = m_model->countTokens(summary);
+   while(tokens > maxTokens && !summary.empty())
+   {
+      summary.resize(summary.size() * maxTokens / tokens);
+      tokens = m_model->countTokens(summary);
+   }
+   return tokens;
+}
+
+// User message of a map task - the file name first, so it joins the shared prefix
+std::string FileSummarizer::piecePrompt(const std::string& name, const std::string& piece, size_t index, size_t count)
+{
+   return "=== File: " + name + " | part " + std::to_string(index + 1) + " of " + std::to_string(count) + " ===\n" +
+          piece + "\n=== End of part ===\nSummarize this part of the file.";
+}
+
+// User message of a merge task over summaries [begin, end) of the previous round
+std::string FileSummarizer::mergePrompt(const std::string& name, const std::vector<std::string>& summaries,
+                                        size_t begin, size_t end)
+{
+   std::string prompt = "=== File: " + name + " ===\nSummaries of consecutive parts of the file, in order:\n";
+   for(size_t i = begin; i < end; ++i)
+   {
+      prompt += "\n=== Part " + std::to_string(i - begin + 1) + " ===\n" +
+                (summaries[i].empty() ? std::string("(no summary)") : summaries[i]) + "\n";
+   }
+   prompt += "\nMerge them into one summary of these parts.";
+   return prompt;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file FileSummarizer.h
+ * @brief Map-reduce summaries of files too large for one context window. The file's pieces are
+ *        summarized side by side on KV sequences of their own behind a shared system prompt, and
+ *        consecutive summaries are merged the same way, round after round, until one is left.
+ */
+#ifndef FILE_SUMMARIZER_H
+#define FILE_SUMMARIZER_H
+
+#include "ModelInterface.h"
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+/**
+ * @brief Prompts and budgets of the summarization tasks
+ */
+struct SummaryOptions
+{
+   // System message of every piece's task, identical across them so it is prefilled once
+   std::string pieceSystemPrompt = "You summarize one part of a file for a reader who will ask questions about the "
+                                   "whole file. Keep the names of types, functions, settings and sections and say "
+                                   "what each does, in short bullet points. Only report what is in the part.";
+   // System message of every merge task
+   std::string mergeSystemPrompt = "You merge summaries of consecutive parts of one file into a single summary of "
+                                   "the file. Keep the names of types, functions, settings and sections, drop "
+                                   "repetition, and answer in short bullet points.";
+   // Reply budget of every task, and so the size of a summary at each level
+   int32_t summaryTokens = 256;
+   // Tokens kept free in each task for the chat template and the task's own instructions
+   size_t promptOverheadTokens = 96;
+};
+
+/**
+ * @brief Outcome of summarizing one file
+ */
+struct SummaryReport
+{
+   std::string summary;
+   // Pieces summarized in the map step, and merge rounds it took to get down to one summary
+   size_t pieces = 0;
+   size_t levels = 0;
+   // Tasks that did not finish cleanly; their summaries may be partial or empty
+   size_t failedTasks = 0;
+   // Stopped between rounds because the caller asked to
+   bool cancelled = false;
+   double ms = 0.0;
+};
+
+class FileSummarizer
+{
+public:
+   /**
+    * @brief Summarizes files on a loaded model, in-process or isolated
+    *
+    * @param model Model the tasks run on
+    * @param options Prompts and budgets of the tasks
+    */
+   FileSummarizer(ModelInterface* model, SummaryOptions options = {});
+
+   /**
+    * @brief Returns the tokens of file text one piece may hold so its task fits in a sequence
+    */
+   size_t pieceTokens() const;
+
+   /**
+    * @brief Summarizes a file given as consecutive pieces of at most pieceTokens each
+    *
+    * Every round runs all of its tasks through one fanOut, so they prefill the system prompt once
+    * and decode in the same batches. Consecutive summaries are merged as many at a time as fit in
+    * a sequence.
+    *
+    * @param name Name of the file, shown to the model
+    * @param pieces The file's contents in order
+    * @param keepGoing Asked before every round; returning false stops with what is done so far
+    * @return SummaryReport The summary and how it was made
+    */
+   SummaryReport summarize(const std::string& name, const std::vector<std::string>& pieces,
+                           const std::function<bool()>& keepGoing = {});
+
+private:
+   // User message of a map task - the file name first, so it joins the shared prefix
+   static std::string piecePrompt(const std::string& name, const std::string& piece, size_t index, size_t count);
+
+   // User message of a merge task over summaries [begin, end) of the previous round
+   static std::string mergePrompt(const std::string& name, const std::vector<std::string>& summaries,
+                                  size_t begin, size_t end);
+
+   // Cuts a summary down to at most maxTokens, from the end; returns the tokens it has left
+   size_t clip(std::string& summary, size_t maxTokens) const;
+
+   // Runs one round of tasks and collects their replies, counting failures into the report
+   std::vector<std::string> runRound(const std::string& systemPrompt, const std::vector<std::string>& prompts,
+                                     SummaryReport& report);
+
+   ModelInterface* m_model;
+   SummaryOptions m_options;
+};
+
+#endif
@@ -0,0 +1,1818 @@
+/**
+ * @file InferenceEngine.cpp
+ * @brief Multi-sequence inference worker. Owns the decode loop for a loaded model context and
+ *        services queued generation requests by batching every active sequence into a single
+ *        llama_decode call per step (continuous batching).
+ */
+
+#include "InferenceEngine.h"
+#include <iostream>
+#include <algorithm>
+#include <future>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+   // How long the worker sleeps when every active sequence is waiting on a rate limit
+   const std::chrono::milliseconds THROTTLE_INTERVAL(10);
+
+   // Idle clients tracked before the ones without limits of their own are forgotten
+   const size_t MAX_TRACKED_CLIENTS = 1024;
+
+   // Keeps a zero weight from stalling a client forever
+   const double MIN_WEIGHT = 0.01;
+
+   // Weight of the newest request in the throughput averages
+   const double RATE_SMOOTHING = 0.2;
+
+   // Fewer tokens than this say more about overhead than about throughput
+   const int32_t MIN_RATE_TOKENS = 8;
+
+   // Positions scored per decode; each one keeps a row of logits the size of the vocabulary
+   const size_t SCORE_BATCH = 256;
+
+   // Tokens a rate limited client may burst - one second's worth
+   double bucketCapacity(const ClientLimits& limits)
+   {
+      return std::max(limits.tokensPerSecond, 1.0);
+   }
+
+   // Appends a single token to a batch for the given sequence
+   void batchAdd(llama_batch& batch, llama_token token, llama_pos pos, llama_seq_id seqId, bool logits)
+   {
+      batch.token[batch.n_tokens] = token;
+      batch.pos[batch.n_tokens] = pos;
+      batch.n_seq_id[batch.n_tokens] = 1;
+      batch.seq_id[batch.n_tokens][0] = seqId;
+      batch.logits[batch.n_tokens] = logits;
+      batch.n_tokens++;
+   }
+
+   // Milliseconds elapsed between two time points
+   double elapsedMs(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+   {
+      return std::chrono::duration<double, std::milli>(to - from).count();
+   }
+
+   // Length of the common prefix of two token sequences
+   size_t commonPrefix(const std::vector<llama_token>& a, const std::vector<llama_token>& b)
+   {
+      size_t n = 0;
+      while(n < a.size() && n < b.size() && a[n] == b[n])
+      {
+         ++n;
+      }
+      return n;
+   }
+}
+
+/**
+ * @brief Constructs the engine over an already initialized context
+ *
+ * @param context The llama context to decode with, created with n_seq_max >= nSlots
+ * @param vocab The vocab of the model the context was created from
+ * @param nSlots Number of KV sequences that may be active at once
+ * @param prefixCacheCells KV cells reserved for the shared prefix cache, 0 to disable it
+ * @param blockStoreBytes Host memory for stored KV blocks, 0 to disable splicing
+ */
+InferenceEngine::InferenceEngine(llama_context* context, const llama_vocab* vocab, uint32_t nSlots,
+                                 uint32_t prefixCacheCells /* 0 */, size_t blockStoreBytes /* 0 */) :
+ m_context(context),
+ m_vocab(vocab),
+ m_scratchSeq(-1),
+ m_probeSeq(-1),
+ m_virtualClock(0.0),
+ m_prefillMicroBatch(DEFAULT_PREFILL_MICRO_BATCH),
+ m_prefillCap(SIZE_MAX),
+ m_prefillRate(0.0),
+ m_decodeRate(0.0),
+ m_rateSamples(0),
+ m_running(false),
+ m_nextRequestId(1)
+{
+   const uint32_t nSeqMax = llama_n_seq_max(m_context);
+   nSlots = std::max<uint32_t>(1, std::min(nSlots, nSeqMax));
+   const uint32_t nCtx = llama_n_ctx(m_context);
+   uint32_t nextSeq = nSlots;
+
+   // Splicing moves blocks to new positions, which the model's cache has to support
+   if(blockStoreBytes > 0 && nSeqMax >= nextSeq + SCRATCH_SEQUENCES && llama_kv_cache_can_shift(m_context))
+   {
+      m_scratchSeq = static_cast<llama_seq_id>(nextSeq++);
+      m_probeSeq = static_cast<llama_seq_id>(nextSeq++);
+      m_blockStore = std::make_unique<KvBlockStore>(blockStoreBytes);
+   }
+
+   if(prefixCacheCells >= nCtx || nSeqMax <= nextSeq)
+   {
+      // No sequences (or cells) left over to hold shared prefixes
+      prefixCacheCells = 0;
+   }
+   // The scratch sequences get one slot's worth of cells between them
+   m_seqContext = (nCtx - prefixCacheCells) / (nSlots + (m_blockStore ? 1 : 0));
+
+   if(prefixCacheCells > 0)
+   {
+      std::vector<llama_seq_id> cacheSequences;
+      for(uint32_t seqId = nextSeq; seqId < nSeqMax; ++seqId)
+      {
+         cacheSequences.push_back(static_cast<llama_seq_id>(seqId));
+      }
+      m_prefixCache = std::make_unique<PrefixCache>(m_context, std::move(cacheSequences), prefixCacheCells);
+   }
+   m_batchSize = llama_n_batch(m_context);
+   m_batch = llama_batch_init(m_batchSize, 0, 1);
+
+   m_slots.resize(nSlots);
+   for(uint32_t i = 0; i < nSlots; ++i)
+   {
+      m_slots[i].seqId = static_cast<llama_seq_id>(i);
+   }
+}
+
+/**
+ * @brief Stops the worker and fails any request that has not completed
+ */
+InferenceEngine::~InferenceEngine()
+{
+   stop();
+   llama_batch_free(m_batch);
+}
+
+/**
+ * @brief Launches the worker thread
+ */
+void InferenceEngine::start()
+{
+   if(m_running)
+   {
+      return;
+   }
+   m_running = true;
+   m_worker = std::thread(&InferenceEngine::run, this);
+}
+
+/**
+ * @brief Stops the worker thread, completing outstanding requests with GenerationStopReason::Cancelled
+ */
+void InferenceEngine::stop()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_running = false;
+   }
+   m_cv.notify_all();
+   if(m_worker.joinable())
+   {
+      m_worker.join();
+   }
+
+   // The worker is gone - complete whatever was left behind on this thread
+   std::deque<std::function<void()>> tasks;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      tasks.swap(m_tasks);
+   }
+   for(auto& task : tasks)
+   {
+      task();
+   }
+   for(auto& slot : m_slots)
+   {
+      if(slot.state != SlotState::Idle)
+      {
+         finishSlot(slot, GenerationStopReason::Cancelled);
+      }
+   }
+   std::deque<PendingRequest> pending;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      pending.swap(m_pending);
+   }
+   for(auto& req : pending)
+   {
+      GenerationResult result;
+      result.stopReason = GenerationStopReason::Cancelled;
+      result.promptTokens = static_cast<int32_t>(req.request.promptTokens.size());
+      if(req.request.onComplete)
+      {
+         req.request.onComplete(result);
+      }
+      for(auto& fork : req.request.forks)
+      {
+         if(fork.onComplete)
+         {
+            fork.onComplete(result);
+         }
+      }
+   }
+}
+
+/**
+ * @brief Queues a request for the worker
+ *
+ * @param request The request to queue, moved into the engine
+ * @return uint64_t Identifier of the queued request
+ */
+uint64_t InferenceEngine::submit(GenerationRequest request)
+{
+   // Every branch needs a sequence of its own at the same time
+   std::vector<GenerationRequest> dropped;
+   while(request.forks.size() >= m_slots.size())
+   {
+      dropped.push_back(std::move(request.forks.back()));
+      request.forks.pop_back();
+   }
+   for(auto& fork : dropped)
+   {
+      if(fork.onComplete)
+      {
+         GenerationResult result;
+         result.stopReason = GenerationStopReason::Cancelled;
+         fork.onComplete(result);
+      }
+   }
+
+   uint64_t id;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      id = m_nextRequestId++;
+      ClientState& client = clientState(request.clientId);
+      if(client.outstanding == 0)
+      {
+         // Time spent idle does not bank credit against clients that kept the engine busy
+         client.virtualTime = std::max(client.virtualTime, m_virtualClock);
+      }
+      client.outstanding += 1 + static_cast<uint32_t>(request.forks.size());
+      m_pending.push_back({id, std::move(request), std::chrono::steady_clock::now()});
+   }
+   m_cv.notify_one();
+   return id;
+}
+
+/**
+ * @brief Drops the KV sequence bound to a session, if any
+ *
+ * The cells are not freed here (the context belongs to the worker thread); the slot simply stops
+ * being reserved for the session and its cache is reclaimed the next time the slot is reused.
+ *
+ * @param sessionId The session whose cached tokens should be discarded
+ */
+void InferenceEngine::releaseSession(int32_t sessionId)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   for(auto& slot : m_slots)
+   {
+      if(slot.sessionId == sessionId && slot.state == SlotState::Idle)
+      {
+         slot.sessionId = -1;
+      }
+   }
+}
+
+/**
+ * @brief Frees the KV cells of the sequence bound to a session right away
+ *
+ * @param sessionId The session to discard, it must not have a request in flight
+ */
+void InferenceEngine::discardSession(int32_t sessionId)
+{
+   runOnWorker([&]()
+   {
+      for(auto& slot : m_slots)
+      {
+         if(slot.sessionId != sessionId || slot.state != SlotState::Idle)
+         {
+            continue;
+         }
+         // Cells shared with other sequences, e.g. the prompt a fork was copied from, stay theirs
+         llama_kv_cache_seq_rm(m_context, slot.seqId, -1, -1);
+         slot.cachedTokens.clear();
+         std::lock_guard<std::mutex> lock(m_mutex);
+         slot.sessionId = -1;
+      }
+   });
+}
+
+/**
+ * @brief Rebinds the sequence of one session to another, discarding the other's own sequence
+ *
+ * @param fromSessionId Session whose sequence is kept, e.g. the branch picked from an n-best request
+ * @param toSessionId Session that continues from that sequence
+ * @return true The sequence now belongs to toSessionId
+ * @return false fromSessionId has no idle sequence
+ */
+bool InferenceEngine::moveSession(int32_t fromSessionId, int32_t toSessionId)
+{
+   bool moved = false;
+   runOnWorker([&]()
+   {
+      auto from = std::find_if(m_slots.begin(), m_slots.end(), [&](const Slot& slot)
+      {
+         return slot.sessionId == fromSessionId && slot.state == SlotState::Idle;
+      });
+      if(from == m_slots.end())
+      {
+         return;
+      }
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for(auto& slot : m_slots)
+      {
+         if(slot.sessionId == toSessionId && slot.state == SlotState::Idle)
+         {
+            llama_kv_cache_seq_rm(m_context, slot.seqId, -1, -1);
+            slot.cachedTokens.clear();
+            slot.sessionId = -1;
+         }
+      }
+      from->sessionId = toSessionId;
+      from->lastUsed = std::chrono::steady_clock::now();
+      moved = true;
+   });
+   return moved;
+}
+
+/**
+ * @brief Writes the KV sequence and tokens resident for a session to a file
+ *
+ * @param sessionId The session to save, it must not have a request in flight
+ * @param path Destination file
+ * @return true The session state was written
+ * @return false The session has no resident sequence or the write failed
+ */
+bool InferenceEngine::saveSession(int32_t sessionId, const std::string& path)
+{
+   bool saved = false;
+   runOnWorker([&]()
+   {
+      for(auto& slot : m_slots)
+      {
+         if(slot.sessionId != sessionId || slot.state != SlotState::Idle || slot.cachedTokens.empty())
+         {
+            continue;
+         }
+         saved = llama_state_seq_save_file(m_context, path.c_str(), slot.seqId,
+                                           slot.cachedTokens.data(), slot.cachedTokens.size()) > 0;
+         break;
+      }
+   });
+   return saved;
+}
+
+/**
+ * @brief Loads a file written by saveSession into a sequence bound to the session
+ *
+ * @param sessionId The session to restore
+ * @param path File written by saveSession
+ * @return true The KV cache now holds the saved tokens for the session
+ * @return false No sequence was free or the file could not be loaded
+ */
+bool InferenceEngine::restoreSession(int32_t sessionId, const std::string& path)
+{
+   bool restored = false;
+   runOnWorker([&]()
+   {
+      Slot* slot = nullptr;
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         GenerationRequest probe;
+         probe.sessionId = sessionId;
+         slot = pickSlot(probe);
+         if(slot == nullptr)
+         {
+            return;
+         }
+         slot->sessionId = sessionId;
+      }
+
+      llama_kv_cache_seq_rm(m_context, slot->seqId, -1, -1);
+      std::vector<llama_token> tokens(m_seqContext);
+      size_t count = 0;
+      if(llama_state_seq_load_file(m_context, path.c_str(), slot->seqId, tokens.data(), tokens.size(), &count) == 0)
+      {
+         #ifdef _DEBUG
+            std::cout << "Failed to load session state from " << path << std::endl;
+         #endif
+         llama_kv_cache_seq_rm(m_context, slot->seqId, -1, -1);
+         slot->cachedTokens.clear();
+         return;
+      }
+      tokens.resize(count);
+      slot->cachedTokens = std::move(tokens);
+      slot->lastUsed = std::chrono::steady_clock::now();
+      restored = true;
+   });
+   return restored;
+}
+
+/**
+ * @brief Copies the KV sequence and tokens resident for a session into memory
+ *
+ * @param sessionId The session to export, it must not have a request in flight
+ * @param state Receives llama_state_seq_get_data of the sequence
+ * @param tokens Receives the tokens the sequence holds
+ * @return true The session was resident and has been copied
+ * @return false The session has no resident sequence
+ */
+bool InferenceEngine::exportSession(int32_t sessionId, std::vector<uint8_t>& state, std::vector<llama_token>& tokens)
+{
+   bool exported = false;
+   runOnWorker([&]()
+   {
+      for(auto& slot : m_slots)
+      {
+         if(slot.sessionId != sessionId || slot.state != SlotState::Idle || slot.cachedTokens.empty())
+         {
+            continue;
+         }
+         state.resize(llama_state_seq_get_size(m_context, slot.seqId));
+         state.resize(llama_state_seq_get_data(m_context, state.data(), state.size(), slot.seqId));
+         tokens = slot.cachedTokens;
+         exported = !state.empty();
+         break;
+      }
+   });
+   return exported;
+}
+
+/**
+ * @brief Loads state produced by exportSession into a sequence bound to the session
+ *
+ * @param sessionId The session to restore
+ * @param state Sequence state, read in place so it may point into a file mapping
+ * @param tokens Tokens the state holds
+ * @return true The KV cache now holds the tokens for the session
+ * @return false No sequence was free or the state does not fit this context
+ */
+bool InferenceEngine::importSession(int32_t sessionId, std::span<const uint8_t> state, std::span<const llama_token> tokens)
+{
+   if(state.empty() || tokens.empty() || tokens.size() > m_seqContext)
+   {
+      return false;
+   }
+   bool imported = false;
+   runOnWorker([&]()
+   {
+      Slot* slot = nullptr;
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         GenerationRequest probe;
+         probe.sessionId = sessionId;
+         slot = pickSlot(probe);
+         if(slot == nullptr)
+         {
+            return;
+         }
+         slot->sessionId = sessionId;
+      }
+
+      llama_kv_cache_seq_rm(m_context, slot->seqId, -1, -1);
+      if(llama_state_seq_set_data(m_context, state.data(), state.size(), slot->seqId) == 0)
+      {
+         #ifdef _DEBUG
+            std::cout << "Failed to import session state for session " << sessionId << std::endl;
+         #endif
+         llama_kv_cache_seq_rm(m_context, slot->seqId, -1, -1);
+         slot->cachedTokens.clear();
+         return;
+      }
+      slot->cachedTokens.assign(tokens.begin(), tokens.end());
+      slot->lastUsed = std::chrono::steady_clock::now();
+      imported = true;
+   });
+   return imported;
+}
+
+/**
+ * @brief Sets the weight and rate limit of one client, overriding the defaults
+ */
+void InferenceEngine::setClientLimits(uint32_t clientId, const ClientLimits& limits)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   ClientState& client = clientState(clientId);
+   client.limits = limits;
+   client.custom = true;
+   client.bucket = std::min(client.bucket, bucketCapacity(limits));
+}
+
+/**
+ * @brief Sets the weight and rate limit of every client without limits of its own
+ */
+void InferenceEngine::setDefaultClientLimits(const ClientLimits& limits)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_defaultLimits = limits;
+   for(auto& [id, client] : m_clients)
+   {
+      if(!client.custom)
+      {
+         client.limits = limits;
+         client.bucket = std::min(client.bucket, bucketCapacity(limits));
+      }
+   }
+}
+
+/**
+ * @brief Sets how many prompt tokens are decoded per step while interactive sequences generate
+ *
+ * Smaller values keep token latency steady under heavy ingestion at the cost of prefill throughput.
+ */
+void InferenceEngine::setPrefillMicroBatch(uint32_t tokens)
+{
+   m_prefillMicroBatch = std::max<uint32_t>(1, tokens);
+}
+
+/**
+ * @brief Returns the number of requests waiting for a free sequence
+ */
+size_t InferenceEngine::getQueueDepth()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_pending.size();
+}
+
+/**
+ * @brief Returns how long requests of a priority class waited for a sequence
+ */
+QueueWaitStats InferenceEngine::getQueueWaitStats(RequestPriority priority)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_queueWait[static_cast<size_t>(priority)];
+}
+
+/**
+ * @brief Returns the prefill and decode rates measured so far
+ */
+ThroughputEstimate InferenceEngine::getThroughput() const
+{
+   ThroughputEstimate estimate;
+   estimate.prefillTokensPerSec = m_prefillRate * 1000.0;
+   estimate.decodeTokensPerSec = m_decodeRate * 1000.0;
+   estimate.samples = m_rateSamples;
+   return estimate;
+}
+
+/**
+ * @brief Estimates how long a request takes from the measured prefill and decode rates
+ *
+ * @param prefillTokens Prompt tokens that are not resident in the KV cache yet
+ * @param decodeTokens Tokens the reply is expected to run to
+ * @return double Estimated milliseconds, 0 while nothing has been measured
+ */
+double InferenceEngine::estimateLatencyMs(size_t prefillTokens, size_t decodeTokens) const
+{
+   const double prefillRate = m_prefillRate;
+   const double decodeRate = m_decodeRate;
+   double ms = 0.0;
+   if(prefillRate > 0.0)
+   {
+      ms += prefillTokens / prefillRate;
+   }
+   if(decodeRate > 0.0)
+   {
+      ms += decodeTokens / decodeRate;
+   }
+   return ms;
+}
+
+/**
+ * @brief Returns the prefix cache counters, all zero when the cache is disabled
+ */
+PrefixCacheStats InferenceEngine::getPrefixCacheStats() const
+{
+   return m_prefixCache ? m_prefixCache->getStats() : PrefixCacheStats();
+}
+
+/**
+ * @brief Returns the block store counters, all zero when splicing is disabled
+ */
+BlockStoreStats InferenceEngine::getBlockStoreStats() const
+{
+   return m_blockStore ? m_blockStore->getStats() : BlockStoreStats();
+}
+
+/**
+ * @brief Prefills self-contained spans into the block store ahead of the request that splices them
+ *
+ * @param spans Tokens of each span, as they will appear in the prompt
+ */
+void InferenceEngine::prefetchBlocks(std::vector<std::vector<llama_token>> spans)
+{
+   if(!m_blockStore || spans.empty())
+   {
+      return;
+   }
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(!m_running)
+      {
+         return;
+      }
+      m_tasks.push_back([this, spans = std::move(spans)]()
+      {
+         for(const auto& span : spans)
+         {
+            if(!span.empty() && span.size() < m_seqContext)
+            {
+               ensureBlock(span.data(), span.size());
+            }
+         }
+      });
+   }
+   m_cv.notify_one();
+}
+
+/**
+ * @brief Compares a prompt assembled from spliced blocks against prefilling it in order
+ *
+ * @param prompt Prompt tokens
+ * @param spans Self-contained spans of the prompt as (offset, length), sorted and disjoint
+ * @return std::expected<SpliceQuality, ModelErrorType> Logit agreement and timing of both paths
+ */
+std::expected<SpliceQuality, ModelErrorType> InferenceEngine::checkSplice(const std::vector<llama_token>& prompt,
+                                                                          const std::vector<std::pair<size_t, size_t>>& spans)
+{
+   if(!m_blockStore)
+   {
+      return std::unexpected(ModelErrorType::KV_SHIFT_UNSUPPORTED);
+   }
+   if(prompt.empty() || prompt.size() >= m_seqContext)
+   {
+      return std::unexpected(ModelErrorType::TOKENIZE_ERROR);
+   }
+
+   std::expected<SpliceQuality, ModelErrorType> outcome = std::unexpected(ModelErrorType::DECODE_ERROR);
+   runOnWorker([&]()
+   {
+      const int32_t nVocab = llama_vocab_n_tokens(m_vocab);
+      SpliceQuality quality;
+
+      // Reference - the whole prompt prefilled in order
+      llama_kv_cache_seq_rm(m_context, m_probeSeq, -1, -1);
+      auto start = std::chrono::steady_clock::now();
+      int32_t index = prefillSequence(m_probeSeq, prompt, 0, prompt.size(), {});
+      if(index < 0)
+      {
+         llama_kv_cache_seq_rm(m_context, m_probeSeq, -1, -1);
+         return;
+      }
+      const float* logits = llama_get_logits_ith(m_context, index);
+      const std::vector<float> reference(logits, logits + nVocab);
+      quality.fullPrefillMs = elapsedMs(start, std::chrono::steady_clock::now());
+      llama_kv_cache_seq_rm(m_context, m_probeSeq, -1, -1);
+
+      // Make sure every block exists so only the assembly itself is timed
+      std::vector<std::pair<size_t, size_t>> usable;
+      for(const auto& [offset, length] : spans)
+      {
+         if(length > 0 && offset + length < prompt.size() && ensureBlock(prompt.data() + offset, length))
+         {
+            usable.emplace_back(offset, length);
+         }
+      }
+
+      // Candidate - blocks spliced in, the rest of the prompt prefilled around them
+      start = std::chrono::steady_clock::now();
+      std::vector<std::pair<size_t, size_t>> spliced;
+      for(const auto& [offset, length] : usable)
+      {
+         const KvBlockStore::Block* block = m_blockStore->find(prompt.data() + offset, length);
+         if(block && spliceBlock(*block, m_probeSeq, static_cast<llama_pos>(offset)))
+         {
+            spliced.emplace_back(offset, length);
+            quality.splicedTokens += static_cast<int32_t>(length);
+         }
+      }
+      index = prefillSequence(m_probeSeq, prompt, 0, prompt.size(), spliced);
+      if(index < 0)
+      {
+         llama_kv_cache_seq_rm(m_context, m_probeSeq, -1, -1);
+         return;
+      }
+      logits = llama_get_logits_ith(m_context, index);
+      const std::vector<float> candidate(logits, logits + nVocab);
+      quality.splicedPrefillMs = elapsedMs(start, std::chrono::steady_clock::now());
+      llama_kv_cache_seq_rm(m_context, m_probeSeq, -1, -1);
+
+      // Compare the next-token distributions
+      const auto refMax = std::max_element(reference.begin(), reference.end());
+      const auto candMax = std::max_element(candidate.begin(), candidate.end());
+      quality.top1Match = (refMax - reference.begin()) == (candMax - candidate.begin());
+      double refSum = 0.0;
+      double candSum = 0.0;
+      for(int32_t i = 0; i < nVocab; ++i)
+      {
+         refSum += std::exp(reference[i] - *refMax);
+         candSum += std::exp(candidate[i] - *candMax);
+         quality.maxLogitDelta = std::max(quality.maxLogitDelta, static_cast<double>(std::fabs(reference[i] - candidate[i])));
+      }
+      const double refLogZ = *refMax + std::log(refSum);
+      const double candLogZ = *candMax + std::log(candSum);
+      for(int32_t i = 0; i < nVocab; ++i)
+      {
+         const double logP = reference[i] - refLogZ;
+         const double logQ = candidate[i] - candLogZ;
+         quality.klDivergence += std::exp(logP) * (logP - logQ);
+      }
+      outcome = quality;
+   });
+   return outcome;
+}
+
+// Measures how surprising each token of a text is to the model
+std::expected<std::vector<float>, ModelErrorType> InferenceEngine::scoreTokens(const std::vector<llama_token>& tokens)
+{
+   if(m_probeSeq < 0)
+   {
+      return std::unexpected(ModelErrorType::KV_SHIFT_UNSUPPORTED);
+   }
+   if(tokens.empty())
+   {
+      return std::vector<float>();
+   }
+
+   std::expected<std::vector<float>, ModelErrorType> outcome = std::unexpected(ModelErrorType::DECODE_ERROR);
+   runOnWorker([&]()
+   {
+      const int32_t nVocab = llama_vocab_n_tokens(m_vocab);
+      const size_t window = std::max<size_t>(2, m_seqContext);
+      const size_t batch = std::min<size_t>(SCORE_BATCH, m_batchSize);
+      std::vector<float> surprisal(tokens.size(), 0.0f);
+      for(size_t begin = 0; begin < tokens.size(); begin += window)
+      {
+         const size_t end = std::min(tokens.size(), begin + window);
+         llama_kv_cache_seq_rm(m_context, m_probeSeq, -1, -1);
+         for(size_t from = begin; from < end; from += batch)
+         {
+            const size_t to = std::min(end, from + batch);
+            m_batch.n_tokens = 0;
+            for(size_t pos = from; pos < to; ++pos)
+            {
+               // The window's last token predicts nothing inside it
+               batchAdd(m_batch, tokens[pos], static_cast<llama_pos>(pos - begin), m_probeSeq, pos + 1 < end);
+            }
+            if(llama_decode(m_context, m_batch) != 0)
+            {
+               llama_kv_cache_seq_rm(m_context, m_probeSeq, -1, -1);
+               return;
+            }
+            for(size_t pos = from; pos + 1 < end && pos < to; ++pos)
+            {
+               // -log softmax of the next token from the raw logits at this position
+               const float* logits = llama_get_logits_ith(m_context, static_cast<int32_t>(pos - from));
+               const float maxLogit = *std::max_element(logits, logits + nVocab);
+               double sum = 0.0;
+               for(int32_t i = 0; i < nVocab; ++i)
+               {
+                  sum += std::exp(logits[i] - maxLogit);
+               }
+               surprisal[pos + 1] = static_cast<float>(maxLogit + std::log(sum) - logits[tokens[pos + 1]]);
+            }
+         }
+         // Nothing came before the window's first token to predict it from
+         if(end - begin > 1)
+         {
+            double mean = 0.0;
+            for(size_t pos = begin + 1; pos < end; ++pos)
+            {
+               mean += surprisal[pos];
+            }
+            surprisal[begin] = static_cast<float>(mean / (end - begin - 1));
+         }
+      }
+      llama_kv_cache_seq_rm(m_context, m_probeSeq, -1, -1);
+      outcome = std::move(surprisal);
+   });
+   return outcome;
+}
+
+// Picks the slot a request should run on, or nullptr if none is available yet
+InferenceEngine::Slot* InferenceEngine::pickSlot(const GenerationRequest& request)
+{
+   // A session always returns to its own sequence so its KV cache is reused
+   if(request.sessionId >= 0)
+   {
+      for(auto& slot : m_slots)
+      {
+         if(slot.sessionId == request.sessionId)
+         {
+            return slot.state == SlotState::Idle ? &slot : nullptr;
+         }
+      }
+   }
+
+   // Otherwise prefer an unbound idle slot with the longest matching prefix, then the least
+   // recently used one. Slots bound to other sessions are only taken as a last resort.
+   Slot* best = nullptr;
+   size_t bestPrefix = 0;
+   for(auto& slot : m_slots)
+   {
+      if(slot.state != SlotState::Idle)
+      {
+         continue;
+      }
+      if(best == nullptr)
+      {
+         best = &slot;
+         bestPrefix = slot.sessionId < 0 ? commonPrefix(slot.cachedTokens, request.promptTokens) : 0;
+         continue;
+      }
+      const bool bestBound = best->sessionId >= 0;
+      const bool slotBound = slot.sessionId >= 0;
+      if(bestBound != slotBound)
+      {
+         if(bestBound)
+         {
+            best = &slot;
+            bestPrefix = commonPrefix(slot.cachedTokens, request.promptTokens);
+         }
+         continue;
+      }
+      const size_t prefix = slotBound ? 0 : commonPrefix(slot.cachedTokens, request.promptTokens);
+      if(prefix > bestPrefix || (prefix == bestPrefix && slot.lastUsed < best->lastUsed))
+      {
+         best = &slot;
+         bestPrefix = prefix;
+      }
+   }
+   return best;
+}
+
+// Binds queued requests to idle slots; must be called with m_mutex held
+void InferenceEngine::assignPending()
+{
+   if(m_pending.empty())
+   {
+      return;
+   }
+
+   // Weighted fair queuing - interactive requests first, then in order of the virtual time at which
+   // each request's prompt would be done if its client were served at its weighted share
+   struct Candidate
+   {
+      RequestPriority priority;
+      double finish;
+      size_t index;
+   };
+   std::vector<Candidate> order;
+   order.reserve(m_pending.size());
+   for(size_t i = 0; i < m_pending.size(); ++i)
+   {
+      const GenerationRequest& request = m_pending[i].request;
+      const ClientState& client = clientState(request.clientId);
+      const double cost = static_cast<double>(request.promptTokens.size()) / std::max(client.limits.weight, MIN_WEIGHT);
+      order.push_back({request.priority, client.virtualTime + cost, i});
+   }
+   std::stable_sort(order.begin(), order.end(), [](const Candidate& a, const Candidate& b)
+   {
+      return a.priority != b.priority ? a.priority < b.priority : a.finish < b.finish;
+   });
+
+   // Background work never takes the last free sequence, so an interactive request never waits
+   // behind a long ingestion
+   size_t background = std::count_if(m_slots.begin(), m_slots.end(), [](const Slot& s)
+   {
+      return s.state != SlotState::Idle && s.priority == RequestPriority::Background;
+   });
+   const size_t backgroundLimit = std::max<size_t>(1, m_slots.size() - 1);
+
+   const auto now = std::chrono::steady_clock::now();
+   std::vector<bool> taken(m_pending.size(), false);
+   for(const Candidate& candidate : order)
+   {
+      PendingRequest& pending = m_pending[candidate.index];
+      const bool isBackground = pending.request.priority == RequestPriority::Background;
+      if(isBackground && background >= backgroundLimit)
+      {
+         continue;
+      }
+      Slot* slot = pickSlot(pending.request);
+      if(slot == nullptr)
+      {
+         continue;
+      }
+      // Reserve the slot now so the next pending request cannot pick it
+      const int32_t previousSession = slot->sessionId;
+      slot->state = SlotState::Prefill;
+      slot->sessionId = pending.request.sessionId;
+      slot->priority = pending.request.priority;
+
+      // Forks are only started together with their parent, each on a sequence of its own
+      std::vector<std::pair<Slot*, int32_t>> forkSlots;
+      for(const GenerationRequest& fork : pending.request.forks)
+      {
+         Slot* forkSlot = pickSlot(fork);
+         if(forkSlot == nullptr)
+         {
+            break;
+         }
+         forkSlots.emplace_back(forkSlot, forkSlot->sessionId);
+         forkSlot->state = SlotState::Forked;
+         forkSlot->sessionId = fork.sessionId;
+         forkSlot->priority = pending.request.priority;
+      }
+      if(forkSlots.size() < pending.request.forks.size())
+      {
+         for(auto& [forkSlot, forkPrevious] : forkSlots)
+         {
+            forkSlot->state = SlotState::Idle;
+            forkSlot->sessionId = forkPrevious;
+         }
+         slot->state = SlotState::Idle;
+         slot->sessionId = previousSession;
+         continue;
+      }
+      slot->forks.clear();
+      for(auto& [forkSlot, forkPrevious] : forkSlots)
+      {
+         slot->forks.push_back(forkSlot);
+      }
+      background += isBackground ? 1 : 0;
+
+      QueueWaitStats& wait = m_queueWait[static_cast<size_t>(pending.request.priority)];
+      const double waited = elapsedMs(pending.enqueuedAt, now);
+      wait.requests++;
+      wait.totalMs += waited;
+      wait.maxMs = std::max(wait.maxMs, waited);
+
+      m_assigned.push_back({slot, std::move(pending)});
+      taken[candidate.index] = true;
+   }
+
+   std::deque<PendingRequest> remaining;
+   for(size_t i = 0; i < m_pending.size(); ++i)
+   {
+      if(!taken[i])
+      {
+         remaining.push_back(std::move(m_pending[i]));
+      }
+   }
+   m_pending.swap(remaining);
+}
+
+// Prepares a slot for a freshly assigned request, reusing its cached prefix
+void InferenceEngine::beginRequest(Slot& slot, PendingRequest&& pending)
+{
+   slot.request = std::move(pending.request);
+   slot.result = GenerationResult();
+   slot.enqueuedAt = pending.enqueuedAt;
+   slot.startedAt = std::chrono::steady_clock::now();
+   slot.decodeStartedAt = slot.startedAt;
+   slot.result.promptTokens = static_cast<int32_t>(slot.request.promptTokens.size());
+   slot.result.queueMs = elapsedMs(slot.enqueuedAt, slot.startedAt);
+   slot.sampler = createSampler(slot.request.sampling);
+   slot.batchIndex = -1;
+
+   // Forks share the prompt, client and deadline; they wait until the prompt has been prefilled
+   std::vector<Slot*> forks;
+   for(size_t i = 0; i < slot.forks.size(); ++i)
+   {
+      Slot& fork = *slot.forks[i];
+      GenerationRequest& forkRequest = slot.request.forks[i];
+      const auto& shared = slot.request.promptTokens;
+      if(forkRequest.promptTokens.empty())
+      {
+         forkRequest.promptTokens = shared;
+      }
+      const bool extends = forkRequest.promptTokens.size() >= shared.size() &&
+                           std::equal(shared.begin(), shared.end(), forkRequest.promptTokens.begin());
+      forkRequest.clientId = slot.request.clientId;
+      forkRequest.priority = slot.request.priority;
+      forkRequest.deadline = slot.request.deadline;
+      fork.request = std::move(forkRequest);
+      fork.result = GenerationResult();
+      fork.enqueuedAt = slot.enqueuedAt;
+      fork.startedAt = slot.startedAt;
+      fork.decodeStartedAt = slot.startedAt;
+      fork.result.promptTokens = slot.result.promptTokens;
+      fork.result.queueMs = slot.result.queueMs;
+      fork.sampler = createSampler(fork.request.sampling);
+      fork.batchIndex = -1;
+      if(!extends || fork.request.promptTokens.size() >= m_seqContext)
+      {
+         // Nothing to continue from, or a remainder that cannot fit
+         finishSlot(fork, extends ? GenerationStopReason::ContextFull : GenerationStopReason::DecodeError);
+         continue;
+      }
+      forks.push_back(&fork);
+   }
+   slot.forks.swap(forks);
+   slot.request.forks.clear();
+
+   const std::vector<llama_token>& prompt = slot.request.promptTokens;
+   if(prompt.empty())
+   {
+      finishSlot(slot, GenerationStopReason::EndOfGeneration);
+      return;
+   }
+   if(slot.startedAt >= slot.request.deadline)
+   {
+      // Spent its whole budget waiting for a sequence
+      finishSlot(slot, GenerationStopReason::Deadline);
+      return;
+   }
+   if(prompt.size() >= m_seqContext)
+   {
+      #ifdef _DEBUG
+         std::cout << "Prompt does not fit in the sequence context..." << std::endl;
+      #endif
+      finishSlot(slot, GenerationStopReason::ContextFull);
+      return;
+   }
+
+   // Keep the part of the KV cache that matches the new prompt. At least one prompt token must be
+   // decoded so that there are logits to sample from.
+   size_t reuse = commonPrefix(slot.cachedTokens, prompt);
+   if(reuse >= prompt.size())
+   {
+      reuse = prompt.size() - 1;
+   }
+   llama_kv_cache_seq_rm(m_context, slot.seqId, static_cast<llama_pos>(reuse), -1);
+   slot.cachedTokens.resize(reuse);
+
+   // Another conversation may already have prefilled more of this prompt
+   if(m_prefixCache)
+   {
+      const size_t shared = m_prefixCache->acquire(slot.seqId, prompt, reuse, prompt.size() - 1);
+      if(shared > reuse)
+      {
+         slot.cachedTokens.assign(prompt.begin(), prompt.begin() + shared);
+         reuse = shared;
+      }
+   }
+   slot.prefillPos = reuse;
+   slot.result.cachedTokens = static_cast<int32_t>(reuse);
+
+   // Self-contained spans that still have to be computed come from the block store. Their cells
+   // sit at positions past the prefill cursor, so tokens decoded before them never attend to them.
+   slot.splices.clear();
+   if(m_blockStore)
+   {
+      size_t end = reuse;
+      for(const auto& [offset, length] : slot.request.blockSpans)
+      {
+         // Leave the final prompt token to be decoded so there are logits to sample from
+         if(length == 0 || offset < end || offset + length >= prompt.size())
+         {
+            continue;
+         }
+         const KvBlockStore::Block* block = ensureBlock(prompt.data() + offset, length);
+         if(block && spliceBlock(*block, slot.seqId, static_cast<llama_pos>(offset)))
+         {
+            slot.exactTokens = std::min(slot.exactTokens, offset);
+            slot.splices.emplace_back(offset, offset + length);
+            slot.result.splicedTokens += static_cast<int32_t>(length);
+            end = offset + length;
+         }
+      }
+   }
+   slot.state = SlotState::Prefill;
+}
+
+// Samples the next token for a slot that received logits in the last batch
+void InferenceEngine::sampleSlot(Slot& slot)
+{
+   if(!slot.forks.empty())
+   {
+      startForks(slot);
+   }
+   if(slot.request.maxTokens == 0)
+   {
+      // Prefill only
+      slot.state = SlotState::Decode;
+      slot.decodeStartedAt = std::chrono::steady_clock::now();
+      slot.result.prefillMs = elapsedMs(slot.startedAt, slot.decodeStartedAt);
+      slot.batchIndex = -1;
+      finishSlot(slot, GenerationStopReason::MaxTokens);
+      return;
+   }
+   const llama_token token = llama_sampler_sample(slot.sampler, m_context, slot.batchIndex);
+   if(slot.request.trackConfidence)
+   {
+      scoreToken(slot, token, slot.batchIndex);
+   }
+   slot.batchIndex = -1;
+
+   if(slot.state == SlotState::Prefill)
+   {
+      slot.state = SlotState::Decode;
+      slot.decodeStartedAt = std::chrono::steady_clock::now();
+      slot.result.prefillMs = elapsedMs(slot.startedAt, slot.decodeStartedAt);
+   }
+
+   // If we are at the end of the generation finish the request
+   if(llama_vocab_is_eog(m_vocab, token))
+   {
+      finishSlot(slot, GenerationStopReason::EndOfGeneration);
+      return;
+   }
+
+   // Convert the token to a string and hand it to the caller
+   char buf[256];
+   const int n = llama_token_to_piece(m_vocab, token, buf, sizeof(buf), 0, true);
+   if(n < 0)
+   {
+      #ifdef _DEBUG
+         std::cout << "Failed to convert token to piece..." << std::endl;
+      #endif
+      finishSlot(slot, GenerationStopReason::DecodeError);
+      return;
+   }
+   const std::string piece(buf, n);
+   slot.result.text += piece;
+   slot.result.generatedTokens++;
+
+   if(slot.request.onToken && !slot.request.onToken(piece))
+   {
+      finishSlot(slot, GenerationStopReason::Cancelled);
+      return;
+   }
+   if(slot.request.maxTokens >= 0 && slot.result.generatedTokens >= slot.request.maxTokens)
+   {
+      finishSlot(slot, GenerationStopReason::MaxTokens);
+      return;
+   }
+   slot.nextToken = token;
+}
+
+// Copies a slot's freshly prefilled prompt into the sequences of its forks; forks with the same
+// prompt sample their first token, the others go on to prefill their own remainder
+void InferenceEngine::startForks(Slot& slot)
+{
+   std::vector<Slot*> forks;
+   forks.swap(slot.forks);
+   for(Slot* fork : forks)
+   {
+      // The copy shares the prompt's cells rather than duplicating them
+      llama_kv_cache_seq_rm(m_context, fork->seqId, -1, -1);
+      llama_kv_cache_seq_cp(m_context, slot.seqId, fork->seqId, -1, -1);
+      fork->cachedTokens = slot.cachedTokens;
+      fork->prefillPos = slot.prefillPos;
+      fork->splices.clear();
+      // The copied cells include whatever the parent spliced
+      fork->exactTokens = slot.exactTokens;
+      fork->result.cachedTokens = static_cast<int32_t>(slot.prefillPos);
+      fork->state = SlotState::Prefill;
+      if(fork->request.promptTokens.size() > slot.prefillPos)
+      {
+         continue;
+      }
+      // Each branch draws its first token from the same logits with its own sampler
+      fork->batchIndex = slot.batchIndex;
+      sampleSlot(*fork);
+   }
+}
+
+// Adds a sampled token's log-probability and its distribution's entropy to the slot's confidence
+void InferenceEngine::scoreToken(Slot& slot, llama_token token, int32_t batchIndex)
+{
+   // The raw logits, before temperature and truncation - the model's own belief
+   const float* logits = llama_get_logits_ith(m_context, batchIndex);
+   const int32_t nVocab = llama_vocab_n_tokens(m_vocab);
+   const float maxLogit = *std::max_element(logits, logits + nVocab);
+   double sum = 0.0;
+   double weighted = 0.0;
+   for(int32_t i = 0; i < nVocab; ++i)
+   {
+      const double shifted = logits[i] - maxLogit;
+      const double e = std::exp(shifted);
+      sum += e;
+      weighted += e * shifted;
+   }
+   const double logZ = std::log(sum);
+   // H = log Z - E[shifted logit]
+   const double entropy = logZ - weighted / sum;
+
+   GenerationConfidence& confidence = slot.result.confidence;
+   confidence.scoredTokens++;
+   confidence.meanLogProb += (logits[token] - maxLogit) - logZ;
+   confidence.meanEntropy += entropy;
+   confidence.maxEntropy = std::max(confidence.maxEntropy, entropy);
+   if(entropy > ENTROPY_SPIKE_NATS)
+   {
+      confidence.entropySpikes++;
+   }
+}
+
+// Completes the request bound to a slot and returns it to the idle pool
+void InferenceEngine::finishSlot(Slot& slot, GenerationStopReason reason)
+{
+   // Forks end with a parent that never got its prompt prefilled
+   std::vector<Slot*> forks;
+   forks.swap(slot.forks);
+   for(Slot* fork : forks)
+   {
+      if(fork->state == SlotState::Forked)
+      {
+         finishSlot(*fork, reason);
+      }
+   }
+
+   const auto now = std::chrono::steady_clock::now();
+   slot.result.stopReason = reason;
+   slot.result.truncated = reason == GenerationStopReason::Deadline || reason == GenerationStopReason::MaxTokens;
+   GenerationConfidence& confidence = slot.result.confidence;
+   if(confidence.scoredTokens > 0)
+   {
+      // Accumulated as sums while generating
+      confidence.meanLogProb /= confidence.scoredTokens;
+      confidence.meanEntropy /= confidence.scoredTokens;
+   }
+   if(slot.state == SlotState::Decode)
+   {
+      slot.result.decodeMs = elapsedMs(slot.decodeStartedAt, now);
+   }
+   else
+   {
+      slot.result.prefillMs = elapsedMs(slot.startedAt, now);
+   }
+   recordThroughput(slot.result, slot.state == SlotState::Decode);
+
+   if(slot.sampler)
+   {
+      llama_sampler_free(slot.sampler);
+      slot.sampler = nullptr;
+   }
+
+   // Offer the prefilled part of the prompt to later requests, up to the first spliced block
+   if(m_prefixCache)
+   {
+      const auto& prompt = slot.request.promptTokens;
+      m_prefixCache->insert(slot.seqId, prompt, std::min(commonPrefix(slot.cachedTokens, prompt), slot.exactTokens));
+   }
+   slot.exactTokens = SIZE_MAX;
+
+   GenerationRequest finished = std::move(slot.request);
+   slot.request = GenerationRequest();
+   slot.batchIndex = -1;
+   slot.stepTokens = 0;
+   slot.lastUsed = now;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      slot.state = SlotState::Idle;
+      auto client = m_clients.find(finished.clientId);
+      if(client != m_clients.end() && client->second.outstanding > 0 && --client->second.outstanding == 0 &&
+         !client->second.custom && client->second.limits.tokensPerSecond <= 0.0)
+      {
+         // Nothing to remember for an idle client without a rate limit
+         m_clients.erase(client);
+      }
+   }
+
+   if(finished.onComplete)
+   {
+      finished.onComplete(slot.result);
+   }
+
+   // A slot freed up - pending requests may now be assignable
+   m_cv.notify_one();
+}
+
+// Builds a sampler chain for a request
+llama_sampler* InferenceEngine::createSampler(const SamplingParams& params)
+{
+   llama_sampler* sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+   if(params.temperature <= 0.0f)
+   {
+      llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
+      return sampler;
+   }
+   if(params.topK > 0)
+   {
+      llama_sampler_chain_add(sampler, llama_sampler_init_top_k(params.topK));
+   }
+   if(params.topP < 1.0f)
+   {
+      llama_sampler_chain_add(sampler, llama_sampler_init_top_p(params.topP, 1));
+   }
+   llama_sampler_chain_add(sampler, llama_sampler_init_min_p(params.minP, 1));
+   llama_sampler_chain_add(sampler, llama_sampler_init_temp(params.temperature));
+   llama_sampler_chain_add(sampler, llama_sampler_init_dist(params.seed));
+   return sampler;
+}
+
+// Decodes tokens[from, to) of a sequence at their own positions, skipping the given spans.
+// Logits are only produced for the final token; returns its batch index or -1 on failure.
+int32_t InferenceEngine::prefillSequence(llama_seq_id seqId, const std::vector<llama_token>& tokens, size_t from, size_t to,
+                                         const std::vector<std::pair<size_t, size_t>>& skip)
+{
+   int32_t lastIndex = -1;
+   size_t pos = from;
+   auto span = skip.begin();
+   while(pos < to)
+   {
+      m_batch.n_tokens = 0;
+      while(pos < to && m_batch.n_tokens < static_cast<int32_t>(m_batchSize))
+      {
+         while(span != skip.end() && span->first + span->second <= pos)
+         {
+            ++span;
+         }
+         if(span != skip.end() && span->first <= pos)
+         {
+            pos = span->first + span->second;
+            continue;
+         }
+         const bool last = pos + 1 == to;
+         if(last)
+         {
+            lastIndex = m_batch.n_tokens;
+         }
+         batchAdd(m_batch, tokens[pos], static_cast<llama_pos>(pos), seqId, last);
+         ++pos;
+      }
+      if(m_batch.n_tokens > 0 && llama_decode(m_context, m_batch) != 0)
+      {
+         #ifdef _DEBUG
+            std::cout << "Failed to decode prefill batch..." << std::endl;
+         #endif
+         return -1;
+      }
+   }
+   return lastIndex;
+}
+
+// Returns the stored block for a span, prefilling and storing it first if needed
+const KvBlockStore::Block* InferenceEngine::ensureBlock(const llama_token* tokens, size_t count)
+{
+   const KvBlockStore::Block* block = m_blockStore->find(tokens, count);
+   if(block)
+   {
+      return block;
+   }
+
+   // First sighting - compute the span on its own at positions [0, count) and keep its state
+   const auto start = std::chrono::steady_clock::now();
+   const std::vector<llama_token> span(tokens, tokens + count);
+   llama_kv_cache_seq_rm(m_context, m_scratchSeq, -1, -1);
+   if(prefillSequence(m_scratchSeq, span, 0, count, {}) < 0)
+   {
+      llama_kv_cache_seq_rm(m_context, m_scratchSeq, -1, -1);
+      return nullptr;
+   }
+   std::vector<uint8_t> state(llama_state_seq_get_size(m_context, m_scratchSeq));
+   const size_t written = llama_state_seq_get_data(m_context, state.data(), state.size(), m_scratchSeq);
+   llama_kv_cache_seq_rm(m_context, m_scratchSeq, -1, -1);
+   if(written == 0)
+   {
+      return nullptr;
+   }
+   state.resize(written);
+   m_blockStore->recordPrefill(elapsedMs(start, std::chrono::steady_clock::now()));
+   return m_blockStore->put(tokens, count, std::move(state));
+}
+
+// Copies a block into a sequence with its positions shifted to start at offset
+bool InferenceEngine::spliceBlock(const KvBlockStore::Block& block, llama_seq_id seqId, llama_pos offset)
+{
+   // Restore into the scratch sequence first - copied cells are shared, so shifting them after the
+   // copy would move them in every sequence holding them
+   const auto start = std::chrono::steady_clock::now();
+   if(llama_state_seq_set_data(m_context, block.state.data(), block.state.size(), m_scratchSeq) == 0)
+   {
+      llama_kv_cache_seq_rm(m_context, m_scratchSeq, -1, -1);
+      return false;
+   }
+   const llama_pos length = static_cast<llama_pos>(block.tokens.size());
+   if(offset > 0)
+   {
+      // Re-rotates the keys for their new positions on the next decode
+      llama_kv_cache_seq_add(m_context, m_scratchSeq, 0, length, offset);
+   }
+   llama_kv_cache_seq_cp(m_context, m_scratchSeq, seqId, offset, offset + length);
+   llama_kv_cache_seq_rm(m_context, m_scratchSeq, -1, -1);
+   m_blockStore->recordSplice(block.tokens.size(), elapsedMs(start, std::chrono::steady_clock::now()));
+   return true;
+}
+
+// Runs a task on the worker thread between decode steps and waits for it to finish
+void InferenceEngine::runOnWorker(std::function<void()> task)
+{
+   std::promise<void> done;
+   std::future<void> finished = done.get_future();
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if(!m_running)
+      {
+         // No worker owns the context, it is safe to touch it from here
+         lock.unlock();
+         task();
+         return;
+      }
+      m_tasks.push_back([&task, &done]()
+      {
+         task();
+         done.set_value();
+      });
+   }
+   m_cv.notify_one();
+   finished.wait();
+}
+
+// Worker thread body
+void InferenceEngine::run()
+{
+   std::deque<std::function<void()>> tasks;
+   while(true)
+   {
+      {
+         std::unique_lock<std::mutex> lock(m_mutex);
+         m_cv.wait(lock, [this]()
+         {
+            if(!m_running || !m_pending.empty() || !m_tasks.empty())
+            {
+               return true;
+            }
+            return std::any_of(m_slots.begin(), m_slots.end(),
+                               [](const Slot& s) { return s.state != SlotState::Idle; });
+         });
+         if(!m_running)
+         {
+            break;
+         }
+         tasks.swap(m_tasks);
+         assignPending();
+      }
+
+      for(auto& task : tasks)
+      {
+         task();
+      }
+      tasks.clear();
+
+      // Start the newly assigned requests outside of the lock, their callbacks may re-enter submit
+      std::vector<std::pair<Slot*, PendingRequest>> assigned;
+      assigned.swap(m_assigned);
+      for(auto& [slot, pending] : assigned)
+      {
+         beginRequest(*slot, std::move(pending));
+      }
+
+      std::unordered_map<uint32_t, double> allowance;
+      const std::vector<Slot*> order = scheduleStep(allowance);
+      buildBatch(order, allowance);
+
+      if(m_batch.n_tokens == 0)
+      {
+         if(!order.empty())
+         {
+            // Every active sequence is waiting for its client's rate limit
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait_for(lock, THROTTLE_INTERVAL, [this]() { return !m_running || !m_tasks.empty(); });
+         }
+         continue;
+      }
+
+      const int32_t decodeResult = llama_decode(m_context, m_batch);
+      if(decodeResult != 0)
+      {
+         #ifdef _DEBUG
+            std::cout << "Failed to decode batch..." << std::endl;
+         #endif
+         // Roll every participating sequence back to what it had before this step
+         std::vector<Slot*> stepped;
+         size_t prefillTokens = 0;
+         for(auto& slot : m_slots)
+         {
+            if(slot.stepTokens == 0)
+            {
+               continue;
+            }
+            prefillTokens += slot.state == SlotState::Prefill ? slot.stepTokens : 0;
+            rollbackStep(slot);
+            stepped.push_back(&slot);
+         }
+         // A positive result means no KV cells were left for the batch - the step is retried once
+         // there is room, anything else is fatal to the requests in it
+         if(decodeResult > 0)
+         {
+            makeRoom(stepped, prefillTokens);
+            continue;
+         }
+         for(Slot* slot : stepped)
+         {
+            finishSlot(*slot, GenerationStopReason::DecodeError);
+         }
+         continue;
+      }
+      // The cache had room again, prefill gets its share back a step at a time
+      if(m_prefillCap != SIZE_MAX)
+      {
+         m_prefillCap = m_prefillCap >= m_batchSize ? SIZE_MAX : m_prefillCap * 2;
+      }
+
+      chargeClients();
+
+      // Record what is now resident in each sequence, then sample where logits were requested
+      for(auto& slot : m_slots)
+      {
+         if(slot.state == SlotState::Decode && slot.batchIndex >= 0)
+         {
+            slot.cachedTokens.push_back(slot.nextToken);
+         }
+         else if(slot.state == SlotState::Prefill)
+         {
+            const auto& prompt = slot.request.promptTokens;
+            slot.cachedTokens.insert(slot.cachedTokens.end(),
+                                     prompt.begin() + slot.cachedTokens.size(),
+                                     prompt.begin() + slot.prefillPos);
+         }
+         if(slot.batchIndex >= 0)
+         {
+            sampleSlot(slot);
+         }
+      }
+   }
+}
+
+// Returns the state of a client, creating it with the default limits; must be called with m_mutex held
+InferenceEngine::ClientState& InferenceEngine::clientState(uint32_t clientId)
+{
+   auto iter = m_clients.find(clientId);
+   if(iter != m_clients.end())
+   {
+      return iter->second;
+   }
+
+   if(m_clients.size() >= MAX_TRACKED_CLIENTS)
+   {
+      std::erase_if(m_clients, [](const auto& entry)
+      {
+         return entry.second.outstanding == 0 && !entry.second.custom;
+      });
+   }
+   ClientState& client = m_clients[clientId];
+   client.limits = m_defaultLimits;
+   client.virtualTime = m_virtualClock;
+   client.bucket = bucketCapacity(client.limits);
+   client.refilledAt = std::chrono::steady_clock::now();
+   return client;
+}
+
+// Orders the active slots for the next step and works out how many tokens each client may spend
+std::vector<InferenceEngine::Slot*> InferenceEngine::scheduleStep(std::unordered_map<uint32_t, double>& allowance)
+{
+   std::vector<Slot*> order;
+   for(auto& slot : m_slots)
+   {
+      // Forks take part once their parent has started them
+      if(slot.state != SlotState::Idle && slot.state != SlotState::Forked)
+      {
+         order.push_back(&slot);
+      }
+   }
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   const auto now = std::chrono::steady_clock::now();
+   double lowest = std::numeric_limits<double>::infinity();
+   for(const Slot* slot : order)
+   {
+      const uint32_t clientId = slot->request.clientId;
+      if(allowance.contains(clientId))
+      {
+         continue;
+      }
+      ClientState& client = clientState(clientId);
+      lowest = std::min(lowest, client.virtualTime);
+      if(client.limits.tokensPerSecond <= 0.0)
+      {
+         allowance[clientId] = std::numeric_limits<double>::infinity();
+         continue;
+      }
+      const double seconds = std::chrono::duration<double>(now - client.refilledAt).count();
+      client.bucket = std::min(bucketCapacity(client.limits), client.bucket + client.limits.tokensPerSecond * seconds);
+      client.refilledAt = now;
+      allowance[clientId] = std::floor(client.bucket);
+   }
+   if(!order.empty())
+   {
+      m_virtualClock = std::max(m_virtualClock, lowest);
+   }
+
+   // Interactive work first, then the client furthest behind its share
+   std::stable_sort(order.begin(), order.end(), [this](const Slot* a, const Slot* b)
+   {
+      if(a->priority != b->priority)
+      {
+         return a->priority < b->priority;
+      }
+      return m_clients.at(a->request.clientId).virtualTime < m_clients.at(b->request.clientId).virtualTime;
+   });
+   return order;
+}
+
+// Adds decode and prefill tokens of the scheduled slots to the batch
+void InferenceEngine::buildBatch(const std::vector<Slot*>& order, std::unordered_map<uint32_t, double>& allowance)
+{
+   m_batch.n_tokens = 0;
+   bool interactiveDecode = false;
+   bool interactiveActive = false;
+
+   // Decode steps go first - each generating sequence contributes exactly one token
+   const auto now = std::chrono::steady_clock::now();
+   for(Slot* slot : order)
+   {
+      slot->stepTokens = 0;
+      if(now >= slot->request.deadline)
+      {
+         // Out of time - hand back what has been generated so far
+         finishSlot(*slot, GenerationStopReason::Deadline);
+         continue;
+      }
+      interactiveActive = interactiveActive || slot->priority == RequestPriority::Interactive;
+      if(slot->state != SlotState::Decode)
+      {
+         continue;
+      }
+      if(slot->cachedTokens.size() + 1 > m_seqContext)
+      {
+         #ifdef _DEBUG
+            std::cout << "Context size exceeded..." << std::endl;
+         #endif
+         finishSlot(*slot, GenerationStopReason::ContextFull);
+         continue;
+      }
+      double& left = allowance[slot->request.clientId];
+      if(left < 1.0)
+      {
+         // Over its client's rate limit, it generates again once the bucket refills
+         continue;
+      }
+      left -= 1.0;
+      slot->batchIndex = m_batch.n_tokens;
+      slot->stepTokens = 1;
+      batchAdd(m_batch, slot->nextToken, static_cast<llama_pos>(slot->cachedTokens.size()), slot->seqId, true);
+      interactiveDecode = interactiveDecode || slot->priority == RequestPriority::Interactive;
+   }
+
+   // Prompt processing fills what is left of the batch. While someone is watching tokens stream in
+   // it only gets a micro-batch per step, and background prefill never gets more than a micro-batch
+   // while any interactive request is active, so a long prefill yields at every micro-batch boundary.
+   const size_t microBatch = m_prefillMicroBatch;
+   size_t budget = std::min(m_batchSize - static_cast<size_t>(m_batch.n_tokens), m_prefillCap);
+   if(interactiveDecode)
+   {
+      budget = std::min(budget, microBatch);
+   }
+   size_t backgroundBudget = interactiveActive ? microBatch : budget;
+   for(Slot* slot : order)
+   {
+      if(slot->state != SlotState::Prefill || budget == 0)
+      {
+         continue;
+      }
+      const bool isBackground = slot->priority == RequestPriority::Background;
+      double& left = allowance[slot->request.clientId];
+      size_t limit = std::min<double>(static_cast<double>(budget), left);
+      if(isBackground)
+      {
+         limit = std::min(limit, backgroundBudget);
+      }
+
+      const auto& prompt = slot->request.promptTokens;
+      uint32_t added = 0;
+      slot->stepFrom = slot->prefillPos;
+      slot->stepSplices.clear();
+      while(slot->prefillPos < prompt.size() && added < limit)
+      {
+         if(!slot->splices.empty() && slot->splices.front().first == slot->prefillPos)
+         {
+            // Already resident - spliced in by beginRequest
+            slot->prefillPos = slot->splices.front().second;
+            slot->stepSplices.push_back(slot->splices.front());
+            slot->splices.pop_front();
+            continue;
+         }
+         const bool last = slot->prefillPos + 1 == prompt.size();
+         if(last)
+         {
+            slot->batchIndex = m_batch.n_tokens;
+         }
+         batchAdd(m_batch, prompt[slot->prefillPos], static_cast<llama_pos>(slot->prefillPos), slot->seqId, last);
+         slot->prefillPos++;
+         added++;
+      }
+      slot->stepTokens = added;
+      budget -= added;
+      left -= added;
+      if(isBackground)
+      {
+         backgroundBudget -= added;
+      }
+   }
+}
+
+// Charges every client for the tokens its slots contributed to the last batch
+void InferenceEngine::chargeClients()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   for(const auto& slot : m_slots)
+   {
+      if(slot.stepTokens == 0)
+      {
+         continue;
+      }
+      ClientState& client = clientState(slot.request.clientId);
+      client.virtualTime += slot.stepTokens / std::max(client.limits.weight, MIN_WEIGHT);
+      if(client.limits.tokensPerSecond > 0.0)
+      {
+         client.bucket -= slot.stepTokens;
+      }
+   }
+}
+
+// Takes a slot's tokens of a batch that failed to decode back out of its sequence
+void InferenceEngine::rollbackStep(Slot& slot)
+{
+   if(slot.state == SlotState::Decode)
+   {
+      const llama_pos pos = static_cast<llama_pos>(slot.cachedTokens.size());
+      llama_kv_cache_seq_rm(m_context, slot.seqId, pos, pos + 1);
+   }
+   else
+   {
+      // Spliced blocks passed over stay resident, only the ranges decoded between them go
+      size_t from = slot.stepFrom;
+      for(const auto& [begin, end] : slot.stepSplices)
+      {
+         if(from < begin)
+         {
+            llama_kv_cache_seq_rm(m_context, slot.seqId, static_cast<llama_pos>(from), static_cast<llama_pos>(begin));
+         }
+         from = end;
+      }
+      if(from < slot.prefillPos)
+      {
+         llama_kv_cache_seq_rm(m_context, slot.seqId, static_cast<llama_pos>(from), static_cast<llama_pos>(slot.prefillPos));
+      }
+      slot.splices.insert(slot.splices.begin(), slot.stepSplices.begin(), slot.stepSplices.end());
+      slot.stepSplices.clear();
+      slot.prefillPos = slot.stepFrom;
+   }
+   slot.batchIndex = -1;
+   slot.stepTokens = 0;
+}
+
+// Frees KV cells after a decode found none left for the batch; only a step that cannot shrink any
+// further ends a request
+void InferenceEngine::makeRoom(const std::vector<Slot*>& stepped, size_t prefillTokens)
+{
+   // Shared prefixes are only a shortcut, they go first
+   if(m_prefixCache && m_prefixCache->release(static_cast<size_t>(m_batch.n_tokens)) > 0)
+   {
+      return;
+   }
+   // Then prompt processing backs off, the sequences already generating keep going
+   if(prefillTokens > 1)
+   {
+      m_prefillCap = std::max<size_t>(1, prefillTokens / 2);
+      return;
+   }
+   if(stepped.empty())
+   {
+      return;
+   }
+
+   // Nothing left to shrink - the request holding the most cells makes way, background work first
+   Slot* victim = *std::max_element(stepped.begin(), stepped.end(), [](const Slot* a, const Slot* b)
+   {
+      if(a->priority != b->priority)
+      {
+         return a->priority < b->priority;
+      }
+      return std::max(a->cachedTokens.size(), a->prefillPos) < std::max(b->cachedTokens.size(), b->prefillPos);
+   });
+   #ifdef _DEBUG
+      std::cout << "KV cache full, ending the request on sequence " << victim->seqId << std::endl;
+   #endif
+   finishSlot(*victim, GenerationStopReason::ContextFull);
+   // Its cells are what the others need, keeping them for a later turn would not free anything
+   llama_kv_cache_seq_rm(m_context, victim->seqId, -1, -1);
+   victim->cachedTokens.clear();
+}
+
+// Folds a completed request's prefill and decode rates into the running estimates; the prefill
+// rate only counts when the whole prompt was processed
+void InferenceEngine::recordThroughput(const GenerationResult& result, bool prefillComplete)
+{
+   const int32_t prefilled = result.promptTokens - result.cachedTokens - result.splicedTokens;
+   const bool prefillSample = prefillComplete && prefilled >= MIN_RATE_TOKENS && result.prefillMs > 0.0;
+   const bool decodeSample = result.generatedTokens >= MIN_RATE_TOKENS && result.decodeMs > 0.0;
+   if(prefillSample)
+   {
+      const double rate = prefilled / result.prefillMs;
+      const double previous = m_prefillRate;
+      m_prefillRate = previous > 0.0 ? previous + RATE_SMOOTHING * (rate - previous) : rate;
+   }
+   if(decodeSample)
+   {
+      const double rate = result.generatedTokens / result.decodeMs;
+      const double previous = m_decodeRate;
+      m_decodeRate = previous > 0.0 ? previous + RATE_SMOOTHING * (rate - previous) : rate;
+   }
+   if(prefillSample || decodeSample)
+   {
+      m_rateSamples++;
+   }
+}
@@ -0,0 +1,611 @@
+/**
+ * @file InferenceEngine.h
+ * @brief Multi-sequence inference worker. Owns the decode loop for a loaded model context and
+ *        services queued generation requests by batching every active sequence into a single
+ *        llama_decode call per step (continuous batching).
+ */
+#ifndef INFERENCE_ENGINE_H
+#define INFERENCE_ENGINE_H
+
+#include "ModelConstants.h"
+#include "PrefixCache.h"
+#include "KvBlockStore.h"
+#include "llama.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <utility>
+#include <memory>
+#include <expected>
+#include <array>
+#include <unordered_map>
+#include <span>
+#include <cstdint>
+
+/**
+ * @brief Sampling configuration applied to a single generation request
+ */
+struct SamplingParams
+{
+   float temperature = 0.8f;
+   float minP = 0.05f;
+   float topP = 1.0f;
+   int32_t topK = 0;
+   uint32_t seed = LLAMA_DEFAULT_SEED;
+};
+
+/**
+ * @brief Scheduling class of a request
+ */
+enum class RequestPriority : uint8_t
+{
+   // Someone is waiting on the reply
+   Interactive,
+   // File ingestion, speculative prefill and other work nobody is watching yet
+   Background
+};
+
+/**
+ * @brief Share of the engine a client is entitled to
+ */
+struct ClientLimits
+{
+   // Relative share of each batch when several clients have work queued
+   double weight = 1.0;
+   // Prompt plus generated tokens per second the client may use, 0 for no limit
+   double tokensPerSecond = 0.0;
+};
+
+/**
+ * @brief Time requests of one priority class spent waiting for a sequence
+ */
+struct QueueWaitStats
+{
+   uint64_t requests = 0;
+   double totalMs = 0.0;
+   double maxMs = 0.0;
+};
+
+/**
+ * @brief Cheap signals of how sure the model was of a reply, filled in when requested
+ */
+struct GenerationConfidence
+{
+   // Sampled tokens the signals were computed over, including the end of generation token
+   int32_t scoredTokens = 0;
+   // Mean natural log-probability of the sampled tokens
+   double meanLogProb = 0.0;
+   // Mean and largest entropy of the next-token distributions, in nats
+   double meanEntropy = 0.0;
+   double maxEntropy = 0.0;
+   // Tokens sampled from a distribution whose entropy exceeded InferenceEngine::ENTROPY_SPIKE_NATS
+   int32_t entropySpikes = 0;
+};
+
+/**
+ * @brief Outcome of a generation request, delivered through the completion callback
+ */
+struct GenerationResult
+{
+   std::string text;
+   GenerationStopReason stopReason = GenerationStopReason::EndOfGeneration;
+   int32_t promptTokens = 0;
+   int32_t cachedTokens = 0;
+   int32_t generatedTokens = 0;
+   // Prompt tokens whose KV was spliced from the block store
+   int32_t splicedTokens = 0;
+   double queueMs = 0.0;
+   double prefillMs = 0.0;
+   double decodeMs = 0.0;
+   // The reply was cut short by the deadline or the token budget rather than ending on its own
+   bool truncated = false;
+   // Only filled in for requests with trackConfidence set
+   GenerationConfidence confidence;
+};
+
+/**
+ * @brief A unit of work for the inference worker
+ *
+ * The prompt is always the full token sequence for the conversation. Tokens already resident in
+ * the sequence's KV cache are reused and only the divergent suffix is prefilled.
+ */
+struct GenerationRequest
+{
+   // Tokenized prompt (full conversation, template already applied)
+   std::vector<llama_token> promptTokens;
+   // Session affinity - requests with the same id reuse the same KV sequence. -1 is ephemeral.
+   int32_t sessionId = -1;
+   // Tenant the request is accounted to for fair queuing and rate limits
+   uint32_t clientId = 0;
+   RequestPriority priority = RequestPriority::Interactive;
+   // Maximum number of tokens to generate, -1 for no limit other than the context size. 0 only
+   // prefills the prompt, e.g. a prefix its forks continue from.
+   int32_t maxTokens = -1;
+   // The reply must be complete by then - generation ends cleanly at the deadline with
+   // GenerationStopReason::Deadline. time_point::max() for none.
+   std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+   SamplingParams sampling;
+   // Score every sampled token against the full next-token distribution, see GenerationConfidence
+   bool trackConfidence = false;
+   // Self-contained spans of the prompt as (offset, length), e.g. attached file chunks. Their KV is
+   // spliced in from the block store instead of being prefilled. Must be sorted and disjoint.
+   std::vector<std::pair<size_t, size_t>> blockSpans;
+   // Called on the worker thread for every generated piece. Return false to cancel the request.
+   std::function<bool(const std::string&)> onToken;
+   // Called on the worker thread exactly once when the request finishes
+   std::function<void(const GenerationResult&)> onComplete;
+   // Further requests continuing from this request's prompt, e.g. n-best replies or sub-tasks behind
+   // a shared system prompt. Each runs on a sequence of its own that starts as a copy of this
+   // request's prompt once it has been prefilled, so the shared part is decoded once and every fork
+   // then prefills its own remainder and decodes in the same batches. A fork's promptTokens must
+   // start with this request's; left empty it samples straight from the same prompt (n-best
+   // branches should then not share a fixed seed). Client, priority and deadline are this request's.
+   std::vector<GenerationRequest> forks;
+};
+
+/**
+ * @brief Latency objective of a single conversation turn
+ */
+struct GenerationBudget
+{
+   // Reply length assumed when estimating a turn without a token budget
+   static constexpr int32_t EXPECTED_REPLY_TOKENS = 256;
+
+   // The reply must be complete by then, time_point::max() for no deadline
+   std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+   // Maximum number of tokens to generate, -1 for no limit
+   int32_t maxTokens = -1;
+
+   inline bool hasDeadline() const
+   {
+      return deadline != std::chrono::steady_clock::time_point::max();
+   }
+
+   // Milliseconds left until the deadline, negative once it has passed
+   inline double remainingMs() const
+   {
+      return std::chrono::duration<double, std::milli>(deadline - std::chrono::steady_clock::now()).count();
+   }
+
+   // Tokens the reply is expected to run to
+   inline int32_t replyTokens() const
+   {
+      return maxTokens >= 0 ? maxTokens : EXPECTED_REPLY_TOKENS;
+   }
+};
+
+/**
+ * @brief Prefill and decode rates measured from completed requests
+ */
+struct ThroughputEstimate
+{
+   // Prompt tokens per second one request sees while sharing batches with the others
+   double prefillTokensPerSec = 0.0;
+   // Generated tokens per second one request sees while sharing batches with the others
+   double decodeTokensPerSec = 0.0;
+   // Requests the rates were measured from, 0 while nothing has been measured
+   uint64_t samples = 0;
+};
+
+/**
+ * @brief How close a prompt assembled from spliced blocks comes to prefilling it in order
+ */
+struct SpliceQuality
+{
+   // The most likely next token is the same either way
+   bool top1Match = false;
+   // KL divergence of the spliced next-token distribution from the reference one
+   double klDivergence = 0.0;
+   // Largest absolute difference between the two sets of logits
+   double maxLogitDelta = 0.0;
+   // Time to prefill the whole prompt in order
+   double fullPrefillMs = 0.0;
+   // Time to splice the stored blocks and prefill the rest of the prompt
+   double splicedPrefillMs = 0.0;
+   int32_t splicedTokens = 0;
+};
+
+class InferenceEngine
+{
+public:
+   // Sequences past the slots the engine keeps for itself: one to stage block splices in and one
+   // for splice quality checks
+   static constexpr uint32_t SCRATCH_SEQUENCES = 2;
+
+   // Prompt tokens decoded per step while interactive sequences are generating, so a long prefill
+   // never holds up their next token for more than one micro-batch
+   static constexpr uint32_t DEFAULT_PREFILL_MICRO_BATCH = 256;
+
+   // Next-token entropy above which a sampled token counts as a guess
+   static constexpr double ENTROPY_SPIKE_NATS = 2.5;
+
+   /**
+    * @brief Constructs the engine over an already initialized context
+    *
+    * When the context has SCRATCH_SEQUENCES sequences past the first nSlots, block spans of
+    * requests are served from a block store of up to blockStoreBytes. Any sequences left after
+    * that are handed to the prefix cache, which keeps up to prefixCacheCells tokens of earlier
+    * prompts resident for later requests to share.
+    *
+    * @param context The llama context to decode with, created with n_seq_max >= nSlots
+    * @param vocab The vocab of the model the context was created from
+    * @param nSlots Number of KV sequences that may be active at once
+    * @param prefixCacheCells KV cells reserved for the shared prefix cache, 0 to disable it
+    * @param blockStoreBytes Host memory for stored KV blocks, 0 to disable splicing
+    */
+   InferenceEngine(llama_context* context, const llama_vocab* vocab, uint32_t nSlots,
+                   uint32_t prefixCacheCells = 0, size_t blockStoreBytes = 0);
+
+   /**
+    * @brief Stops the worker and fails any request that has not completed
+    */
+   ~InferenceEngine();
+
+   /**
+    * @brief Launches the worker thread
+    */
+   void start();
+
+   /**
+    * @brief Stops the worker thread, completing outstanding requests with GenerationStopReason::Cancelled
+    */
+   void stop();
+
+   /**
+    * @brief Queues a request for the worker
+    *
+    * @param request The request to queue, moved into the engine
+    * @return uint64_t Identifier of the queued request
+    */
+   uint64_t submit(GenerationRequest request);
+
+   /**
+    * @brief Drops the KV sequence bound to a session, if any
+    *
+    * @param sessionId The session whose cached tokens should be discarded
+    */
+   void releaseSession(int32_t sessionId);
+
+   /**
+    * @brief Frees the KV cells of the sequence bound to a session right away
+    *
+    * Unlike releaseSession the cells are removed on the worker thread before this returns, e.g. for
+    * branches of an n-best request that were not kept.
+    *
+    * @param sessionId The session to discard, it must not have a request in flight
+    */
+   void discardSession(int32_t sessionId);
+
+   /**
+    * @brief Rebinds the sequence of one session to another, discarding the other's own sequence
+    *
+    * @param fromSessionId Session whose sequence is kept, e.g. the branch picked from an n-best request
+    * @param toSessionId Session that continues from that sequence
+    * @return true The sequence now belongs to toSessionId
+    * @return false fromSessionId has no idle sequence
+    */
+   bool moveSession(int32_t fromSessionId, int32_t toSessionId);
+
+   /**
+    * @brief Writes the KV sequence and tokens resident for a session to a file
+    *
+    * Runs on the worker thread between decode steps and blocks until it has been written.
+    *
+    * @param sessionId The session to save, it must not have a request in flight
+    * @param path Destination file
+    * @return true The session state was written
+    * @return false The session has no resident sequence or the write failed
+    */
+   bool saveSession(int32_t sessionId, const std::string& path);
+
+   /**
+    * @brief Loads a file written by saveSession into a sequence bound to the session
+    *
+    * @param sessionId The session to restore
+    * @param path File written by saveSession
+    * @return true The KV cache now holds the saved tokens for the session
+    * @return false No sequence was free or the file could not be loaded
+    */
+   bool restoreSession(int32_t sessionId, const std::string& path);
+
+   /**
+    * @brief Copies the KV sequence and tokens resident for a session into memory
+    *
+    * Like saveSession, but leaves the file format to the caller, see SessionSnapshot.
+    *
+    * @param sessionId The session to export, it must not have a request in flight
+    * @param state Receives llama_state_seq_get_data of the sequence
+    * @param tokens Receives the tokens the sequence holds
+    * @return true The session was resident and has been copied
+    * @return false The session has no resident sequence
+    */
+   bool exportSession(int32_t sessionId, std::vector<uint8_t>& state, std::vector<llama_token>& tokens);
+
+   /**
+    * @brief Loads state produced by exportSession into a sequence bound to the session
+    *
+    * @param sessionId The session to restore
+    * @param state Sequence state, read in place so it may point into a file mapping
+    * @param tokens Tokens the state holds
+    * @return true The KV cache now holds the tokens for the session
+    * @return false No sequence was free or the state does not fit this context
+    */
+   bool importSession(int32_t sessionId, std::span<const uint8_t> state, std::span<const llama_token> tokens);
+
+   /**
+    * @brief Sets the weight and rate limit of one client, overriding the defaults
+    */
+   void setClientLimits(uint32_t clientId, const ClientLimits& limits);
+
+   /**
+    * @brief Sets the weight and rate limit of every client without limits of its own
+    */
+   void setDefaultClientLimits(const ClientLimits& limits);
+
+   /**
+    * @brief Sets how many prompt tokens are decoded per step while interactive sequences generate
+    */
+   void setPrefillMicroBatch(uint32_t tokens);
+
+   /**
+    * @brief Returns the number of sequences requests run on, a request runs at most this many branches
+    */
+   inline uint32_t getSlotCount() const
+   {
+      return static_cast<uint32_t>(m_slots.size());
+   }
+
+   /**
+    * @brief Returns the number of tokens each sequence may occupy
+    */
+   inline uint32_t getSequenceContext() const
+   {
+      return m_seqContext;
+   }
+
+   /**
+    * @brief Returns the number of requests waiting for a free sequence
+    */
+   size_t getQueueDepth();
+
+   /**
+    * @brief Returns how long requests of a priority class waited for a sequence
+    */
+   QueueWaitStats getQueueWaitStats(RequestPriority priority);
+
+   /**
+    * @brief Returns the prefill and decode rates measured so far
+    */
+   ThroughputEstimate getThroughput() const;
+
+   /**
+    * @brief Estimates how long a request takes from the measured prefill and decode rates
+    *
+    * @param prefillTokens Prompt tokens that are not resident in the KV cache yet
+    * @param decodeTokens Tokens the reply is expected to run to
+    * @return double Estimated milliseconds, 0 while nothing has been measured
+    */
+   double estimateLatencyMs(size_t prefillTokens, size_t decodeTokens) const;
+
+   /**
+    * @brief Returns the prefix cache counters, all zero when the cache is disabled
+    */
+   PrefixCacheStats getPrefixCacheStats() const;
+
+   /**
+    * @brief Returns the block store counters, all zero when splicing is disabled
+    */
+   BlockStoreStats getBlockStoreStats() const;
+
+   /**
+    * @brief Prefills self-contained spans into the block store ahead of the request that splices them
+    *
+    * Queued for the worker thread, which computes each span between decode steps on its scratch
+    * sequence; this returns right away. E.g. a tool result that is ready while the reply that asked
+    * for it is still generating. Spans already stored are skipped; nothing happens when splicing is
+    * disabled or the worker is not running.
+    *
+    * @param spans Tokens of each span, as they will appear in the prompt
+    */
+   void prefetchBlocks(std::vector<std::vector<llama_token>> spans);
+
+   /**
+    * @brief Compares a prompt assembled from spliced blocks against prefilling it in order
+    *
+    * Runs on the worker thread between decode steps using a sequence of its own.
+    *
+    * @param prompt Prompt tokens
+    * @param spans Self-contained spans of the prompt as (offset, length), sorted and disjoint
+    * @return std::expected<SpliceQuality, ModelErrorType> Logit agreement and timing of both paths
+    */
+   std::expected<SpliceQuality, ModelErrorType> checkSplice(const std::vector<llama_token>& prompt,
+                                                            const std::vector<std::pair<size_t, size_t>>& spans);
+
+   /**
+    * @brief Measures how surprising each token of a text is to the model
+    *
+    * Runs on the worker thread between decode steps using the splice check's sequence. Texts longer
+    * than a sequence are scored in consecutive windows, each starting without context.
+    *
+    * @param tokens Tokens of the text, starting with BOS if the model expects one
+    * @return std::expected<std::vector<float>, ModelErrorType> Self-information -log p of every token
+    *         given the ones before it, in nats; the first token of each window gets its window's mean
+    */
+   std::expected<std::vector<float>, ModelErrorType> scoreTokens(const std::vector<llama_token>& tokens);
+
+private:
+   enum class SlotState
+   {
+      Idle,
+      Prefill,
+      Decode,
+      // Reserved for a fork, waits for its parent's prompt to be prefilled
+      Forked
+   };
+
+   // One KV sequence of the context and the request currently bound to it
+   struct Slot
+   {
+      llama_seq_id seqId = 0;
+      SlotState state = SlotState::Idle;
+      int32_t sessionId = -1;
+      // Class of the bound request, set as soon as the slot is reserved for it
+      RequestPriority priority = RequestPriority::Interactive;
+      // Tokens that are resident in the KV cache for this sequence, in position order
+      std::vector<llama_token> cachedTokens;
+      GenerationRequest request;
+      GenerationResult result;
+      llama_sampler* sampler = nullptr;
+      size_t prefillPos = 0;
+      // Slots reserved for the bound request's forks until its prompt has been prefilled
+      std::vector<Slot*> forks;
+      // Prompt ranges [begin, end) already spliced in, skipped by prefill
+      std::deque<std::pair<size_t, size_t>> splices;
+      // Leading prompt tokens whose KV was computed in order. From the first spliced block on the
+      // cells only approximate a prefill, so they are not offered to the prefix cache.
+      size_t exactTokens = SIZE_MAX;
+      llama_token nextToken = 0;
+      int32_t batchIndex = -1;
+      // Tokens this slot contributed to the current batch, charged to its client after the decode
+      uint32_t stepTokens = 0;
+      // Prefill cursor and the splices passed over in the current step, restored if its decode fails
+      size_t stepFrom = 0;
+      std::vector<std::pair<size_t, size_t>> stepSplices;
+      std::chrono::steady_clock::time_point enqueuedAt;
+      std::chrono::steady_clock::time_point startedAt;
+      std::chrono::steady_clock::time_point decodeStartedAt;
+      std::chrono::steady_clock::time_point lastUsed;
+   };
+
+   struct PendingRequest
+   {
+      uint64_t id;
+      GenerationRequest request;
+      std::chrono::steady_clock::time_point enqueuedAt;
+   };
+
+   // Fair queuing and rate limiting state of one client
+   struct ClientState
+   {
+      ClientLimits limits;
+      // Limits were set for this client specifically
+      bool custom = false;
+      // Service received so far, in tokens divided by weight
+      double virtualTime = 0.0;
+      // Token bucket for the rate limit
+      double bucket = 0.0;
+      std::chrono::steady_clock::time_point refilledAt;
+      // Requests queued or running
+      uint32_t outstanding = 0;
+   };
+
+   // Worker thread body
+   void run();
+
+   // Returns the state of a client, creating it with the default limits; must be called with m_mutex held
+   ClientState& clientState(uint32_t clientId);
+
+   // Orders the active slots for the next step and works out how many tokens each client may spend
+   std::vector<Slot*> scheduleStep(std::unordered_map<uint32_t, double>& allowance);
+
+   // Adds decode and prefill tokens of the scheduled slots to the batch
+   void buildBatch(const std::vector<Slot*>& order, std::unordered_map<uint32_t, double>& allowance);
+
+   // Charges every client for the tokens its slots contributed to the last batch
+   void chargeClients();
+
+   // Takes a slot's tokens of a batch that failed to decode back out of its sequence
+   void rollbackStep(Slot& slot);
+
+   // Frees KV cells after a decode found none left for the batch; only a step that cannot shrink any
+   // further ends a request
+   void makeRoom(const std::vector<Slot*>& stepped, size_t prefillTokens);
+
+   // Folds a completed request's prefill and decode rates into the running estimates; the prefill
+   // rate only counts when the whole prompt was processed
+   void recordThroughput(const GenerationResult& result, bool prefillComplete);
+
+   // Runs a task on the worker thread between decode steps and waits for it to finish
+   void runOnWorker(std::function<void()> task);
+
+   // Binds queued requests to idle slots; must be called with m_mutex held
+   void assignPending();
+
+   // Picks the slot a request should run on, or nullptr if none is available yet
+   Slot* pickSlot(const GenerationRequest& request);
+
+   // Prepares a slot for a freshly assigned request, reusing its cached prefix
+   void beginRequest(Slot& slot, PendingRequest&& pending);
+
+   // Samples the next token for a slot that received logits in the last batch
+   void sampleSlot(Slot& slot);
+
+   // Copies a slot's freshly prefilled prompt into the sequences of its forks and samples their first token
+   void startForks(Slot& slot);
+
+   // Adds a sampled token's log-probability and its distribution's entropy to the slot's confidence
+   void scoreToken(Slot& slot, llama_token token, int32_t batchIndex);
+
+   // Completes the request bound to a slot and returns it to the idle pool
+   void finishSlot(Slot& slot, GenerationStopReason reason);
+
+   // Builds a sampler chain for a request
+   static llama_sampler* createSampler(const SamplingParams& params);
+
+   // Decodes tokens[from, to) of a sequence at their own positions, skipping the given spans.
+   // Logits are only produced for the final token; returns its batch index or -1 on failure.
+   int32_t prefillSequence(llama_seq_id seqId, const std::vector<llama_token>& tokens, size_t from, size_t to,
+                           const std::vector<std::pair<size_t, size_t>>& skip);
+
+   // Returns the stored block for a span, prefilling and storing it first if needed
+   const KvBlockStore::Block* ensureBlock(const llama_token* tokens, size_t count);
+
+   // Copies a block into a sequence with its positions shifted to start at offset
+   bool spliceBlock(const KvBlockStore::Block& block, llama_seq_id seqId, llama_pos offset);
+
+   llama_context* m_context;
+   const llama_vocab* m_vocab;
+   uint32_t m_seqContext;
+   uint32_t m_batchSize;
+   llama_batch m_batch;
+   std::vector<Slot> m_slots;
+   // Prompt prefixes shared between sequences, nullptr when disabled
+   std::unique_ptr<PrefixCache> m_prefixCache;
+   // KV blocks of self-contained spans, nullptr when splicing is disabled
+   std::unique_ptr<KvBlockStore> m_blockStore;
+   // Where blocks are restored and shifted before being copied into their destination
+   llama_seq_id m_scratchSeq;
+   // Where splice quality checks assemble their prompts
+   llama_seq_id m_probeSeq;
+
+   std::deque<PendingRequest> m_pending;
+   // Requests bound to a slot by assignPending that the worker has not started yet
+   std::vector<std::pair<Slot*, PendingRequest>> m_assigned;
+   // Maintenance work that needs the context, executed by the worker between steps
+   std::deque<std::function<void()>> m_tasks;
+   std::unordered_map<uint32_t, ClientState> m_clients;
+   ClientLimits m_defaultLimits;
+   // Lowest virtual time among clients with work, clients returning from idle start here
+   double m_virtualClock;
+   std::atomic<uint32_t> m_prefillMicroBatch;
+   // Prompt tokens a step may take while the KV cache is short of cells; worker thread only
+   size_t m_prefillCap;
+   std::array<QueueWaitStats, 2> m_queueWait;
+   // Exponential moving averages of the per-request rates, in tokens per millisecond
+   std::atomic<double> m_prefillRate;
+   std::atomic<double> m_decodeRate;
+   std::atomic<uint64_t> m_rateSamples;
+   std::mutex m_mutex;
+   std::condition_variable m_cv;
+   std::thread m_worker;
+   std::atomic<bool> m_running;
+   uint64_t m_nextRequestId;
+};
+
+#endif
@@ -0,0 +1,130 @@
+/**
+ * @file KvBlockStore.cpp
+ * @brief Host-memory store of KV blocks for self-contained token spans (attached file chunks).
+ *        Each block is the serialized sequence state of its tokens prefilled at positions
+ *        [0, n); the inference engine splices it into a request's sequence at any offset by
+ *        restoring it and shifting its positions, so a chunk is only ever prefilled once.
+ */
+
+#include "KvBlockStore.h"
+#include <algorithm>
+
+/**
+ * @brief Creates an empty store
+ *
+ * @param capacityBytes Serialized state kept before least recently used blocks are dropped
+ */
+KvBlockStore::KvBlockStore(size_t capacityBytes) :
+ m_capacity(capacityBytes),
+ m_blocks(0),
+ m_bytes(0),
+ m_hits(0),
+ m_misses(0),
+ m_splicedTokens(0),
+ m_spliceUs(0),
+ m_blockPrefillUs(0)
+{
+}
+
+/**
+ * @brief Looks up the block for a span of tokens, counting a hit or a miss
+ *
+ * @return const Block* The block, or nullptr if the span has not been stored
+ */
+const KvBlockStore::Block* KvBlockStore::find(const llama_token* tokens, size_t count)
+{
+   auto iter = m_index.find(hashTokens(tokens, count));
+   if(iter == m_index.end() || !std::equal(tokens, tokens + count, iter->second->second.tokens.begin(),
+                                           iter->second->second.tokens.end()))
+   {
+      m_misses++;
+      return nullptr;
+   }
+   m_lru.splice(m_lru.begin(), m_lru, iter->second);
+   m_hits++;
+   return &iter->second->second;
+}
+
+/**
+ * @brief Stores the serialized state computed for a span of tokens
+ *
+ * @return const Block* The stored block, nullptr if it is larger than the whole store
+ */
+const KvBlockStore::Block* KvBlockStore::put(const llama_token* tokens, size_t count, std::vector<uint8_t> state)
+{
+   if(state.size() > m_capacity)
+   {
+      return nullptr;
+   }
+
+   const uint64_t key = hashTokens(tokens, count);
+   auto existing = m_index.find(key);
+   if(existing != m_index.end())
+   {
+      // Same hash - either the same span or a collision, the newer block wins
+      m_bytes -= existing->second->second.state.size();
+      m_blocks--;
+      m_lru.erase(existing->second);
+      m_index.erase(existing);
+   }
+
+   while(!m_lru.empty() && m_bytes + state.size() > m_capacity)
+   {
+      m_bytes -= m_lru.back().second.state.size();
+      m_blocks--;
+      m_index.erase(m_lru.back().first);
+      m_lru.pop_back();
+   }
+
+   m_bytes += state.size();
+   m_blocks++;
+   m_lru.emplace_front(key, Block{std::vector<llama_token>(tokens, tokens + count), std::move(state)});
+   m_index[key] = m_lru.begin();
+   return &m_lru.front().second;
+}
+
+/**
+ * @brief Accounts for a block spliced into a sequence
+ */
+void KvBlockStore::recordSplice(size_t tokens, double ms)
+{
+   m_splicedTokens += tokens;
+   m_spliceUs += static_cast<uint64_t>(ms * 1000.0);
+}
+
+/**
+ * @brief Accounts for the prefill of a block that was not stored yet
+ */
+void KvBlockStore::recordPrefill(double ms)
+{
+   m_blockPrefillUs += static_cast<uint64_t>(ms * 1000.0);
+}
+
+/**
+ * @brief Returns a snapshot of the counters, safe to call from any thread
+ */
+BlockStoreStats KvBlockStore::getStats() const
+{
+   BlockStoreStats stats;
+   stats.blocks = m_blocks;
+   stats.bytes = m_bytes;
+   stats.hits = m_hits;
+   stats.misses = m_misses;
+   stats.splicedTokens = m_splicedTokens;
+   stats.spliceMs = m_spliceUs / 1000.0;
+   stats.blockPrefillMs = m_blockPrefillUs / 1000.0;
+   return stats;
+}
+
+// FNV-1a over the token ids
+uint64_t KvBlockStore::hashTokens(const llama_token* tokens, size_t count)
+{
+   uint64_t hash = 1469598103934665603ULL;
+   const uint8_t* bytes = reinterpret_cast<const uint8_t*>(tokens);
+   for(size_t i = 0; i < count * sizeof(llama_token); ++i)
+   {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+   }
+   return hash;
+}
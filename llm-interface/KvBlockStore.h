@@ -0,0 +1,102 @@
+/**
+ * @file KvBlockStore.h
+ * @brief Host-memory store of KV blocks for self-contained token spans (attached file chunks).
+ *        Each block is the serialized sequence state of its tokens prefilled at positions
+ *        [0, n); the inference engine splices it into a request's sequence at any offset by
+ *        restoring it and shifting its positions, so a chunk is only ever prefilled once.
+ */
+#ifndef KV_BLOCK_STORE_H
+#define KV_BLOCK_STORE_H
+
+#include "llama.h"
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief Counters describing the block store
+ */
+struct BlockStoreStats
+{
+   uint64_t blocks = 0;
+   uint64_t bytes = 0;
+   uint64_t hits = 0;
+   uint64_t misses = 0;
+   // Prompt tokens served by splicing instead of prefill
+   uint64_t splicedTokens = 0;
+   // Time spent restoring and shifting blocks
+   double spliceMs = 0.0;
+   // Time spent prefilling blocks the first time they were needed
+   double blockPrefillMs = 0.0;
+};
+
+class KvBlockStore
+{
+public:
+   /**
+    * @brief A stored block and the tokens it was computed from
+    */
+   struct Block
+   {
+      std::vector<llama_token> tokens;
+      std::vector<uint8_t> state;
+   };
+
+   /**
+    * @brief Creates an empty store
+    *
+    * @param capacityBytes Serialized state kept before least recently used blocks are dropped
+    */
+   explicit KvBlockStore(size_t capacityBytes);
+
+   /**
+    * @brief Looks up the block for a span of tokens, counting a hit or a miss
+    *
+    * @return const Block* The block, or nullptr if the span has not been stored
+    */
+   const Block* find(const llama_token* tokens, size_t count);
+
+   /**
+    * @brief Stores the serialized state computed for a span of tokens
+    *
+    * @return const Block* The stored block, nullptr if it is larger than the whole store
+    */
+   const Block* put(const llama_token* tokens, size_t count, std::vector<uint8_t> state);
+
+   /**
+    * @brief Accounts for a block spliced into a sequence
+    */
+   void recordSplice(size_t tokens, double ms);
+
+   /**
+    * @brief Accounts for the prefill of a block that was not stored yet
+    */
+   void recordPrefill(double ms);
+
+   /**
+    * @brief Returns a snapshot of the counters, safe to call from any thread
+    */
+   BlockStoreStats getStats() const;
+
+private:
+   // FNV-1a over the token ids
+   static uint64_t hashTokens(const llama_token* tokens, size_t count);
+
+   // Most recently used at the front
+   std::list<std::pair<uint64_t, Block>> m_lru;
+   std::unordered_map<uint64_t, std::list<std::pair<uint64_t, Block>>::iterator> m_index;
+   size_t m_capacity;
+
+   std::atomic<uint64_t> m_blocks;
+   std::atomic<uint64_t> m_bytes;
+   std::atomic<uint64_t> m_hits;
+   std::atomic<uint64_t> m_misses;
+   std::atomic<uint64_t> m_splicedTokens;
+   std::atomic<uint64_t> m_spliceUs;
+   std::atomic<uint64_t> m_blockPrefillUs;
+};
+
+#endif
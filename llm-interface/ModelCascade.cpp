@@ -0,0 +1,302 @@
+/**
+ * @file ModelCascade.cpp
+ * @brief Small-to-large routing between two resident models. The small model's reply is scored with
+ *        the engine's per-token confidence signals and only escalated when it looks unsure, so the
+ *        large model is spent on the requests that need it.
+ */
+
+#include "ModelCascade.h"
+#include <iostream>
+#include <chrono>
+
+// State one request carries from the small model to the large one
+struct ModelCascade::Pending
+{
+   std::shared_ptr<Shared> shared;
+   ModelInterface* small = nullptr;
+   ModelInterface* large = nullptr;
+   CascadePolicy policy;
+   // Consumer's limits and callbacks, without prompt tokens
+   GenerationRequest request;
+   std::function<void(const GenerationResult&, ModelInterface*)> onComplete;
+   // The small model's prompt tokens, kept when the large model can decode them as is
+   bool reusePrompt = false;
+   std::vector<llama_token> promptTokens;
+   // Otherwise the prompt formatted with the large model's template, tokenized on escalation
+   std::string largePrompt;
+   std::chrono::steady_clock::time_point started;
+};
+
+namespace
+{
+   double elapsedMs(std::chrono::steady_clock::time_point since)
+   {
+      return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+   }
+}
+
+/**
+ * @brief Routes between two loaded, in-process models
+ *
+ * @param small Model that answers first
+ * @param large Model unsure replies are escalated to
+ * @param policy Escalation thresholds
+ */
+ModelCascade::ModelCascade(ModelInterface* small, ModelInterface* large, const CascadePolicy& policy /* {} */) :
+ m_small(small),
+ m_large(large),
+ m_sharedVocab(small->sharesVocab(*large)),
+ m_shared(std::make_shared<Shared>())
+{
+   m_shared->policy = policy;
+
+   #ifdef _DEBUG
+      std::cout << "Cascade " << small->getModelName() << " -> " << large->getModelName()
+                << (m_sharedVocab ? " (shared vocabulary)" : " (separate vocabularies)") << std::endl;
+   #endif
+}
+
+/**
+ * @brief Replaces the escalation thresholds, applies to requests submitted afterwards
+ */
+void ModelCascade::setPolicy(const CascadePolicy& policy)
+{
+   std::lock_guard<std::mutex> lock(m_shared->mutex);
+   m_shared->policy = policy;
+}
+
+/**
+ * @brief Returns the escalation thresholds in use
+ */
+CascadePolicy ModelCascade::getPolicy() const
+{
+   std::lock_guard<std::mutex> lock(m_shared->mutex);
+   return m_shared->policy;
+}
+
+/**
+ * @brief Returns a snapshot of the routing counters
+ */
+CascadeStats ModelCascade::getStats() const
+{
+   std::lock_guard<std::mutex> lock(m_shared->mutex);
+   return m_shared->stats;
+}
+
+/**
+ * @brief Answers a stateless conversation through the cascade
+ *
+ * @param messages Conversation as (role, content) pairs, the reply continues it
+ * @param request Sampling, limits, accounting and consumer callbacks; promptTokens is filled in
+ * @param onComplete Called exactly once with the final result and the model that produced it
+ * @return true The request was queued
+ * @return false Either model is unavailable or the prompt could not be prepared
+ */
+bool ModelCascade::submit(const std::vector<std::pair<std::string, std::string>>& messages, GenerationRequest request,
+                          std::function<void(const GenerationResult&, ModelInterface*)> onComplete)
+{
+   InferenceEngine* engine = m_small->getEngine();
+   if(engine == nullptr || m_large->getEngine() == nullptr)
+   {
+      return false;
+   }
+
+   std::vector<llama_chat_message> chat;
+   chat.reserve(messages.size());
+   for(const auto& [role, content] : messages)
+   {
+      chat.push_back({role.c_str(), content.c_str()});
+   }
+   auto smallPrompt = m_small->applyChatTemplate(chat);
+   auto largePrompt = m_large->applyChatTemplate(chat);
+   if(!smallPrompt.has_value() || !largePrompt.has_value())
+   {
+      return false;
+   }
+   auto tokens = m_small->tokenize(smallPrompt.value(), true);
+   if(!tokens.has_value())
+   {
+      return false;
+   }
+
+   auto pending = std::make_shared<Pending>();
+   pending->shared = m_shared;
+   pending->small = m_small;
+   pending->large = m_large;
+   pending->policy = getPolicy();
+   pending->onComplete = std::move(onComplete);
+   pending->started = std::chrono::steady_clock::now();
+   // Same tokens and same template output - the large model can start from the small one's prompt
+   pending->reusePrompt = m_sharedVocab && smallPrompt.value() == largePrompt.value();
+   if(pending->reusePrompt)
+   {
+      pending->promptTokens = tokens.value();
+   }
+   else
+   {
+      pending->largePrompt = std::move(largePrompt.value());
+   }
+
+   GenerationRequest draft;
+   draft.promptTokens = std::move(tokens.value());
+   draft.clientId = request.clientId;
+   draft.priority = request.priority;
+   draft.maxTokens = request.maxTokens;
+   draft.deadline = request.deadline;
+   draft.sampling = request.sampling;
+   draft.trackConfidence = true;
+   // Pieces are held back in the result until the reply is judged
+   draft.onComplete = [pending](const GenerationResult& result)
+   {
+      onSmallComplete(pending, result);
+   };
+
+   // Every request through the cascade is stateless, and block spans index the caller's tokens
+   request.promptTokens.clear();
+   request.blockSpans.clear();
+   request.sessionId = -1;
+   pending->request = std::move(request);
+
+   {
+      std::lock_guard<std::mutex> lock(m_shared->mutex);
+      m_shared->stats.requests++;
+   }
+   engine->submit(std::move(draft));
+   return true;
+}
+
+// Judges a small model reply against the policy
+ModelCascade::Escalation ModelCascade::judge(const GenerationResult& result, const CascadePolicy& policy)
+{
+   // A reply that ran out of room or failed is worth a second try; a cancelled one is not, and one
+   // that hit the deadline or the caller's token limit would do so on the large model as well
+   if(result.stopReason == GenerationStopReason::ContextFull || result.stopReason == GenerationStopReason::DecodeError)
+   {
+      return Escalation::StopReason;
+   }
+   if(result.stopReason == GenerationStopReason::Cancelled)
+   {
+      return Escalation::None;
+   }
+
+   const GenerationConfidence& confidence = result.confidence;
+   if(confidence.scoredTokens < policy.minScoredTokens)
+   {
+      return Escalation::None;
+   }
+   if(confidence.meanLogProb < policy.minMeanLogProb)
+   {
+      return Escalation::LogProb;
+   }
+   if(static_cast<double>(confidence.entropySpikes) / confidence.scoredTokens > policy.maxEntropySpikeRate)
+   {
+      return Escalation::Entropy;
+   }
+   return Escalation::None;
+}
+
+// Runs when the small model finishes; keeps its reply or hands the request to the large model
+void ModelCascade::onSmallComplete(const std::shared_ptr<Pending>& pending, const GenerationResult& result)
+{
+   const double smallMs = elapsedMs(pending->started);
+   Shared& shared = *pending->shared;
+   InferenceEngine* largeEngine = pending->large->getEngine();
+
+   Escalation escalation = judge(result, pending->policy);
+   bool keptForDeadline = false;
+   const GenerationBudget budget{pending->request.deadline, pending->request.maxTokens};
+   if(escalation != Escalation::None && budget.hasDeadline() && largeEngine != nullptr)
+   {
+      // An unsure reply beats none at all
+      const double largeEstimate = largeEngine->estimateLatencyMs(result.promptTokens, budget.replyTokens());
+      if(largeEstimate > budget.remainingMs())
+      {
+         escalation = Escalation::None;
+         keptForDeadline = true;
+      }
+   }
+
+   GenerationRequest escalated;
+   if(escalation != Escalation::None && largeEngine != nullptr)
+   {
+      if(pending->reusePrompt)
+      {
+         escalated.promptTokens = std::move(pending->promptTokens);
+      }
+      else
+      {
+         auto tokens = pending->large->tokenize(pending->largePrompt, true);
+         if(tokens.has_value())
+         {
+            escalated.promptTokens = std::move(tokens.value());
+         }
+      }
+   }
+
+   if(escalated.promptTokens.empty())
+   {
+      // Kept - the large model would have prefilled the same prompt and generated a similar reply
+      const double avoidedMs = largeEngine != nullptr
+                                  ? largeEngine->estimateLatencyMs(result.promptTokens, result.generatedTokens)
+                                  : 0.0;
+      {
+         std::lock_guard<std::mutex> lock(shared.mutex);
+         shared.stats.answeredSmall++;
+         shared.stats.keptForDeadline += keptForDeadline ? 1 : 0;
+         shared.stats.smallMs += smallMs;
+         // Nothing is claimed until the large model's rates have been measured
+         if(avoidedMs > 0.0)
+         {
+            shared.stats.savedMs += avoidedMs - smallMs;
+         }
+      }
+      if(pending->request.onToken && !result.text.empty())
+      {
+         pending->request.onToken(result.text);
+      }
+      if(pending->onComplete)
+      {
+         pending->onComplete(result, pending->small);
+      }
+      return;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(shared.mutex);
+      shared.stats.escalated++;
+      shared.stats.escalatedLogProb += escalation == Escalation::LogProb ? 1 : 0;
+      shared.stats.escalatedEntropy += escalation == Escalation::Entropy ? 1 : 0;
+      shared.stats.escalatedStopReason += escalation == Escalation::StopReason ? 1 : 0;
+      shared.stats.reusedPrompts += pending->reusePrompt ? 1 : 0;
+      shared.stats.smallMs += smallMs;
+      shared.stats.savedMs -= smallMs;
+   }
+
+   #ifdef _DEBUG
+      std::cout << "Cascade escalating (mean log-prob " << result.confidence.meanLogProb << ", "
+                << result.confidence.entropySpikes << "/" << result.confidence.scoredTokens << " entropy spikes)" << std::endl;
+   #endif
+
+   const GenerationRequest& request = pending->request;
+   escalated.clientId = request.clientId;
+   escalated.priority = request.priority;
+   escalated.maxTokens = request.maxTokens;
+   escalated.deadline = request.deadline;
+   escalated.sampling = request.sampling;
+   escalated.trackConfidence = request.trackConfidence;
+   escalated.onToken = request.onToken;
+   const auto escalatedAt = std::chrono::steady_clock::now();
+   escalated.onComplete = [pending, escalatedAt](const GenerationResult& largeResult)
+   {
+      {
+         std::lock_guard<std::mutex> lock(pending->shared->mutex);
+         pending->shared->stats.largeMs += elapsedMs(escalatedAt);
+      }
+      if(pending->onComplete)
+      {
+         pending->onComplete(largeResult, pending->large);
+      }
+   };
+   // Runs on the small model's worker thread; submit only queues
+   largeEngine->submit(std::move(escalated));
+}
@@ -0,0 +1,151 @@
+/**
+ * @file ModelCascade.h
+ * @brief Small-to-large routing between two resident models. Every request is answered by the small
+ *        model first; when its reply looks unsure (low mean token log-probability, too many
+ *        high-entropy tokens, or a reply that did not end on its own) the request is escalated to
+ *        the large model, reusing the small model's prompt tokens when both share a vocabulary.
+ */
+#ifndef MODEL_CASCADE_H
+#define MODEL_CASCADE_H
+
+#include "ModelInterface.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+/**
+ * @brief Thresholds deciding when the small model's reply is good enough to keep
+ */
+struct CascadePolicy
+{
+   // Escalate when the mean log-probability of the small model's tokens is below this
+   double minMeanLogProb = -1.0;
+   // Escalate when more than this fraction of its tokens were sampled from a high-entropy distribution
+   double maxEntropySpikeRate = 0.15;
+   // Replies shorter than this are always kept, there is too little signal to second-guess them
+   int32_t minScoredTokens = 4;
+};
+
+/**
+ * @brief Routing counters, meant for tuning the policy per workload
+ */
+struct CascadeStats
+{
+   // Requests routed through the cascade
+   uint64_t requests = 0;
+   // Requests the small model's reply was kept for
+   uint64_t answeredSmall = 0;
+   // Requests handed to the large model, by the first reason that applied
+   uint64_t escalated = 0;
+   uint64_t escalatedLogProb = 0;
+   uint64_t escalatedEntropy = 0;
+   uint64_t escalatedStopReason = 0;
+   // Escalations that decoded the small model's prompt tokens as is
+   uint64_t reusedPrompts = 0;
+   // Unsure replies kept anyway because the large model could not have met the deadline
+   uint64_t keptForDeadline = 0;
+   // Wall time spent in each model
+   double smallMs = 0.0;
+   double largeMs = 0.0;
+   // Large model time avoided by kept replies, minus small model time wasted on escalations.
+   // Avoided time is the large model's throughput-based estimate for the same prompt and reply.
+   double savedMs = 0.0;
+};
+
+class ModelCascade
+{
+public:
+   /**
+    * @brief Routes between two loaded, in-process models
+    *
+    * @param small Model that answers first
+    * @param large Model unsure replies are escalated to
+    * @param policy Escalation thresholds
+    */
+   ModelCascade(ModelInterface* small, ModelInterface* large, const CascadePolicy& policy = {});
+
+   /**
+    * @brief Replaces the escalation thresholds, applies to requests submitted afterwards
+    */
+   void setPolicy(const CascadePolicy& policy);
+
+   /**
+    * @brief Returns the escalation thresholds in use
+    */
+   CascadePolicy getPolicy() const;
+
+   /**
+    * @brief Answers a stateless conversation through the cascade
+    *
+    * The small model's pieces are held back until its reply is accepted, so a consumer only ever
+    * sees one model's reply. Callbacks run on whichever model's worker thread finished the request.
+    *
+    * @param messages Conversation as (role, content) pairs, the reply continues it
+    * @param request Sampling, limits, accounting and consumer callbacks; promptTokens is filled in
+    * @param onComplete Called exactly once with the final result and the model that produced it
+    * @return true The request was queued
+    * @return false Either model is unavailable or the prompt could not be prepared
+    */
+   bool submit(const std::vector<std::pair<std::string, std::string>>& messages, GenerationRequest request,
+               std::function<void(const GenerationResult&, ModelInterface*)> onComplete);
+
+   /**
+    * @brief Returns a snapshot of the routing counters
+    */
+   CascadeStats getStats() const;
+
+   /**
+    * @brief Returns the model that answers first
+    */
+   inline ModelInterface* getSmallModel() const
+   {
+      return m_small;
+   }
+
+   /**
+    * @brief Returns the model unsure replies are escalated to
+    */
+   inline ModelInterface* getLargeModel() const
+   {
+      return m_large;
+   }
+
+private:
+   // Why a reply was escalated, None when it is kept
+   enum class Escalation
+   {
+      None,
+      LogProb,
+      Entropy,
+      StopReason
+   };
+
+   // State one request carries from the small model to the large one
+   struct Pending;
+
+   // Counters shared with callbacks that may outlive a submit() call
+   struct Shared
+   {
+      mutable std::mutex mutex;
+      CascadePolicy policy;
+      CascadeStats stats;
+   };
+
+   // Judges a small model reply against the policy
+   static Escalation judge(const GenerationResult& result, const CascadePolicy& policy);
+
+   // Runs when the small model finishes; keeps its reply or hands the request to the large model
+   static void onSmallComplete(const std::shared_ptr<Pending>& pending, const GenerationResult& result);
+
+   ModelInterface* m_small;
+   ModelInterface* m_large;
+   // Both models tokenize identically, checked once at construction
+   bool m_sharedVocab;
+   std::shared_ptr<Shared> m_shared;
+};
+
+#endif
@@ -15,7 +15,15 @@ enum class ModelErrorType
    MODEL_DIRECTORY_NOT_SET,
    MODEL_DIRECTORY_DOES_NOT_EXIST,
    MODEL_PATH_ERROR, 
-   MODEL_NOT_FOUND
+   MODEL_NOT_FOUND,
+   MODEL_NOT_LOADED,
+   TOKENIZE_ERROR,
+   TEMPLATE_ERROR,
+   MODEL_IN_USE,
+   DECODE_ERROR,
+   KV_SHIFT_UNSUPPORTED,
+   RPC_UNREACHABLE,
+   SNAPSHOT_INVALID
 };
 
 enum class PromptRoleType
@@ -24,5 +32,15 @@ enum class PromptRoleType
    SystemRole
 };
 
+enum class GenerationStopReason
+{
+   EndOfGeneration,
+   MaxTokens,
+   ContextFull,
+   Cancelled,
+   DecodeError,
+   Deadline
+};
+
 
 #endif
\ No newline at end of file
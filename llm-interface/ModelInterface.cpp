@@ -5,20 +5,51 @@
  */
 
 #include "ModelInterface.h"
+#include "PromptCompressor.h"
+#include "ModelWorker.h"
+#include "SessionSnapshot.h"
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <future>
+#include <filesystem>
+#include <limits>
 #include <unistd.h>
 
+// Context size available to each KV sequence
 const uint32_t DEFAULT_CTX = 2048;
 
+// Extra KV sequences the prefix cache may spread shared prompts across
+const uint32_t PREFIX_CACHE_SEQUENCES = 16;
+
+// Host memory for KV blocks of attached file chunks
+const size_t BLOCK_STORE_BYTES = 256 * 1024 * 1024;
+
+// Stands in for a chunk while the chat template is applied, must never occur in real text
+const std::string CHUNK_MARKER = "\x1f\x1esmart-agent-chunk\x1e\x1f";
+
+// Most replies sendPromptVariants samples at once
+const uint32_t MAX_VARIANTS = 16;
+
+// Sessions the extra variants of a conversation are sampled on count down from here, below the -1
+// of stateless requests; conversations, server conversation ids and daemon clients are never negative
+const int32_t FIRST_VARIANT_SESSION = -2;
+
 // Given the name of an LLM - this method will attempt to launch that LLM and load it into memory
-ModelInterface::ModelInterface(std::string model_path) :
+ModelInterface::ModelInterface(std::string model_path, uint32_t num_slots /* 4 */, uint32_t prefix_cache_cells /* 0 */) :
  m_modelPath(model_path),
  m_model(0),
  m_vocab(0),
  m_context(0),
+ m_activeConversation(INTERACTIVE_SESSION),
+ m_nextVariantSessions(FIRST_VARIANT_SESSION),
  m_prevLength(0),
+ m_numSlots(num_slots == 0 ? 1 : num_slots),
+ m_prefixCacheCells(prefix_cache_cells),
+ m_isolated(false),
+ m_rpcProfile(false),
  m_isLoaded(false)
 {
    // Initialize all of the llama-cpp content that is not dependent on the model
@@ -27,22 +58,24 @@ ModelInterface::ModelInterface(std::string model_path) :
    // Use dafault model params - fine tune later
    m_modelParams = llama_model_default_params();
 
-   // Initialize context parameters - get a grip on these...
+   // Initialize context parameters - every slot gets its own DEFAULT_CTX worth of KV cells, plus
+   // one more for the engine's scratch sequences
    m_contextParams = llama_context_default_params();
-   m_contextParams.n_ctx = DEFAULT_CTX;
+   m_contextParams.n_ctx = DEFAULT_CTX * (m_numSlots + 1) + m_prefixCacheCells;
    m_contextParams.n_batch = DEFAULT_CTX;
+   m_contextParams.n_seq_max = m_numSlots + InferenceEngine::SCRATCH_SEQUENCES +
+                               (m_prefixCacheCells > 0 ? PREFIX_CACHE_SEQUENCES : 0);
 
-   // Initialize the sampler - again, dig in more here....
-   m_sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
-   llama_sampler_chain_add(m_sampler, llama_sampler_init_min_p(0.05f, 1));
-   llama_sampler_chain_add(m_sampler, llama_sampler_init_temp(0.8f));
-   llama_sampler_chain_add(m_sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+   // Sampling defaults for the interactive conversation - each request gets its own chain
+   m_samplingParams.minP = 0.05f;
+   m_samplingParams.temperature = 0.8f;
+   m_samplingParams.seed = LLAMA_DEFAULT_SEED;
 }
 
 // Default destructor
 ModelInterface::~ModelInterface()
 {
-
+   unload();
 }
 
 // Returns the value of the m_isLoaded flag
@@ -51,6 +84,32 @@ const bool ModelInterface::isLoaded() const
    return m_isLoaded;
 }
 
+// Runs the model in a supervised smart-agent-worker process instead of this one
+void ModelInterface::setIsolated(bool isolated)
+{
+   if(!m_isLoaded)
+   {
+      m_isolated = isolated;
+   }
+}
+
+// Splits the model's layers over llama.cpp rpc-server endpoints in proportion to their free memory
+void ModelInterface::setRpcEndpoints(const std::vector<std::string>& endpoints, bool profile /* false */)
+{
+   m_rpcEndpoints = endpoints;
+   m_rpcProfile = profile;
+}
+
+// Returns what each RPC node holds and the time it has cost, empty when not distributed
+std::vector<RpcNodeStats> ModelInterface::getRpcStats() const
+{
+   #ifdef SMART_AGENT_RPC
+      return m_rpcCluster ? m_rpcCluster->getStats() : std::vector<RpcNodeStats>();
+   #else
+      return {};
+   #endif
+}
+
 // This method will load the model and finish setting up any llama-cpp attributes specific to the model
 bool ModelInterface::load()
 {
@@ -58,11 +117,46 @@ bool ModelInterface::load()
       std::cout << "Loading " << m_modelPath << " into memory..." << std::endl;
    #endif
 
+   if(m_isolated)
+   {
+      // The worker process loads the model, this process only relays prompts and pieces
+      m_worker = std::make_unique<ModelWorker>(m_modelPath, m_numSlots, m_prefixCacheCells);
+      if(!m_worker->start())
+      {
+         std::cerr << "Error : model worker failed to load " << m_modelPath << std::endl;
+         m_worker.reset();
+         return false;
+      }
+      m_isLoaded = true;
+      return true;
+   }
+
+   // Spread the layers over the RPC nodes, if any - the parameters point into the cluster
+   llama_model_params modelParams = m_modelParams;
+   llama_context_params contextParams = m_contextParams;
+   if(!m_rpcEndpoints.empty())
+   {
+      #ifdef SMART_AGENT_RPC
+         auto cluster = RpcCluster::connect(m_rpcEndpoints, m_rpcProfile);
+         if(!cluster.has_value())
+         {
+            return false;
+         }
+         m_rpcCluster = std::move(cluster.value());
+         m_rpcCluster->applyTo(modelParams);
+         m_rpcCluster->applyTo(contextParams);
+      #else
+         std::cerr << "Error : RPC endpoints were given but this build has no RPC backend (GGML_RPC is off)" << std::endl;
+         return false;
+      #endif
+   }
+
    // Load the model from the path using the model parameters
-   m_model = llama_model_load_from_file(m_modelPath.c_str(), m_modelParams);
+   m_model = llama_model_load_from_file(m_modelPath.c_str(), modelParams);
    if(!m_model)
    {
       std::cerr << "Error : failed to load model @ " << m_modelPath << std::endl;
+      m_rpcCluster.reset();
       return false; // Make use of std::expected.....
    }
 
@@ -70,13 +164,17 @@ bool ModelInterface::load()
    m_vocab = llama_model_get_vocab(m_model);
 
    // Initialize the context from the model using the context params
-   m_context = llama_init_from_model(m_model, m_contextParams);
+   m_context = llama_init_from_model(m_model, contextParams);
    if(!m_context)
    {
       std::cerr << "Error : failed to initialize the model context!" << std::endl;
       return false; // Make use of std::expected...
    }
 
+   // Start the worker that owns all decoding against the context
+   m_engine = std::make_unique<InferenceEngine>(m_context, m_vocab, m_numSlots, m_prefixCacheCells, BLOCK_STORE_BYTES);
+   m_engine->start();
+
    m_isLoaded = true;
 
    return true;
@@ -94,27 +192,551 @@ void ModelInterface::unload()
    #ifdef _DEBUG
       std::cout << "Unloading " << m_llmName << std::endl;
    #endif
-   if(m_isLoaded == true)
+   if(m_isLoaded == true && m_worker)
+   {
+      m_worker.reset();
+   }
+   else if(m_isLoaded == true)
    {
-      llama_sampler_free(m_sampler);
+      // The worker must be gone before the context it decodes with
+      m_engine.reset();
       llama_free(m_context);
       llama_model_free(m_model);
+      m_rpcCluster.reset();
    }
    m_isLoaded = false;
 }
 
 // This method will send a system prompt to the model with the provided
 // text
-void ModelInterface::sendPrompt(const int writeFd, std::string prompt, std::string role /* User*/)
+void ModelInterface::sendPrompt(const int writeFd, std::string prompt, std::string role /* User*/,
+                                const std::vector<std::string>& chunks /* {} */, const GenerationBudget& budget /* {} */,
+                                int32_t conversation /* INTERACTIVE_SESSION */)
 {
+   sendPrompt(std::move(prompt), std::move(role), [writeFd](const std::string& piece)
+   {
+      // Write the piece to the pipe
+      if(write(writeFd, piece.data(), piece.size()) == -1)
+      {
+         #ifdef _DEBUG
+            std::cout << "Model Interface write to pipe failed..." << std::endl;
+         #endif
+      }
+      return true;
+   }, chunks, budget, conversation);
+   close(writeFd); // close the pipe
+}
+
+// Same as above but hands every generated piece to a callback; returning false stops the reply
+GenerationResult ModelInterface::sendPrompt(std::string prompt, std::string role,
+                                            const std::function<bool(const std::string&)>& onToken,
+                                            const std::vector<std::string>& chunks /* {} */,
+                                            const GenerationBudget& budget /* {} */,
+                                            int32_t conversation /* INTERACTIVE_SESSION */)
+{
+   // Compressed before the worker sees them, so each chunk's KV block is keyed by the text the model reads
+   const std::vector<std::string> compressed = compressChunks(chunks);
+   if(m_worker)
+   {
+      return m_worker->sendPrompt(prompt, role, onToken, compressed, budget, conversation);
+   }
+
+   std::lock_guard<std::mutex> lock(m_conversationMutex);
+   activateConversation(conversation);
+   keepActiveVariant(0);
+
+   // A shorter reference context is better than a reply that never arrives
+   const std::vector<std::string> kept = budget.hasDeadline() ? fitChunks(prompt, compressed, budget) : compressed;
+
    // Add raw prompt to the llama messages vector with the user role
-   m_messages.push_back({role.c_str(), strdup(prompt.c_str())});
+   m_messages.push_back({strdup(role.c_str()), strdup(prompt.c_str())});
+
+   // Generate response and keep it in the history so the next turn's prompt matches the KV cache.
+   // Chunks only accompany this turn - the history keeps the bare prompt.
+   GenerationResult result;
+   if(kept.empty())
+   {
+      result = generateResponse(formatPrompt(), onToken, budget);
+   }
+   else
+   {
+      auto built = tokenizeWithChunks(kept);
+      if(built.has_value())
+      {
+         result = generateFromTokens(std::move(built.value().first), std::move(built.value().second), onToken, budget);
+      }
+      else
+      {
+         result.stopReason = GenerationStopReason::DecodeError;
+      }
+   }
+   m_messages.push_back({strdup("assistant"), strdup(result.text.c_str())});
+   return result;
+}
+
+// Samples several replies to a prompt side by side from one prefill of the prompt
+std::vector<GenerationResult> ModelInterface::sendPromptVariants(std::string prompt, std::string role, uint32_t count,
+                                                                 const std::function<bool(uint32_t, const std::string&)>& onToken,
+                                                                 const std::vector<std::string>& chunks /* {} */,
+                                                                 int32_t conversation /* INTERACTIVE_SESSION */)
+{
+   const std::vector<std::string> compressed = compressChunks(chunks);
+   if(m_worker)
+   {
+      return m_worker->sendPromptVariants(prompt, role, count, onToken, compressed, conversation);
+   }
+
+   std::vector<GenerationResult> results;
+   if(!m_engine || count == 0)
+   {
+      return results;
+   }
+   count = std::min({count, MAX_VARIANTS, m_engine->getSlotCount()});
+
+   std::lock_guard<std::mutex> lock(m_conversationMutex);
+   activateConversation(conversation);
+   keepActiveVariant(0);
+   if(count > 1 && !reserveVariantSessions(conversation))
+   {
+      count = 1;
+   }
+   m_messages.push_back({strdup(role.c_str()), strdup(prompt.c_str())});
+
+   std::vector<llama_token> promptTokens;
+   std::vector<std::pair<size_t, size_t>> blockSpans;
+   if(compressed.empty())
+   {
+      auto tokens = tokenize(formatPrompt(), true);
+      if(tokens.has_value())
+      {
+         promptTokens = std::move(tokens.value());
+      }
+   }
+   else
+   {
+      auto built = tokenizeWithChunks(compressed);
+      if(built.has_value())
+      {
+         promptTokens = std::move(built.value().first);
+         blockSpans = std::move(built.value().second);
+      }
+   }
+   results.resize(count);
+   if(promptTokens.empty())
+   {
+      for(auto& result : results)
+      {
+         result.stopReason = GenerationStopReason::DecodeError;
+      }
+      m_variants[conversation].assign(count, "");
+      return results;
+   }
+
+   // The first variant is the conversation's own turn, the others fork from its prefilled prompt
+   std::vector<std::promise<GenerationResult>> done(count);
+   auto variantRequest = [&](uint32_t variant)
+   {
+      GenerationRequest request;
+      request.sessionId = variantSession(conversation, variant);
+      request.sampling = m_samplingParams;
+      if(request.sampling.seed != LLAMA_DEFAULT_SEED)
+      {
+         // A fixed seed would make every variant the same reply
+         request.sampling.seed += variant;
+      }
+      request.onToken = [&onToken, variant](const std::string& piece)
+      {
+         return !onToken || onToken(variant, piece);
+      };
+      request.onComplete = [&done, variant](const GenerationResult& r)
+      {
+         done[variant].set_value(r);
+      };
+      return request;
+   };
+   GenerationRequest request = variantRequest(0);
+   request.promptTokens = std::move(promptTokens);
+   request.blockSpans = std::move(blockSpans);
+   for(uint32_t variant = 1; variant < count; ++variant)
+   {
+      request.forks.push_back(variantRequest(variant));
+   }
+   m_engine->submit(std::move(request));
+
+   std::vector<std::string> replies;
+   for(uint32_t variant = 0; variant < count; ++variant)
+   {
+      results[variant] = done[variant].get_future().get();
+      replies.push_back(results[variant].text);
+   }
+   m_variants[conversation] = std::move(replies);
+   return results;
+}
+
+// Answers independent prompts behind a common system prompt in one go
+std::vector<GenerationResult> ModelInterface::fanOut(const std::string& systemPrompt, const std::vector<std::string>& prompts,
+                                                     int32_t maxTokens)
+{
+   if(m_worker)
+   {
+      return m_worker->fanOut(systemPrompt, prompts, maxTokens);
+   }
+
+   std::vector<GenerationResult> results(prompts.size());
+   for(auto& result : results)
+   {
+      result.stopReason = GenerationStopReason::DecodeError;
+   }
+   if(!m_engine || prompts.empty())
+   {
+      return results;
+   }
+
+   // Prompts that cannot be prepared keep their DecodeError result
+   std::vector<std::vector<llama_token>> tokens(prompts.size());
+   std::vector<size_t> ready;
+   for(size_t i = 0; i < prompts.size(); ++i)
+   {
+      const std::vector<llama_chat_message> messages = {{"system", systemPrompt.c_str()}, {"user", prompts[i].c_str()}};
+      auto formatted = applyChatTemplate(messages);
+      auto tokenized = formatted.has_value() ? tokenize(formatted.value(), true) : std::unexpected(formatted.error());
+      if(tokenized.has_value() && !tokenized.value().empty())
+      {
+         tokens[i] = std::move(tokenized.value());
+         ready.push_back(i);
+      }
+   }
+
+   std::vector<std::promise<GenerationResult>> done(prompts.size());
+   auto taskRequest = [&](size_t index)
+   {
+      GenerationRequest request;
+      request.promptTokens = std::move(tokens[index]);
+      request.maxTokens = maxTokens;
+      request.sampling = m_samplingParams;
+      request.onComplete = [&done, index](const GenerationResult& r)
+      {
+         done[index].set_value(r);
+      };
+      return request;
+   };
+
+   // Every fork needs a sequence next to the shared prefix's, so the prompts go out in waves
+   const size_t wave = std::max<size_t>(1, m_engine->getSlotCount() - 1);
+   for(size_t begin = 0; begin < ready.size(); begin += wave)
+   {
+      const size_t end = std::min(ready.size(), begin + wave);
+      // Tokens every prompt of the wave starts with, short of the last token of the shortest so
+      // each one has something of its own left to decode
+      const std::vector<llama_token>& first = tokens[ready[begin]];
+      size_t shared = first.size() - 1;
+      for(size_t i = begin + 1; i < end; ++i)
+      {
+         const std::vector<llama_token>& other = tokens[ready[i]];
+         shared = std::min(shared, other.size() - 1);
+         shared = static_cast<size_t>(std::mismatch(first.begin(), first.begin() + shared, other.begin()).first - first.begin());
+      }
+      if(shared == 0 || end - begin == 1)
+      {
+         for(size_t i = begin; i < end; ++i)
+         {
+            m_engine->submit(taskRequest(ready[i]));
+         }
+         continue;
+      }
+
+      GenerationRequest prefix;
+      prefix.promptTokens.assign(first.begin(), first.begin() + shared);
+      prefix.maxTokens = 0;
+      prefix.sampling = m_samplingParams;
+      for(size_t i = begin; i < end; ++i)
+      {
+         prefix.forks.push_back(taskRequest(ready[i]));
+      }
+      m_engine->submit(std::move(prefix));
+   }
+
+   for(size_t index : ready)
+   {
+      results[index] = done[index].get_future().get();
+   }
+   return results;
+}
+
+// Makes one of the replies of sendPromptVariants the conversation's reply
+bool ModelInterface::keepVariant(uint32_t variant, int32_t conversation /* INTERACTIVE_SESSION */)
+{
+   if(m_worker)
+   {
+      return m_worker->keepVariant(variant, conversation);
+   }
+   std::lock_guard<std::mutex> lock(m_conversationMutex);
+   activateConversation(conversation);
+   return keepActiveVariant(variant);
+}
+
+// keepVariant for the active conversation; requires m_conversationMutex
+bool ModelInterface::keepActiveVariant(uint32_t variant)
+{
+   auto pending = m_variants.find(m_activeConversation);
+   if(pending == m_variants.end() || variant >= pending->second.size())
+   {
+      return false;
+   }
+   const std::vector<std::string> replies = std::move(pending->second);
+   m_variants.erase(pending);
+   m_messages.push_back({strdup("assistant"), strdup(replies[variant].c_str())});
+   if(!m_engine)
+   {
+      releaseVariantSessions(m_activeConversation);
+      return true;
+   }
+
+   // The kept branch's sequence already holds the prompt and the reply, so the next turn continues
+   // from it; the prompt cells the branches shared stay resident through it. Should the branch have
+   // lost its sequence, the conversation's own still holds the prompt.
+   if(variant > 0)
+   {
+      m_engine->moveSession(variantSession(m_activeConversation, variant), m_activeConversation);
+   }
+   for(uint32_t other = 1; other < replies.size(); ++other)
+   {
+      if(other != variant)
+      {
+         m_engine->discardSession(variantSession(m_activeConversation, other));
+      }
+   }
+   releaseVariantSessions(m_activeConversation);
+   return true;
+}
+
+// Session a variant of a conversation is sampled on, the first is the conversation's own
+int32_t ModelInterface::variantSession(int32_t conversation, uint32_t variant) const
+{
+   if(variant == 0)
+   {
+      return conversation;
+   }
+   auto block = m_variantSessions.find(conversation);
+   return block == m_variantSessions.end() ? -1 : block->second - static_cast<int32_t>(variant - 1);
+}
+
+// Reserves the sessions of a conversation's extra variants; false when none are left
+bool ModelInterface::reserveVariantSessions(int32_t conversation)
+{
+   if(m_variantSessions.contains(conversation))
+   {
+      return true;
+   }
+   int32_t block;
+   if(!m_freeVariantSessions.empty())
+   {
+      block = m_freeVariantSessions.back();
+      m_freeVariantSessions.pop_back();
+   }
+   else if(m_nextVariantSessions - std::numeric_limits<int32_t>::min() >= static_cast<int64_t>(MAX_VARIANTS))
+   {
+      block = m_nextVariantSessions;
+      m_nextVariantSessions -= static_cast<int32_t>(MAX_VARIANTS - 1);
+   }
+   else
+   {
+      std::cerr << "Error : no sessions left for reply variants" << std::endl;
+      return false;
+   }
+   m_variantSessions[conversation] = block;
+   return true;
+}
+
+// Hands back the sessions of a conversation's extra variants once one of its replies is kept
+void ModelInterface::releaseVariantSessions(int32_t conversation)
+{
+   auto block = m_variantSessions.find(conversation);
+   if(block != m_variantSessions.end())
+   {
+      m_freeVariantSessions.push_back(block->second);
+      m_variantSessions.erase(block);
+   }
+}
+
+// Forgets a conversation's history and frees its KV sequence
+void ModelInterface::closeConversation(int32_t conversation)
+{
+   if(m_worker)
+   {
+      m_worker->closeConversation(conversation);
+      return;
+   }
+   std::lock_guard<std::mutex> lock(m_conversationMutex);
+   activateConversation(conversation);
+   keepActiveVariant(0);
+   freeMessages(m_messages);
+   if(m_engine)
+   {
+      m_engine->releaseSession(conversation);
+   }
+}
+
+// Returns an interactive conversation as (role, content) pairs
+std::vector<std::pair<std::string, std::string>> ModelInterface::getConversation(int32_t conversation /* INTERACTIVE_SESSION */)
+{
+   std::lock_guard<std::mutex> lock(m_conversationMutex);
+   activateConversation(conversation);
+   std::vector<std::pair<std::string, std::string>> messages;
+   for(const auto& message : m_messages)
+   {
+      messages.emplace_back(message.role, message.content);
+   }
+   return messages;
+}
+
+// Replaces an interactive conversation, e.g. when resuming from a checkpoint
+void ModelInterface::restoreConversation(const std::vector<std::pair<std::string, std::string>>& messages,
+                                         int32_t conversation /* INTERACTIVE_SESSION */)
+{
+   std::lock_guard<std::mutex> lock(m_conversationMutex);
+   activateConversation(conversation);
+   freeMessages(m_messages);
+   for(const auto& [role, content] : messages)
+   {
+      m_messages.push_back({strdup(role.c_str()), strdup(content.c_str())});
+   }
+}
+
+// Writes an interactive conversation and its KV sequence to a SessionSnapshot file
+bool ModelInterface::saveSnapshot(const std::string& path, int32_t conversation /* INTERACTIVE_SESSION */)
+{
+   if(m_isolated)
+   {
+      return m_worker && m_worker->saveSnapshot(path, conversation);
+   }
+
+   std::lock_guard<std::mutex> lock(m_conversationMutex);
+   activateConversation(conversation);
+   SessionSnapshotContents contents;
+   contents.modelName = getModelName();
+   contents.vocabSize = m_vocab ? llama_vocab_n_tokens(m_vocab) : 0;
+   contents.sampling = m_samplingParams;
+   for(const auto& message : m_messages)
+   {
+      contents.messages.emplace_back(message.role, message.content);
+   }
+   // Nothing resident (e.g. no turn yet) still saves the messages
+   std::vector<uint8_t> state;
+   std::vector<llama_token> tokens;
+   if(m_engine && m_engine->exportSession(conversation, state, tokens))
+   {
+      contents.tokens = tokens;
+      contents.state = state;
+   }
+   return SessionSnapshot::write(path, contents);
+}
+
+// Resumes a conversation written by saveSnapshot
+bool ModelInterface::restoreSnapshot(const std::string& path, int32_t conversation /* INTERACTIVE_SESSION */)
+{
+   if(m_isolated)
+   {
+      return m_worker && m_worker->restoreSnapshot(path, conversation);
+   }
+
+   auto opened = SessionSnapshot::open(path);
+   if(!opened.has_value())
+   {
+      return false;
+   }
+   const SessionSnapshot& snapshot = *opened.value();
+   restoreConversation(snapshot.getMessages(), conversation);
+
+   std::lock_guard<std::mutex> lock(m_conversationMutex);
+   m_samplingParams = snapshot.getSampling();
+   const bool sameModel = m_vocab && snapshot.getModelName() == getModelName() &&
+                          snapshot.getVocabSize() == llama_vocab_n_tokens(m_vocab);
+   if(m_engine && sameModel && !snapshot.getState().empty() &&
+      !m_engine->importSession(conversation, snapshot.getState(), snapshot.getTokens()))
+   {
+      #ifdef _DEBUG
+         std::cout << "Snapshot KV state not restored, the next turn prefills the conversation" << std::endl;
+      #endif
+   }
+   return true;
+}
 
-   // Generate the formatted prompt for generation
-   std::string genPrompt = formatPrompt();
+// Applies the model's chat template to an arbitrary list of messages
+std::expected<std::string, ModelErrorType> ModelInterface::applyChatTemplate(const std::vector<llama_chat_message>& messages,
+                                                                             bool addAssistant /* true */) const
+{
+   // An isolated model lives in its worker process, there is nothing to apply the template with here
+   if(!m_isLoaded || m_model == nullptr)
+   {
+      return std::unexpected(ModelErrorType::MODEL_NOT_LOADED);
+   }
 
-   // Generate response
-   generateResponse(writeFd, genPrompt);
+   const char* dTempl = llama_model_chat_template(m_model, nullptr);
+   std::vector<char> buf(1024);
+   int newLen = llama_chat_apply_template(dTempl, messages.data(), messages.size(), addAssistant, buf.data(), buf.size());
+   if(newLen > (int)buf.size())
+   {
+      buf.resize(newLen);
+      newLen = llama_chat_apply_template(dTempl, messages.data(), messages.size(), addAssistant, buf.data(), buf.size());
+   }
+   if(newLen < 0)
+   {
+      return std::unexpected(ModelErrorType::TEMPLATE_ERROR);
+   }
+   return std::string(buf.data(), newLen);
+}
+
+// Converts text into model tokens
+std::expected<std::vector<llama_token>, ModelErrorType> ModelInterface::tokenize(const std::string& text, bool addSpecial) const
+{
+   // Nor a vocabulary to tokenize with
+   if(!m_isLoaded || m_vocab == nullptr)
+   {
+      return std::unexpected(ModelErrorType::MODEL_NOT_LOADED);
+   }
+
+   const int nTokens = -llama_tokenize(m_vocab, text.c_str(), text.size(), NULL, 0, addSpecial, true);
+   std::vector<llama_token> tokens(nTokens);
+   if(llama_tokenize(m_vocab, text.c_str(), text.size(), tokens.data(), tokens.size(), addSpecial, true) < 0)
+   {
+      return std::unexpected(ModelErrorType::TOKENIZE_ERROR);
+   }
+   return tokens;
+}
+
+// Returns true if both models map text to the same token ids, so a prompt tokenized by one can
+// be decoded by the other as is
+bool ModelInterface::sharesVocab(const ModelInterface& other) const
+{
+   if(!m_isLoaded || !other.m_isLoaded || m_vocab == nullptr || other.m_vocab == nullptr)
+   {
+      return false;
+   }
+   const int32_t nTokens = llama_vocab_n_tokens(m_vocab);
+   if(nTokens != llama_vocab_n_tokens(other.m_vocab) ||
+      llama_vocab_type(m_vocab) != llama_vocab_type(other.m_vocab) ||
+      llama_vocab_bos(m_vocab) != llama_vocab_bos(other.m_vocab) ||
+      llama_vocab_eos(m_vocab) != llama_vocab_eos(other.m_vocab))
+   {
+      return false;
+   }
+   // Sizes of one family's models match exactly; compare a spread of pieces rather than all of them
+   const int32_t stride = std::max(1, nTokens / 512);
+   for(int32_t id = 0; id < nTokens; id += stride)
+   {
+      if(std::strcmp(llama_vocab_get_text(m_vocab, id), llama_vocab_get_text(other.m_vocab, id)) != 0)
+      {
+         return false;
+      }
+   }
+   return std::strcmp(llama_vocab_get_text(m_vocab, nTokens - 1), llama_vocab_get_text(other.m_vocab, nTokens - 1)) == 0;
+}
+
+// Returns the file name of the model this interface is for
+std::string ModelInterface::getModelName() const
+{
+   return std::filesystem::path(m_modelPath).filename().string();
 }
 
 // This method will take the llama messages vector, apply the prompt template, and isolate the
@@ -150,79 +772,352 @@ std::string ModelInterface::formatPrompt()
 // This method will take a formatted llama prompt and generate an output
 // from the model
 //
-void ModelInterface::generateResponse(const int writeFd, const std::string& fPrompt)
+GenerationResult ModelInterface::generateResponse(const std::string& fPrompt, const std::function<bool(const std::string&)>& onToken,
+                                                  const GenerationBudget& budget /* {} */)
 {
-   // Check if this is the first prompt
-   const bool isFirst = llama_get_kv_cache_used_cells(m_context) == 0;
-
-   // Tokenize the prompt
-   const int nPromptTokens = -llama_tokenize(m_vocab, fPrompt.c_str(), fPrompt.size(), NULL, 0, isFirst, true);
-   std::vector<llama_token> promptTokens(nPromptTokens);
-   if(llama_tokenize(m_vocab, fPrompt.c_str(), fPrompt.size(), promptTokens.data(), promptTokens.size(), isFirst, true) < 0)
+   // Tokenize the prompt - the formatted prompt is always the whole conversation, the engine
+   // only prefills the part that is not already in the session's KV cache
+   auto promptTokens = tokenize(fPrompt, true);
+   if(!promptTokens.has_value())
    {
       #ifdef _DEBUG
          std::cout << "Failed to tokenize prompt..." << std::endl;
       #endif
-      return; // TODO - use C++ 23 exception handling
+      GenerationResult result;
+      result.stopReason = GenerationStopReason::DecodeError;
+      return result;
    }
+   return generateFromTokens(std::move(promptTokens.value()), {}, onToken, budget);
+}
 
-   // Prepare a batch for the prompt
-   llama_batch batch = llama_batch_get_one(promptTokens.data(), promptTokens.size());
-   llama_token newTokenId;
-   while(true)
+// Makes a conversation's history m_messages, parking the current one; requires m_conversationMutex
+void ModelInterface::activateConversation(int32_t conversation)
+{
+   if(conversation == m_activeConversation)
+   {
+      return;
+   }
+   // Only the history moves - each conversation's KV sequence stays bound to its own session
+   std::swap(m_parkedConversations[m_activeConversation], m_messages);
+   m_activeConversation = conversation;
+   auto parked = m_parkedConversations.find(conversation);
+   if(parked != m_parkedConversations.end())
+   {
+      m_messages = std::move(parked->second);
+      m_parkedConversations.erase(parked);
+   }
+   else
+   {
+      m_messages.clear();
+   }
+}
+
+// Frees the strings of a message list
+void ModelInterface::freeMessages(std::vector<llama_chat_message>& messages)
+{
+   for(auto& message : messages)
    {
-      // Check if we have enough space in the context to evaluate batch
-      int nContext = llama_n_ctx(m_context);
-      int nContextUsed = llama_get_kv_cache_used_cells(m_context);
-      if(nContextUsed + batch.n_tokens > nContext)
+      free(const_cast<char*>(message.role));
+      free(const_cast<char*>(message.content));
+   }
+   messages.clear();
+}
+
+// Runs the interactive session over an already tokenized prompt and waits for the reply
+GenerationResult ModelInterface::generateFromTokens(std::vector<llama_token> promptTokens,
+                                                    std::vector<std::pair<size_t, size_t>> blockSpans,
+                                                    const std::function<bool(const std::string&)>& onToken,
+                                                    const GenerationBudget& budget)
+{
+   GenerationResult result;
+   result.stopReason = GenerationStopReason::DecodeError;
+   if(!m_engine)
+   {
+      return result;
+   }
+
+   std::promise<GenerationResult> done;
+   GenerationRequest request;
+   request.promptTokens = std::move(promptTokens);
+   request.blockSpans = std::move(blockSpans);
+   request.sessionId = m_activeConversation;
+   request.maxTokens = budget.maxTokens;
+   request.deadline = budget.deadline;
+   request.sampling = m_samplingParams;
+   request.onToken = onToken;
+   request.onComplete = [&done](const GenerationResult& r)
+   {
+      done.set_value(r);
+   };
+   m_engine->submit(std::move(request));
+   result = done.get_future().get();
+   return result;
+}
+
+// Estimates how long a turn takes from the engine's measured rates
+double ModelInterface::estimateTurnMs(const std::string& prompt, const std::vector<std::string>& chunks, const GenerationBudget& budget,
+                                      const std::vector<std::pair<std::string, std::string>>& history /* {} */) const
+{
+   if(!m_engine)
+   {
+      return 0.0;
+   }
+   // Chunks whose blocks are already stored splice in almost for free, counting them keeps the
+   // estimate on the safe side
+   size_t prefill = countTokens(prompt);
+   for(const auto& chunk : chunks)
+   {
+      prefill += countTokens(chunk);
+   }
+   for(const auto& [role, content] : history)
+   {
+      prefill += countTokens(content);
+   }
+   return m_engine->estimateLatencyMs(prefill, static_cast<size_t>(budget.replyTokens()));
+}
+
+// Drops chunks from the back until the turn is expected to meet the budget's deadline
+std::vector<std::string> ModelInterface::fitChunks(const std::string& prompt, std::vector<std::string> chunks,
+                                                   const GenerationBudget& budget) const
+{
+   const double remaining = budget.remainingMs();
+   while(!chunks.empty() && estimateTurnMs(prompt, chunks, budget) > remaining)
+   {
+      #ifdef _DEBUG
+         std::cout << "Dropping a reference chunk to meet the deadline..." << std::endl;
+      #endif
+      chunks.pop_back();
+   }
+   return chunks;
+}
+
+// Measures how surprising every token of a text is to this model
+std::expected<std::vector<TokenSurprisal>, ModelErrorType> ModelInterface::scoreText(const std::string& text) const
+{
+   if(!m_engine)
+   {
+      return std::unexpected(ModelErrorType::MODEL_NOT_LOADED);
+   }
+   auto tokens = tokenize(text, true);
+   if(!tokens.has_value())
+   {
+      return std::unexpected(tokens.error());
+   }
+   auto nats = m_engine->scoreTokens(tokens.value());
+   if(!nats.has_value())
+   {
+      return std::unexpected(nats.error());
+   }
+
+   // Lay the tokens' pieces back over the text; special tokens such as BOS cover none of it
+   std::vector<TokenSurprisal> scored;
+   scored.reserve(tokens.value().size());
+   size_t offset = 0;
+   for(size_t i = 0; i < tokens.value().size(); ++i)
+   {
+      char buf[256];
+      const int n = llama_token_to_piece(m_vocab, tokens.value()[i], buf, sizeof(buf), 0, false);
+      if(n < 0)
       {
-         #ifdef _DEBUG
-            std::cout << "Context size exceeded..." << std::endl;
-         #endif
-         break;
+         return std::unexpected(ModelErrorType::TOKENIZE_ERROR);
       }
-
-      // Decode the batch
-      if(llama_decode(m_context, batch))
+      std::string_view piece(buf, n);
+      // SentencePiece vocabularies put a space in front of the first word that the text lacks
+      if(offset == 0 && !piece.empty() && piece.front() == ' ' && (text.empty() || text.front() != ' '))
       {
-         #ifdef _DEBUG
-            std::cout << "Failed to decode batch..." << std::endl;
-         #endif
-         break; // TODO - what to do with response here...
+         piece.remove_prefix(1);
+      }
+      if(text.compare(offset, piece.size(), piece) != 0)
+      {
+         return std::unexpected(ModelErrorType::TOKENIZE_ERROR);
       }
+      scored.push_back({offset, offset + piece.size(), nats.value()[i]});
+      offset += piece.size();
+   }
+   if(offset != text.size())
+   {
+      return std::unexpected(ModelErrorType::TOKENIZE_ERROR);
+   }
+   return scored;
+}
+
+// Compresses the chunks of every later turn before they are tokenized
+void ModelInterface::setCompressor(std::shared_ptr<PromptCompressor> compressor)
+{
+   std::lock_guard<std::mutex> lock(m_compressorMutex);
+   m_compressor = std::move(compressor);
+}
+
+// The chunks as the compressor leaves them, or as they are without one
+std::vector<std::string> ModelInterface::compressChunks(const std::vector<std::string>& chunks) const
+{
+   std::shared_ptr<PromptCompressor> compressor;
+   {
+      std::lock_guard<std::mutex> lock(m_compressorMutex);
+      compressor = m_compressor;
+   }
+   if(!compressor || chunks.empty())
+   {
+      return chunks;
+   }
+   std::vector<std::string> compressed;
+   compressed.reserve(chunks.size());
+   for(const auto& chunk : chunks)
+   {
+      compressed.push_back(compressor->compress(chunk));
+   }
+   return compressed;
+}
+
+// Tokens each conversation's sequence may hold
+uint32_t ModelInterface::getSequenceContext() const
+{
+   // An isolated interface's worker creates its context with the same parameters
+   return m_engine ? m_engine->getSequenceContext() : DEFAULT_CTX;
+}
+
+// Tokens a conversation's next turn leaves for reference chunks
+size_t ModelInterface::getContextBudget(const std::string& prompt, const std::string& role /* "User" */,
+                                        const GenerationBudget& budget /* {} */,
+                                        int32_t conversation /* INTERACTIVE_SESSION */)
+{
+   const size_t reply = static_cast<size_t>(budget.replyTokens());
+   if(!m_engine)
+   {
+      const size_t used = countTokens(prompt) + reply;
+      return used < DEFAULT_CTX ? (DEFAULT_CTX - used) / 2 : 0;
+   }
+
+   std::lock_guard<std::mutex> lock(m_conversationMutex);
+   activateConversation(conversation);
+   // The turn as tokenizeWithChunks lays it out, less the chunks
+   const std::string content = "Reference material:\n\n" + prompt;
+   std::vector<llama_chat_message> messages(m_messages.begin(), m_messages.end());
+   messages.push_back({role.c_str(), content.c_str()});
+   auto formatted = applyChatTemplate(messages, true);
+   auto tokens = tokenize(formatted.has_value() ? formatted.value() : content, true);
+   const size_t used = (tokens.has_value() ? tokens.value().size() : content.size() / 4) + reply;
+   const size_t context = getSequenceContext();
+   return used < context ? context - used : 0;
+}
+
+// Number of tokens a text encodes to, without special tokens
+size_t ModelInterface::countTokens(const std::string& text) const
+{
+   auto tokens = tokenize(text, false);
+   // Roughly four characters per token if the text cannot be tokenized
+   return tokens.has_value() ? tokens.value().size() : text.size() / 4;
+}
 
-      // Sample the next token
-      newTokenId = llama_sampler_sample(m_sampler, m_context, -1);
+// Tokenizes the conversation with reference chunks placed ahead of the newest message. Each chunk
+// is tokenized on its own so its tokens - and therefore its stored KV block - are identical in
+// every prompt that selects it.
+std::expected<std::pair<std::vector<llama_token>, std::vector<std::pair<size_t, size_t>>>, ModelErrorType>
+ModelInterface::tokenizeWithChunks(const std::vector<std::string>& chunks)
+{
+   if(m_messages.empty())
+   {
+      return std::unexpected(ModelErrorType::TEMPLATE_ERROR);
+   }
 
-      // If we are at the end of the generation break from generation
-      if(llama_vocab_is_eog(m_vocab, newTokenId))
+   // Apply the template with a marker standing in for each chunk
+   std::string content = "Reference material:\n";
+   for(size_t i = 0; i < chunks.size(); ++i)
+   {
+      content += CHUNK_MARKER;
+   }
+   content += "\n";
+   content += m_messages.back().content;
+   std::vector<llama_chat_message> messages(m_messages.begin(), m_messages.end() - 1);
+   messages.push_back({m_messages.back().role, content.c_str()});
+   auto formatted = applyChatTemplate(messages, true);
+   if(!formatted.has_value())
+   {
+      return std::unexpected(formatted.error());
+   }
+
+   // Tokenize the template text between markers and splice each chunk's own tokens in between
+   std::vector<llama_token> tokens;
+   std::vector<std::pair<size_t, size_t>> spans;
+   const std::string& text = formatted.value();
+   size_t from = 0;
+   for(size_t i = 0; i <= chunks.size(); ++i)
+   {
+      const size_t marker = i < chunks.size() ? text.find(CHUNK_MARKER, from) : std::string::npos;
+      if(i < chunks.size() && marker == std::string::npos)
+      {
+         return std::unexpected(ModelErrorType::TEMPLATE_ERROR);
+      }
+      const std::string segment = text.substr(from, marker == std::string::npos ? std::string::npos : marker - from);
+      auto segmentTokens = tokenize(segment, i == 0);
+      if(!segmentTokens.has_value())
+      {
+         return std::unexpected(segmentTokens.error());
+      }
+      tokens.insert(tokens.end(), segmentTokens.value().begin(), segmentTokens.value().end());
+      if(i == chunks.size())
       {
          break;
       }
 
-      // Convert the token to a string and add it to the response
-      char buf[256];
-      int n = llama_token_to_piece(m_vocab, newTokenId, buf, sizeof(buf), 0, true);
-      if(n < 0)
+      auto chunkTokens = tokenize(chunks[i], false);
+      if(!chunkTokens.has_value())
       {
-         #ifdef _DEBUG
-            std::cout << "Failed to convert token to piece..." << std::endl;
-         #endif
-         break; // TODO - what to do with response here...
+         return std::unexpected(chunkTokens.error());
       }
-      for(int i = 0; i < n; ++i)
+      spans.emplace_back(tokens.size(), chunkTokens.value().size());
+      tokens.insert(tokens.end(), chunkTokens.value().begin(), chunkTokens.value().end());
+      from = marker + CHUNK_MARKER.size();
+   }
+   return std::make_pair(std::move(tokens), std::move(spans));
+}
+
+// Compares the current conversation plus chunks assembled from stored blocks against a full prefill
+std::expected<SpliceQuality, ModelErrorType> ModelInterface::checkChunkSplice(const std::string& prompt,
+                                                                              const std::vector<std::string>& chunks)
+{
+   std::lock_guard<std::mutex> lock(m_conversationMutex);
+   if(!m_engine)
+   {
+      return std::unexpected(ModelErrorType::MODEL_NOT_LOADED);
+   }
+   m_messages.push_back({strdup("User"), strdup(prompt.c_str())});
+   auto built = tokenizeWithChunks(chunks);
+   free(const_cast<char*>(m_messages.back().role));
+   free(const_cast<char*>(m_messages.back().content));
+   m_messages.pop_back();
+   if(!built.has_value())
+   {
+      return std::unexpected(built.error());
+   }
+   return m_engine->checkSplice(built.value().first, built.value().second);
+}
+
+// Prefills chunks into stored KV blocks ahead of the turn that will pass them to sendPrompt
+void ModelInterface::prefetchChunks(const std::vector<std::string>& chunks)
+{
+   // The blocks the turn will look for are those of the compressed chunks
+   const std::vector<std::string> compressed = compressChunks(chunks);
+   if(m_worker)
+   {
+      m_worker->prefetchChunks(compressed);
+      return;
+   }
+   if(!m_engine)
+   {
+      return;
+   }
+
+   // Tokenized exactly as tokenizeWithChunks does, so the blocks match the turn's spans. The
+   // conversation lock is not needed and may be held by the turn that is streaming.
+   std::vector<std::vector<llama_token>> spans;
+   for(const auto& chunk : compressed)
+   {
+      auto tokens = tokenize(chunk, false);
+      if(tokens.has_value())
       {
-         // Write each character to the pipe
-         if(write(writeFd, &buf[i], 1) == -1)
-         {
-            #ifdef _DEBUG
-               std::cout << "Model Interface write to pipe failed..." << std::endl;
-            #endif
-         }
+         spans.push_back(std::move(tokens.value()));
       }
-      // Prepare the next batch with the sampled token
-      batch = llama_batch_get_one(&newTokenId, 1);
    }
-
-   close(writeFd); // close the pipe
-}
\ No newline at end of file
+   m_engine->prefetchBlocks(std::move(spans));
+}
@@ -7,18 +7,41 @@
 #define MODEL_INTERFACE_H
 
 #include "ModelConstants.h"
+#include "InferenceEngine.h"
+#include "RpcCluster.h"
 #include "llama.h"
 #include <string>
 #include <vector>
+#include <utility>
+#include <functional>
 #include <thread>
 #include <mutex>
+#include <memory>
+#include <unordered_map>
 #include <expected>
 
+// Session id used by the interactive conversation driven through sendPrompt; further interactive
+// conversations (e.g. GUI tabs) pick their own small ids next to it
+const int32_t INTERACTIVE_SESSION = 0;
+
+class ModelWorker;
+class PromptCompressor;
+
+// Self-information of one token of a text, and the bytes of the text the token covers
+struct TokenSurprisal
+{
+   size_t begin = 0;
+   size_t end = 0;
+   float nats = 0.0f;
+};
+
 class ModelInterface
 {
 public:
-   // Given the name of an LLM - this method will attempt to launch that LLM and load it into memory
-   ModelInterface(std::string model_path);
+   // Given the name of an LLM - this method will attempt to launch that LLM and load it into memory.
+   // The context is created with one KV sequence per slot so several requests can decode together,
+   // plus prefix_cache_cells extra cells in which prompt prefixes are shared between requests.
+   ModelInterface(std::string model_path, uint32_t num_slots = 4, uint32_t prefix_cache_cells = 0);
 
    // Default destructor
    ~ModelInterface();
@@ -32,6 +55,24 @@ public:
       return m_modelPath;
    }
 
+   // Runs the model in a supervised smart-agent-worker process instead of this one. Must be set
+   // before load(); only sendPrompt is available on an isolated interface.
+   void setIsolated(bool isolated);
+
+   // Returns true if the model runs in a worker process
+   inline bool isIsolated() const
+   {
+      return m_isolated;
+   }
+
+   // Splits the model's layers over llama.cpp rpc-server endpoints ("host:port") in proportion to
+   // their free memory. Must be set before load(); ignored for isolated interfaces. Profiling times
+   // every graph node per machine at the cost of a synchronization after each one.
+   void setRpcEndpoints(const std::vector<std::string>& endpoints, bool profile = false);
+
+   // Returns what each RPC node holds and the time it has cost, empty when not distributed
+   std::vector<RpcNodeStats> getRpcStats() const;
+
    // This method will send the initial command to the Ollama to load the model into memory
    bool load();
 
@@ -42,8 +83,61 @@ public:
    bool addFileToContext(std::string file_path);
 
    // This method will send a prompt to the LLM and stream the response through the provided pipe
-   // Options for role are "System" and "User"
-   void sendPrompt(const int writeFd, std::string prompt, std::string role = "User");
+   // Options for role are "System" and "User". Chunks are reference material for this turn only;
+   // each one is prefilled once and its KV block reused whenever it is selected again. When the
+   // budget has a deadline the turn is expected to miss, chunks are dropped from the back until it
+   // fits, and the reply ends cleanly at the deadline. Each conversation keeps its own history and
+   // KV sequence, so alternating between conversations costs no prefill while the context has a
+   // sequence for each; the least recently used gives its sequence up first.
+   void sendPrompt(const int writeFd, std::string prompt, std::string role = "User",
+                   const std::vector<std::string>& chunks = {}, const GenerationBudget& budget = {},
+                   int32_t conversation = INTERACTIVE_SESSION);
+
+   // Same as above but hands every generated piece to a callback; returning false stops the reply
+   GenerationResult sendPrompt(std::string prompt, std::string role,
+                               const std::function<bool(const std::string&)>& onToken,
+                               const std::vector<std::string>& chunks = {}, const GenerationBudget& budget = {},
+                               int32_t conversation = INTERACTIVE_SESSION);
+
+   // Samples several replies to a prompt side by side. The prompt is prefilled once and its KV
+   // forked into a sequence per variant, and all variants decode in the same batches with samplers
+   // of their own; onToken gets the variant index with every piece. At most as many variants as the
+   // context has sequences are generated. The conversation holds the prompt without a reply until
+   // keepVariant picks one - a prompt sent before that keeps the first.
+   std::vector<GenerationResult> sendPromptVariants(std::string prompt, std::string role, uint32_t count,
+                                                    const std::function<bool(uint32_t, const std::string&)>& onToken,
+                                                    const std::vector<std::string>& chunks = {},
+                                                    int32_t conversation = INTERACTIVE_SESSION);
+
+   // Makes one of the replies of sendPromptVariants the conversation's reply. Its KV sequence becomes
+   // the conversation's and the cells of the other variants are dropped.
+   bool keepVariant(uint32_t variant, int32_t conversation = INTERACTIVE_SESSION);
+
+   // Answers independent prompts behind a common system prompt in one go, outside of any conversation.
+   // The leading tokens all prompts share (the system prompt at least) are prefilled once and forked
+   // into a sequence per prompt, and the prompts then prefill their own remainder and decode side by
+   // side in the same batches. Results come back in prompt order.
+   std::vector<GenerationResult> fanOut(const std::string& systemPrompt, const std::vector<std::string>& prompts,
+                                        int32_t maxTokens);
+
+   // Forgets a conversation's history and frees its KV sequence
+   void closeConversation(int32_t conversation);
+
+   // Estimates how long a turn takes from the engine's measured rates, 0 when nothing has been
+   // measured yet or inference runs in a worker process. Earlier turns are taken to be resident in
+   // the KV cache unless a history is given, e.g. one another model would have to prefill.
+   double estimateTurnMs(const std::string& prompt, const std::vector<std::string>& chunks, const GenerationBudget& budget,
+                         const std::vector<std::pair<std::string, std::string>>& history = {}) const;
+
+   // Measures how far a reply's next-token distribution moves when the chunks are spliced from
+   // stored blocks instead of prefilled in place, without changing the conversation
+   std::expected<SpliceQuality, ModelErrorType> checkChunkSplice(const std::string& prompt,
+                                                                 const std::vector<std::string>& chunks);
+
+   // Prefills chunks into stored KV blocks ahead of the turn that will pass them to sendPrompt,
+   // without waiting for it. Safe to call while a reply streams - the blocks are computed between
+   // its decode steps, so the next turn splices them instead of prefilling them.
+   void prefetchChunks(const std::vector<std::string>& chunks);
 
    // This method will take the llama messages vector, apply the prompt template, and isolate the
    // prompt for response generation
@@ -51,10 +145,103 @@ public:
 
    // This method will take a formatted llama prompt and generate an output
    // from the model
-   void generateResponse(const int writeFd, const std::string& fPrompt);
+   GenerationResult generateResponse(const std::string& fPrompt, const std::function<bool(const std::string&)>& onToken,
+                                     const GenerationBudget& budget = {});
+
+   // Returns an interactive conversation as (role, content) pairs
+   std::vector<std::pair<std::string, std::string>> getConversation(int32_t conversation = INTERACTIVE_SESSION);
+
+   // Replaces an interactive conversation, e.g. when resuming from a checkpoint
+   void restoreConversation(const std::vector<std::pair<std::string, std::string>>& messages,
+                            int32_t conversation = INTERACTIVE_SESSION);
+
+   // Writes an interactive conversation - messages, sampling parameters, resident tokens and the
+   // KV sequence - to a SessionSnapshot file
+   bool saveSnapshot(const std::string& path, int32_t conversation = INTERACTIVE_SESSION);
+
+   // Resumes a conversation written by saveSnapshot. The KV sequence is only restored into the model
+   // it was taken with; otherwise, or if it does not fit, the next turn prefills the messages.
+   bool restoreSnapshot(const std::string& path, int32_t conversation = INTERACTIVE_SESSION);
+
+   // Applies the model's chat template to an arbitrary list of messages
+   std::expected<std::string, ModelErrorType> applyChatTemplate(const std::vector<llama_chat_message>& messages,
+                                                                bool addAssistant = true) const;
+
+   // Converts text into model tokens
+   std::expected<std::vector<llama_token>, ModelErrorType> tokenize(const std::string& text, bool addSpecial) const;
+
+   // Number of tokens a text encodes to, without special tokens - what a chunk passed to sendPrompt
+   // occupies. Roughly a token per four characters when the text cannot be tokenized.
+   size_t countTokens(const std::string& text) const;
+
+   // Measures how surprising every token of a text is to this model, e.g. to find the parts of a
+   // prompt that can be left out. Only available in-process.
+   std::expected<std::vector<TokenSurprisal>, ModelErrorType> scoreText(const std::string& text) const;
+
+   // Compresses the chunks of every later turn before they are tokenized, nullptr to stop. The
+   // compressor's scoring model is usually a small one kept resident next to this one.
+   void setCompressor(std::shared_ptr<PromptCompressor> compressor);
+
+   // Tokens each conversation's sequence may hold - a prompt and its reply must fit in it
+   uint32_t getSequenceContext() const;
+
+   // Tokens a conversation's next turn leaves for reference chunks: the sequence's context less the
+   // history with its system prompt, the prompt itself and the reply the budget expects. Isolated
+   // interfaces keep the history in the worker, so half of what the prompt leaves is kept for it.
+   size_t getContextBudget(const std::string& prompt, const std::string& role = "User",
+                           const GenerationBudget& budget = {}, int32_t conversation = INTERACTIVE_SESSION);
+
+   // Returns true if both models map text to the same token ids, so a prompt tokenized by one can
+   // be decoded by the other as is
+   bool sharesVocab(const ModelInterface& other) const;
+
+   // Returns the worker that owns decoding for this model, nullptr when not loaded
+   inline InferenceEngine* getEngine() const
+   {
+      return m_engine.get();
+   }
+
+   // Returns the file name of the model this interface is for
+   std::string getModelName() const;
 
 private:
 
+   // Makes a conversation's history m_messages, parking the current one; requires m_conversationMutex
+   void activateConversation(int32_t conversation);
+
+   // Frees the strings of a message list
+   static void freeMessages(std::vector<llama_chat_message>& messages);
+
+   // keepVariant for the active conversation; requires m_conversationMutex
+   bool keepActiveVariant(uint32_t variant);
+
+   // Session a variant of a conversation is sampled on, the first is the conversation's own; the
+   // others need reserveVariantSessions. All three require m_conversationMutex.
+   int32_t variantSession(int32_t conversation, uint32_t variant) const;
+
+   // Reserves the sessions of a conversation's extra variants; false when none are left
+   bool reserveVariantSessions(int32_t conversation);
+
+   // Hands back the sessions of a conversation's extra variants once one of its replies is kept
+   void releaseVariantSessions(int32_t conversation);
+
+   // Runs the interactive session over an already tokenized prompt and waits for the reply
+   GenerationResult generateFromTokens(std::vector<llama_token> promptTokens,
+                                       std::vector<std::pair<size_t, size_t>> blockSpans,
+                                       const std::function<bool(const std::string&)>& onToken,
+                                       const GenerationBudget& budget);
+
+   // The chunks as the compressor leaves them, or as they are without one
+   std::vector<std::string> compressChunks(const std::vector<std::string>& chunks) const;
+
+   // Drops chunks from the back until the turn is expected to meet the budget's deadline
+   std::vector<std::string> fitChunks(const std::string& prompt, std::vector<std::string> chunks,
+                                      const GenerationBudget& budget) const;
+
+   // Tokenizes the conversation with reference chunks placed ahead of the newest message
+   std::expected<std::pair<std::vector<llama_token>, std::vector<std::pair<size_t, size_t>>>, ModelErrorType>
+   tokenizeWithChunks(const std::vector<std::string>& chunks);
+
    //
    // llama-cpp specific attributes
    //
@@ -63,11 +250,42 @@ private:
    const llama_vocab* m_vocab;
    llama_context_params m_contextParams;
    llama_context* m_context;
-   llama_sampler* m_sampler;
+   SamplingParams m_samplingParams;
+   // History of the active conversation; the others are parked until their next turn
    std::vector<llama_chat_message> m_messages;
+   int32_t m_activeConversation;
+   std::unordered_map<int32_t, std::vector<llama_chat_message>> m_parkedConversations;
+   // Replies of each conversation's last sendPromptVariants until one of them is kept
+   std::unordered_map<int32_t, std::vector<std::string>> m_variants;
+   // Highest session of the extra variants of each conversation with variants pending, blocks of
+   // sessions handed back, and where the next new block starts
+   std::unordered_map<int32_t, int32_t> m_variantSessions;
+   std::vector<int32_t> m_freeVariantSessions;
+   int32_t m_nextVariantSessions;
    std::vector<char> m_formattedPrompt;
    int m_prevLength;
 
+   // Number of KV sequences (and therefore concurrent requests) the context is sized for
+   uint32_t m_numSlots;
+   // KV cells set aside for the engine's shared prefix cache
+   uint32_t m_prefixCacheCells;
+   // Worker that batches every request against m_context
+   std::unique_ptr<InferenceEngine> m_engine;
+   // Serializes turns of the interactive conversation
+   std::mutex m_conversationMutex;
+   // Set when inference runs in a worker process
+   bool m_isolated;
+   // Supervisor of that worker process
+   std::unique_ptr<ModelWorker> m_worker;
+   // Compresses chunks ahead of every turn when set
+   std::shared_ptr<PromptCompressor> m_compressor;
+   mutable std::mutex m_compressorMutex;
+   // rpc-server endpoints the next load() spreads the model over
+   std::vector<std::string> m_rpcEndpoints;
+   bool m_rpcProfile;
+   // Devices the loaded model is split across, kept alive as long as the model
+   std::unique_ptr<RpcCluster> m_rpcCluster;
+
    // This is the name of the model this interface is for
    std::string m_modelPath;
    // This attribute contains the last 'context' KV string returned from the model
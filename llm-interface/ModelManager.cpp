@@ -76,12 +76,136 @@ std::expected<std::vector<std::pair<std::string, std::string>>, ModelErrorType>
  */
 std::expected<ModelInterface*, ModelErrorType> ModelManager::loadModel(std::string_view modelName)
 {
-   // If a model is already loaded, unload it first
+   // Asking for the model that is already resident is a no-op - several clients may share it
+   if (m_loadedModel != nullptr && m_loadedModel->isLoaded() &&
+       m_loadedModel->getModelName() == std::filesystem::path(std::string(modelName)).filename().string())
+   {
+      return m_loadedModel;
+   }
+
+   // If a model is already loaded, unload it first - the fallback model stays resident
+   if (m_loadedModel != nullptr)
+   {
+      m_loadedModel->unload();
+      m_loadedModel = nullptr;
+   }
+   m_cascade.reset();
+
+   auto loadResp = acquireModel(modelName);
+   if (!loadResp.has_value())
+   {
+      return loadResp;
+   }
+   m_loadedModel = loadResp.value();
+   if (m_fallbackModel == m_loadedModel)
+   {
+      // Promoted to the main model - it can no longer stand in for itself
+      m_fallbackModel = nullptr;
+   }
+   return m_loadedModel;
+}
+
+/**
+ * @brief Loads a smaller model that stays resident next to the loaded one
+ * 
+ * @param modelName The name of the model to keep resident
+ * @return std::expected<ModelInterface*,ModelErrorType>
+ *         Pointer to the fallback ModelInterface on success,
+ *         or ModelErrorType on failure
+ */
+std::expected<ModelInterface*, ModelErrorType> ModelManager::loadFallbackModel(std::string_view modelName)
+{
+   // Both roles share one interface per model file, so the same model cannot fill both
+   if (m_loadedModel != nullptr &&
+       m_loadedModel->getModelName() == std::filesystem::path(std::string(modelName)).filename().string())
+   {
+      return std::unexpected(ModelErrorType::MODEL_IN_USE);
+   }
+
+   if (m_fallbackModel != nullptr)
+   {
+      m_fallbackModel->unload();
+      m_fallbackModel = nullptr;
+   }
+   m_cascade.reset();
+
+   auto loadResp = acquireModel(modelName);
+   if (!loadResp.has_value())
+   {
+      return loadResp;
+   }
+   m_fallbackModel = loadResp.value();
+   return m_fallbackModel;
+}
+
+/**
+ * @brief Unloads the fallback model if one is resident, leaving the loaded model alone
+ */
+void ModelManager::unloadFallbackModel()
+{
+   if (m_fallbackModel != nullptr)
+   {
+      m_fallbackModel->unload();
+      m_fallbackModel = nullptr;
+   }
+   m_cascade.reset();
+}
+
+// This method will unload the current loaded model - if any
+/**
+ * @brief Unloads the currently loaded model if one is active
+ * 
+ * Checks if a model is currently loaded and, if so, unloads it
+ * and resets the m_loadedModel pointer to nullptr. The fallback
+ * model, if any, is unloaded as well.
+ */
+void ModelManager::unloadModel()
+{
    if (m_loadedModel != nullptr)
    {
-      unloadModel();
+      // Call unload on the model interface
+      m_loadedModel->unload();
+      m_loadedModel = nullptr;
+   }
+   if (m_fallbackModel != nullptr)
+   {
+      m_fallbackModel->unload();
+      m_fallbackModel = nullptr;
+   }
+   m_cascade.reset();
+}
+
+/**
+ * @brief Routes requests through the fallback model first, escalating unsure replies to the loaded model
+ * 
+ * @param policy Thresholds deciding when the fallback model's reply is kept
+ * @return std::expected<ModelCascade*,ModelErrorType>
+ *         Pointer to the cascade on success, MODEL_NOT_LOADED if either model is missing
+ *         or runs in a worker process
+ */
+std::expected<ModelCascade*, ModelErrorType> ModelManager::enableCascade(const CascadePolicy& policy /* {} */)
+{
+   // Both engines have to live in this process to score tokens and share prompts
+   if (m_loadedModel == nullptr || m_fallbackModel == nullptr ||
+       m_loadedModel->getEngine() == nullptr || m_fallbackModel->getEngine() == nullptr)
+   {
+      return std::unexpected(ModelErrorType::MODEL_NOT_LOADED);
+   }
+
+   if (m_cascade)
+   {
+      m_cascade->setPolicy(policy);
    }
+   else
+   {
+      m_cascade = std::make_unique<ModelCascade>(m_fallbackModel, m_loadedModel, policy);
+   }
+   return m_cascade.get();
+}
 
+// Finds or creates the interface for a model file and makes sure it is loaded
+std::expected<ModelInterface*, ModelErrorType> ModelManager::acquireModel(std::string_view modelName)
+{
    // Check if the model directory is set
    if (m_modelsDir.empty())
    {
@@ -106,21 +230,23 @@ std::expected<ModelInterface*, ModelErrorType> ModelManager::loadModel(std::stri
       
       if (!modelInterface->isLoaded())
       {
+         modelInterface->setRpcEndpoints(m_rpcEndpoints, m_rpcProfile);
          if (!modelInterface->load())
          {
             return std::unexpected(ModelErrorType::MODEL_LOAD_ERROR);
          }
       }
       
-      m_loadedModel = modelInterface;
-      return m_loadedModel;
+      return modelInterface;
    }
    else
    {
       // Create a new model interface
       try
       {
-         ModelInterface* modelInterface = new ModelInterface(modelPath);
+         ModelInterface* modelInterface = new ModelInterface(modelPath, m_sequenceSlots, m_prefixCacheCells);
+         modelInterface->setIsolated(m_isolatedWorkers);
+         modelInterface->setRpcEndpoints(m_rpcEndpoints, m_rpcProfile);
          
          // Try to load the model
          if (!modelInterface->load())
@@ -129,11 +255,10 @@ std::expected<ModelInterface*, ModelErrorType> ModelManager::loadModel(std::stri
             return std::unexpected(ModelErrorType::MODEL_LOAD_ERROR);
          }
          
-         // Add to the map and set as loaded model
+         // Add to the map so later loads reuse the interface
          m_modelMap[std::string(modelName)] = modelInterface;
-         m_loadedModel = modelInterface;
          
-         return m_loadedModel;
+         return modelInterface;
       }
       catch (const std::exception& e)
       {
@@ -141,20 +266,3 @@ std::expected<ModelInterface*, ModelErrorType> ModelManager::loadModel(std::stri
       }
    }
 }
-
-// This method will unload the current loaded model - if any
-/**
- * @brief Unloads the currently loaded model if one is active
- * 
- * Checks if a model is currently loaded and, if so, unloads it
- * and resets the m_loadedModel pointer to nullptr
- */
-void ModelManager::unloadModel()
-{
-   if (m_loadedModel != nullptr)
-   {
-      // Call unload on the model interface
-      m_loadedModel->unload();
-      m_loadedModel = nullptr;
-   }
-}
\ No newline at end of file
@@ -8,12 +8,14 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <thread>
 #include <mutex>
 #include <memory>
 #include <expected>
 #include "ModelConstants.h"
 #include "ModelInterface.h"
+#include "ModelCascade.h"
 
 class ModelManager
 {
@@ -41,6 +43,58 @@ public:
       m_modelsDir = path;
    }
 
+   /**
+    * @brief Sets how many KV sequences each newly created model context is sized for
+    * 
+    * @param slots Number of requests that may decode concurrently against one model
+    */
+   inline void setSequenceSlots(uint32_t slots)
+   {
+      m_sequenceSlots = slots;
+   }
+
+   /**
+    * @brief Sets how many KV cells newly created model contexts reserve for shared prompt prefixes
+    * 
+    * @param cells Size of the prefix cache in tokens, 0 disables it
+    */
+   inline void setPrefixCacheCells(uint32_t cells)
+   {
+      m_prefixCacheCells = cells;
+   }
+
+   /**
+    * @brief Runs newly loaded models in a supervised worker process instead of this one
+    * 
+    * @param isolated True to isolate inference from the calling process
+    */
+   inline void setIsolatedWorkers(bool isolated)
+   {
+      m_isolatedWorkers = isolated;
+   }
+
+   /**
+    * @brief Spreads newly loaded models over llama.cpp rpc-server processes on other machines
+    * 
+    * @param endpoints rpc-server addresses as "host:port", empty to load models locally
+    * @param profile True to time every graph node per machine, see ModelInterface::getRpcStats
+    */
+   inline void setRpcEndpoints(std::vector<std::string> endpoints, bool profile = false)
+   {
+      m_rpcEndpoints = std::move(endpoints);
+      m_rpcProfile = profile;
+   }
+
+   /**
+    * @brief Returns the model that is currently loaded, nullptr if none
+    * 
+    * @return ModelInterface* Pointer to the loaded model interface
+    */
+   inline ModelInterface* getLoadedModel() const
+   {
+      return m_loadedModel;
+   }
+
    /**
     * @brief Retrieves a list of all available LLM models in the models directory
     * 
@@ -60,11 +114,62 @@ public:
     */
    std::expected<ModelInterface*,ModelErrorType> loadModel(std::string_view modelName);
 
+   /**
+    * @brief Loads a smaller model that stays resident next to the loaded one
+    * 
+    * Requests whose deadline the loaded model is not expected to meet can be answered by the
+    * fallback model instead.
+    * 
+    * @param modelName The name of the model to keep resident
+    * @return std::expected<ModelInterface*,ModelErrorType>
+    *         Pointer to the fallback ModelInterface on success,
+    *         or ModelErrorType on failure
+    */
+   std::expected<ModelInterface*,ModelErrorType> loadFallbackModel(std::string_view modelName);
+
+   /**
+    * @brief Unloads the fallback model if one is resident, leaving the loaded model alone
+    */
+   void unloadFallbackModel();
+
+   /**
+    * @brief Returns the resident fallback model, nullptr if none
+    * 
+    * @return ModelInterface* Pointer to the fallback model interface
+    */
+   inline ModelInterface* getFallbackModel() const
+   {
+      return m_fallbackModel;
+   }
+
+   /**
+    * @brief Routes requests through the fallback model first, escalating unsure replies to the loaded model
+    * 
+    * The cascade is dropped whenever either model is replaced or unloaded and has to be enabled again.
+    * 
+    * @param policy Thresholds deciding when the fallback model's reply is kept
+    * @return std::expected<ModelCascade*,ModelErrorType>
+    *         Pointer to the cascade on success, MODEL_NOT_LOADED if either model is missing
+    *         or runs in a worker process
+    */
+   std::expected<ModelCascade*,ModelErrorType> enableCascade(const CascadePolicy& policy = {});
+
+   /**
+    * @brief Returns the active cascade, nullptr if none
+    * 
+    * @return ModelCascade* Pointer to the cascade
+    */
+   inline ModelCascade* getCascade() const
+   {
+      return m_cascade.get();
+   }
+
    /**
     * @brief Unloads the currently loaded model if one is active
     * 
     * Checks if a model is currently loaded and, if so, unloads it
-    * and resets the m_loadedModel pointer to nullptr
+    * and resets the m_loadedModel pointer to nullptr. The fallback
+    * model, if any, is unloaded as well.
     */
    void unloadModel();
 
@@ -75,7 +180,7 @@ protected:
     * 
     * Initializes the loaded model pointer to nullptr
     */
-   ModelManager() : m_loadedModel(nullptr)
+   ModelManager() : m_loadedModel(nullptr), m_fallbackModel(nullptr), m_sequenceSlots(4), m_prefixCacheCells(0), m_isolatedWorkers(false), m_rpcProfile(false)
    {
       m_modelMap.clear();
       m_modelsDir = "";
@@ -101,6 +206,9 @@ private:
     */
    ModelManager& operator=(const ModelManager& rhs) = delete;
 
+   // Finds or creates the interface for a model file and makes sure it is loaded
+   std::expected<ModelInterface*,ModelErrorType> acquireModel(std::string_view modelName);
+
    // Map that maps the name of the LLM to the instance of ModelInterface that
    // controls the interaction with the LLM
    //
@@ -110,8 +218,24 @@ private:
    // Pointer to the model that is currently loaded in memory
    ModelInterface* m_loadedModel;
 
+   // Smaller model kept resident for requests the loaded model cannot answer in time
+   ModelInterface* m_fallbackModel;
+
+   // Small-to-large routing between the fallback and the loaded model, when enabled
+   std::unique_ptr<ModelCascade> m_cascade;
+
    // This holds the path to the directory to search for models
    std::string m_modelsDir;
+
+   // Number of KV sequences newly created model interfaces are sized for
+   uint32_t m_sequenceSlots;
+   // KV cells each new model context reserves for its prefix cache
+   uint32_t m_prefixCacheCells;
+   // When set models are hosted by smart-agent-worker processes
+   bool m_isolatedWorkers;
+   // rpc-server endpoints newly loaded models are split across
+   std::vector<std::string> m_rpcEndpoints;
+   bool m_rpcProfile;
 };
 
 
@@ -0,0 +1,850 @@
+/**
+ * @file ModelWorker.cpp
+ * @brief Supervisor for a model running in a separate smart-agent-worker process. Prompts travel to
+ *        the worker and generated pieces travel back through a pair of shared-memory rings, so a
+ *        crash in llama.cpp or the GPU driver takes down the worker instead of the caller. A dead
+ *        worker is restarted and resumes from the checkpoint written after its last completed turn.
+ */
+
+#include "ModelWorker.h"
+#include "SessionSnapshot.h"
+#include <iostream>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <csignal>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+using WorkerProtocol::Record;
+
+namespace
+{
+   // How often a blocked read checks whether the worker is still alive
+   const std::chrono::milliseconds LIVENESS_INTERVAL(100);
+
+   // How long a request may wait for room in the worker's ring
+   const std::chrono::milliseconds REQUEST_TIMEOUT(5000);
+
+   // How long a turn may go without a record from the worker before it is taken to be hung. Generous,
+   // as prefilling a long prompt on a CPU produces nothing to read for a while.
+   const std::chrono::seconds STALL_TIMEOUT(300);
+
+   // How long the worker gets to exit after Shutdown before it is killed
+   const std::chrono::milliseconds SHUTDOWN_GRACE(2000);
+
+   // Restarts allowed without a completed turn in between before the supervisor gives up
+   const uint32_t MAX_CONSECUTIVE_RESTARTS = 3;
+
+   // Distinguishes the rings of several workers owned by one process
+   std::atomic<uint32_t> g_nextWorkerId(1);
+
+   // Reads the fields Done and VariantDone records share
+   bool readCompletion(WireReader& reader, GenerationResult& result)
+   {
+      uint8_t reason = 0;
+      if(!reader.u8(reason) || !reader.i32(result.promptTokens) || !reader.i32(result.cachedTokens) ||
+         !reader.i32(result.generatedTokens) || !reader.f64(result.queueMs) || !reader.f64(result.prefillMs) ||
+         !reader.f64(result.decodeMs))
+      {
+         return false;
+      }
+      result.stopReason = static_cast<GenerationStopReason>(reason);
+      result.truncated = result.stopReason == GenerationStopReason::Deadline ||
+                         result.stopReason == GenerationStopReason::MaxTokens;
+      return true;
+   }
+}
+
+/**
+ * @brief Describes the worker to launch, nothing is started until start() is called
+ *
+ * @param modelPath Model file the worker loads
+ * @param numSlots Number of KV sequences the worker's context is sized for
+ * @param prefixCacheCells KV cells the worker sets aside for prompt prefixes shared between conversations
+ */
+ModelWorker::ModelWorker(std::string modelPath, uint32_t numSlots, uint32_t prefixCacheCells /* 0 */) :
+ m_modelPath(std::move(modelPath)),
+ m_numSlots(numSlots),
+ m_prefixCacheCells(prefixCacheCells),
+ m_pid(-1),
+ m_restarts(0),
+ m_consecutiveRestarts(0)
+{
+   const std::string tag = std::to_string(getpid()) + "-" + std::to_string(g_nextWorkerId++);
+   m_checkpointPath = (std::filesystem::temp_directory_path() / ("smart-agent-" + tag + ".snap")).string();
+}
+
+/**
+ * @brief Shuts the worker down and removes its checkpoints
+ */
+ModelWorker::~ModelWorker()
+{
+   shutdown();
+   std::error_code ec;
+   for(const auto& [conversation, messages] : m_conversations)
+   {
+      std::filesystem::remove(WorkerProtocol::checkpointFile(m_checkpointPath, conversation), ec);
+   }
+}
+
+/**
+ * @brief Launches the worker and waits until it has loaded the model
+ *
+ * @return true The worker is ready for prompts
+ * @return false The worker could not be launched or failed to load the model
+ */
+bool ModelWorker::start()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   if(!spawn())
+   {
+      return false;
+   }
+   if(!waitReady())
+   {
+      shutdown();
+      return false;
+   }
+   return true;
+}
+
+/**
+ * @brief Asks the worker to exit, killing it if it does not do so promptly
+ */
+void ModelWorker::shutdown()
+{
+   if(m_pid <= 0)
+   {
+      return;
+   }
+
+   const uint8_t shutdownRecord = static_cast<uint8_t>(Record::Shutdown);
+   if(m_requests)
+   {
+      m_requests->write(&shutdownRecord, 1, LIVENESS_INTERVAL);
+   }
+
+   const auto deadline = std::chrono::steady_clock::now() + SHUTDOWN_GRACE;
+   while(checkAlive() && std::chrono::steady_clock::now() < deadline)
+   {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   }
+   if(m_pid > 0)
+   {
+      kill(m_pid, SIGKILL);
+      waitpid(m_pid, nullptr, 0);
+      m_pid = -1;
+   }
+}
+
+/**
+ * @brief Forgets a conversation and frees its KV sequence in the worker
+ */
+void ModelWorker::closeConversation(int32_t conversation)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_variants.erase(conversation);
+   if(m_conversations.erase(conversation) == 0)
+   {
+      return;
+   }
+   std::error_code ec;
+   std::filesystem::remove(WorkerProtocol::checkpointFile(m_checkpointPath, conversation), ec);
+   if(m_pid > 0)
+   {
+      WireWriter close;
+      close.u8(static_cast<uint8_t>(Record::Close)).i32(conversation);
+      m_requests->write(close.data().data(), static_cast<uint32_t>(close.data().size()), REQUEST_TIMEOUT);
+   }
+}
+
+/**
+ * @brief Has the worker prefill chunks into stored KV blocks, see ModelInterface::prefetchChunks
+ */
+void ModelWorker::prefetchChunks(const std::vector<std::string>& chunks)
+{
+   if(chunks.empty())
+   {
+      return;
+   }
+   WireWriter prefetch;
+   prefetch.u8(static_cast<uint8_t>(Record::Prefetch)).u32(static_cast<uint32_t>(chunks.size()));
+   for(const auto& chunk : chunks)
+   {
+      prefetch.str(chunk);
+   }
+
+   std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+   if(!lock.owns_lock())
+   {
+      // A turn is streaming - its reading loop is the only writer of the request ring until it ends
+      std::lock_guard<std::mutex> queued(m_prefetchMutex);
+      m_prefetch.push_back(prefetch.data());
+      return;
+   }
+   if(m_pid > 0)
+   {
+      m_requests->write(prefetch.data().data(), static_cast<uint32_t>(prefetch.data().size()), REQUEST_TIMEOUT);
+   }
+}
+
+/**
+ * @brief Copies a conversation as of its last completed turn to a SessionSnapshot file
+ *
+ * @param path Destination file
+ * @param conversation Conversation to save
+ * @return bool False if there is no conversation yet or the file could not be written
+ */
+bool ModelWorker::saveSnapshot(const std::string& path, int32_t conversation /* 0 */)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   auto iter = m_conversations.find(conversation);
+   if(iter == m_conversations.end() || iter->second.empty())
+   {
+      return false;
+   }
+   // The worker rewrites the checkpoint before acknowledging each turn, so it is never behind the messages
+   std::error_code ec;
+   const std::string temp = path + ".tmp";
+   if(std::filesystem::copy_file(WorkerProtocol::checkpointFile(m_checkpointPath, conversation), temp,
+                                 std::filesystem::copy_options::overwrite_existing, ec))
+   {
+      std::filesystem::rename(temp, path, ec);
+      if(!ec)
+      {
+         return true;
+      }
+      std::filesystem::remove(temp, ec);
+   }
+
+   // No checkpoint to copy - the messages alone still resume the conversation, with a prefill
+   SessionSnapshotContents contents;
+   contents.modelName = std::filesystem::path(m_modelPath).filename().string();
+   contents.messages = iter->second;
+   return SessionSnapshot::write(path, contents);
+}
+
+/**
+ * @brief Resumes a conversation from a SessionSnapshot file, KV state included
+ *
+ * @param path File written by saveSnapshot or ModelInterface::saveSnapshot
+ * @param conversation Conversation the snapshot becomes
+ * @return bool False if the snapshot is unreadable or the worker could not be primed with it
+ */
+bool ModelWorker::restoreSnapshot(const std::string& path, int32_t conversation /* 0 */)
+{
+   auto opened = SessionSnapshot::open(path);
+   if(!opened.has_value())
+   {
+      return false;
+   }
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_conversations[conversation] = opened.value()->getMessages();
+   // The checkpoint is what a worker restores from, so the snapshot becomes it
+   const std::string checkpoint = WorkerProtocol::checkpointFile(m_checkpointPath, conversation);
+   std::error_code ec;
+   if(!std::filesystem::copy_file(path, checkpoint, std::filesystem::copy_options::overwrite_existing, ec))
+   {
+      std::filesystem::remove(checkpoint, ec);
+   }
+   return m_pid > 0 && sendRestore(conversation);
+}
+
+/**
+ * @brief Returns true while a worker process is up
+ */
+bool ModelWorker::isRunning()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return checkAlive();
+}
+
+/**
+ * @brief Sends a conversation turn to the worker and streams the reply through a callback
+ *
+ * @param prompt Message content
+ * @param role "User" or "System"
+ * @param onToken Called for every streamed piece
+ * @param chunks Reference material for this turn, see ModelInterface::sendPrompt
+ * @param budget Deadline and token budget, the deadline travels as time remaining
+ * @param conversation Conversation the turn belongs to, see ModelInterface::sendPrompt
+ */
+GenerationResult ModelWorker::sendPrompt(const std::string& prompt, const std::string& role,
+                                         const std::function<bool(const std::string&)>& onToken,
+                                         const std::vector<std::string>& chunks /* {} */,
+                                         const GenerationBudget& budget /* {} */,
+                                         int32_t conversation /* 0 */)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   GenerationResult result;
+   result.stopReason = GenerationStopReason::DecodeError;
+
+   // A worker that died between turns is brought back before the prompt goes out
+   if(!checkAlive() && !restart())
+   {
+      return result;
+   }
+   // The worker keeps the first of any variants left undecided before the turn
+   recordVariant(conversation, 0);
+   flushPrefetch(false);
+
+   WireWriter request;
+   request.u8(static_cast<uint8_t>(Record::Prompt)).i32(conversation).str(role).str(prompt)
+          .u32(static_cast<uint32_t>(chunks.size()));
+   for(const auto& chunk : chunks)
+   {
+      request.str(chunk);
+   }
+   // Clocks are not shared with the worker, so the deadline goes over as time remaining
+   request.i32(budget.maxTokens).f64(budget.hasDeadline() ? std::max(0.0, budget.remainingMs()) : -1.0);
+   if(!sendRequest(request.data()))
+   {
+      return result;
+   }
+
+   bool cancelled = false;
+   std::string record;
+   auto lastRecord = std::chrono::steady_clock::now();
+   while(true)
+   {
+      if(!readResponse(record, lastRecord))
+      {
+         return result;
+      }
+      if(record.empty())
+      {
+         continue;
+      }
+
+      const Record kind = static_cast<Record>(static_cast<uint8_t>(record[0]));
+      if(kind == Record::Piece)
+      {
+         const std::string piece = record.substr(1);
+         result.text += piece;
+         if(!cancelled && onToken && !onToken(piece))
+         {
+            // The worker checks for this between tokens and finishes the turn early
+            cancelled = true;
+            const uint8_t cancelRecord = static_cast<uint8_t>(Record::Cancel);
+            m_requests->write(&cancelRecord, 1, LIVENESS_INTERVAL);
+         }
+         // Chunks asked for while this reply streams are prefilled between its tokens
+         flushPrefetch(true);
+         continue;
+      }
+      if(kind != Record::Done)
+      {
+         continue;
+      }
+
+      WireReader reader(record);
+      uint8_t tag = 0;
+      if(!reader.u8(tag) || !readCompletion(reader, result))
+      {
+         #ifdef _DEBUG
+            std::cout << "Malformed completion record from worker..." << std::endl;
+         #endif
+         return result;
+      }
+
+      // Mirror the worker's history so a replacement can be primed with it
+      auto& messages = m_conversations[conversation];
+      messages.emplace_back(role, prompt);
+      messages.emplace_back("assistant", result.text);
+      m_consecutiveRestarts = 0;
+      return result;
+   }
+}
+
+/**
+ * @brief Samples several replies to a prompt side by side, see ModelInterface::sendPromptVariants
+ *
+ * @param prompt Message content
+ * @param role "User" or "System"
+ * @param count Number of replies to sample
+ * @param onToken Called with the variant index for every streamed piece; returning false stops every variant
+ * @param chunks Reference material for this turn, see ModelInterface::sendPrompt
+ * @param conversation Conversation the turn belongs to
+ */
+std::vector<GenerationResult> ModelWorker::sendPromptVariants(const std::string& prompt, const std::string& role, uint32_t count,
+                                                              const std::function<bool(uint32_t, const std::string&)>& onToken,
+                                                              const std::vector<std::string>& chunks /* {} */,
+                                                              int32_t conversation /* 0 */)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   std::vector<GenerationResult> results(count);
+   for(auto& result : results)
+   {
+      result.stopReason = GenerationStopReason::DecodeError;
+   }
+   if(count == 0 || (!checkAlive() && !restart()))
+   {
+      return results;
+   }
+   recordVariant(conversation, 0);
+
+   WireWriter request;
+   request.u8(static_cast<uint8_t>(Record::Variants)).i32(conversation).u32(count).str(role).str(prompt)
+          .u32(static_cast<uint32_t>(chunks.size()));
+   for(const auto& chunk : chunks)
+   {
+      request.str(chunk);
+   }
+   if(!sendRequest(request.data()))
+   {
+      return results;
+   }
+
+   // The worker may sample fewer variants than asked for, it completes each one it ran and then
+   // ends the turn with a plain Done
+   uint32_t completed = 0;
+   bool cancelled = false;
+   std::string record;
+   auto lastRecord = std::chrono::steady_clock::now();
+   while(true)
+   {
+      if(!readResponse(record, lastRecord))
+      {
+         return results;
+      }
+      if(record.empty())
+      {
+         continue;
+      }
+
+      WireReader reader(record);
+      uint8_t tag = 0;
+      uint32_t variant = 0;
+      reader.u8(tag);
+      const Record kind = static_cast<Record>(tag);
+      if(kind == Record::Done)
+      {
+         results.resize(completed);
+         PendingVariants& pending = m_variants[conversation];
+         pending.role = role;
+         pending.prompt = prompt;
+         pending.replies.clear();
+         for(const auto& result : results)
+         {
+            pending.replies.push_back(result.text);
+         }
+         m_consecutiveRestarts = 0;
+         return results;
+      }
+      if(!reader.u32(variant) || variant >= count)
+      {
+         continue;
+      }
+      if(kind == Record::VariantPiece)
+      {
+         const std::string piece = record.substr(1 + sizeof(uint32_t));
+         results[variant].text += piece;
+         if(!cancelled && onToken && !onToken(variant, piece))
+         {
+            cancelled = true;
+            const uint8_t cancelRecord = static_cast<uint8_t>(Record::Cancel);
+            m_requests->write(&cancelRecord, 1, LIVENESS_INTERVAL);
+         }
+      }
+      else if(kind == Record::VariantDone && readCompletion(reader, results[variant]))
+      {
+         completed = std::max(completed, variant + 1);
+      }
+   }
+}
+
+/**
+ * @brief Makes one of the replies of sendPromptVariants the conversation's reply
+ *
+ * @param variant Index of the reply to keep
+ * @param conversation Conversation the replies belong to
+ * @return bool False if there are no replies to pick from, e.g. because the worker was restarted since
+ */
+bool ModelWorker::keepVariant(uint32_t variant, int32_t conversation /* 0 */)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   auto pending = m_variants.find(conversation);
+   if(pending == m_variants.end() || variant >= pending->second.replies.size() || !checkAlive())
+   {
+      return false;
+   }
+
+   WireWriter keep;
+   keep.u8(static_cast<uint8_t>(Record::Keep)).i32(conversation).u32(variant);
+   if(!sendRequest(keep.data()))
+   {
+      return false;
+   }
+   // Wait for the worker's checkpoint to hold the kept reply, as it does after every turn
+   std::string record;
+   auto lastRecord = std::chrono::steady_clock::now();
+   while(true)
+   {
+      if(!readResponse(record, lastRecord))
+      {
+         return false;
+      }
+      if(record.empty() || static_cast<Record>(static_cast<uint8_t>(record[0])) != Record::Kept)
+      {
+         continue;
+      }
+      if(record.size() > 1 && record[1] != 0)
+      {
+         recordVariant(conversation, variant);
+         return true;
+      }
+      m_variants.erase(conversation);
+      return false;
+   }
+}
+
+/**
+ * @brief Answers independent prompts behind a common system prompt in one go, see ModelInterface::fanOut
+ *
+ * @param systemPrompt System message every prompt is answered under
+ * @param prompts User messages, one per task
+ * @param maxTokens Reply budget of each task
+ */
+std::vector<GenerationResult> ModelWorker::fanOut(const std::string& systemPrompt, const std::vector<std::string>& prompts,
+                                                  int32_t maxTokens)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+
+   std::vector<GenerationResult> results(prompts.size());
+   for(auto& result : results)
+   {
+      result.stopReason = GenerationStopReason::DecodeError;
+   }
+   if(prompts.empty() || (!checkAlive() && !restart()))
+   {
+      return results;
+   }
+
+   WireWriter request;
+   request.u8(static_cast<uint8_t>(Record::FanOut)).str(systemPrompt).u32(static_cast<uint32_t>(prompts.size()));
+   for(const auto& prompt : prompts)
+   {
+      request.str(prompt);
+   }
+   request.i32(maxTokens);
+   if(!sendRequest(request.data()))
+   {
+      return results;
+   }
+
+   std::string record;
+   auto lastRecord = std::chrono::steady_clock::now();
+   while(true)
+   {
+      if(!readResponse(record, lastRecord))
+      {
+         return results;
+      }
+      if(record.empty())
+      {
+         continue;
+      }
+
+      WireReader reader(record);
+      uint8_t tag = 0;
+      reader.u8(tag);
+      const Record kind = static_cast<Record>(tag);
+      if(kind == Record::Done)
+      {
+         m_consecutiveRestarts = 0;
+         return results;
+      }
+      uint32_t index = 0;
+      if(kind != Record::TaskDone || !reader.u32(index) || index >= results.size())
+      {
+         continue;
+      }
+      GenerationResult result;
+      if(reader.str(result.text) && readCompletion(reader, result))
+      {
+         results[index] = std::move(result);
+      }
+   }
+}
+
+// Creates the rings and spawns the worker process
+bool ModelWorker::spawn()
+{
+   if(!m_requests || !m_responses)
+   {
+      const std::string base = "/smart-agent-w" + std::to_string(getpid()) + "-" + std::to_string(g_nextWorkerId++);
+      auto requests = ShmRing::create(base + "-req", WorkerProtocol::RING_CAPACITY);
+      auto responses = ShmRing::create(base + "-rsp", WorkerProtocol::RING_CAPACITY);
+      if(!requests.has_value() || !responses.has_value())
+      {
+         std::cerr << "Error : failed to create the model worker rings" << std::endl;
+         return false;
+      }
+      m_requests = std::move(requests.value());
+      m_responses = std::move(responses.value());
+   }
+   else
+   {
+      // The previous worker is gone, nothing can be touching the rings
+      m_requests->reset();
+      m_responses->reset();
+   }
+
+   const std::string executable = locateExecutable();
+   const std::string slots = std::to_string(m_numSlots);
+   const std::string prefixCache = std::to_string(m_prefixCacheCells);
+   std::vector<std::string> args = {
+      executable,
+      "--model", m_modelPath,
+      "--slots", slots,
+      "--prefix-cache", prefixCache,
+      "--requests", m_requests->getName(),
+      "--responses", m_responses->getName(),
+      "--checkpoint", m_checkpointPath
+   };
+   std::vector<char*> argv;
+   for(auto& arg : args)
+   {
+      argv.push_back(arg.data());
+   }
+   argv.push_back(nullptr);
+
+   pid_t pid = -1;
+   const int rc = executable.find('/') == std::string::npos
+                     ? posix_spawnp(&pid, executable.c_str(), nullptr, nullptr, argv.data(), environ)
+                     : posix_spawn(&pid, executable.c_str(), nullptr, nullptr, argv.data(), environ);
+   if(rc != 0)
+   {
+      std::cerr << "Error : failed to launch " << executable << std::endl;
+      return false;
+   }
+   m_pid = pid;
+
+   #ifdef _DEBUG
+      std::cout << "Launched model worker " << m_pid << " for " << m_modelPath << std::endl;
+   #endif
+   return true;
+}
+
+// Waits for the worker's Ready record while it loads the model
+bool ModelWorker::waitReady()
+{
+   std::string record;
+   while(true)
+   {
+      if(!m_responses->read(record, LIVENESS_INTERVAL))
+      {
+         if(m_responses->isBroken() || !checkAlive())
+         {
+            return false;
+         }
+         continue;
+      }
+      if(record.empty())
+      {
+         continue;
+      }
+      const Record kind = static_cast<Record>(static_cast<uint8_t>(record[0]));
+      if(kind == Record::Ready)
+      {
+         return true;
+      }
+      if(kind == Record::LoadFailed)
+      {
+         return false;
+      }
+   }
+}
+
+// Reaps the worker if it has exited; returns true while it is still running
+bool ModelWorker::checkAlive()
+{
+   if(m_pid <= 0)
+   {
+      return false;
+   }
+   int status = 0;
+   const pid_t rc = waitpid(m_pid, &status, WNOHANG);
+   if(rc == 0)
+   {
+      return true;
+   }
+   #ifdef _DEBUG
+      if(rc == m_pid && WIFSIGNALED(status))
+      {
+         std::cout << "Model worker " << m_pid << " killed by signal " << WTERMSIG(status) << std::endl;
+      }
+   #endif
+   m_pid = -1;
+   return false;
+}
+
+// Kills whatever is left of the worker and launches a new one that resumes every conversation
+bool ModelWorker::restart()
+{
+   if(m_consecutiveRestarts >= MAX_CONSECUTIVE_RESTARTS)
+   {
+      std::cerr << "Error : model worker keeps failing, giving up on " << m_modelPath << std::endl;
+      return false;
+   }
+   m_consecutiveRestarts++;
+   m_restarts++;
+   // Undecided variants only lived in the worker
+   m_variants.clear();
+
+   if(m_pid > 0)
+   {
+      kill(m_pid, SIGKILL);
+      waitpid(m_pid, nullptr, 0);
+      m_pid = -1;
+   }
+   if(!spawn() || !waitReady())
+   {
+      return false;
+   }
+
+   for(const auto& [conversation, messages] : m_conversations)
+   {
+      if(!sendRestore(conversation))
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+// Primes the worker with a conversation's messages and the KV state in its checkpoint
+bool ModelWorker::sendRestore(int32_t conversation)
+{
+   // The worker reloads the KV cache from the checkpoint so only turns after it need to be
+   // prefilled again
+   const auto& messages = m_conversations[conversation];
+   WireWriter restore;
+   restore.u8(static_cast<uint8_t>(Record::Restore)).i32(conversation).u32(static_cast<uint32_t>(messages.size()));
+   for(const auto& [role, content] : messages)
+   {
+      restore.str(role).str(content);
+   }
+   if(!m_requests->write(restore.data().data(), static_cast<uint32_t>(restore.data().size()), REQUEST_TIMEOUT))
+   {
+      std::cerr << "Error : model worker did not accept the history of conversation " << conversation << std::endl;
+      return false;
+   }
+   return true;
+}
+
+// Writes a request for the turn in flight; a worker that does not take it is restarted and false returned
+bool ModelWorker::sendRequest(const std::string& request)
+{
+   if(m_requests->write(request.data(), static_cast<uint32_t>(request.size()), REQUEST_TIMEOUT))
+   {
+      return true;
+   }
+   // The ring may hold part of the request, only a fresh worker starts from clean rings
+   std::cerr << "Error : model worker did not accept a request, restarting from the last checkpoint" << std::endl;
+   restart();
+   return false;
+}
+
+// Waits for the worker's next record; a worker that died or stopped making progress is restarted and
+// false returned
+bool ModelWorker::readResponse(std::string& record, std::chrono::steady_clock::time_point& lastRecord)
+{
+   while(!m_responses->read(record, LIVENESS_INTERVAL))
+   {
+      if(m_responses->isBroken())
+      {
+         std::cerr << "Error : model worker corrupted its response ring, restarting from the last checkpoint" << std::endl;
+         restart();
+         return false;
+      }
+      if(!checkAlive())
+      {
+         std::cerr << "Error : model worker exited mid-turn, restarting from the last checkpoint" << std::endl;
+         restart();
+         return false;
+      }
+      if(std::chrono::steady_clock::now() - lastRecord > STALL_TIMEOUT)
+      {
+         std::cerr << "Error : model worker stopped making progress, restarting from the last checkpoint" << std::endl;
+         restart();
+         return false;
+      }
+   }
+   lastRecord = std::chrono::steady_clock::now();
+   return true;
+}
+
+// Mirrors the worker keeping a variant into a conversation's history
+void ModelWorker::recordVariant(int32_t conversation, uint32_t variant)
+{
+   auto pending = m_variants.find(conversation);
+   if(pending == m_variants.end())
+   {
+      return;
+   }
+   if(variant < pending->second.replies.size())
+   {
+      auto& messages = m_conversations[conversation];
+      messages.emplace_back(pending->second.role, pending->second.prompt);
+      messages.emplace_back("assistant", pending->second.replies[variant]);
+   }
+   m_variants.erase(pending);
+}
+
+// Writes the prefetch records queued while a turn held the rings; must be called with m_mutex held
+void ModelWorker::flushPrefetch(bool midTurn)
+{
+   std::vector<std::string> records;
+   {
+      std::lock_guard<std::mutex> queued(m_prefetchMutex);
+      records.swap(m_prefetch);
+   }
+   if(m_pid <= 0)
+   {
+      return;
+   }
+   std::vector<std::string> deferred;
+   for(auto& record : records)
+   {
+      // The worker only picks up single-record controls between a turn's pieces; a record that needs
+      // fragments goes out before the next turn instead, when the worker reads whole messages
+      if(midTurn && record.size() + sizeof(uint32_t) > WorkerProtocol::RING_CAPACITY / 2)
+      {
+         deferred.push_back(std::move(record));
+      }
+      else if(!m_requests->write(record.data(), static_cast<uint32_t>(record.size()), midTurn ? LIVENESS_INTERVAL : REQUEST_TIMEOUT))
+      {
+         std::cerr << "Error : model worker did not accept chunks to prefetch" << std::endl;
+      }
+   }
+   if(!deferred.empty())
+   {
+      std::lock_guard<std::mutex> queued(m_prefetchMutex);
+      m_prefetch.insert(m_prefetch.begin(), std::make_move_iterator(deferred.begin()), std::make_move_iterator(deferred.end()));
+   }
+}
+
+// Full path of the worker executable
+std::string ModelWorker::locateExecutable()
+{
+   // Prefer the copy installed alongside this program so GUI and worker always match
+   std::error_code ec;
+   const std::filesystem::path self = std::filesystem::read_symlink("/proc/self/exe", ec);
+   if(!ec)
+   {
+      const std::filesystem::path sibling = self.parent_path() / WorkerProtocol::WORKER_EXECUTABLE;
+      if(std::filesystem::exists(sibling, ec))
+      {
+         return sibling.string();
+      }
+   }
+   return WorkerProtocol::WORKER_EXECUTABLE;
+}
@@ -0,0 +1,244 @@
+/**
+ * @file ModelWorker.h
+ * @brief Supervisor for a model running in a separate smart-agent-worker process. Prompts travel to
+ *        the worker and generated pieces travel back through a pair of shared-memory rings, so a
+ *        crash in llama.cpp or the GPU driver takes down the worker instead of the caller. A dead
+ *        worker is restarted and resumes from the checkpoint written after its last completed turn.
+ */
+#ifndef MODEL_WORKER_H
+#define MODEL_WORKER_H
+
+#include "InferenceEngine.h"
+#include "ShmRing.h"
+#include "DaemonProtocol.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace WorkerProtocol
+{
+   // Name of the worker executable, looked up next to the running executable and then on PATH
+   const char* const WORKER_EXECUTABLE = "smart-agent-worker";
+
+   // Capacity of each direction's ring; larger records, e.g. a FanOut over many files or a Restore of a
+   // long history, travel in fragments
+   const size_t RING_CAPACITY = 1024 * 1024;
+
+   // First byte of every ring record
+   enum class Record : uint8_t
+   {
+      // supervisor -> worker
+      Prompt = 1,       // i32 conversation, str role, str text, u32 count, count x str chunk, i32 maxTokens, f64 ms to deadline (< 0 none)
+      Restore,          // i32 conversation, u32 count, count x (str role, str content)
+      Cancel,           // (empty) - stops the turn in flight
+      Shutdown,         // (empty)
+      Close,            // i32 conversation
+      Variants,         // i32 conversation, u32 variants, str role, str text, u32 count, count x str chunk
+      Keep,             // i32 conversation, u32 variant
+      FanOut,           // str system, u32 count, count x str prompt, i32 maxTokens
+      Prefetch,         // u32 count, count x str chunk - also accepted while a turn streams
+
+      // worker -> supervisor
+      Ready = 64,       // (empty)
+      LoadFailed,       // (empty)
+      Piece,            // raw piece bytes
+      Done,             // u8 GenerationStopReason, i32 prompt, i32 cached, i32 generated, f64 queue, f64 prefill, f64 decode
+      VariantPiece,     // u32 variant, raw piece bytes
+      VariantDone,      // u32 variant, then as Done
+      Kept,             // u8 1 if the variant was kept - the checkpoint holds it by then
+      TaskDone          // u32 prompt index, str text, then as Done
+   };
+
+   // Checkpoint of one conversation, next to the base path handed to the worker
+   inline std::string checkpointFile(const std::string& base, int32_t conversation)
+   {
+      return base + "." + std::to_string(conversation);
+   }
+}
+
+class ModelWorker
+{
+public:
+   /**
+    * @brief Describes the worker to launch, nothing is started until start() is called
+    *
+    * @param modelPath Model file the worker loads
+    * @param numSlots Number of KV sequences the worker's context is sized for
+    */
+   ModelWorker(std::string modelPath, uint32_t numSlots, uint32_t prefixCacheCells = 0);
+
+   /**
+    * @brief Shuts the worker down and removes its checkpoints
+    */
+   ~ModelWorker();
+
+   /**
+    * @brief Launches the worker and waits until it has loaded the model
+    *
+    * @return true The worker is ready for prompts
+    * @return false The worker could not be launched or failed to load the model
+    */
+   bool start();
+
+   /**
+    * @brief Asks the worker to exit, killing it if it does not do so promptly
+    */
+   void shutdown();
+
+   /**
+    * @brief Sends a conversation turn to the worker and streams the reply through a callback
+    *
+    * If the worker dies mid-turn the partial reply is returned with GenerationStopReason::DecodeError
+    * and the worker is restarted from its last checkpoint before this returns.
+    *
+    * @param prompt Message content
+    * @param role "User" or "System"
+    * @param onToken Called for every streamed piece
+    * @param chunks Reference material for this turn, see ModelInterface::sendPrompt
+    * @param budget Deadline and token budget, the deadline travels as time remaining
+    * @param conversation Conversation the turn belongs to, see ModelInterface::sendPrompt
+    */
+   GenerationResult sendPrompt(const std::string& prompt, const std::string& role,
+                               const std::function<bool(const std::string&)>& onToken,
+                               const std::vector<std::string>& chunks = {}, const GenerationBudget& budget = {},
+                               int32_t conversation = 0);
+
+   /**
+    * @brief Samples several replies to a prompt side by side, see ModelInterface::sendPromptVariants
+    *
+    * If the worker dies mid-turn the partial replies are returned with GenerationStopReason::DecodeError.
+    */
+   std::vector<GenerationResult> sendPromptVariants(const std::string& prompt, const std::string& role, uint32_t count,
+                                                    const std::function<bool(uint32_t, const std::string&)>& onToken,
+                                                    const std::vector<std::string>& chunks = {},
+                                                    int32_t conversation = 0);
+
+   /**
+    * @brief Makes one of the replies of sendPromptVariants the conversation's reply
+    *
+    * @return bool False if there are no replies to pick from, e.g. because the worker was restarted since
+    */
+   bool keepVariant(uint32_t variant, int32_t conversation = 0);
+
+   /**
+    * @brief Answers independent prompts behind a common system prompt in one go, see ModelInterface::fanOut
+    *
+    * If the worker dies meanwhile the prompts without an answer yet come back with GenerationStopReason::DecodeError.
+    */
+   std::vector<GenerationResult> fanOut(const std::string& systemPrompt, const std::vector<std::string>& prompts,
+                                        int32_t maxTokens);
+
+   /**
+    * @brief Forgets a conversation and frees its KV sequence in the worker
+    */
+   void closeConversation(int32_t conversation);
+
+   /**
+    * @brief Has the worker prefill chunks into stored KV blocks, see ModelInterface::prefetchChunks
+    *
+    * Never waits for a turn in flight: the record is then handed over by that turn between its pieces.
+    */
+   void prefetchChunks(const std::vector<std::string>& chunks);
+
+   /**
+    * @brief Copies a conversation as of its last completed turn to a SessionSnapshot file
+    *
+    * @param path Destination file
+    * @param conversation Conversation to save
+    * @return bool False if there is no conversation yet or the file could not be written
+    */
+   bool saveSnapshot(const std::string& path, int32_t conversation = 0);
+
+   /**
+    * @brief Resumes a conversation from a SessionSnapshot file, KV state included
+    *
+    * @param path File written by saveSnapshot or ModelInterface::saveSnapshot
+    * @param conversation Conversation the snapshot becomes
+    * @return bool False if the snapshot is unreadable or the worker could not be primed with it
+    */
+   bool restoreSnapshot(const std::string& path, int32_t conversation = 0);
+
+   /**
+    * @brief Returns true while a worker process is up
+    */
+   bool isRunning();
+
+   /**
+    * @brief Returns how many times the worker has been restarted after dying
+    */
+   inline uint32_t getRestartCount() const
+   {
+      return m_restarts;
+   }
+
+private:
+   // Creates the rings and spawns the worker process
+   bool spawn();
+
+   // Waits for the worker's Ready record while it loads the model
+   bool waitReady();
+
+   // Reaps the worker if it has exited; returns true while it is still running
+   bool checkAlive();
+
+   // Kills whatever is left of the worker and launches a new one that resumes the conversation
+   bool restart();
+
+   // Primes the worker with a conversation's messages and the KV state in its checkpoint
+   bool sendRestore(int32_t conversation);
+
+   // Writes a request for the turn in flight; a worker that does not take it is restarted and false returned
+   bool sendRequest(const std::string& request);
+
+   // Waits for the worker's next record; a worker that died or stopped making progress is restarted and
+   // false returned
+   bool readResponse(std::string& record, std::chrono::steady_clock::time_point& lastRecord);
+
+   // Mirrors the worker keeping a variant into a conversation's history
+   void recordVariant(int32_t conversation, uint32_t variant);
+
+   // Writes the prefetch records queued while a turn held the rings, midTurn while one streams; must be
+   // called with m_mutex held
+   void flushPrefetch(bool midTurn);
+
+   // Full path of the worker executable
+   static std::string locateExecutable();
+
+   std::string m_modelPath;
+   uint32_t m_numSlots;
+   uint32_t m_prefixCacheCells;
+   pid_t m_pid;
+   std::unique_ptr<ShmRing> m_requests;
+   std::unique_ptr<ShmRing> m_responses;
+   // Base path of the SessionSnapshot the worker writes for each conversation after every completed
+   // turn, see WorkerProtocol::checkpointFile
+   std::string m_checkpointPath;
+   // Every conversation so far, replayed into a restarted worker alongside its checkpoint
+   std::map<int32_t, std::vector<std::pair<std::string, std::string>>> m_conversations;
+   // Prompt and replies of each conversation's last sendPromptVariants until one of them is kept;
+   // they only live in the worker, so a restart drops them
+   struct PendingVariants
+   {
+      std::string role;
+      std::string prompt;
+      std::vector<std::string> replies;
+   };
+   std::map<int32_t, PendingVariants> m_variants;
+   uint32_t m_restarts;
+   // Restarts since the last turn that completed, bounds crash loops
+   uint32_t m_consecutiveRestarts;
+   // One turn at a time travels through the rings
+   std::mutex m_mutex;
+   // Prefetch records waiting for the turn in flight to pass them on
+   std::vector<std::string> m_prefetch;
+   std::mutex m_prefetchMutex;
+};
+
+#endif
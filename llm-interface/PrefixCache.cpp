@@ -0,0 +1,303 @@
+/**
+ * @file PrefixCache.cpp
+ * @brief Token radix tree over KV cache sequences reserved for sharing. Prompt prefixes that have
+ *        been prefilled once (a common system prompt, the same attached files) stay resident and
+ *        are copied into new requests' sequences with llama_kv_cache_seq_cp instead of being
+ *        decoded again. Only touched from the inference worker thread, except for getStats().
+ */
+
+#include "PrefixCache.h"
+#include <algorithm>
+#include <cassert>
+
+/**
+ * @brief Creates an empty cache
+ *
+ * @param context Context whose KV cache holds the shared prefixes
+ * @param cacheSequences Sequence ids reserved for the cache, never used by requests directly
+ * @param cellBudget Maximum number of tokens kept resident by the cache
+ */
+PrefixCache::PrefixCache(llama_context* context, std::vector<llama_seq_id> cacheSequences, uint32_t cellBudget) :
+ m_context(context),
+ m_cellBudget(cellBudget),
+ m_clock(0),
+ m_lookups(0),
+ m_hits(0),
+ m_savedPrefillTokens(0),
+ m_residentTokens(0),
+ m_evictedTokens(0)
+{
+   for(llama_seq_id seqId : cacheSequences)
+   {
+      m_sequenceUsers[seqId] = 0;
+   }
+}
+
+/**
+ * @brief Extends a sequence with the longest cached prefix of a prompt
+ *
+ * @param seqId Destination sequence, holding exactly tokens[0, have) on entry
+ * @param tokens Prompt the sequence is being prepared for
+ * @param have Number of prompt tokens the sequence already holds
+ * @param limit Never copy more than this many tokens in total
+ * @return size_t Number of prompt tokens now resident in the sequence, at least have
+ */
+size_t PrefixCache::acquire(llama_seq_id seqId, const std::vector<llama_token>& tokens, size_t have, size_t limit)
+{
+   m_lookups++;
+   limit = std::min(limit, tokens.size());
+   const uint64_t now = ++m_clock;
+
+   // Walk down the tree as far as the prompt matches
+   std::vector<Node*> path;
+   size_t matched = 0;
+   Node* node = &m_root;
+   while(matched < limit)
+   {
+      auto iter = node->children.find(tokens[matched]);
+      if(iter == node->children.end())
+      {
+         break;
+      }
+      Node* child = iter->second.get();
+      size_t n = 0;
+      while(n < child->tokens.size() && matched + n < limit && child->tokens[n] == tokens[matched + n])
+      {
+         ++n;
+      }
+      child->lastUsed = now;
+      path.push_back(child);
+      matched += n;
+      if(n < child->tokens.size())
+      {
+         break;
+      }
+      node = child;
+   }
+
+   if(matched <= have)
+   {
+      return have;
+   }
+
+   // Share the cells of every edge on the path that covers positions the sequence does not have yet
+   for(const Node* edge : path)
+   {
+      const llama_pos from = std::max(edge->start, static_cast<llama_pos>(have));
+      const llama_pos to = std::min(edge->start + static_cast<llama_pos>(edge->tokens.size()), static_cast<llama_pos>(matched));
+      if(from < to)
+      {
+         llama_kv_cache_seq_cp(m_context, edge->seqId, seqId, from, to);
+      }
+   }
+
+   m_hits++;
+   m_savedPrefillTokens += matched - have;
+   return matched;
+}
+
+/**
+ * @brief Makes the first count tokens of a sequence available to later requests
+ *
+ * @param seqId Sequence holding tokens[0, count) at positions [0, count)
+ * @param tokens Tokens of that sequence
+ * @param count Number of leading tokens to share
+ */
+void PrefixCache::insert(llama_seq_id seqId, const std::vector<llama_token>& tokens, size_t count)
+{
+   count = std::min(count, tokens.size());
+   const uint64_t now = ++m_clock;
+
+   // Find where the prompt leaves the tree, splitting the edge it diverges from
+   Node* node = &m_root;
+   size_t pos = 0;
+   while(pos < count)
+   {
+      auto iter = node->children.find(tokens[pos]);
+      if(iter == node->children.end())
+      {
+         break;
+      }
+      Node* child = iter->second.get();
+      size_t n = 0;
+      while(n < child->tokens.size() && pos + n < count && child->tokens[n] == tokens[pos + n])
+      {
+         ++n;
+      }
+      child->lastUsed = now;
+      if(n < child->tokens.size())
+      {
+         if(pos + n == count)
+         {
+            // Everything is cached already
+            return;
+         }
+         child = split(child, n);
+      }
+      node = child;
+      pos += n;
+   }
+
+   size_t length = std::min<size_t>(count - pos, m_cellBudget);
+   if(length == 0)
+   {
+      return;
+   }
+
+   // Make room for the new edge without touching the path it hangs off
+   evict(m_cellBudget - length, node);
+   const llama_seq_id cacheSeq = allocateSequence(node);
+   if(cacheSeq < 0)
+   {
+      return;
+   }
+   // The path itself is never evicted; when it leaves too little room the edge is cut down to what fits
+   length = std::min<size_t>(length, m_cellBudget - std::min<uint64_t>(m_residentTokens, m_cellBudget));
+   if(length == 0)
+   {
+      return;
+   }
+   assert(m_residentTokens + length <= m_cellBudget);
+
+   auto leaf = std::make_unique<Node>();
+   leaf->tokens.assign(tokens.begin() + pos, tokens.begin() + pos + length);
+   leaf->start = static_cast<llama_pos>(pos);
+   leaf->seqId = cacheSeq;
+   leaf->parent = node;
+   leaf->lastUsed = now;
+   llama_kv_cache_seq_cp(m_context, seqId, cacheSeq, leaf->start, leaf->start + static_cast<llama_pos>(length));
+
+   m_sequenceUsers[cacheSeq]++;
+   m_residentTokens += length;
+   node->children[tokens[pos]] = std::move(leaf);
+}
+
+/**
+ * @brief Drops least recently used prefixes until tokens cells were given up or the cache is empty
+ *
+ * @return size_t Number of cached tokens dropped
+ */
+size_t PrefixCache::release(size_t tokens)
+{
+   const uint64_t before = m_residentTokens;
+   evict(before > tokens ? before - tokens : 0, nullptr);
+   return static_cast<size_t>(before - m_residentTokens);
+}
+
+/**
+ * @brief Returns a snapshot of the cache counters, safe to call from any thread
+ */
+PrefixCacheStats PrefixCache::getStats() const
+{
+   PrefixCacheStats stats;
+   stats.lookups = m_lookups;
+   stats.hits = m_hits;
+   stats.savedPrefillTokens = m_savedPrefillTokens;
+   stats.residentTokens = m_residentTokens;
+   stats.evictedTokens = m_evictedTokens;
+   return stats;
+}
+
+// Splits a node so that it keeps only its first length tokens; returns the node itself
+PrefixCache::Node* PrefixCache::split(Node* node, size_t length)
+{
+   // The tail keeps the cells where they are, it simply becomes a child in the same sequence
+   auto tail = std::make_unique<Node>();
+   tail->tokens.assign(node->tokens.begin() + length, node->tokens.end());
+   tail->start = node->start + static_cast<llama_pos>(length);
+   tail->seqId = node->seqId;
+   tail->parent = node;
+   tail->lastUsed = node->lastUsed;
+   tail->children = std::move(node->children);
+   for(auto& [token, child] : tail->children)
+   {
+      child->parent = tail.get();
+   }
+
+   node->tokens.resize(length);
+   node->children.clear();
+   node->children[tail->tokens.front()] = std::move(tail);
+   m_sequenceUsers[node->seqId]++;
+   return node;
+}
+
+// Chooses a cache sequence for a new child of parent, evicting if every sequence is taken
+llama_seq_id PrefixCache::allocateSequence(Node* parent)
+{
+   while(true)
+   {
+      // A child continues its parent's sequence unless a sibling already does
+      if(parent != &m_root)
+      {
+         const bool taken = std::any_of(parent->children.begin(), parent->children.end(),
+                                        [parent](const auto& entry) { return entry.second->seqId == parent->seqId; });
+         if(!taken)
+         {
+            return parent->seqId;
+         }
+      }
+      for(const auto& [seqId, users] : m_sequenceUsers)
+      {
+         if(users == 0)
+         {
+            return seqId;
+         }
+      }
+
+      // Every sequence holds something, give up the oldest leaf and look again
+      Node* victim = oldestLeaf(&m_root, parent);
+      if(victim == nullptr)
+      {
+         return -1;
+      }
+      evict(m_residentTokens - victim->tokens.size(), parent);
+   }
+}
+
+// Drops least recently used leaves until the cache holds at most target tokens
+void PrefixCache::evict(uint64_t target, const Node* keep)
+{
+   while(m_residentTokens > target)
+   {
+      Node* leaf = oldestLeaf(&m_root, keep);
+      if(leaf == nullptr)
+      {
+         return;
+      }
+      const size_t length = leaf->tokens.size();
+      llama_kv_cache_seq_rm(m_context, leaf->seqId, leaf->start, leaf->start + static_cast<llama_pos>(length));
+      m_sequenceUsers[leaf->seqId]--;
+      m_residentTokens -= length;
+      m_evictedTokens += length;
+      leaf->parent->children.erase(leaf->tokens.front());
+   }
+}
+
+// Returns the least recently used leaf, skipping keep and its ancestors
+PrefixCache::Node* PrefixCache::oldestLeaf(Node* node, const Node* keep)
+{
+   Node* oldest = nullptr;
+   for(auto& [token, child] : node->children)
+   {
+      Node* candidate = child->children.empty() ? (onPath(child.get(), keep) ? nullptr : child.get())
+                                                : oldestLeaf(child.get(), keep);
+      if(candidate != nullptr && (oldest == nullptr || candidate->lastUsed < oldest->lastUsed))
+      {
+         oldest = candidate;
+      }
+   }
+   return oldest;
+}
+
+// True if node is keep or one of its ancestors
+bool PrefixCache::onPath(const Node* node, const Node* keep)
+{
+   for(const Node* n = keep; n != nullptr; n = n->parent)
+   {
+      if(n == node)
+      {
+         return true;
+      }
+   }
+   return false;
+}
@@ -0,0 +1,121 @@
+/**
+ * @file PrefixCache.h
+ * @brief Token radix tree over KV cache sequences reserved for sharing. Prompt prefixes that have
+ *        been prefilled once (a common system prompt, the same attached files) stay resident and
+ *        are copied into new requests' sequences with llama_kv_cache_seq_cp instead of being
+ *        decoded again. Only touched from the inference worker thread, except for getStats().
+ */
+#ifndef PREFIX_CACHE_H
+#define PREFIX_CACHE_H
+
+#include "llama.h"
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * @brief Counters describing how well the prefix cache is doing
+ */
+struct PrefixCacheStats
+{
+   // Requests that consulted the cache
+   uint64_t lookups = 0;
+   // Requests that got at least one token from the cache
+   uint64_t hits = 0;
+   // Prompt tokens copied from the cache instead of being prefilled
+   uint64_t savedPrefillTokens = 0;
+   // Tokens currently resident in cache sequences
+   uint64_t residentTokens = 0;
+   // Tokens dropped to stay under the cell budget
+   uint64_t evictedTokens = 0;
+};
+
+class PrefixCache
+{
+public:
+   /**
+    * @brief Creates an empty cache
+    *
+    * @param context Context whose KV cache holds the shared prefixes
+    * @param cacheSequences Sequence ids reserved for the cache, never used by requests directly
+    * @param cellBudget Maximum number of tokens kept resident by the cache
+    */
+   PrefixCache(llama_context* context, std::vector<llama_seq_id> cacheSequences, uint32_t cellBudget);
+
+   /**
+    * @brief Extends a sequence with the longest cached prefix of a prompt
+    *
+    * @param seqId Destination sequence, holding exactly tokens[0, have) on entry
+    * @param tokens Prompt the sequence is being prepared for
+    * @param have Number of prompt tokens the sequence already holds
+    * @param limit Never copy more than this many tokens in total
+    * @return size_t Number of prompt tokens now resident in the sequence, at least have
+    */
+   size_t acquire(llama_seq_id seqId, const std::vector<llama_token>& tokens, size_t have, size_t limit);
+
+   /**
+    * @brief Makes the first count tokens of a sequence available to later requests
+    *
+    * @param seqId Sequence holding tokens[0, count) at positions [0, count)
+    * @param tokens Tokens of that sequence
+    * @param count Number of leading tokens to share
+    */
+   void insert(llama_seq_id seqId, const std::vector<llama_token>& tokens, size_t count);
+
+   /**
+    * @brief Drops least recently used prefixes until tokens cells were given up or the cache is empty
+    *
+    * @return size_t Number of cached tokens dropped
+    */
+   size_t release(size_t tokens);
+
+   /**
+    * @brief Returns a snapshot of the cache counters, safe to call from any thread
+    */
+   PrefixCacheStats getStats() const;
+
+private:
+   // One edge of the radix tree. The node's tokens live at positions [start, start + tokens.size())
+   // of its cache sequence; the rest of the prefix lives in its ancestors.
+   struct Node
+   {
+      std::vector<llama_token> tokens;
+      llama_pos start = 0;
+      llama_seq_id seqId = -1;
+      Node* parent = nullptr;
+      std::map<llama_token, std::unique_ptr<Node>> children;
+      uint64_t lastUsed = 0;
+   };
+
+   // Splits a node so that it keeps only its first length tokens; returns the node itself
+   Node* split(Node* node, size_t length);
+
+   // Chooses a cache sequence for a new child of parent, evicting if every sequence is taken
+   llama_seq_id allocateSequence(Node* parent);
+
+   // Drops least recently used leaves until the cache holds at most target tokens
+   void evict(uint64_t target, const Node* keep);
+
+   // Returns the least recently used leaf, skipping keep and its ancestors
+   Node* oldestLeaf(Node* node, const Node* keep);
+
+   // True if node is keep or one of its ancestors
+   static bool onPath(const Node* node, const Node* keep);
+
+   llama_context* m_context;
+   uint32_t m_cellBudget;
+   Node m_root;
+   // Number of nodes stored in each cache sequence, keyed by sequence id
+   std::map<llama_seq_id, uint32_t> m_sequenceUsers;
+   uint64_t m_clock;
+
+   std::atomic<uint64_t> m_lookups;
+   std::atomic<uint64_t> m_hits;
+   std::atomic<uint64_t> m_savedPrefillTokens;
+   std::atomic<uint64_t> m_residentTokens;
+   std::atomic<uint64_t> m_evictedTokens;
+};
+
+#endif
@@ -0,0 +1,283 @@
+/**
+ * @file PromptCompressor.cpp
+ * @brief Shortens reference material by leaving out the words and symbols a small scoring model
+ *        finds least surprising, keeping identifiers, numbers and line structure intact.
+ */
+
+#include "PromptCompressor.h"
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+
+namespace
+{
+   // Texts kept compressed before the cache starts over
+   const size_t MAX_CACHED_TEXTS = 4096;
+
+   // Brackets and quotes hold code together, leaving one out changes what the rest means
+   const std::string STRUCTURAL_SYMBOLS = "()[]{}<>\"'`";
+
+   bool isWordByte(char c)
+   {
+      const unsigned char u = static_cast<unsigned char>(c);
+      return std::isalnum(u) || c == '_' || u >= 0x80;
+   }
+
+   bool isBlank(char c)
+   {
+      return c == ' ' || c == '\t' || c == '\r';
+   }
+
+   // Numbers and words that read as code - snake_case, camelCase, with digits, or used as a call or
+   // a member - carry meaning no scoring model can judge from their tokens
+   bool isCodeWord(const std::string& text, size_t begin, size_t end)
+   {
+      if(std::isdigit(static_cast<unsigned char>(text[begin])))
+      {
+         return true;
+      }
+      for(size_t i = begin; i < end; ++i)
+      {
+         const unsigned char c = static_cast<unsigned char>(text[i]);
+         if(c == '_' || std::isdigit(c) || (i > begin && std::isupper(c)))
+         {
+            return true;
+         }
+      }
+      const char before = begin > 0 ? text[begin - 1] : ' ';
+      const char after = end < text.size() ? text[end] : ' ';
+      return before == '.' || before == '>' || before == ':' || before == '#' ||
+             after == '(' || after == '.' || after == ':' || after == '-';
+   }
+}
+
+/**
+ * @brief Compresses texts by the self-information a scoring model gives their tokens
+ *
+ * @param scorer In-process model the tokens are scored with; a small one is enough
+ * @param options Target ratio and what is left alone
+ */
+PromptCompressor::PromptCompressor(ModelInterface* scorer, CompressionOptions options /* {} */) :
+ m_scorer(scorer),
+ m_options(std::move(options))
+{
+}
+
+/**
+ * @brief Leaves the least informative parts out of a text
+ *
+ * @param text Reference material, e.g. an attached file chunk
+ * @return std::string The text with its least informative words and symbols removed
+ */
+std::string PromptCompressor::compress(const std::string& text)
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto cached = m_cache.find(text);
+      if(cached != m_cache.end())
+      {
+         m_stats.texts++;
+         m_stats.originalTokens += cached->second.originalTokens;
+         m_stats.keptTokens += cached->second.keptTokens;
+         return cached->second.text;
+      }
+   }
+
+   const auto start = std::chrono::steady_clock::now();
+   auto scored = m_scorer ? m_scorer->scoreText(text)
+                          : std::expected<std::vector<TokenSurprisal>, ModelErrorType>(std::unexpected(ModelErrorType::MODEL_NOT_LOADED));
+   const double scoringMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+   Compressed compressed;
+   compressed.text = text;
+   bool passedThrough = true;
+   if(scored.has_value())
+   {
+      // Every token counts towards the span its first visible byte lies in
+      std::vector<Span> spans = splitSpans(text);
+      size_t span = 0;
+      for(const TokenSurprisal& token : scored.value())
+      {
+         if(token.end <= token.begin)
+         {
+            continue;
+         }
+         size_t at = token.begin;
+         while(at + 1 < token.end && (isBlank(text[at]) || text[at] == '\n'))
+         {
+            at++;
+         }
+         while(span + 1 < spans.size() && spans[span].end <= at)
+         {
+            span++;
+         }
+         spans[span].nats += token.nats;
+         spans[span].tokens++;
+         compressed.originalTokens++;
+      }
+
+      compressed.keptTokens = compressed.originalTokens;
+      if(compressed.originalTokens >= m_options.minTokens)
+      {
+         // Least surprising per token first
+         std::vector<size_t> droppable;
+         for(size_t i = 0; i < spans.size(); ++i)
+         {
+            if(!spans[i].required && spans[i].tokens > 0)
+            {
+               droppable.push_back(i);
+            }
+         }
+         std::stable_sort(droppable.begin(), droppable.end(), [&](size_t a, size_t b)
+         {
+            return spans[a].nats / spans[a].tokens < spans[b].nats / spans[b].tokens;
+         });
+         const size_t target = static_cast<size_t>(std::ceil(m_options.keepRatio * compressed.originalTokens));
+         for(size_t index : droppable)
+         {
+            if(compressed.keptTokens <= target)
+            {
+               break;
+            }
+            spans[index].kept = false;
+            compressed.keptTokens -= spans[index].tokens;
+         }
+         compressed.text = assemble(text, spans);
+         passedThrough = false;
+      }
+   }
+
+   #ifdef _DEBUG
+      if(!passedThrough)
+      {
+         std::cout << "Compressed " << compressed.originalTokens << " tokens to " << compressed.keptTokens << " in "
+                   << scoringMs << " ms" << std::endl;
+      }
+   #endif
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_stats.texts++;
+   m_stats.passedThrough += passedThrough ? 1 : 0;
+   m_stats.originalTokens += compressed.originalTokens;
+   m_stats.keptTokens += compressed.keptTokens;
+   m_stats.scoringMs += scoringMs;
+   // A text that could not be scored is tried again next time
+   if(scored.has_value())
+   {
+      if(m_cache.size() >= MAX_CACHED_TEXTS)
+      {
+         m_cache.clear();
+      }
+      m_cache.emplace(text, compressed);
+   }
+   return compressed.text;
+}
+
+/**
+ * @brief Returns the counters since the compressor was created
+ */
+CompressionStats PromptCompressor::getStats() const
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_stats;
+}
+
+// Cuts a text into spans, marking the ones that must be kept
+std::vector<PromptCompressor::Span> PromptCompressor::splitSpans(const std::string& text) const
+{
+   std::vector<Span> spans;
+   size_t line = 0;
+   bool lineStart = true;
+   size_t i = 0;
+   while(i < text.size())
+   {
+      Span span;
+      span.begin = i;
+      if(text[i] == '\n')
+      {
+         i++;
+         span.required = true;
+         line++;
+         lineStart = true;
+      }
+      else if(lineStart && isBlank(text[i]))
+      {
+         // Indentation is structure, in Python it is syntax
+         while(i < text.size() && isBlank(text[i]))
+         {
+            i++;
+         }
+         span.required = true;
+         lineStart = false;
+      }
+      else
+      {
+         lineStart = false;
+         if(isWordByte(text[i]))
+         {
+            const bool number = std::isdigit(static_cast<unsigned char>(text[i]));
+            while(i < text.size() && (isWordByte(text[i]) ||
+                  (number && text[i] == '.' && i + 1 < text.size() && std::isdigit(static_cast<unsigned char>(text[i + 1])))))
+            {
+               i++;
+            }
+            span.required = isCodeWord(text, span.begin, i);
+         }
+         else
+         {
+            while(i < text.size() && !isWordByte(text[i]) && !isBlank(text[i]) && text[i] != '\n')
+            {
+               span.required = span.required || STRUCTURAL_SYMBOLS.find(text[i]) != std::string::npos;
+               i++;
+            }
+         }
+         // The spaces after a word go with it
+         while(i < text.size() && isBlank(text[i]))
+         {
+            i++;
+         }
+      }
+      span.end = i;
+      span.required = span.required || line < m_options.keptLeadingLines;
+      spans.push_back(span);
+   }
+   return spans;
+}
+
+// Drops lines left without any content, along with their indentation and break
+std::string PromptCompressor::assemble(const std::string& text, const std::vector<Span>& spans)
+{
+   std::string result;
+   result.reserve(text.size());
+   std::string line;
+   bool hadContent = false;
+   bool keptContent = false;
+   for(const Span& span : spans)
+   {
+      const bool lineBreak = text[span.begin] == '\n';
+      const bool content = !lineBreak && !isBlank(text[span.begin]);
+      hadContent = hadContent || content;
+      if(span.kept)
+      {
+         line.append(text, span.begin, span.end - span.begin);
+         keptContent = keptContent || content;
+      }
+      if(lineBreak)
+      {
+         if(keptContent || !hadContent)
+         {
+            result += line;
+         }
+         line.clear();
+         hadContent = false;
+         keptContent = false;
+      }
+   }
+   if(keptContent || !hadContent)
+   {
+      result += line;
+   }
+   return result;
+}
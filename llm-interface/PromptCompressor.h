@@ -0,0 +1,114 @@
+/**
+ * @file PromptCompressor.h
+ * @brief Shortens reference material before it is prefilled. A small scoring model measures the
+ *        self-information of every token, and the least informative words and symbols are left out
+ *        until the text is down to a target share of its tokens. Identifiers, numbers and line
+ *        structure are kept whole so code still reads as code.
+ */
+#ifndef PROMPT_COMPRESSOR_H
+#define PROMPT_COMPRESSOR_H
+
+#include "ModelInterface.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+/**
+ * @brief How far texts are compressed
+ */
+struct CompressionOptions
+{
+   // Share of a text's tokens that is kept, counted with the scoring model's tokenizer
+   double keepRatio = 0.5;
+   // Texts of fewer tokens are left alone, there is too little in them to leave out
+   size_t minTokens = 64;
+   // Lines the compressor never touches at the start of a text, e.g. a chunk's "=== File: ===" header
+   size_t keptLeadingLines = 1;
+};
+
+/**
+ * @brief What the compressor has done so far
+ */
+struct CompressionStats
+{
+   // Texts compressed, cached ones included, and those passed through unchanged
+   size_t texts = 0;
+   size_t passedThrough = 0;
+   // Scoring-model tokens before and after compression
+   size_t originalTokens = 0;
+   size_t keptTokens = 0;
+   // Time spent scoring texts that were not cached
+   double scoringMs = 0.0;
+
+   inline double keptRatio() const
+   {
+      return originalTokens > 0 ? static_cast<double>(keptTokens) / originalTokens : 1.0;
+   }
+};
+
+class PromptCompressor
+{
+public:
+   /**
+    * @brief Compresses texts by the self-information a scoring model gives their tokens
+    *
+    * @param scorer In-process model the tokens are scored with; a small one is enough
+    * @param options Target ratio and what is left alone
+    */
+   PromptCompressor(ModelInterface* scorer, CompressionOptions options = {});
+
+   /**
+    * @brief Leaves the least informative parts out of a text
+    *
+    * The same text always compresses the same way and is only scored once, so a compressed chunk
+    * keeps its KV block across turns. Texts that cannot be scored are returned unchanged.
+    *
+    * @param text Reference material, e.g. an attached file chunk
+    * @return std::string The text with its least informative words and symbols removed
+    */
+   std::string compress(const std::string& text);
+
+   /**
+    * @brief Returns the counters since the compressor was created
+    */
+   CompressionStats getStats() const;
+
+private:
+   // A word, number or run of symbols with the spaces after it, or a line's indentation or break
+   struct Span
+   {
+      size_t begin = 0;
+      size_t end = 0;
+      // Identifiers, numbers, brackets and line structure are never left out
+      bool required = false;
+      // Summed self-information and the number of scoring tokens that start in the span
+      double nats = 0.0;
+      size_t tokens = 0;
+      bool kept = true;
+   };
+
+   // Cuts a text into spans, marking the ones that must be kept
+   std::vector<Span> splitSpans(const std::string& text) const;
+
+   // Drops lines left without any content, along with their indentation and break
+   static std::string assemble(const std::string& text, const std::vector<Span>& spans);
+
+   ModelInterface* m_scorer;
+   CompressionOptions m_options;
+
+   // A compressed text with its token counts for the stats
+   struct Compressed
+   {
+      std::string text;
+      size_t originalTokens = 0;
+      size_t keptTokens = 0;
+   };
+
+   mutable std::mutex m_mutex;
+   // Compressed texts by the text they were made from
+   std::unordered_map<std::string, Compressed> m_cache;
+   CompressionStats m_stats;
+};
+
+#endif
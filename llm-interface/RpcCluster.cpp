@@ -0,0 +1,195 @@
+/**
+ * @file RpcCluster.cpp
+ * @brief Spreads a model's layers over remote machines running llama.cpp's rpc-server. Each
+ *        endpoint becomes a ggml RPC device and llama.cpp's layer split places weights and KV
+ *        cache on it; this class only decides the split and keeps the per-node accounting.
+ */
+
+#include "RpcCluster.h"
+#include "ggml-rpc.h"
+#include <iostream>
+#include <numeric>
+#include <algorithm>
+
+namespace
+{
+   // More layers than any model has - llama.cpp clamps it, so every layer goes to the cluster
+   const int32_t ALL_LAYERS = 9999;
+
+   double elapsedMs(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+   {
+      return std::chrono::duration<double, std::milli>(to - from).count();
+   }
+}
+
+/**
+ * @brief Connects to every endpoint and reads back its free memory
+ *
+ * @param endpoints rpc-server addresses as "host:port"
+ * @param profile Time every graph node, which synchronizes after each one and slows decoding
+ * @return std::expected<std::unique_ptr<RpcCluster>, ModelErrorType> The cluster, or
+ *         RPC_UNREACHABLE if an endpoint did not answer
+ */
+std::expected<std::unique_ptr<RpcCluster>, ModelErrorType> RpcCluster::connect(const std::vector<std::string>& endpoints,
+                                                                               bool profile /* false */)
+{
+   std::unique_ptr<RpcCluster> cluster(new RpcCluster(profile));
+   for(const auto& endpoint : endpoints)
+   {
+      RpcNodeStats node;
+      node.endpoint = endpoint;
+      // Zero total means the server could not be reached
+      ggml_backend_rpc_get_device_memory(endpoint.c_str(), &node.freeBytes, &node.totalBytes);
+      ggml_backend_dev_t device = node.totalBytes > 0 ? ggml_backend_rpc_add_device(endpoint.c_str()) : nullptr;
+      if(device == nullptr)
+      {
+         std::cerr << "Error : rpc-server at " << endpoint << " is not reachable" << std::endl;
+         return std::unexpected(ModelErrorType::RPC_UNREACHABLE);
+      }
+      cluster->m_devices.push_back(device);
+      cluster->m_nodes.push_back(node);
+   }
+   cluster->m_devices.push_back(nullptr);
+
+   // Layers follow free memory, so a box with twice the headroom holds twice the layers
+   const double totalFree = std::accumulate(cluster->m_nodes.begin(), cluster->m_nodes.end(), 0.0,
+                                            [](double sum, const RpcNodeStats& node) { return sum + node.freeBytes; });
+   for(auto& node : cluster->m_nodes)
+   {
+      node.layerShare = totalFree > 0.0 ? static_cast<float>(node.freeBytes / totalFree)
+                                        : 1.0f / static_cast<float>(cluster->m_nodes.size());
+      cluster->m_split.push_back(node.layerShare);
+
+      #ifdef _DEBUG
+         std::cout << "RPC node " << node.endpoint << ": " << (node.freeBytes >> 20) << " MiB free, "
+                   << node.layerShare * 100.0f << "% of layers" << std::endl;
+      #endif
+   }
+
+   RpcNodeStats local;
+   local.endpoint = "local";
+   cluster->m_nodes.push_back(local);
+   return cluster;
+}
+
+/**
+ * @brief Splits a comma separated endpoint list as given on the command line
+ *
+ * @param list e.g. "127.0.0.1:50052,127.0.0.1:50053"
+ * @return std::vector<std::string> The non-empty entries
+ */
+std::vector<std::string> RpcCluster::parseEndpoints(const std::string& list)
+{
+   std::vector<std::string> endpoints;
+   size_t start = 0;
+   while(start <= list.size())
+   {
+      const size_t end = std::min(list.find(',', start), list.size());
+      if(end > start)
+      {
+         endpoints.push_back(list.substr(start, end - start));
+      }
+      start = end + 1;
+   }
+   return endpoints;
+}
+
+RpcCluster::RpcCluster(bool profile) :
+ m_profile(profile),
+ m_lastNode(0)
+{
+}
+
+/**
+ * @brief Places every layer on the cluster, split in proportion to each node's free memory
+ *
+ * @param params Model parameters to update; must not outlive the cluster
+ */
+void RpcCluster::applyTo(llama_model_params& params)
+{
+   params.devices = m_devices.data();
+   params.n_gpu_layers = ALL_LAYERS;
+   params.split_mode = LLAMA_SPLIT_MODE_LAYER;
+   params.tensor_split = m_split.data();
+}
+
+/**
+ * @brief Installs the profiling callback when profiling was requested
+ *
+ * @param params Context parameters to update; must not outlive the cluster
+ */
+void RpcCluster::applyTo(llama_context_params& params)
+{
+   if(m_profile)
+   {
+      params.cb_eval = &RpcCluster::onEval;
+      params.cb_eval_user_data = this;
+   }
+}
+
+/**
+ * @brief Returns one entry per endpoint followed by one for this process
+ */
+std::vector<RpcNodeStats> RpcCluster::getStats() const
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_nodes;
+}
+
+// Scheduler callback timing each graph node against the device it ran on
+bool RpcCluster::onEval(ggml_tensor* tensor, bool ask, void* userData)
+{
+   RpcCluster* cluster = static_cast<RpcCluster*>(userData);
+   const auto now = std::chrono::steady_clock::now();
+   const size_t node = cluster->nodeOf(tensor);
+   const size_t local = cluster->m_nodes.size() - 1;
+
+   if(ask)
+   {
+      // The scheduler copies a split's inputs to its device before asking about the split's first
+      // node, so a switch onto a remote node is preceded by that node's transfer. Switches back to
+      // this process are not counted - they also cover the idle time between two decodes.
+      if(node != cluster->m_lastNode && node != local && cluster->m_lastEval.time_since_epoch().count() > 0)
+      {
+         std::lock_guard<std::mutex> lock(cluster->m_mutex);
+         cluster->m_nodes[node].transferMs += elapsedMs(cluster->m_lastEval, now);
+      }
+      cluster->m_lastEval = now;
+      cluster->m_lastNode = node;
+      // Asking for every node computes them one at a time
+      return true;
+   }
+
+   // Compute was only launched; reading a byte back waits for it, over the wire for remote nodes
+   if(tensor->buffer != nullptr && ggml_nbytes(tensor) > 0)
+   {
+      uint8_t byte = 0;
+      ggml_backend_tensor_get(tensor, &byte, 0, 1);
+   }
+   const auto done = std::chrono::steady_clock::now();
+   {
+      std::lock_guard<std::mutex> lock(cluster->m_mutex);
+      cluster->m_nodes[node].computeMs += elapsedMs(cluster->m_lastEval, done);
+      cluster->m_nodes[node].evaluated++;
+   }
+   cluster->m_lastEval = done;
+   // Returning false would abort the graph
+   return true;
+}
+
+// Index into m_nodes of the node a tensor lives on
+size_t RpcCluster::nodeOf(const ggml_tensor* tensor) const
+{
+   if(tensor->buffer != nullptr)
+   {
+      ggml_backend_dev_t device = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(tensor->buffer));
+      for(size_t i = 0; i + 1 < m_devices.size(); ++i)
+      {
+         if(m_devices[i] == device)
+         {
+            return i;
+         }
+      }
+   }
+   return m_nodes.size() - 1;
+}
@@ -0,0 +1,107 @@
+/**
+ * @file RpcCluster.h
+ * @brief Spreads a model's layers over remote machines running llama.cpp's rpc-server. Each
+ *        endpoint becomes a ggml RPC device and receives a share of the layers proportional to its
+ *        free memory, so a model too large for any one box can still be loaded. Optionally times
+ *        every graph node to report per-node compute and transfer cost.
+ */
+#ifndef RPC_CLUSTER_H
+#define RPC_CLUSTER_H
+
+#include "ModelConstants.h"
+#include "llama.h"
+#include "ggml-backend.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <expected>
+#include <cstdint>
+
+/**
+ * @brief What one RPC node holds and how much time it has cost
+ */
+struct RpcNodeStats
+{
+   // "host:port" of the rpc-server, "local" for the devices of this process
+   std::string endpoint;
+   // Memory the node reported when the cluster was connected
+   size_t freeBytes = 0;
+   size_t totalBytes = 0;
+   // Fraction of the offloaded layers placed on the node
+   float layerShare = 0.0f;
+   // Time spent computing graph nodes on the node, only measured when profiling
+   double computeMs = 0.0;
+   // Time spent moving activations to the node before it could start, only measured when profiling
+   double transferMs = 0.0;
+   // Graph nodes timed
+   uint64_t evaluated = 0;
+};
+
+class RpcCluster
+{
+public:
+   /**
+    * @brief Connects to every endpoint and reads back its free memory
+    *
+    * @param endpoints rpc-server addresses as "host:port"
+    * @param profile Time every graph node, which synchronizes after each one and slows decoding
+    * @return std::expected<std::unique_ptr<RpcCluster>, ModelErrorType> The cluster, or
+    *         RPC_UNREACHABLE if an endpoint did not answer
+    */
+   static std::expected<std::unique_ptr<RpcCluster>, ModelErrorType> connect(const std::vector<std::string>& endpoints,
+                                                                             bool profile = false);
+
+   /**
+    * @brief Splits a comma separated endpoint list as given on the command line
+    *
+    * @param list e.g. "127.0.0.1:50052,127.0.0.1:50053"
+    * @return std::vector<std::string> The non-empty entries
+    */
+   static std::vector<std::string> parseEndpoints(const std::string& list);
+
+   /**
+    * @brief Places every layer on the cluster, split in proportion to each node's free memory
+    *
+    * @param params Model parameters to update; must not outlive the cluster
+    */
+   void applyTo(llama_model_params& params);
+
+   /**
+    * @brief Installs the profiling callback when profiling was requested
+    *
+    * @param params Context parameters to update; must not outlive the cluster
+    */
+   void applyTo(llama_context_params& params);
+
+   /**
+    * @brief Returns one entry per endpoint followed by one for this process
+    */
+   std::vector<RpcNodeStats> getStats() const;
+
+private:
+   RpcCluster(bool profile);
+
+   // Scheduler callback timing each graph node against the device it ran on
+   static bool onEval(ggml_tensor* tensor, bool ask, void* userData);
+
+   // Index into m_nodes of the node a tensor lives on
+   size_t nodeOf(const ggml_tensor* tensor) const;
+
+   bool m_profile;
+   // One device per endpoint plus the terminating nullptr llama_model_params expects
+   std::vector<ggml_backend_dev_t> m_devices;
+   // Layer split handed to llama_model_params::tensor_split
+   std::vector<float> m_split;
+
+   mutable std::mutex m_mutex;
+   // Endpoints first, this process last
+   std::vector<RpcNodeStats> m_nodes;
+
+   // Profiling state, only touched from the inference thread
+   std::chrono::steady_clock::time_point m_lastEval;
+   size_t m_lastNode;
+};
+
+#endif
@@ -0,0 +1,287 @@
+/**
+ * @file SessionSnapshot.cpp
+ * @brief Versioned on-disk snapshot of a conversation and its KV sequence, used straight out of a
+ *        read-only mapping when reopened.
+ */
+
+#include "SessionSnapshot.h"
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace
+{
+   // "SNAP" read as a little-endian word
+   const uint32_t SNAPSHOT_MAGIC = 0x50414e53;
+
+   // Every section starts on this boundary so tokens and state can be used in place
+   const uint64_t SECTION_ALIGNMENT = 64;
+
+   struct Section
+   {
+      uint64_t offset;
+      uint64_t size;
+   };
+
+   struct Header
+   {
+      uint32_t magic;
+      uint32_t version;
+      uint64_t fileSize;
+      int32_t vocabSize;
+      uint32_t messageCount;
+      float temperature;
+      float minP;
+      float topP;
+      int32_t topK;
+      uint32_t seed;
+      uint32_t reserved;
+      Section modelName;
+      Section messages;
+      Section tokens;
+      Section state;
+   };
+
+   uint64_t alignUp(uint64_t value)
+   {
+      return (value + SECTION_ALIGNMENT - 1) & ~(SECTION_ALIGNMENT - 1);
+   }
+
+   void appendString(std::string& out, const std::string& value)
+   {
+      const uint32_t size = static_cast<uint32_t>(value.size());
+      out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+      out.append(value);
+   }
+
+   bool readString(const uint8_t*& cursor, const uint8_t* end, std::string& value)
+   {
+      uint32_t size = 0;
+      if(static_cast<size_t>(end - cursor) < sizeof(size))
+      {
+         return false;
+      }
+      std::memcpy(&size, cursor, sizeof(size));
+      cursor += sizeof(size);
+      if(static_cast<size_t>(end - cursor) < size)
+      {
+         return false;
+      }
+      value.assign(reinterpret_cast<const char*>(cursor), size);
+      cursor += size;
+      return true;
+   }
+
+   bool inBounds(const Section& section, uint64_t fileSize)
+   {
+      return section.offset <= fileSize && section.size <= fileSize - section.offset;
+   }
+}
+
+/**
+ * @brief Writes a snapshot, replacing any file at the path atomically
+ *
+ * @param path Destination file
+ * @param contents What to save
+ * @return bool True if the whole snapshot reached the file
+ */
+bool SessionSnapshot::write(const std::string& path, const SessionSnapshotContents& contents)
+{
+   std::string messages;
+   for(const auto& [role, content] : contents.messages)
+   {
+      appendString(messages, role);
+      appendString(messages, content);
+   }
+
+   Header header{};
+   header.magic = SNAPSHOT_MAGIC;
+   header.version = VERSION;
+   header.vocabSize = contents.vocabSize;
+   header.messageCount = static_cast<uint32_t>(contents.messages.size());
+   header.temperature = contents.sampling.temperature;
+   header.minP = contents.sampling.minP;
+   header.topP = contents.sampling.topP;
+   header.topK = contents.sampling.topK;
+   header.seed = contents.sampling.seed;
+   header.modelName = {alignUp(sizeof(Header)), contents.modelName.size()};
+   header.messages = {alignUp(header.modelName.offset + header.modelName.size), messages.size()};
+   header.tokens = {alignUp(header.messages.offset + header.messages.size), contents.tokens.size_bytes()};
+   header.state = {alignUp(header.tokens.offset + header.tokens.size), contents.state.size_bytes()};
+   header.fileSize = header.state.offset + header.state.size;
+
+   // Written beside the target and renamed over it, so a crash never leaves half a snapshot
+   const std::string temp = path + ".tmp";
+   {
+      std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+      auto section = [&](const Section& at, const void* data) {
+         out.seekp(static_cast<std::streamoff>(at.offset));
+         out.write(static_cast<const char*>(data), static_cast<std::streamsize>(at.size));
+      };
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      section(header.modelName, contents.modelName.data());
+      section(header.messages, messages.data());
+      section(header.tokens, contents.tokens.data());
+      section(header.state, contents.state.data());
+      if(!out.flush())
+      {
+         out.close();
+         std::error_code ec;
+         std::filesystem::remove(temp, ec);
+         return false;
+      }
+   }
+   // Seeking past the end leaves the last padding unwritten, pin the size the header promises
+   std::error_code ec;
+   std::filesystem::resize_file(temp, header.fileSize, ec);
+   if(!ec)
+   {
+      std::filesystem::rename(temp, path, ec);
+   }
+   if(ec)
+   {
+      std::filesystem::remove(temp, ec);
+      return false;
+   }
+   return true;
+}
+
+/**
+ * @brief Maps a snapshot and checks its header and section bounds
+ *
+ * @param path File written by write()
+ * @return std::expected<std::unique_ptr<SessionSnapshot>, ModelErrorType> The snapshot, or
+ *         SNAPSHOT_INVALID if the file is missing, truncated or of another version
+ */
+std::expected<std::unique_ptr<SessionSnapshot>, ModelErrorType> SessionSnapshot::open(const std::string& path)
+{
+   const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if(fd == -1)
+   {
+      return std::unexpected(ModelErrorType::SNAPSHOT_INVALID);
+   }
+   struct stat st;
+   if(fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(Header))
+   {
+      close(fd);
+      return std::unexpected(ModelErrorType::SNAPSHOT_INVALID);
+   }
+   const size_t size = static_cast<size_t>(st.st_size);
+   void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(mapping == MAP_FAILED)
+   {
+      return std::unexpected(ModelErrorType::SNAPSHOT_INVALID);
+   }
+
+   Header header;
+   std::memcpy(&header, mapping, sizeof(header));
+   const bool valid = header.magic == SNAPSHOT_MAGIC && header.version == VERSION && header.fileSize == size &&
+                      inBounds(header.modelName, size) && inBounds(header.messages, size) &&
+                      inBounds(header.tokens, size) && inBounds(header.state, size) &&
+                      header.tokens.offset % alignof(llama_token) == 0 && header.tokens.size % sizeof(llama_token) == 0 &&
+                      // Every message takes at least its two string lengths, so the count cannot exceed what the section holds
+                      header.messageCount <= header.messages.size / (2 * sizeof(uint32_t));
+   if(!valid)
+   {
+      munmap(mapping, size);
+      return std::unexpected(ModelErrorType::SNAPSHOT_INVALID);
+   }
+
+   // The state is consumed front to back as soon as the snapshot is restored
+   madvise(static_cast<uint8_t*>(mapping) + header.state.offset - header.state.offset % getpagesize(),
+           header.state.size + header.state.offset % getpagesize(), MADV_WILLNEED);
+   return std::unique_ptr<SessionSnapshot>(new SessionSnapshot(static_cast<const uint8_t*>(mapping), size));
+}
+
+// Takes ownership of a validated mapping
+SessionSnapshot::SessionSnapshot(const uint8_t* mapping, size_t size) :
+ m_mapping(mapping),
+ m_size(size)
+{
+}
+
+/**
+ * @brief Unmaps the file
+ */
+SessionSnapshot::~SessionSnapshot()
+{
+   munmap(const_cast<uint8_t*>(m_mapping), m_size);
+}
+
+/**
+ * @brief Returns the file name of the model the snapshot was taken with
+ */
+std::string SessionSnapshot::getModelName() const
+{
+   const Header* header = reinterpret_cast<const Header*>(m_mapping);
+   return std::string(reinterpret_cast<const char*>(m_mapping + header->modelName.offset), header->modelName.size);
+}
+
+/**
+ * @brief Returns the vocabulary size of that model
+ */
+int32_t SessionSnapshot::getVocabSize() const
+{
+   return reinterpret_cast<const Header*>(m_mapping)->vocabSize;
+}
+
+/**
+ * @brief Returns the sampling parameters in effect when the snapshot was taken
+ */
+SamplingParams SessionSnapshot::getSampling() const
+{
+   const Header* header = reinterpret_cast<const Header*>(m_mapping);
+   SamplingParams sampling;
+   sampling.temperature = header->temperature;
+   sampling.minP = header->minP;
+   sampling.topP = header->topP;
+   sampling.topK = header->topK;
+   sampling.seed = header->seed;
+   return sampling;
+}
+
+/**
+ * @brief Decodes the conversation's messages
+ */
+std::vector<std::pair<std::string, std::string>> SessionSnapshot::getMessages() const
+{
+   const Header* header = reinterpret_cast<const Header*>(m_mapping);
+   const uint8_t* cursor = m_mapping + header->messages.offset;
+   const uint8_t* end = cursor + header->messages.size;
+   std::vector<std::pair<std::string, std::string>> messages;
+   messages.reserve(header->messageCount);
+   for(uint32_t i = 0; i < header->messageCount; ++i)
+   {
+      std::string role, content;
+      if(!readString(cursor, end, role) || !readString(cursor, end, content))
+      {
+         break; // a damaged section still yields the messages before the damage
+      }
+      messages.emplace_back(std::move(role), std::move(content));
+   }
+   return messages;
+}
+
+/**
+ * @brief Returns the resident tokens, pointing into the mapping
+ */
+std::span<const llama_token> SessionSnapshot::getTokens() const
+{
+   const Header* header = reinterpret_cast<const Header*>(m_mapping);
+   return {reinterpret_cast<const llama_token*>(m_mapping + header->tokens.offset),
+           static_cast<size_t>(header->tokens.size / sizeof(llama_token))};
+}
+
+/**
+ * @brief Returns the sequence state, pointing into the mapping
+ */
+std::span<const uint8_t> SessionSnapshot::getState() const
+{
+   const Header* header = reinterpret_cast<const Header*>(m_mapping);
+   return {m_mapping + header->state.offset, static_cast<size_t>(header->state.size)};
+}
@@ -0,0 +1,106 @@
+/**
+ * @file SessionSnapshot.h
+ * @brief Versioned on-disk snapshot of a conversation: its messages, the tokens resident in its KV
+ *        sequence, the sampling parameters and the sequence's llama state. Sections are 64-byte
+ *        aligned so an opened snapshot is used straight out of a read-only mapping - resuming a
+ *        long conversation costs a disk read instead of a prefill.
+ */
+#ifndef SESSION_SNAPSHOT_H
+#define SESSION_SNAPSHOT_H
+
+#include "ModelConstants.h"
+#include "InferenceEngine.h"
+#include "llama.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <span>
+#include <expected>
+#include <cstdint>
+
+/**
+ * @brief Everything a snapshot holds, as handed to SessionSnapshot::write
+ */
+struct SessionSnapshotContents
+{
+   // File name of the model the KV state belongs to
+   std::string modelName;
+   // Vocabulary size of that model, the state is only restored into a model with the same
+   int32_t vocabSize = 0;
+   // Conversation as (role, content) pairs
+   std::vector<std::pair<std::string, std::string>> messages;
+   SamplingParams sampling;
+   // Tokens resident in the sequence, empty when only the messages are saved
+   std::span<const llama_token> tokens;
+   // llama_state_seq_get_data of the sequence, empty when only the messages are saved
+   std::span<const uint8_t> state;
+};
+
+class SessionSnapshot
+{
+public:
+   // Bumped whenever the layout changes; older files are rejected rather than misread
+   static const uint32_t VERSION = 1;
+
+   /**
+    * @brief Writes a snapshot, replacing any file at the path atomically
+    *
+    * @param path Destination file
+    * @param contents What to save
+    * @return bool True if the whole snapshot reached the file
+    */
+   static bool write(const std::string& path, const SessionSnapshotContents& contents);
+
+   /**
+    * @brief Maps a snapshot and checks its header and section bounds
+    *
+    * @param path File written by write()
+    * @return std::expected<std::unique_ptr<SessionSnapshot>, ModelErrorType> The snapshot, or
+    *         SNAPSHOT_INVALID if the file is missing, truncated or of another version
+    */
+   static std::expected<std::unique_ptr<SessionSnapshot>, ModelErrorType> open(const std::string& path);
+
+   /**
+    * @brief Unmaps the file
+    */
+   ~SessionSnapshot();
+
+   /**
+    * @brief Returns the file name of the model the snapshot was taken with
+    */
+   std::string getModelName() const;
+
+   /**
+    * @brief Returns the vocabulary size of that model
+    */
+   int32_t getVocabSize() const;
+
+   /**
+    * @brief Returns the sampling parameters in effect when the snapshot was taken
+    */
+   SamplingParams getSampling() const;
+
+   /**
+    * @brief Decodes the conversation's messages
+    */
+   std::vector<std::pair<std::string, std::string>> getMessages() const;
+
+   /**
+    * @brief Returns the resident tokens, pointing into the mapping
+    */
+   std::span<const llama_token> getTokens() const;
+
+   /**
+    * @brief Returns the sequence state, pointing into the mapping
+    */
+   std::span<const uint8_t> getState() const;
+
+private:
+   SessionSnapshot(const uint8_t* mapping, size_t size);
+
+   const uint8_t* m_mapping;
+   size_t m_size;
+};
+
+#endif
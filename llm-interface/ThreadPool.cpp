@@ -0,0 +1,76 @@
+/**
+ * @file ThreadPool.cpp
+ * @brief Fixed set of worker threads running queued tasks.
+ */
+
+#include "ThreadPool.h"
+#include <algorithm>
+
+/**
+ * @brief Starts the worker threads
+ *
+ * @param threads Number of tasks that may run at once, at least one
+ */
+ThreadPool::ThreadPool(size_t threads) :
+ m_stopping(false)
+{
+   threads = std::max<size_t>(1, threads);
+   for(size_t i = 0; i < threads; ++i)
+   {
+      m_threads.emplace_back(&ThreadPool::run, this);
+   }
+}
+
+/**
+ * @brief Finishes the queued tasks and joins the worker threads
+ */
+ThreadPool::~ThreadPool()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+   }
+   m_cv.notify_all();
+   for(auto& thread : m_threads)
+   {
+      thread.join();
+   }
+}
+
+/**
+ * @brief Queues a task
+ *
+ * @param task Work to run on one of the pool's threads
+ * @return std::future<void> Ready once the task has run; rethrows anything it threw
+ */
+std::future<void> ThreadPool::submit(std::function<void()> task)
+{
+   std::packaged_task<void()> packaged(std::move(task));
+   std::future<void> done = packaged.get_future();
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.push_back(std::move(packaged));
+   }
+   m_cv.notify_one();
+   return done;
+}
+
+// Worker thread body
+void ThreadPool::run()
+{
+   while(true)
+   {
+      std::packaged_task<void()> task;
+      {
+         std::unique_lock<std::mutex> lock(m_mutex);
+         m_cv.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+         if(m_tasks.empty())
+         {
+            return;
+         }
+         task = std::move(m_tasks.front());
+         m_tasks.pop_front();
+      }
+      task();
+   }
+}
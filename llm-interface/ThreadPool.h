@@ -0,0 +1,59 @@
+/**
+ * @file ThreadPool.h
+ * @brief Fixed set of worker threads running queued tasks, e.g. the tool calls a model made in one
+ *        turn, so independent work runs concurrently without a thread per task.
+ */
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+
+class ThreadPool
+{
+public:
+   /**
+    * @brief Starts the worker threads
+    *
+    * @param threads Number of tasks that may run at once, at least one
+    */
+   explicit ThreadPool(size_t threads);
+
+   /**
+    * @brief Finishes the queued tasks and joins the worker threads
+    */
+   ~ThreadPool();
+
+   /**
+    * @brief Queues a task
+    *
+    * @param task Work to run on one of the pool's threads
+    * @return std::future<void> Ready once the task has run; rethrows anything it threw
+    */
+   std::future<void> submit(std::function<void()> task);
+
+   /**
+    * @brief Returns the number of worker threads
+    */
+   inline size_t getThreadCount() const
+   {
+      return m_threads.size();
+   }
+
+private:
+   // Worker thread body
+   void run();
+
+   std::vector<std::thread> m_threads;
+   std::deque<std::packaged_task<void()>> m_tasks;
+   std::mutex m_mutex;
+   std::condition_variable m_cv;
+   bool m_stopping;
+};
+
+#endif
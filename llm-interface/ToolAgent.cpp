@@ -0,0 +1,177 @@
+/**
+ * @file ToolAgent.cpp
+ * @brief Lets a model call tools while it answers, running the calls of a turn concurrently.
+ */
+
+#include "ToolAgent.h"
+#include <iostream>
+#include <future>
+#include <chrono>
+
+namespace
+{
+   // Rounds of tool calls before the model is asked to answer with what it has
+   const int MAX_TOOL_ROUNDS = 4;
+
+   // Characters of a tool result handed back to the model, keeps one result from filling the context
+   const size_t MAX_RESULT_CHARS = 4000;
+
+   // Time the calls of a turn get after the reply ended; a call still running then answers with a
+   // timeout error and keeps its pool thread until it returns
+   const std::chrono::seconds TOOL_CALL_TIMEOUT(30);
+
+   // Adds the counters of one round to those of the whole reply
+   void accumulate(GenerationResult& total, const GenerationResult& round)
+   {
+      total.promptTokens += round.promptTokens;
+      total.cachedTokens += round.cachedTokens;
+      total.generatedTokens += round.generatedTokens;
+      total.splicedTokens += round.splicedTokens;
+      total.queueMs += round.queueMs;
+      total.prefillMs += round.prefillMs;
+      total.decodeMs += round.decodeMs;
+      total.stopReason = round.stopReason;
+      total.truncated = round.truncated;
+   }
+}
+
+/**
+ * @brief Runs tool-using turns on a loaded model, in-process or isolated
+ *
+ * @param model Model the turns run on
+ * @param tools Tools the model may call, must outlive the agent
+ * @param threads Tool calls that may run at once
+ */
+ToolAgent::ToolAgent(ModelInterface* model, ToolRegistry* tools, size_t threads /* 4 */) :
+ m_model(model),
+ m_tools(tools),
+ m_pool(threads)
+{
+}
+
+/**
+ * @brief Sends a prompt and lets the model call tools until it answers without any
+ *
+ * @param prompt User message
+ * @param onToken Called for every piece of reply text; returning false stops the reply
+ * @param chunks Reference material for the first turn, as for ModelInterface::sendPrompt
+ * @param conversation Conversation the turns belong to
+ * @return GenerationResult The reply text of all rounds, with their counters added up
+ */
+GenerationResult ToolAgent::sendPrompt(const std::string& prompt, const std::function<bool(const std::string&)>& onToken,
+                                       const std::vector<std::string>& chunks /* {} */,
+                                       int32_t conversation /* INTERACTIVE_SESSION */)
+{
+   // The catalog rides along in the first user message rather than the system prompt, so it also
+   // reaches a model running in a worker process
+   std::string message = prompt;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(m_primed.insert(conversation).second)
+      {
+         message = m_tools->describe() + "\n" + prompt;
+      }
+   }
+
+   GenerationResult total;
+   // Calls of the current turn; a deque so the entries stay put while the parser adds more
+   std::deque<RunningCall> running;
+   ToolCallParser parser([&total, &onToken](const std::string& text)
+   {
+      total.text += text;
+      return onToken(text);
+   },
+   [this, &running](const ToolCall& call)
+   {
+      // Runs while the model keeps generating the rest of its reply
+      running.emplace_back();
+      startCall(call, running.back());
+   });
+
+   std::vector<std::string> results = chunks;
+   for(int round = 0; ; ++round)
+   {
+      parser.reset();
+      running.clear();
+      const GenerationResult result = m_model->sendPrompt(message, "User",
+                                                          [&parser](const std::string& piece) { return parser.feed(piece); },
+                                                          results, {}, conversation);
+      const bool keepGoing = parser.finish();
+      accumulate(total, result);
+
+      // Calls still running when the reply ended are the only wait left, up to a shared deadline
+      const auto waitStart = std::chrono::steady_clock::now();
+      const auto deadline = waitStart + TOOL_CALL_TIMEOUT;
+      std::vector<std::string> responses;
+      for(auto& call : running)
+      {
+         if(call.done.wait_until(deadline) == std::future_status::ready)
+         {
+            responses.push_back(std::move(*call.response));
+         }
+         else
+         {
+            std::cerr << "Error : tool " << call.name << " did not finish within " << TOOL_CALL_TIMEOUT.count() << " s" << std::endl;
+            responses.push_back("<tool_response name=\"" + call.name + "\">\nError: the tool did not finish within " +
+                                std::to_string(TOOL_CALL_TIMEOUT.count()) + " seconds\n</tool_response>");
+         }
+      }
+      #ifdef _DEBUG
+         std::cout << "Waited " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count()
+                   << " ms for " << running.size() << " tool call(s) after the reply ended" << std::endl;
+      #endif
+
+      if(running.empty() || !keepGoing || result.stopReason != GenerationStopReason::EndOfGeneration ||
+         round >= MAX_TOOL_ROUNDS)
+      {
+         break;
+      }
+
+      // The results travel as chunks, whose KV blocks were prefilled while the reply streamed. Chunks
+      // leave the history after their turn, so the message that stays behind must not point at them;
+      // each result names its tool in its own tags.
+      results = std::move(responses);
+      message = "Continue your answer.";
+      if(round + 1 >= MAX_TOOL_ROUNDS)
+      {
+         message += " No more tool calls are possible, answer with the information you have.";
+      }
+   }
+   return total;
+}
+
+/**
+ * @brief Forgets that a conversation has seen the tool catalog, call when it is closed
+ */
+void ToolAgent::forgetConversation(int32_t conversation)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_primed.erase(conversation);
+}
+
+// Runs a call on the pool and prefetches its result's KV block as soon as it is ready
+void ToolAgent::startCall(const ToolCall& call, RunningCall& running)
+{
+   running.name = call.name;
+   running.response = std::make_shared<std::string>();
+   running.done = m_pool.submit([this, call, response = running.response]()
+   {
+      std::string output;
+      if(!call.error.empty())
+      {
+         output = "Error: " + call.error;
+      }
+      else
+      {
+         std::expected<std::string, std::string> result = m_tools->call(call.name, call.arguments);
+         output = result.has_value() ? std::move(*result) : "Error: " + result.error();
+      }
+      if(output.size() > MAX_RESULT_CHARS)
+      {
+         output.resize(MAX_RESULT_CHARS);
+         output += "\n[... result truncated ...]";
+      }
+      *response = "<tool_response name=\"" + call.name + "\">\n" + output + "\n</tool_response>";
+      m_model->prefetchChunks({*response});
+   });
+}
@@ -0,0 +1,83 @@
+/**
+ * @file ToolAgent.h
+ * @brief Lets a model call tools while it answers. Calls are picked out of the reply as it streams
+ *        and each one starts on a thread pool the moment its closing tag arrives, while the model is
+ *        still generating. A finished result is prefilled into a stored KV block right away, between
+ *        the reply's decode steps, so when the turn ends the results are spliced into the follow-up
+ *        turn instead of being prefilled cold.
+ */
+#ifndef TOOL_AGENT_H
+#define TOOL_AGENT_H
+
+#include "ModelInterface.h"
+#include "ToolRegistry.h"
+#include "ToolCallParser.h"
+#include "ThreadPool.h"
+#include <string>
+#include <vector>
+#include <functional>
+#include <set>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+
+class ToolAgent
+{
+public:
+   /**
+    * @brief Runs tool-using turns on a loaded model, in-process or isolated
+    *
+    * @param model Model the turns run on
+    * @param tools Tools the model may call, must outlive the agent
+    * @param threads Tool calls that may run at once
+    */
+   ToolAgent(ModelInterface* model, ToolRegistry* tools, size_t threads = 4);
+
+   /**
+    * @brief Sends a prompt and lets the model call tools until it answers without any
+    *
+    * The first prompt of a conversation carries the tool catalog. onToken only sees the reply text,
+    * not the call blocks or the results; the turns stop after a few rounds of calls. Results are
+    * reference material of the turn that follows their calls and, like attached file chunks, are
+    * not kept in the conversation's history.
+    *
+    * @param prompt User message
+    * @param onToken Called for every piece of reply text; returning false stops the reply
+    * @param chunks Reference material for the first turn, as for ModelInterface::sendPrompt
+    * @param conversation Conversation the turns belong to
+    * @return GenerationResult The reply text of all rounds, with their counters added up
+    */
+   GenerationResult sendPrompt(const std::string& prompt, const std::function<bool(const std::string&)>& onToken,
+                               const std::vector<std::string>& chunks = {},
+                               int32_t conversation = INTERACTIVE_SESSION);
+
+   /**
+    * @brief Forgets that a conversation has seen the tool catalog, call when it is closed
+    */
+   void forgetConversation(int32_t conversation);
+
+private:
+   // A call started while the reply that made it is still streaming
+   struct RunningCall
+   {
+      std::string name;
+      // The result as the follow-up turn's chunk, set by the pool once the call has run; shared so a
+      // call given up on can still finish after the turn has moved on
+      std::shared_ptr<std::string> response;
+      std::future<void> done;
+   };
+
+   // Runs a call on the pool and prefetches its result's KV block as soon as it is ready
+   void startCall(const ToolCall& call, RunningCall& running);
+
+   ModelInterface* m_model;
+   ToolRegistry* m_tools;
+   ThreadPool m_pool;
+   // Conversations whose history already holds the tool catalog
+   std::set<int32_t> m_primed;
+   std::mutex m_mutex;
+};
+
+#endif
@@ -0,0 +1,166 @@
+/**
+ * @file ToolCallParser.cpp
+ * @brief Picks <tool_call>{...}</tool_call> blocks out of a reply while it streams.
+ */
+
+#include "ToolCallParser.h"
+#include <algorithm>
+
+namespace
+{
+   const std::string OPEN_TAG = "<tool_call>";
+   const std::string CLOSE_TAG = "</tool_call>";
+
+   // Length of the longest suffix of text that is a proper prefix of tag
+   size_t partialTagLength(const std::string& text, const std::string& tag)
+   {
+      for(size_t length = std::min(text.size(), tag.size() - 1); length > 0; --length)
+      {
+         if(text.compare(text.size() - length, length, tag, 0, length) == 0)
+         {
+            return length;
+         }
+      }
+      return 0;
+   }
+}
+
+/**
+ * @brief Parses a reply, passing text outside of tool calls to a callback
+ *
+ * @param onText Called with reply text that is not part of a tool call; returning false stops the reply
+ * @param onCall Called as soon as a call is complete, while the rest of the reply is still streaming
+ */
+ToolCallParser::ToolCallParser(std::function<bool(const std::string&)> onText,
+                               std::function<void(const ToolCall&)> onCall /* {} */) :
+ m_onText(std::move(onText)),
+ m_onCall(std::move(onCall)),
+ m_inCall(false),
+ m_stopped(false)
+{
+}
+
+/**
+ * @brief Feeds the next piece of the reply
+ *
+ * @param piece Text as the model generated it, tags may be split across pieces
+ * @return true to keep generating, false if the text callback asked to stop
+ */
+bool ToolCallParser::feed(const std::string& piece)
+{
+   m_pending += piece;
+   while(true)
+   {
+      if(m_inCall)
+      {
+         const size_t close = m_pending.find(CLOSE_TAG);
+         if(close == std::string::npos)
+         {
+            break;
+         }
+         addCall(parseCall(m_pending.substr(0, close)));
+         m_pending.erase(0, close + CLOSE_TAG.size());
+         m_inCall = false;
+      }
+      else
+      {
+         const size_t open = m_pending.find(OPEN_TAG);
+         if(open == std::string::npos)
+         {
+            // Hold back only what may still turn into an open tag
+            const size_t held = partialTagLength(m_pending, OPEN_TAG);
+            emit(m_pending.substr(0, m_pending.size() - held));
+            m_pending.erase(0, m_pending.size() - held);
+            break;
+         }
+         emit(m_pending.substr(0, open));
+         m_pending.erase(0, open + OPEN_TAG.size());
+         m_inCall = true;
+      }
+   }
+   return !m_stopped;
+}
+
+/**
+ * @brief Ends the reply, passing on held back text and closing an unfinished call
+ *
+ * @return true unless the text callback asked to stop
+ */
+bool ToolCallParser::finish()
+{
+   if(m_inCall)
+   {
+      // The reply ended inside a call, e.g. on a stop sequence that ate the closing tag
+      addCall(parseCall(m_pending));
+      m_inCall = false;
+   }
+   else
+   {
+      emit(m_pending);
+   }
+   m_pending.clear();
+   return !m_stopped;
+}
+
+/**
+ * @brief Forgets the calls and any partial state, for the next reply
+ */
+void ToolCallParser::reset()
+{
+   m_pending.clear();
+   m_inCall = false;
+   m_stopped = false;
+   m_calls.clear();
+}
+
+// Turns the body of a block into a call
+ToolCall ToolCallParser::parseCall(const std::string& body)
+{
+   ToolCall call;
+   const nlohmann::json parsed = nlohmann::json::parse(body, nullptr, false);
+   if(parsed.is_discarded() || !parsed.is_object())
+   {
+      call.error = "the tool call is not a JSON object: " + body;
+      return call;
+   }
+   auto name = parsed.find("name");
+   if(name == parsed.end() || !name->is_string())
+   {
+      call.error = "the tool call has no name: " + body;
+      return call;
+   }
+   call.name = name->get<std::string>();
+   auto arguments = parsed.find("arguments");
+   if(arguments != parsed.end())
+   {
+      // Some models send the arguments as a JSON string rather than an object
+      call.arguments = arguments->is_string() ? nlohmann::json::parse(arguments->get<std::string>(), nullptr, false)
+                                              : *arguments;
+      if(call.arguments.is_discarded() || !call.arguments.is_object())
+      {
+         call.error = "the arguments of " + call.name + " are not a JSON object";
+         call.arguments = nlohmann::json::object();
+      }
+   }
+   return call;
+}
+
+// Records a completed call and hands it to the call callback
+void ToolCallParser::addCall(ToolCall call)
+{
+   m_calls.push_back(std::move(call));
+   if(m_onCall)
+   {
+      m_onCall(m_calls.back());
+   }
+}
+
+// Passes text on, remembering if the callback asked to stop
+bool ToolCallParser::emit(const std::string& text)
+{
+   if(!text.empty() && !m_stopped && !m_onText(text))
+   {
+      m_stopped = true;
+   }
+   return !m_stopped;
+}
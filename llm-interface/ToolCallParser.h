@@ -0,0 +1,85 @@
+/**
+ * @file ToolCallParser.h
+ * @brief Picks <tool_call>{...}</tool_call> blocks out of a reply while it streams. Text outside of
+ *        the blocks is passed on as soon as it cannot be the start of a block, so the reader sees the
+ *        reply without delay, and each call is ready to run the moment its closing tag arrives.
+ */
+#ifndef TOOL_CALL_PARSER_H
+#define TOOL_CALL_PARSER_H
+
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+#include <functional>
+
+/**
+ * @brief One tool call the model made
+ */
+struct ToolCall
+{
+   std::string name;
+   nlohmann::json arguments = nlohmann::json::object();
+   // Set when the block was not a valid call; the text is handed back to the model instead of a result
+   std::string error;
+};
+
+class ToolCallParser
+{
+public:
+   /**
+    * @brief Parses a reply, passing text outside of tool calls to a callback
+    *
+    * @param onText Called with reply text that is not part of a tool call; returning false stops the reply
+    * @param onCall Called as soon as a call is complete, while the rest of the reply is still streaming
+    */
+   explicit ToolCallParser(std::function<bool(const std::string&)> onText,
+                           std::function<void(const ToolCall&)> onCall = {});
+
+   /**
+    * @brief Feeds the next piece of the reply
+    *
+    * @param piece Text as the model generated it, tags may be split across pieces
+    * @return true to keep generating, false if the text callback asked to stop
+    */
+   bool feed(const std::string& piece);
+
+   /**
+    * @brief Ends the reply, passing on held back text and closing an unfinished call
+    *
+    * @return true unless the text callback asked to stop
+    */
+   bool finish();
+
+   /**
+    * @brief Returns the calls completed so far, in the order they were made
+    */
+   inline const std::vector<ToolCall>& getCalls() const
+   {
+      return m_calls;
+   }
+
+   /**
+    * @brief Forgets the calls and any partial state, for the next reply
+    */
+   void reset();
+
+private:
+   // Turns the body of a block into a call
+   static ToolCall parseCall(const std::string& body);
+
+   // Records a completed call and hands it to the call callback
+   void addCall(ToolCall call);
+
+   // Passes text on, remembering if the callback asked to stop
+   bool emit(const std::string& text);
+
+   std::function<bool(const std::string&)> m_onText;
+   std::function<void(const ToolCall&)> m_onCall;
+   // Text not yet passed on: a possible partial open tag outside of a call, or the body inside one
+   std::string m_pending;
+   bool m_inCall;
+   bool m_stopped;
+   std::vector<ToolCall> m_calls;
+};
+
+#endif
@@ -0,0 +1,670 @@
+/**
+ * @file ToolRegistry.cpp
+ * @brief Tools a model may call while answering, their handlers and per-tool latency counters.
+ */
+
+#include "ToolRegistry.h"
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <bitset>
+#include <optional>
+#include <cctype>
+
+namespace
+{
+   // Matches grep reports before it stops, unless the call asks for fewer
+   const int64_t DEFAULT_MAX_MATCHES = 50;
+
+   // Lines read_file returns when the call gives no end line
+   const int64_t DEFAULT_READ_LINES = 200;
+
+   // Longest regular expression grep compiles, bounds the work per searched character
+   const size_t MAX_REGEX_PATTERN = 256;
+
+   // Regular expressions for grep, matched by stepping every alternative along the line at once so a
+   // model-written pattern costs at most the pattern size per character instead of backtracking.
+   // Supports literals, '.', classes, anchors, groups, '|' and the '*', '+' and '?' repeats; syntax
+   // that needs backtracking (backreferences, lookaround, counted repeats) is refused.
+   class LineRegex
+   {
+   public:
+      // Compiles a pattern, or says why it can't be
+      static std::expected<LineRegex, std::string> compile(const std::string& pattern)
+      {
+         Parser parser{pattern};
+         const int root = parser.parseAlternation();
+         if(parser.error.empty() && parser.position < pattern.size())
+         {
+            parser.error = "unmatched )";
+         }
+         if(!parser.error.empty())
+         {
+            return std::unexpected(parser.error);
+         }
+         LineRegex regex;
+         regex.emit(parser.nodes, root);
+         regex.m_program.push_back({Op::Match, {}, 0, 0});
+         return regex;
+      }
+
+      // Returns true if the pattern matches anywhere in the line
+      bool search(const std::string& line) const
+      {
+         std::vector<size_t> current;
+         std::vector<size_t> next;
+         std::vector<size_t> seen(m_program.size(), SIZE_MAX);
+         for(size_t position = 0; ; ++position)
+         {
+            // A match may start at every position
+            if(addThread(current, seen, 0, position, line.size()))
+            {
+               return true;
+            }
+            if(position == line.size())
+            {
+               break;
+            }
+            const unsigned char c = static_cast<unsigned char>(line[position]);
+            next.clear();
+            for(size_t pc : current)
+            {
+               if(m_program[pc].op == Op::Byte && m_program[pc].set.test(c) &&
+                  addThread(next, seen, pc + 1, position + 1, line.size()))
+               {
+                  return true;
+               }
+            }
+            current.swap(next);
+         }
+         return false;
+      }
+
+   private:
+      enum class Op { Byte, Split, Jump, LineStart, LineEnd, Match };
+
+      struct Instruction
+      {
+         Op op;
+         std::bitset<256> set;
+         size_t x;
+         size_t y;
+      };
+
+      enum class Kind { Empty, Set, LineStart, LineEnd, Concat, Alternate, Star, Plus, Optional };
+
+      struct Node
+      {
+         Kind kind;
+         std::bitset<256> set;
+         int left;
+         int right;
+      };
+
+      // Recursive descent over the pattern; depth is bounded by MAX_REGEX_PATTERN
+      struct Parser
+      {
+         const std::string& pattern;
+         size_t position = 0;
+         std::vector<Node> nodes;
+         std::string error;
+
+         int add(Kind kind, int left = -1, int right = -1, const std::bitset<256>& set = {})
+         {
+            nodes.push_back({kind, set, left, right});
+            return static_cast<int>(nodes.size()) - 1;
+         }
+
+         bool atEnd() const
+         {
+            return position >= pattern.size();
+         }
+
+         int parseAlternation()
+         {
+            int node = parseSequence();
+            while(error.empty() && !atEnd() && pattern[position] == '|')
+            {
+               position++;
+               const int right = parseSequence();
+               node = add(Kind::Alternate, node, right);
+            }
+            return node;
+         }
+
+         int parseSequence()
+         {
+            int node = add(Kind::Empty);
+            while(error.empty() && !atEnd() && pattern[position] != '|' && pattern[position] != ')')
+            {
+               const int atom = parseRepeat();
+               node = add(Kind::Concat, node, atom);
+            }
+            return node;
+         }
+
+         int parseRepeat()
+         {
+            int node = parseAtom();
+            while(error.empty() && !atEnd())
+            {
+               const char c = pattern[position];
+               if(c == '*' || c == '+' || c == '?')
+               {
+                  // A lazy '?' after a repeat changes nothing for whether a line matches
+                  position++;
+                  node = add(c == '*' ? Kind::Star : c == '+' ? Kind::Plus : Kind::Optional, node);
+               }
+               else if(c == '{')
+               {
+                  error = "counted repeats {n,m} are not supported";
+               }
+               else
+               {
+                  break;
+               }
+            }
+            return node;
+         }
+
+         int parseAtom()
+         {
+            const char c = pattern[position++];
+            std::bitset<256> set;
+            switch(c)
+            {
+               case '(':
+               {
+                  if(!atEnd() && pattern[position] == '?')
+                  {
+                     if(pattern.compare(position, 2, "?:") != 0)
+                     {
+                        error = "lookaround is not supported";
+                        return -1;
+                     }
+                     position += 2;
+                  }
+                  const int inner = parseAlternation();
+                  if(error.empty() && (atEnd() || pattern[position] != ')'))
+                  {
+                     error = "missing )";
+                  }
+                  position++;
+                  return inner;
+               }
+               case '.':
+                  set.set();
+                  set.reset('\n');
+                  return add(Kind::Set, -1, -1, set);
+               case '^':
+                  return add(Kind::LineStart);
+               case '$':
+                  return add(Kind::LineEnd);
+               case '[':
+                  return parseClass();
+               case '\\':
+                  if(!parseEscape(set, false))
+                  {
+                     return -1;
+                  }
+                  return add(Kind::Set, -1, -1, set);
+               case '*':
+               case '+':
+               case '?':
+               case '{':
+                  error = std::string("nothing to repeat before ") + c;
+                  return -1;
+               default:
+                  set.set(static_cast<unsigned char>(c));
+                  return add(Kind::Set, -1, -1, set);
+            }
+         }
+
+         // Reads the escape after a backslash into set
+         bool parseEscape(std::bitset<256>& set, bool inClass)
+         {
+            if(atEnd())
+            {
+               error = "pattern ends with a backslash";
+               return false;
+            }
+            const char c = pattern[position++];
+            const char kind = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            if(kind == 'd' || kind == 'w' || kind == 's')
+            {
+               std::bitset<256> members;
+               for(int byte = 0; byte < 256; ++byte)
+               {
+                  members[byte] = kind == 'd' ? std::isdigit(byte) != 0 :
+                                  kind == 'w' ? std::isalnum(byte) != 0 || byte == '_' : std::isspace(byte) != 0;
+               }
+               set |= c == kind ? members : ~members;
+            }
+            else if(c == 'n' || c == 't' || c == 'r')
+            {
+               set.set(c == 'n' ? '\n' : c == 't' ? '\t' : '\r');
+            }
+            else if(c == 'b' && inClass)
+            {
+               set.set('\b');
+            }
+            else if(std::isalnum(static_cast<unsigned char>(c)))
+            {
+               error = std::string("escape \\") + c + " is not supported";
+               return false;
+            }
+            else
+            {
+               set.set(static_cast<unsigned char>(c));
+            }
+            return true;
+         }
+
+         int parseClass()
+         {
+            std::bitset<256> set;
+            const bool negated = !atEnd() && pattern[position] == '^';
+            position += negated ? 1 : 0;
+            bool first = true;
+            while(!atEnd() && (pattern[position] != ']' || first))
+            {
+               first = false;
+               std::bitset<256> item;
+               if(pattern[position] == '\\')
+               {
+                  position++;
+                  if(!parseEscape(item, true))
+                  {
+                     return -1;
+                  }
+                  set |= item;
+                  continue;
+               }
+               const unsigned char low = static_cast<unsigned char>(pattern[position++]);
+               if(position + 1 < pattern.size() && pattern[position] == '-' && pattern[position + 1] != ']')
+               {
+                  const unsigned char high = static_cast<unsigned char>(pattern[position + 1]);
+                  position += 2;
+                  if(high < low)
+                  {
+                     error = "range out of order in character class";
+                     return -1;
+                  }
+                  for(unsigned int byte = low; byte <= high; ++byte)
+                  {
+                     set.set(byte);
+                  }
+               }
+               else
+               {
+                  set.set(low);
+               }
+            }
+            if(atEnd())
+            {
+               error = "missing ]";
+               return -1;
+            }
+            position++;
+            return add(Kind::Set, -1, -1, negated ? ~set : set);
+         }
+      };
+
+      // Appends the instructions of a node and its children
+      void emit(const std::vector<Node>& nodes, int index)
+      {
+         const Node& node = nodes[index];
+         switch(node.kind)
+         {
+            case Kind::Empty:
+               break;
+            case Kind::Set:
+               m_program.push_back({Op::Byte, node.set, 0, 0});
+               break;
+            case Kind::LineStart:
+               m_program.push_back({Op::LineStart, {}, 0, 0});
+               break;
+            case Kind::LineEnd:
+               m_program.push_back({Op::LineEnd, {}, 0, 0});
+               break;
+            case Kind::Concat:
+               emit(nodes, node.left);
+               emit(nodes, node.right);
+               break;
+            case Kind::Alternate:
+            {
+               const size_t split = push(Op::Split);
+               m_program[split].x = m_program.size();
+               emit(nodes, node.left);
+               const size_t jump = push(Op::Jump);
+               m_program[split].y = m_program.size();
+               emit(nodes, node.right);
+               m_program[jump].x = m_program.size();
+               break;
+            }
+            case Kind::Star:
+            {
+               const size_t split = push(Op::Split);
+               m_program[split].x = m_program.size();
+               emit(nodes, node.left);
+               m_program[push(Op::Jump)].x = split;
+               m_program[split].y = m_program.size();
+               break;
+            }
+            case Kind::Plus:
+            {
+               const size_t start = m_program.size();
+               emit(nodes, node.left);
+               const size_t split = push(Op::Split);
+               m_program[split].x = start;
+               m_program[split].y = m_program.size();
+               break;
+            }
+            case Kind::Optional:
+            {
+               const size_t split = push(Op::Split);
+               m_program[split].x = m_program.size();
+               emit(nodes, node.left);
+               m_program[split].y = m_program.size();
+               break;
+            }
+         }
+      }
+
+      size_t push(Op op)
+      {
+         m_program.push_back({op, {}, 0, 0});
+         return m_program.size() - 1;
+      }
+
+      // Follows the jumps and anchors from pc, adding each instruction that reads a byte to the list
+      // once per position; returns true when the program can match here
+      bool addThread(std::vector<size_t>& list, std::vector<size_t>& seen, size_t pc, size_t position, size_t length) const
+      {
+         std::vector<size_t> pending{pc};
+         while(!pending.empty())
+         {
+            const size_t at = pending.back();
+            pending.pop_back();
+            if(seen[at] == position)
+            {
+               continue;
+            }
+            seen[at] = position;
+            const Instruction& instruction = m_program[at];
+            switch(instruction.op)
+            {
+               case Op::Byte:
+                  list.push_back(at);
+                  break;
+               case Op::Split:
+                  pending.push_back(instruction.y);
+                  pending.push_back(instruction.x);
+                  break;
+               case Op::Jump:
+                  pending.push_back(instruction.x);
+                  break;
+               case Op::LineStart:
+                  if(position == 0)
+                  {
+                     pending.push_back(at + 1);
+                  }
+                  break;
+               case Op::LineEnd:
+                  if(position == length)
+                  {
+                     pending.push_back(at + 1);
+                  }
+                  break;
+               case Op::Match:
+                  return true;
+            }
+         }
+         return false;
+      }
+
+      std::vector<Instruction> m_program;
+   };
+
+   std::string lower(std::string text)
+   {
+      std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+      return text;
+   }
+
+   // Splits contents into lines without their terminators
+   std::vector<std::string> splitLines(const std::string& contents)
+   {
+      std::vector<std::string> lines;
+      std::istringstream stream(contents);
+      std::string line;
+      while(std::getline(stream, line))
+      {
+         lines.push_back(line);
+      }
+      return lines;
+   }
+
+   // Reads an optional string argument
+   std::string stringArgument(const nlohmann::json& arguments, const char* key)
+   {
+      auto iter = arguments.find(key);
+      return iter != arguments.end() && iter->is_string() ? iter->get<std::string>() : std::string();
+   }
+
+   // Reads an optional integer argument
+   int64_t integerArgument(const nlohmann::json& arguments, const char* key, int64_t fallback)
+   {
+      auto iter = arguments.find(key);
+      return iter != arguments.end() && iter->is_number_integer() ? iter->get<int64_t>() : fallback;
+   }
+}
+
+/**
+ * @brief Adds a tool, replacing any tool of the same name
+ */
+void ToolRegistry::add(ToolSpec spec, ToolHandler handler)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   const std::string name = spec.name;
+   m_tools[name] = {std::move(spec), std::move(handler)};
+}
+
+/**
+ * @brief Adds list_files, search_files, grep and read_file over the files a source provides
+ *
+ * @param files Called on every tool call, so the tools always see the current files
+ */
+void ToolRegistry::addFileTools(FileSource files)
+{
+   add({"list_files", "Lists the attached files with their line counts.", {{"type", "object"}, {"properties", nlohmann::json::object()}}},
+       [files](const nlohmann::json&) -> std::expected<std::string, std::string>
+   {
+      std::string listing;
+      for(const auto& [name, contents] : files())
+      {
+         listing += name + " (" + std::to_string(splitLines(contents).size()) + " lines)\n";
+      }
+      return listing.empty() ? std::string("No files are attached.") : listing;
+   });
+
+   add({"search_files", "Finds attached files whose name contains a text, ignoring case.",
+        {{"type", "object"},
+         {"properties", {{"query", {{"type", "string"}, {"description", "Part of the file name"}}}}},
+         {"required", {"query"}}}},
+       [files](const nlohmann::json& arguments) -> std::expected<std::string, std::string>
+   {
+      const std::string query = lower(stringArgument(arguments, "query"));
+      if(query.empty())
+      {
+         return std::unexpected("query is required");
+      }
+      std::string found;
+      for(const auto& [name, contents] : files())
+      {
+         if(lower(name).find(query) != std::string::npos)
+         {
+            found += name + "\n";
+         }
+      }
+      return found.empty() ? std::string("No file names match.") : found;
+   });
+
+   add({"grep", "Searches the attached files for lines containing a text, or matching a regular expression when regex is true (literals, ., [classes], ^, $, groups, |, *, + and ?; \\d, \\w and \\s escapes; no backreferences, lookaround or {n,m}).",
+        {{"type", "object"},
+         {"properties", {{"pattern", {{"type", "string"}, {"description", "Text to find, or a regular expression"}}},
+                         {"regex", {{"type", "boolean"}, {"description", "Treat the pattern as a regular expression"}}},
+                         {"file", {{"type", "string"}, {"description", "Only search this file"}}},
+                         {"max_matches", {{"type", "integer"}, {"description", "Stop after this many matching lines"}}}}},
+         {"required", {"pattern"}}}},
+       [files](const nlohmann::json& arguments) -> std::expected<std::string, std::string>
+   {
+      const std::string pattern = stringArgument(arguments, "pattern");
+      const std::string only = stringArgument(arguments, "file");
+      const int64_t maxMatches = std::max<int64_t>(1, integerArgument(arguments, "max_matches", DEFAULT_MAX_MATCHES));
+      auto regexFlag = arguments.find("regex");
+      const bool useRegex = regexFlag != arguments.end() && regexFlag->is_boolean() && regexFlag->get<bool>();
+      if(pattern.empty())
+      {
+         return std::unexpected("pattern is required");
+      }
+      std::optional<LineRegex> expression;
+      if(useRegex)
+      {
+         if(pattern.size() > MAX_REGEX_PATTERN)
+         {
+            return std::unexpected("regular expressions are limited to " + std::to_string(MAX_REGEX_PATTERN) + " characters");
+         }
+         std::expected<LineRegex, std::string> compiled = LineRegex::compile(pattern);
+         if(!compiled)
+         {
+            return std::unexpected("invalid pattern: " + compiled.error());
+         }
+         expression = std::move(*compiled);
+      }
+
+      std::string matches;
+      int64_t count = 0;
+      for(const auto& [name, contents] : files())
+      {
+         if(!only.empty() && name != only)
+         {
+            continue;
+         }
+         const std::vector<std::string> lines = splitLines(contents);
+         for(size_t i = 0; i < lines.size() && count < maxMatches; ++i)
+         {
+            const bool found = expression ? expression->search(lines[i]) : lines[i].find(pattern) != std::string::npos;
+            if(found)
+            {
+               matches += name + ":" + std::to_string(i + 1) + ": " + lines[i] + "\n";
+               count++;
+            }
+         }
+      }
+      if(count >= maxMatches)
+      {
+         matches += "[stopped after " + std::to_string(maxMatches) + " matches]\n";
+      }
+      return matches.empty() ? std::string("No lines match.") : matches;
+   });
+
+   add({"read_file", "Returns numbered lines of an attached file.",
+        {{"type", "object"},
+         {"properties", {{"file", {{"type", "string"}, {"description", "File name as listed"}}},
+                         {"start_line", {{"type", "integer"}, {"description", "First line, from 1"}}},
+                         {"end_line", {{"type", "integer"}, {"description", "Last line, inclusive"}}}}},
+         {"required", {"file"}}}},
+       [files](const nlohmann::json& arguments) -> std::expected<std::string, std::string>
+   {
+      const std::string wanted = stringArgument(arguments, "file");
+      for(const auto& [name, contents] : files())
+      {
+         if(name != wanted)
+         {
+            continue;
+         }
+         const std::vector<std::string> lines = splitLines(contents);
+         // Clamped to the file first, the model may ask for any line number
+         const int64_t count = static_cast<int64_t>(lines.size());
+         const int64_t first = std::clamp<int64_t>(integerArgument(arguments, "start_line", 1), 1, count + 1);
+         const int64_t last = std::min<int64_t>(count, integerArgument(arguments, "end_line", first + DEFAULT_READ_LINES - 1));
+         std::string text;
+         for(int64_t line = first; line <= last; ++line)
+         {
+            text += std::to_string(line) + ": " + lines[line - 1] + "\n";
+         }
+         return text.empty() ? std::string("No lines in that range.") : text;
+      }
+      return std::unexpected("no attached file is named " + wanted);
+   });
+}
+
+/**
+ * @brief Returns true if no tools are registered
+ */
+bool ToolRegistry::empty() const
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_tools.empty();
+}
+
+/**
+ * @brief Describes every tool and the tool-call format, for the model's instructions
+ */
+std::string ToolRegistry::describe() const
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   std::string text = "You can call tools. To call one, write exactly\n"
+                      "<tool_call>{\"name\": \"<tool>\", \"arguments\": {...}}</tool_call>\n"
+                      "Several calls in one reply run together. Their results come back in <tool_response> blocks; "
+                      "then continue your answer. Available tools:\n";
+   for(const auto& [name, tool] : m_tools)
+   {
+      text += nlohmann::json({{"name", name}, {"description", tool.spec.description}, {"parameters", tool.spec.parameters}}).dump() + "\n";
+   }
+   return text;
+}
+
+/**
+ * @brief Runs a tool and records its latency; safe to call from several threads at once
+ *
+ * @param name Tool to run
+ * @param arguments Arguments object from the model's call
+ * @return std::expected<std::string, std::string> The tool's result, or why it failed
+ */
+std::expected<std::string, std::string> ToolRegistry::call(const std::string& name, const nlohmann::json& arguments)
+{
+   ToolHandler handler;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto tool = m_tools.find(name);
+      if(tool == m_tools.end())
+      {
+         // Not counted, the names come from the model and would grow the stats without bound
+         return std::unexpected("unknown tool " + name);
+      }
+      handler = tool->second.handler;
+   }
+
+   const auto start = std::chrono::steady_clock::now();
+   std::expected<std::string, std::string> result = handler(arguments.is_object() ? arguments : nlohmann::json::object());
+   const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   ToolStats& stats = m_stats[name];
+   stats.calls++;
+   stats.failures += result.has_value() ? 0 : 1;
+   stats.totalMs += ms;
+   stats.maxMs = std::max(stats.maxMs, ms);
+   return result;
+}
+
+/**
+ * @brief Returns the latency counters of every tool called so far, by tool name
+ */
+std::map<std::string, ToolStats> ToolRegistry::getStats() const
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return m_stats;
+}
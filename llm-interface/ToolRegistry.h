@@ -0,0 +1,103 @@
+/**
+ * @file ToolRegistry.h
+ * @brief Tools a model may call while answering: their names, descriptions and JSON argument
+ *        schemas for the prompt, the handlers that run them, and per-tool latency counters so slow
+ *        tools can be identified. Comes with shell-free tools over the attached files.
+ */
+#ifndef TOOL_REGISTRY_H
+#define TOOL_REGISTRY_H
+
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <functional>
+#include <expected>
+#include <mutex>
+#include <cstdint>
+
+/**
+ * @brief A tool as the model sees it
+ */
+struct ToolSpec
+{
+   std::string name;
+   std::string description;
+   // JSON schema of the arguments object
+   nlohmann::json parameters = nlohmann::json::object();
+};
+
+/**
+ * @brief Runs a tool on its arguments; the error text is handed back to the model as the result
+ */
+using ToolHandler = std::function<std::expected<std::string, std::string>(const nlohmann::json&)>;
+
+/**
+ * @brief Latency counters of one tool
+ */
+struct ToolStats
+{
+   uint64_t calls = 0;
+   // Calls that returned an error, unknown tools included
+   uint64_t failures = 0;
+   double totalMs = 0.0;
+   double maxMs = 0.0;
+};
+
+class ToolRegistry
+{
+public:
+   // Files the built-in tools work on, as (name, contents) pairs
+   using FileSource = std::function<std::vector<std::pair<std::string, std::string>>()>;
+
+   /**
+    * @brief Adds a tool, replacing any tool of the same name
+    */
+   void add(ToolSpec spec, ToolHandler handler);
+
+   /**
+    * @brief Adds list_files, search_files, grep and read_file over the files a source provides
+    *
+    * @param files Called on every tool call, so the tools always see the current files
+    */
+   void addFileTools(FileSource files);
+
+   /**
+    * @brief Returns true if no tools are registered
+    */
+   bool empty() const;
+
+   /**
+    * @brief Describes every tool and the tool-call format, for the model's instructions
+    */
+   std::string describe() const;
+
+   /**
+    * @brief Runs a tool and records its latency; safe to call from several threads at once
+    *
+    * @param name Tool to run
+    * @param arguments Arguments object from the model's call
+    * @return std::expected<std::string, std::string> The tool's result, or why it failed
+    */
+   std::expected<std::string, std::string> call(const std::string& name, const nlohmann::json& arguments);
+
+   /**
+    * @brief Returns the latency counters of every tool called so far, by tool name
+    */
+   std::map<std::string, ToolStats> getStats() const;
+
+private:
+   struct Tool
+   {
+      ToolSpec spec;
+      ToolHandler handler;
+   };
+
+   std::map<std::string, Tool> m_tools;
+   std::map<std::string, ToolStats> m_stats;
+   // Guards both maps - tools run concurrently, their handlers outside of the lock
+   mutable std::mutex m_mutex;
+};
+
+#endif
@@ -0,0 +1,1170 @@
+/**
+ * @file ConversationRouter.cpp
+ * @brief HTTP front end that spreads conversations over several smart-agent-server backends by
+ *        consistent hashing with bounded load, migrating KV state off draining backends.
+ */
+
+#include "ConversationRouter.h"
+#include <nlohmann/json.hpp>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <tuple>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace
+{
+   // Largest request body we are willing to buffer - chat requests, never KV state
+   const size_t MAX_BODY_SIZE = 8 * 1024 * 1024;
+   // Largest header block we are willing to buffer
+   const size_t MAX_HEADER_SIZE = 16 * 1024;
+   // Client connections served at once; more are turned away rather than each getting a thread
+   const size_t MAX_CLIENTS = 1024;
+   // A client gets this long between reads and this long in all to send its request
+   const std::chrono::seconds CLIENT_READ_TIMEOUT(10);
+   const std::chrono::seconds REQUEST_TIMEOUT(30);
+   // Conversations remembered before the least recently used is forgotten
+   const size_t MAX_CONVERSATIONS = 65536;
+   // How long a backend is skipped after a failed connection
+   const std::chrono::seconds DOWN_INTERVAL(5);
+   // Connect timeout for backends; a dead host must not hold a client for the kernel's default
+   const int CONNECT_TIMEOUT_MS = 2000;
+   // Longest a backend may stall one of the router's own requests; turns of a conversation being
+   // migrated wait on it
+   const std::chrono::seconds EXCHANGE_STALL_TIMEOUT(30);
+
+   const std::string CONVERSATIONS_PATH = "/v1/conversations/";
+
+   // A backend's answer to one of the router's own requests
+   struct Reply
+   {
+      int status = 0;
+      std::string body;
+   };
+
+   const char* statusText(int status)
+   {
+      switch(status)
+      {
+         case 200: return "OK";
+         case 400: return "Bad Request";
+         case 404: return "Not Found";
+         case 405: return "Method Not Allowed";
+         case 408: return "Request Timeout";
+         case 413: return "Payload Too Large";
+         case 502: return "Bad Gateway";
+         case 503: return "Service Unavailable";
+         default:  return "Unknown";
+      }
+   }
+
+   bool setNonBlocking(int fd)
+   {
+      const int flags = fcntl(fd, F_GETFL, 0);
+      return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+   }
+
+   std::string toLower(std::string s)
+   {
+      std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+      return s;
+   }
+
+   std::string trim(const std::string& s)
+   {
+      const size_t b = s.find_first_not_of(" \t");
+      if(b == std::string::npos)
+      {
+         return "";
+      }
+      const size_t e = s.find_last_not_of(" \t\r");
+      return s.substr(b, e - b + 1);
+   }
+
+   // Splits "host:port", the port being after the last colon so bracketless IPv6 still parses
+   bool splitEndpoint(const std::string& endpoint, std::string& host, uint16_t& port)
+   {
+      const size_t colon = endpoint.rfind(':');
+      if(colon == std::string::npos || colon == 0 || colon + 1 == endpoint.size())
+      {
+         return false;
+      }
+      const int value = std::atoi(endpoint.c_str() + colon + 1);
+      if(value <= 0 || value > 65535)
+      {
+         return false;
+      }
+      host = endpoint.substr(0, colon);
+      port = static_cast<uint16_t>(value);
+      return true;
+   }
+
+   bool sendAll(int fd, const char* data, size_t size)
+   {
+      while(size > 0)
+      {
+         const ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+         if(n < 0)
+         {
+            if(errno == EINTR)
+            {
+               continue;
+            }
+            return false;
+         }
+         data += n;
+         size -= static_cast<size_t>(n);
+      }
+      return true;
+   }
+
+   bool sendAll(int fd, const std::string& data)
+   {
+      return sendAll(fd, data.data(), data.size());
+   }
+
+   void sendResponse(int fd, int status, const std::string& contentType, const std::string& body)
+   {
+      std::string out = "HTTP/1.1 " + std::to_string(status) + " " + statusText(status) + "\r\n";
+      out += "Content-Type: " + contentType + "\r\n";
+      out += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+      out += "Connection: close\r\n\r\n";
+      out += body;
+      sendAll(fd, out);
+   }
+
+   void sendError(int fd, int status, const std::string& message)
+   {
+      nlohmann::json body = {{"error", {{"message", message}, {"code", status}}}};
+      sendResponse(fd, status, "application/json", body.dump());
+   }
+
+   // Opens a blocking connection to a backend, -1 if it does not answer within CONNECT_TIMEOUT_MS
+   int connectTo(const std::string& host, uint16_t port)
+   {
+      addrinfo hints{};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      addrinfo* addrs = nullptr;
+      const std::string service = std::to_string(port);
+      if(getaddrinfo(host.c_str(), service.c_str(), &hints, &addrs) != 0)
+      {
+         return -1;
+      }
+
+      int connected = -1;
+      for(addrinfo* ai = addrs; ai != nullptr && connected == -1; ai = ai->ai_next)
+      {
+         const int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+         if(fd == -1)
+         {
+            continue;
+         }
+         const int flags = fcntl(fd, F_GETFL, 0);
+         bool ok = flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+         if(ok && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+         {
+            ok = false;
+            if(errno == EINPROGRESS)
+            {
+               pollfd pfd{fd, POLLOUT, 0};
+               int error = 0;
+               socklen_t length = sizeof(error);
+               ok = poll(&pfd, 1, CONNECT_TIMEOUT_MS) == 1 &&
+                    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+            }
+         }
+         if(ok && fcntl(fd, F_SETFL, flags) != -1)
+         {
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            connected = fd;
+         }
+         else
+         {
+            close(fd);
+         }
+      }
+      freeaddrinfo(addrs);
+      return connected;
+   }
+
+   // Sends one request to a backend and reads the whole response, which ends when the backend closes
+   bool exchange(const std::string& host, uint16_t port, const std::string& method, const std::string& path,
+                 const std::string& body, Reply& reply)
+   {
+      const int fd = connectTo(host, port);
+      if(fd == -1)
+      {
+         return false;
+      }
+      const timeval timeout{static_cast<time_t>(EXCHANGE_STALL_TIMEOUT.count()), 0};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      std::string out = method + " " + path + " HTTP/1.1\r\n";
+      out += "Host: " + host + ":" + std::to_string(port) + "\r\n";
+      out += "Content-Type: application/octet-stream\r\n";
+      out += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+      out += "Connection: close\r\n\r\n";
+      bool ok = sendAll(fd, out) && sendAll(fd, body);
+
+      std::string in;
+      char buf[65536];
+      while(ok)
+      {
+         const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+         if(n < 0 && errno == EINTR)
+         {
+            continue;
+         }
+         if(n <= 0)
+         {
+            ok = n == 0;
+            break;
+         }
+         in.append(buf, static_cast<size_t>(n));
+      }
+      close(fd);
+
+      const size_t headerEnd = in.find("\r\n\r\n");
+      if(!ok || headerEnd == std::string::npos || in.compare(0, 5, "HTTP/") != 0)
+      {
+         return false;
+      }
+      const size_t space = in.find(' ');
+      reply.status = space < headerEnd ? std::atoi(in.c_str() + space + 1) : 0;
+      reply.body = in.substr(headerEnd + 4);
+      return reply.status != 0;
+   }
+
+   // Receives from a client that has until the deadline to send its request; SO_RCVTIMEO bounds
+   // each wait, sets status to 408 once the deadline has passed
+   ssize_t recvRequest(int fd, char* buf, size_t size, std::chrono::steady_clock::time_point deadline, int& status)
+   {
+      while(true)
+      {
+         if(std::chrono::steady_clock::now() >= deadline)
+         {
+            status = 408;
+            return -1;
+         }
+         const ssize_t n = recv(fd, buf, size, 0);
+         if(n < 0 && errno == EINTR)
+         {
+            continue;
+         }
+         if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         {
+            status = 408;
+         }
+         return n;
+      }
+   }
+
+   // Reads one request off a client connection; sets status to the error to answer with on failure
+   template<typename Request>
+   bool readRequest(int fd, Request& request, int& status)
+   {
+      const auto deadline = std::chrono::steady_clock::now() + REQUEST_TIMEOUT;
+      std::string in;
+      char buf[16384];
+      size_t headerEnd = std::string::npos;
+      status = 0;
+      while(headerEnd == std::string::npos)
+      {
+         const ssize_t n = recvRequest(fd, buf, sizeof(buf), deadline, status);
+         if(n <= 0)
+         {
+            return false;
+         }
+         in.append(buf, static_cast<size_t>(n));
+         headerEnd = in.find("\r\n\r\n");
+         if(headerEnd == std::string::npos && in.size() > MAX_HEADER_SIZE)
+         {
+            status = 413;
+            return false;
+         }
+      }
+      if(headerEnd > MAX_HEADER_SIZE)
+      {
+         status = 413;
+         return false;
+      }
+
+      size_t lineEnd = in.find("\r\n");
+      const std::string requestLine = in.substr(0, lineEnd);
+      const size_t sp1 = requestLine.find(' ');
+      const size_t sp2 = requestLine.find(' ', sp1 + 1);
+      if(sp1 == std::string::npos || sp2 == std::string::npos)
+      {
+         status = 400;
+         return false;
+      }
+      request.method = requestLine.substr(0, sp1);
+      request.path = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+
+      size_t contentLength = 0;
+      while(lineEnd < headerEnd)
+      {
+         const size_t start = lineEnd + 2;
+         lineEnd = in.find("\r\n", start);
+         const std::string line = in.substr(start, lineEnd - start);
+         const size_t colon = line.find(':');
+         if(colon == std::string::npos)
+         {
+            continue;
+         }
+         const std::string name = toLower(trim(line.substr(0, colon)));
+         const std::string value = trim(line.substr(colon + 1));
+         if(name == "content-length")
+         {
+            contentLength = static_cast<size_t>(std::strtoull(value.c_str(), nullptr, 10));
+         }
+         else if(name == "transfer-encoding")
+         {
+            status = 400; // chunked uploads are not something any client of ours sends
+            return false;
+         }
+         request.headers.emplace_back(name, value);
+      }
+      if(contentLength > MAX_BODY_SIZE)
+      {
+         status = 413;
+         return false;
+      }
+
+      request.body = in.substr(headerEnd + 4);
+      while(request.body.size() < contentLength)
+      {
+         const ssize_t n = recvRequest(fd, buf, sizeof(buf), deadline, status);
+         if(n <= 0)
+         {
+            return false;
+         }
+         request.body.append(buf, static_cast<size_t>(n));
+      }
+      request.body.resize(contentLength);
+      return true;
+   }
+
+   // True for ids that can go into a URL path as they are
+   bool urlSafe(const std::string& id)
+   {
+      return std::all_of(id.begin(), id.end(), [](unsigned char c) {
+         return std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~';
+      });
+   }
+
+   std::string hexHash(std::string_view data)
+   {
+      char out[17];
+      std::snprintf(out, sizeof(out), "%016llx", static_cast<unsigned long long>(HashRing::hash(data)));
+      return out;
+   }
+
+   // Conversation a chat request belongs to: its "conversation_id", else the X-Conversation-Id
+   // header, else one derived from the opening messages that every later turn repeats
+   std::string conversationOf(const nlohmann::json& body, const std::string& header)
+   {
+      std::string id;
+      auto field = body.find("conversation_id");
+      if(field != body.end() && field->is_string())
+      {
+         id = field->get<std::string>();
+      }
+      else if(!header.empty())
+      {
+         id = header;
+      }
+      else
+      {
+         auto messages = body.find("messages");
+         if(messages == body.end() || !messages->is_array())
+         {
+            return "";
+         }
+         // Up to and including the first user message; later turns only append
+         std::string opening;
+         for(const auto& message : *messages)
+         {
+            // The backend rejects malformed messages, they only need to hash consistently here
+            if(!message.is_object())
+            {
+               opening += message.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+               opening += '\0';
+               continue;
+            }
+            auto roleField = message.find("role");
+            const std::string role = roleField != message.end() && roleField->is_string() ? roleField->get<std::string>() : "";
+            opening += role;
+            opening += '\0';
+            auto content = message.find("content");
+            if(content != message.end())
+            {
+               opening += content->is_string() ? content->get<std::string>()
+                                               : content->dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+            }
+            opening += '\0';
+            if(role == "user")
+            {
+               break;
+            }
+         }
+         return "auto-" + hexHash(opening);
+      }
+      // The id also names the backends' state endpoints, so keep it to URL-safe characters
+      if(id.empty() || id.size() > 128 || !urlSafe(id))
+      {
+         return id.empty() ? id : "id-" + hexHash(id);
+      }
+      return id;
+   }
+}
+
+/**
+ * @brief Sets up the router, nothing is bound until listen() is called
+ *
+ * @param host Address to bind, e.g. "127.0.0.1"
+ * @param port TCP port to listen on
+ * @param loadFactor A node takes new conversations while below loadFactor times the mean load
+ */
+ConversationRouter::ConversationRouter(std::string host, uint16_t port, double loadFactor /* 1.25 */) :
+ m_host(std::move(host)),
+ m_port(port),
+ m_loadFactor(std::max(1.0, loadFactor)),
+ m_listenFd(-1),
+ m_running(false),
+ m_migrations(0),
+ m_failedMigrations(0),
+ m_drainPending(false)
+{
+   m_wakePipe[0] = -1;
+   m_wakePipe[1] = -1;
+}
+
+/**
+ * @brief Closes the listening socket, waiting for proxied requests to finish
+ */
+ConversationRouter::~ConversationRouter()
+{
+   m_running = false;
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      // Unblocks the client threads, including those waiting on a backend for a generation to
+      // finish; each closes its own descriptors on the way out
+      for(const auto& [clientFd, backendFd] : m_clients)
+      {
+         shutdown(clientFd, SHUT_RDWR);
+         if(backendFd != -1)
+         {
+            shutdown(backendFd, SHUT_RDWR);
+         }
+      }
+      m_clientsDone.wait(lock, [this]() { return m_clients.empty(); });
+   }
+   m_drainWake.notify_all();
+   if(m_drainThread.joinable())
+   {
+      m_drainThread.join();
+   }
+   if(m_listenFd != -1)
+   {
+      close(m_listenFd);
+   }
+   if(m_wakePipe[0] != -1)
+   {
+      close(m_wakePipe[0]);
+      close(m_wakePipe[1]);
+   }
+}
+
+/**
+ * @brief Adds a smart-agent-server backend
+ *
+ * @param endpoint "host:port" of the backend
+ * @return bool False if the endpoint is not of that form
+ */
+bool ConversationRouter::addBackend(const std::string& endpoint)
+{
+   Backend backend;
+   if(!splitEndpoint(endpoint, backend.host, backend.port))
+   {
+      return false;
+   }
+   backend.stats.endpoint = endpoint;
+   std::lock_guard<std::mutex> lock(m_mutex);
+   if(m_backends.emplace(endpoint, std::move(backend)).second)
+   {
+      m_ring.addNode(endpoint);
+   }
+   return true;
+}
+
+/**
+ * @brief Creates the listening socket
+ *
+ * @return bool True if the socket is bound and listening
+ */
+bool ConversationRouter::listen()
+{
+   if(pipe(m_wakePipe) == -1 || !setNonBlocking(m_wakePipe[0]) || !setNonBlocking(m_wakePipe[1]))
+   {
+      std::cerr << "Error : failed to create the router wake pipe" << std::endl;
+      return false;
+   }
+
+   addrinfo hints{};
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE;
+   addrinfo* addrs = nullptr;
+   const std::string port = std::to_string(m_port);
+   if(getaddrinfo(m_host.c_str(), port.c_str(), &hints, &addrs) != 0)
+   {
+      std::cerr << "Error : could not resolve " << m_host << std::endl;
+      return false;
+   }
+
+   for(addrinfo* ai = addrs; ai != nullptr; ai = ai->ai_next)
+   {
+      int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if(fd == -1)
+      {
+         continue;
+      }
+      int yes = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+      if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, SOMAXCONN) == 0 && setNonBlocking(fd))
+      {
+         m_listenFd = fd;
+         break;
+      }
+      close(fd);
+   }
+   freeaddrinfo(addrs);
+
+   if(m_listenFd == -1)
+   {
+      std::cerr << "Error : failed to listen on " << m_host << ":" << m_port << std::endl;
+      return false;
+   }
+   return true;
+}
+
+/**
+ * @brief Accepts connections until stop() is called; each one is served on its own thread
+ */
+void ConversationRouter::run()
+{
+   m_running = true;
+   pollfd fds[2] = {{m_listenFd, POLLIN, 0}, {m_wakePipe[0], POLLIN, 0}};
+   while(m_running)
+   {
+      if(poll(fds, 2, -1) == -1)
+      {
+         if(errno == EINTR)
+         {
+            continue;
+         }
+         std::cerr << "Error : poll failed - " << std::strerror(errno) << std::endl;
+         break;
+      }
+      if(!(fds[0].revents & POLLIN))
+      {
+         continue;
+      }
+      while(m_running)
+      {
+         const int fd = accept(m_listenFd, nullptr, nullptr);
+         if(fd == -1)
+         {
+            break; // EAGAIN - nothing left to accept
+         }
+         // Token streams are many tiny writes, don't let Nagle hold them back
+         int yes = 1;
+         setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+         // A client that stops sending halfway through its request must not hold its thread
+         const timeval timeout{static_cast<time_t>(CLIENT_READ_TIMEOUT.count()), 0};
+         setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+         {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(m_clients.size() >= MAX_CLIENTS)
+            {
+               sendError(fd, 503, "Too many connections");
+               close(fd);
+               continue;
+            }
+            m_clients.emplace(fd, -1);
+         }
+         // Proxying blocks on the backend for a whole generation, so every client gets a thread
+         std::thread(&ConversationRouter::serveConnection, this, fd).detach();
+      }
+   }
+}
+
+/**
+ * @brief Asks the accept loop to exit; safe to call from a signal handler
+ */
+void ConversationRouter::stop()
+{
+   m_running = false;
+   if(m_wakePipe[1] != -1)
+   {
+      const char byte = 1;
+      if(write(m_wakePipe[1], &byte, 1) == -1)
+      {
+         // Pipe full - the loop is already going to wake up
+      }
+   }
+}
+
+/**
+ * @brief Stops placing conversations on a backend and migrates the ones it holds
+ *
+ * @param endpoint Backend to drain
+ * @return bool False if the backend is unknown or is the last one not draining
+ */
+bool ConversationRouter::drain(const std::string& endpoint)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   auto iter = m_backends.find(endpoint);
+   if(iter == m_backends.end())
+   {
+      return false;
+   }
+   if(!iter->second.stats.draining)
+   {
+      if(m_ring.size() <= 1)
+      {
+         return false; // nowhere to move its conversations to
+      }
+      iter->second.stats.draining = true;
+      m_ring.removeNode(endpoint);
+   }
+   m_drainPending = true;
+   if(!m_drainThread.joinable())
+   {
+      m_drainThread = std::thread(&ConversationRouter::drainLoop, this);
+   }
+   m_drainWake.notify_one();
+   return true;
+}
+
+/**
+ * @brief Puts a drained backend back on the ring
+ */
+bool ConversationRouter::undrain(const std::string& endpoint)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   auto iter = m_backends.find(endpoint);
+   if(iter == m_backends.end())
+   {
+      return false;
+   }
+   iter->second.stats.draining = false;
+   m_ring.addNode(endpoint);
+   return true;
+}
+
+/**
+ * @brief Returns a snapshot of every backend's counters
+ */
+std::vector<BackendStats> ConversationRouter::getStats() const
+{
+   const auto now = std::chrono::steady_clock::now();
+   std::vector<BackendStats> stats;
+   std::lock_guard<std::mutex> lock(m_mutex);
+   stats.reserve(m_backends.size());
+   for(const auto& [endpoint, backend] : m_backends)
+   {
+      stats.push_back(backend.stats);
+      stats.back().down = now < backend.downUntil;
+   }
+   return stats;
+}
+
+// Answers the router's own endpoints, false if the request is for a backend
+bool ConversationRouter::serveLocal(int clientFd, const Request& request)
+{
+   if(request.path == "/health")
+   {
+      sendResponse(clientFd, 200, "application/json", "{\"status\":\"ok\"}");
+      return true;
+   }
+   if(request.path == "/router/status")
+   {
+      nlohmann::json backends = nlohmann::json::array();
+      for(const BackendStats& stats : getStats())
+      {
+         backends.push_back({{"endpoint", stats.endpoint},
+                             {"in_flight", stats.inFlight},
+                             {"requests", stats.requests},
+                             {"spilled_in", stats.spilledIn},
+                             {"failures", stats.failures},
+                             {"conversations", stats.conversations},
+                             {"draining", stats.draining},
+                             {"down", stats.down}});
+      }
+      nlohmann::json body = {{"backends", backends}, {"load_factor", m_loadFactor}};
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         body["migrations"] = m_migrations;
+         body["failed_migrations"] = m_failedMigrations;
+      }
+      sendResponse(clientFd, 200, "application/json", body.dump());
+      return true;
+   }
+   if(request.path == "/router/drain" || request.path == "/router/undrain")
+   {
+      if(request.method != "POST")
+      {
+         sendError(clientFd, 405, "Use POST for " + request.path);
+         return true;
+      }
+      nlohmann::json body = nlohmann::json::parse(request.body, nullptr, false);
+      if(!body.is_object() || !body.contains("backend") || !body["backend"].is_string())
+      {
+         sendError(clientFd, 400, "Expected {\"backend\": \"host:port\"}");
+         return true;
+      }
+      const std::string endpoint = body["backend"].get<std::string>();
+      const bool ok = request.path == "/router/drain" ? drain(endpoint) : undrain(endpoint);
+      if(!ok)
+      {
+         sendError(clientFd, 400, "Unknown backend, or the last one left on the ring: " + endpoint);
+         return true;
+      }
+      sendResponse(clientFd, 200, "application/json", nlohmann::json({{"backend", endpoint}}).dump());
+      return true;
+   }
+   return false;
+}
+
+// Serves one client connection on its own thread
+void ConversationRouter::serveConnection(int fd)
+{
+   // An exception escaping a detached thread ends the process
+   try
+   {
+      serveRequest(fd);
+   }
+   catch(const nlohmann::json::exception&)
+   {
+      // Thrown while the request was looked at, before anything went to the client
+      sendError(fd, 400, "Malformed request body");
+   }
+   catch(const std::exception& e)
+   {
+      std::cerr << "Error : serving a client failed - " << e.what() << std::endl;
+   }
+
+   close(fd);
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_clients.erase(fd);
+   m_clientsDone.notify_all();
+}
+
+// Reads, routes and answers the request on a client connection
+void ConversationRouter::serveRequest(int fd)
+{
+   Request request;
+   int status = 0;
+   if(readRequest(fd, request, status))
+   {
+      if(!serveLocal(fd, request))
+      {
+         std::string conversationId;
+         if(request.method == "POST" && request.path == "/v1/chat/completions")
+         {
+            nlohmann::json body = nlohmann::json::parse(request.body, nullptr, false);
+            if(body.is_object())
+            {
+               std::string header;
+               for(const auto& [name, value] : request.headers)
+               {
+                  if(name == "x-conversation-id")
+                  {
+                     header = value;
+                  }
+               }
+               conversationId = conversationOf(body, header);
+               if(!conversationId.empty())
+               {
+                  // Binds the conversation to one engine session on whichever backend serves it
+                  body["conversation_id"] = conversationId;
+                  request.body = body.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+               }
+            }
+         }
+         forward(fd, request, conversationId);
+      }
+   }
+   else if(status != 0)
+   {
+      sendError(fd, status, status == 413 ? "Request too large" : status == 408 ? "Request timed out" : "Malformed request");
+   }
+}
+
+// Proxies a request to a backend, relaying the response as it streams back
+void ConversationRouter::forward(int clientFd, const Request& request, const std::string& conversationId)
+{
+   std::string head = request.method + " " + request.path + " HTTP/1.1\r\n";
+   for(const auto& [name, value] : request.headers)
+   {
+      // Hop-by-hop headers are the router's own; each backend connection carries one request
+      if(name != "host" && name != "connection" && name != "keep-alive" && name != "content-length")
+      {
+         head += name + ": " + value + "\r\n";
+      }
+   }
+   head += "Content-Length: " + std::to_string(request.body.size()) + "\r\n";
+   head += "Connection: close\r\n";
+
+   size_t attempts = 0;
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      attempts = m_backends.size();
+   }
+   for(size_t attempt = 0; attempt < attempts; ++attempt)
+   {
+      Placement placement;
+      if(!place(conversationId, placement))
+      {
+         break;
+      }
+      if(!placement.migrateFrom.empty())
+      {
+         // A failed move only costs the new backend a prefill
+         migrate(conversationId, placement.migrateFrom, placement.backend);
+         finishMigration(conversationId);
+      }
+
+      std::string host;
+      uint16_t port = 0;
+      splitEndpoint(placement.backend, host, port);
+      const int backendFd = connectTo(host, port);
+      if(backendFd != -1 && !watchBackend(clientFd, backendFd))
+      {
+         // Shutting down - the destructor would not know to stop this one
+         close(backendFd);
+         release(placement.backend, false);
+         break;
+      }
+      if(backendFd == -1 ||
+         !sendAll(backendFd, head + "Host: " + placement.backend + "\r\n\r\n") ||
+         !sendAll(backendFd, request.body))
+      {
+         if(backendFd != -1)
+         {
+            watchBackend(clientFd, -1);
+            close(backendFd);
+         }
+         release(placement.backend, true);
+         continue;
+      }
+
+      // Relay until the backend closes; a client hanging up closes the backend socket, which the
+      // server takes as a cancel
+      char buf[16384];
+      bool relayed = false;
+      while(true)
+      {
+         const ssize_t n = recv(backendFd, buf, sizeof(buf), 0);
+         if(n < 0 && errno == EINTR)
+         {
+            continue;
+         }
+         if(n <= 0 || !sendAll(clientFd, buf, static_cast<size_t>(n)))
+         {
+            break;
+         }
+         relayed = true;
+      }
+      watchBackend(clientFd, -1);
+      close(backendFd);
+      // Nothing back at all means the backend died under us; once bytes went out there is no retry
+      release(placement.backend, !relayed);
+      if(relayed)
+      {
+         return;
+      }
+   }
+   sendError(clientFd, 503, "No backend available");
+}
+
+// Records the backend socket a client's request is relayed from, -1 once it is closed; false if
+// the router is shutting down
+bool ConversationRouter::watchBackend(int clientFd, int backendFd)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   auto iter = m_clients.find(clientFd);
+   if(iter == m_clients.end() || (backendFd != -1 && !m_running))
+   {
+      return false;
+   }
+   iter->second = backendFd;
+   return true;
+}
+
+// Chooses the backend for a conversation and accounts the request to it
+bool ConversationRouter::place(const std::string& conversationId, Placement& placement)
+{
+   std::unique_lock<std::mutex> lock(m_mutex);
+   // The conversation's state is on its way somewhere; where it ends up is known once it arrives
+   m_migrated.wait(lock, [&]() { return conversationId.empty() || !m_migrating.contains(conversationId); });
+   const auto now = std::chrono::steady_clock::now();
+
+   uint64_t totalInFlight = 0;
+   uint64_t nodes = 0;
+   Backend* leastLoaded = nullptr;
+   for(auto& [endpoint, backend] : m_backends)
+   {
+      if(usable(backend, now))
+      {
+         totalInFlight += backend.stats.inFlight;
+         ++nodes;
+         if(leastLoaded == nullptr || backend.stats.inFlight < leastLoaded->stats.inFlight)
+         {
+            leastLoaded = &backend;
+         }
+      }
+   }
+   if(nodes == 0)
+   {
+      return false;
+   }
+   // Bounded load: no node takes more than loadFactor times its share counting this request
+   const uint64_t capacity = static_cast<uint64_t>(
+      std::ceil(m_loadFactor * static_cast<double>(totalInFlight + 1) / static_cast<double>(nodes)));
+   auto fits = [&](const std::string& endpoint) {
+      auto iter = m_backends.find(endpoint);
+      return iter != m_backends.end() && usable(iter->second, now) && iter->second.stats.inFlight < capacity;
+   };
+
+   std::string previous;
+   auto known = m_conversations.find(conversationId);
+   if(!conversationId.empty() && known != m_conversations.end())
+   {
+      previous = known->second->second;
+   }
+
+   Backend* chosen = nullptr;
+   bool spilled = false;
+   if(!previous.empty() && fits(previous))
+   {
+      // Its KV cache is there; hashing only decides where a conversation starts or moves
+      chosen = &m_backends[previous];
+   }
+   else if(conversationId.empty())
+   {
+      chosen = leastLoaded;
+   }
+   else
+   {
+      const std::vector<std::string> order = m_ring.preference(conversationId);
+      for(const std::string& endpoint : order)
+      {
+         if(fits(endpoint))
+         {
+            chosen = &m_backends[endpoint];
+            break;
+         }
+      }
+      if(chosen == nullptr)
+      {
+         chosen = leastLoaded;
+      }
+      const std::string& home = previous.empty() ? (order.empty() ? chosen->stats.endpoint : order.front()) : previous;
+      spilled = chosen->stats.endpoint != home;
+   }
+
+   placement.backend = chosen->stats.endpoint;
+   ++chosen->stats.inFlight;
+   ++chosen->stats.requests;
+   if(spilled)
+   {
+      ++chosen->stats.spilledIn;
+   }
+   if(!conversationId.empty())
+   {
+      // Only a draining backend gives its state up - a busy one keeps it for when load drops
+      auto from = m_backends.find(previous);
+      if(from != m_backends.end() && previous != placement.backend && from->second.stats.draining &&
+         now >= from->second.downUntil)
+      {
+         placement.migrateFrom = previous;
+         m_migrating.insert(conversationId);
+      }
+      remember(conversationId, placement.backend);
+   }
+   return true;
+}
+
+// Clears the mark place set on a conversation once its migration is over
+void ConversationRouter::finishMigration(const std::string& conversationId)
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_migrating.erase(conversationId);
+   }
+   m_migrated.notify_all();
+}
+
+// Releases the request's accounting; a failed backend is skipped for a while
+void ConversationRouter::release(const std::string& backend, bool failed)
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   auto iter = m_backends.find(backend);
+   if(iter == m_backends.end())
+   {
+      return;
+   }
+   --iter->second.stats.inFlight;
+   if(failed)
+   {
+      ++iter->second.stats.failures;
+      iter->second.downUntil = std::chrono::steady_clock::now() + DOWN_INTERVAL;
+#ifdef _DEBUG
+      std::cout << "Backend " << backend << " failed, skipping it for " << DOWN_INTERVAL.count() << "s" << std::endl;
+#endif
+   }
+}
+
+// Moves a conversation's KV state between backends, true if the target now holds it
+bool ConversationRouter::migrate(const std::string& conversationId, const std::string& from, const std::string& to)
+{
+   std::string fromHost, toHost;
+   uint16_t fromPort = 0, toPort = 0;
+   splitEndpoint(from, fromHost, fromPort);
+   splitEndpoint(to, toHost, toPort);
+   const std::string path = CONVERSATIONS_PATH + conversationId;
+
+   // A 409 means the state is gone or still in use; the target then prefills from the messages
+   Reply exported;
+   Reply imported;
+   const bool moved = exchange(fromHost, fromPort, "GET", path + "/state", "", exported) && exported.status == 200 &&
+                      exchange(toHost, toPort, "PUT", path + "/state", exported.body, imported) &&
+                      imported.status == 200;
+   if(moved)
+   {
+      Reply released;
+      exchange(fromHost, fromPort, "DELETE", path, "", released);
+   }
+#ifdef _DEBUG
+   std::cout << "Migrating " << conversationId << " from " << from << " to " << to << (moved ? " done" : " failed")
+             << std::endl;
+#endif
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   ++(moved ? m_migrations : m_failedMigrations);
+   return moved;
+}
+
+// Records the backend a conversation's KV state now lives on
+void ConversationRouter::remember(const std::string& conversationId, const std::string& backend)
+{
+   auto iter = m_conversations.find(conversationId);
+   if(iter != m_conversations.end())
+   {
+      auto previous = m_backends.find(iter->second->second);
+      if(previous != m_backends.end())
+      {
+         --previous->second.stats.conversations;
+      }
+      m_conversationOrder.erase(iter->second);
+      m_conversations.erase(iter);
+   }
+   m_conversationOrder.emplace_back(conversationId, backend);
+   m_conversations[conversationId] = std::prev(m_conversationOrder.end());
+   ++m_backends[backend].stats.conversations;
+
+   if(m_conversationOrder.size() > MAX_CONVERSATIONS)
+   {
+      // The backend's own cache has long evicted it; it will simply be placed afresh
+      const auto& oldest = m_conversationOrder.front();
+      auto holder = m_backends.find(oldest.second);
+      if(holder != m_backends.end())
+      {
+         --holder->second.stats.conversations;
+      }
+      m_conversations.erase(oldest.first);
+      m_conversationOrder.pop_front();
+   }
+}
+
+// Migrates every conversation away from draining backends, runs on m_drainThread
+void ConversationRouter::drainLoop()
+{
+   std::unique_lock<std::mutex> lock(m_mutex);
+   while(true)
+   {
+      m_drainWake.wait(lock, [this]() { return m_drainPending || !m_running; });
+      if(!m_running && !m_drainPending)
+      {
+         return;
+      }
+      m_drainPending = false;
+
+      // Conversations on draining backends, oldest first, and their new owner on the ring
+      const auto now = std::chrono::steady_clock::now();
+      std::vector<std::tuple<std::string, std::string, std::string>> moves;
+      for(const auto& [conversationId, endpoint] : m_conversationOrder)
+      {
+         auto iter = m_backends.find(endpoint);
+         if(iter == m_backends.end() || !iter->second.stats.draining || now < iter->second.downUntil ||
+            m_migrating.contains(conversationId))
+         {
+            continue;
+         }
+         for(const std::string& target : m_ring.preference(conversationId))
+         {
+            if(usable(m_backends[target], now))
+            {
+               moves.emplace_back(conversationId, endpoint, target);
+               break;
+            }
+         }
+      }
+
+      for(const auto& [conversationId, from, to] : moves)
+      {
+         if(!m_running)
+         {
+            break;
+         }
+         // A turn may have placed the conversation since the list was made, and may be moving it
+         auto held = m_conversations.find(conversationId);
+         if(held == m_conversations.end() || held->second->second != from || m_migrating.contains(conversationId))
+         {
+            continue;
+         }
+         // Turns of the conversation wait in place until it has arrived
+         m_migrating.insert(conversationId);
+         lock.unlock();
+         const bool moved = migrate(conversationId, from, to);
+         lock.lock();
+         m_migrating.erase(conversationId);
+         auto iter = m_conversations.find(conversationId);
+         if(moved && iter != m_conversations.end() && iter->second->second == from)
+         {
+            remember(conversationId, to);
+         }
+         m_migrated.notify_all();
+      }
+   }
+}
+
+// True if the backend can take requests right now; requires m_mutex
+bool ConversationRouter::usable(const Backend& backend, std::chrono::steady_clock::time_point now) const
+{
+   return !backend.stats.draining && now >= backend.downUntil;
+}
@@ -0,0 +1,203 @@
+/**
+ * @file ConversationRouter.h
+ * @brief HTTP front end that spreads conversations over several smart-agent-server backends. A
+ *        conversation is placed by consistent hashing of its id so every turn lands on the host
+ *        whose KV cache already holds it; a node over its bounded share of the load spills to the
+ *        next node on the ring. Draining a node moves each of its conversations' serialized KV
+ *        sequence to the conversation's new owner before the node is taken down.
+ */
+#ifndef CONVERSATION_ROUTER_H
+#define CONVERSATION_ROUTER_H
+
+#include "HashRing.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * @brief Counters of one backend, as reported by GET /router/status
+ */
+struct BackendStats
+{
+   std::string endpoint;
+   // Requests currently being proxied to the backend
+   uint32_t inFlight = 0;
+   uint64_t requests = 0;
+   // Requests placed here because their ring owner was over its bounded load
+   uint64_t spilledIn = 0;
+   // Connections that failed; the backend is skipped for a while after each
+   uint64_t failures = 0;
+   // Conversations whose KV cache the backend is believed to hold
+   uint64_t conversations = 0;
+   bool draining = false;
+   bool down = false;
+};
+
+class ConversationRouter
+{
+public:
+   /**
+    * @brief Sets up the router, nothing is bound until listen() is called
+    *
+    * @param host Address to bind, e.g. "127.0.0.1"
+    * @param port TCP port to listen on
+    * @param loadFactor A node takes new conversations while below loadFactor times the mean load
+    */
+   ConversationRouter(std::string host, uint16_t port, double loadFactor = 1.25);
+
+   /**
+    * @brief Closes the listening socket, waiting for proxied requests to finish
+    */
+   ~ConversationRouter();
+
+   /**
+    * @brief Adds a smart-agent-server backend
+    *
+    * @param endpoint "host:port" of the backend
+    * @return bool False if the endpoint is not of that form
+    */
+   bool addBackend(const std::string& endpoint);
+
+   /**
+    * @brief Creates the listening socket
+    *
+    * @return bool True if the socket is bound and listening
+    */
+   bool listen();
+
+   /**
+    * @brief Accepts connections until stop() is called; each one is served on its own thread
+    */
+   void run();
+
+   /**
+    * @brief Asks the accept loop to exit; safe to call from a signal handler
+    */
+   void stop();
+
+   /**
+    * @brief Stops placing conversations on a backend and migrates the ones it holds
+    *
+    * @param endpoint Backend to drain
+    * @return bool False if the backend is unknown or is the last one not draining
+    */
+   bool drain(const std::string& endpoint);
+
+   /**
+    * @brief Puts a drained backend back on the ring
+    */
+   bool undrain(const std::string& endpoint);
+
+   /**
+    * @brief Returns a snapshot of every backend's counters
+    */
+   std::vector<BackendStats> getStats() const;
+
+private:
+   // A backend and its live state
+   struct Backend
+   {
+      std::string host;
+      uint16_t port = 0;
+      BackendStats stats;
+      // Skipped for placement until then after a failed connection
+      std::chrono::steady_clock::time_point downUntil;
+   };
+
+   // Where a request was sent and where its conversation's KV state has to come from
+   struct Placement
+   {
+      std::string backend;
+      // Non-empty when the conversation's state should first be moved from this backend
+      std::string migrateFrom;
+   };
+
+   // A parsed client request
+   struct Request
+   {
+      std::string method;
+      std::string path;
+      // Header names lower-cased, in the order received
+      std::vector<std::pair<std::string, std::string>> headers;
+      std::string body;
+   };
+
+   // Answers the router's own endpoints, false if the request is for a backend
+   bool serveLocal(int clientFd, const Request& request);
+
+   // Serves one client connection on its own thread
+   void serveConnection(int fd);
+
+   // Reads, routes and answers the request on a client connection
+   void serveRequest(int fd);
+
+   // Proxies a request to a backend, relaying the response as it streams back
+   void forward(int clientFd, const Request& request, const std::string& conversationId);
+
+   // Records the backend socket a client's request is relayed from, -1 once it is closed; false if
+   // the router is shutting down
+   bool watchBackend(int clientFd, int backendFd);
+
+   // Chooses the backend for a conversation and accounts the request to it; waits for a migration of
+   // the conversation already under way, and marks the one the placement asks for as under way
+   bool place(const std::string& conversationId, Placement& placement);
+
+   // Clears the mark place set on a conversation once its migration is over
+   void finishMigration(const std::string& conversationId);
+
+   // Releases the request's accounting; a failed backend is skipped for a while
+   void release(const std::string& backend, bool failed);
+
+   // Moves a conversation's KV state between backends, true if the target now holds it
+   bool migrate(const std::string& conversationId, const std::string& from, const std::string& to);
+
+   // Records the backend a conversation's KV state now lives on
+   void remember(const std::string& conversationId, const std::string& backend);
+
+   // Migrates every conversation away from draining backends, runs on m_drainThread
+   void drainLoop();
+
+   // True if the backend can take requests right now; requires m_mutex
+   bool usable(const Backend& backend, std::chrono::steady_clock::time_point now) const;
+
+   std::string m_host;
+   uint16_t m_port;
+   double m_loadFactor;
+   int m_listenFd;
+   int m_wakePipe[2];
+   std::atomic<bool> m_running;
+
+   mutable std::mutex m_mutex;
+   HashRing m_ring;
+   std::map<std::string, Backend> m_backends;
+   // Conversation id -> backend holding its KV state, least recently used first
+   std::list<std::pair<std::string, std::string>> m_conversationOrder;
+   std::unordered_map<std::string, std::list<std::pair<std::string, std::string>>::iterator> m_conversations;
+   uint64_t m_migrations;
+   uint64_t m_failedMigrations;
+   // Conversations whose KV state is being moved, by a request or the drain thread, and signalled
+   // whenever one of them is done
+   std::set<std::string> m_migrating;
+   std::condition_variable m_migrated;
+
+   // Client connections being served and the backend socket each is relayed from, or -1; both are
+   // shut down by the destructor
+   std::map<int, int> m_clients;
+   std::condition_variable m_clientsDone;
+
+   // Background migration off draining backends
+   std::thread m_drainThread;
+   std::condition_variable m_drainWake;
+   bool m_drainPending;
+};
+
+#endif
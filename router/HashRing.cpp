@@ -0,0 +1,104 @@
+/**
+ * @file HashRing.cpp
+ * @brief Consistent-hash ring of backend nodes.
+ */
+
+#include "HashRing.h"
+
+/**
+ * @brief Creates an empty ring
+ *
+ * @param virtualNodes Points each node occupies on the ring
+ */
+HashRing::HashRing(uint32_t virtualNodes /* 160 */) :
+ m_virtualNodes(virtualNodes == 0 ? 1 : virtualNodes)
+{
+}
+
+/**
+ * @brief Places a node on the ring, no-op if it is already there
+ */
+void HashRing::addNode(const std::string& node)
+{
+   if(!m_nodes.insert(node).second)
+   {
+      return;
+   }
+   for(uint32_t i = 0; i < m_virtualNodes; ++i)
+   {
+      // A collision just leaves the earlier node at that point
+      m_ring.emplace(hash(node + "#" + std::to_string(i)), node);
+   }
+}
+
+/**
+ * @brief Takes a node off the ring, its keys move to the next nodes clockwise
+ */
+void HashRing::removeNode(const std::string& node)
+{
+   if(m_nodes.erase(node) == 0)
+   {
+      return;
+   }
+   for(auto iter = m_ring.begin(); iter != m_ring.end();)
+   {
+      iter = iter->second == node ? m_ring.erase(iter) : std::next(iter);
+   }
+}
+
+/**
+ * @brief Returns true if the node is on the ring
+ */
+bool HashRing::contains(const std::string& node) const
+{
+   return m_nodes.count(node) > 0;
+}
+
+/**
+ * @brief Returns every node in the order a key prefers them, walking clockwise from its hash
+ *
+ * @param key Key being placed, e.g. a conversation id
+ * @return std::vector<std::string> Distinct nodes, the key's owner first
+ */
+std::vector<std::string> HashRing::preference(std::string_view key) const
+{
+   std::vector<std::string> order;
+   if(m_ring.empty())
+   {
+      return order;
+   }
+   order.reserve(m_nodes.size());
+   std::set<std::string_view> seen;
+   auto iter = m_ring.lower_bound(hash(key));
+   for(size_t steps = 0; steps < m_ring.size() && order.size() < m_nodes.size(); ++steps, ++iter)
+   {
+      if(iter == m_ring.end())
+      {
+         iter = m_ring.begin();
+      }
+      if(seen.insert(iter->second).second)
+      {
+         order.push_back(iter->second);
+      }
+   }
+   return order;
+}
+
+/**
+ * @brief Stable 64-bit hash shared by every router process, unlike std::hash
+ */
+uint64_t HashRing::hash(std::string_view data)
+{
+   // FNV-1a, then a splitmix64 finalizer - FNV alone clusters similar keys such as "node#1", "node#2"
+   uint64_t h = 14695981039346656037ull;
+   for(unsigned char c : data)
+   {
+      h = (h ^ c) * 1099511628211ull;
+   }
+   h ^= h >> 30;
+   h *= 0xbf58476d1ce4e5b9ull;
+   h ^= h >> 27;
+   h *= 0x94d049bb133111ebull;
+   h ^= h >> 31;
+   return h;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file HashRing.h
+ * @brief Consistent-hash ring of backend nodes. Every node is placed at many points on a 64-bit
+ *        ring so keys spread evenly, and adding or removing a node only moves the keys that land
+ *        on its points. Not thread safe - the router guards it with its own mutex.
+ */
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstdint>
+
+class HashRing
+{
+public:
+   /**
+    * @brief Creates an empty ring
+    *
+    * @param virtualNodes Points each node occupies on the ring
+    */
+   explicit HashRing(uint32_t virtualNodes = 160);
+
+   /**
+    * @brief Places a node on the ring, no-op if it is already there
+    */
+   void addNode(const std::string& node);
+
+   /**
+    * @brief Takes a node off the ring, its keys move to the next nodes clockwise
+    */
+   void removeNode(const std::string& node);
+
+   /**
+    * @brief Returns true if the node is on the ring
+    */
+   bool contains(const std::string& node) const;
+
+   /**
+    * @brief Returns every node in the order a key prefers them, walking clockwise from its hash
+    *
+    * @param key Key being placed, e.g. a conversation id
+    * @return std::vector<std::string> Distinct nodes, the key's owner first
+    */
+   std::vector<std::string> preference(std::string_view key) const;
+
+   /**
+    * @brief Returns the number of nodes on the ring
+    */
+   inline size_t size() const
+   {
+      return m_nodes.size();
+   }
+
+   /**
+    * @brief Stable 64-bit hash shared by every router process, unlike std::hash
+    */
+   static uint64_t hash(std::string_view data);
+
+private:
+   uint32_t m_virtualNodes;
+   // Ring position -> node
+   std::map<uint64_t, std::string> m_ring;
+   std::set<std::string> m_nodes;
+};
+
+#endif
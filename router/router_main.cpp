@@ -0,0 +1,86 @@
+/**
+ * @file router_main.cpp
+ * @brief Entry point for smart-agent-router, which spreads conversations over several
+ *        smart-agent-server hosts so each turn reuses the KV cache of the host that served the last.
+ */
+#include "ConversationRouter.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <csignal>
+#include <cstdlib>
+
+namespace
+{
+   ConversationRouter* g_router = nullptr;
+
+   void handleSignal(int)
+   {
+      if(g_router)
+      {
+         g_router->stop();
+      }
+   }
+
+   void printUsage(const char* argv0)
+   {
+      std::cerr << "Usage: " << argv0 << " --backend <host:port> [--backend <host:port> ...] [options]\n"
+                << "  --host <addr>     Address to bind (default 127.0.0.1)\n"
+                << "  --port <port>     Port to listen on (default 8090)\n"
+                << "  --load-factor <x> A backend takes new conversations below x times the mean load (default 1.25)\n"
+                << "Conversations are keyed by \"conversation_id\", the X-Conversation-Id header, or their opening messages.\n"
+                << "POST {\"backend\": \"host:port\"} to /router/drain to move a backend's conversations elsewhere.\n";
+   }
+}
+
+int main(int argc, char** argv)
+{
+   std::string host = "127.0.0.1";
+   int port = 8090;
+   double loadFactor = 1.25;
+   std::vector<std::string> backends;
+
+   for(int i = 1; i < argc; ++i)
+   {
+      const std::string arg = argv[i];
+      const bool hasValue = i + 1 < argc;
+      if(arg == "--backend" && hasValue)         backends.push_back(argv[++i]);
+      else if(arg == "--host" && hasValue)       host = argv[++i];
+      else if(arg == "--port" && hasValue)       port = std::atoi(argv[++i]);
+      else if(arg == "--load-factor" && hasValue) loadFactor = std::atof(argv[++i]);
+      else
+      {
+         printUsage(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+   if(backends.empty() || port <= 0 || port > 65535 || loadFactor < 1.0)
+   {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   ConversationRouter router(host, static_cast<uint16_t>(port), loadFactor);
+   for(const std::string& backend : backends)
+   {
+      if(!router.addBackend(backend))
+      {
+         std::cerr << "Error : backend must be host:port, got " << backend << std::endl;
+         return EXIT_FAILURE;
+      }
+   }
+   if(!router.listen())
+   {
+      return EXIT_FAILURE;
+   }
+
+   g_router = &router;
+   std::signal(SIGINT, handleSignal);
+   std::signal(SIGTERM, handleSignal);
+   std::cout << "smart-agent-router listening on http://" << host << ":" << port << " over " << backends.size()
+             << " backends" << std::endl;
+   router.run();
+   g_router = nullptr;
+
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,1384 @@
+/**
+ * @file HttpServer.cpp
+ * @brief Headless HTTP front end exposing the loaded model through an OpenAI compatible
+ *        chat-completions endpoint. A single poll() driven loop services every connection and
+ *        hands generation straight to the model's InferenceEngine.
+ */
+
+#include "HttpServer.h"
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <iterator>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace
+{
+   // Largest request body we are willing to buffer
+   const size_t MAX_BODY_SIZE = 8 * 1024 * 1024;
+   // Largest header block we are willing to buffer, nothing past it is read before the head is complete
+   const size_t MAX_HEADER_SIZE = 16 * 1024;
+   // Largest conversation KV state accepted for import, see /v1/conversations/<id>/state
+   const size_t MAX_STATE_SIZE = 1024 * 1024 * 1024;
+   // State bodies buffered across every connection; an import waits in its socket until it fits
+   const size_t MAX_STATE_BUFFERED = MAX_STATE_SIZE;
+
+   // Conversation endpoints - state export / import for migrating a conversation between hosts
+   const std::string CONVERSATIONS_PATH = "/v1/conversations/";
+   const std::string STATE_SUFFIX = "/state";
+
+   // Engine session a conversation id is bound to; session 0 belongs to ModelInterface
+   int32_t conversationSession(const std::string& conversationId)
+   {
+      uint32_t hash = 2166136261u;
+      for(unsigned char c : conversationId)
+      {
+         hash = (hash ^ c) * 16777619u;
+      }
+      return std::max<int32_t>(1, static_cast<int32_t>(hash & 0x7fffffffu));
+   }
+
+   // Temporary file state passes through on its way in or out of the engine
+   std::string stateFilePath()
+   {
+      static std::atomic<uint32_t> next(0);
+      const std::string name = "smart-agent-conv-" + std::to_string(getpid()) + "-" + std::to_string(next++) + ".kv";
+      return (std::filesystem::temp_directory_path() / name).string();
+   }
+
+   const char* statusText(int status)
+   {
+      switch(status)
+      {
+         case 200: return "OK";
+         case 400: return "Bad Request";
+         case 403: return "Forbidden";
+         case 404: return "Not Found";
+         case 405: return "Method Not Allowed";
+         case 409: return "Conflict";
+         case 413: return "Payload Too Large";
+         case 500: return "Internal Server Error";
+         case 503: return "Service Unavailable";
+         default:  return "Unknown";
+      }
+   }
+
+   bool setNonBlocking(int fd)
+   {
+      const int flags = fcntl(fd, F_GETFL, 0);
+      return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+   }
+
+   std::string toLower(std::string s)
+   {
+      std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+      return s;
+   }
+
+   std::string trim(const std::string& s)
+   {
+      const size_t b = s.find_first_not_of(" \t");
+      if(b == std::string::npos)
+      {
+         return "";
+      }
+      const size_t e = s.find_last_not_of(" \t\r");
+      return s.substr(b, e - b + 1);
+   }
+
+   // Length of the longest prefix of text that does not end inside a multi-byte UTF-8 sequence
+   size_t completeUtf8Length(const std::string& text)
+   {
+      const size_t n = text.size();
+      for(size_t back = 1; back <= 4 && back <= n; ++back)
+      {
+         const unsigned char c = static_cast<unsigned char>(text[n - back]);
+         if((c & 0xC0) == 0x80)
+         {
+            continue; // continuation byte - keep looking for the lead byte
+         }
+         size_t need = 1;
+         if((c & 0xE0) == 0xC0) need = 2;
+         else if((c & 0xF0) == 0xE0) need = 3;
+         else if((c & 0xF8) == 0xF0) need = 4;
+         return back >= need ? n : n - back;
+      }
+      return n;
+   }
+
+   std::string finishReason(GenerationStopReason reason)
+   {
+      switch(reason)
+      {
+         case GenerationStopReason::MaxTokens:
+         case GenerationStopReason::ContextFull:
+         case GenerationStopReason::Deadline:
+            return "length";
+         default:
+            return "stop";
+      }
+   }
+
+   // Dumps JSON replacing any invalid UTF-8 instead of throwing
+   std::string dumpJson(const nlohmann::json& j)
+   {
+      return j.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+   }
+
+   // True for 127.0.0.0/8, ::1 and IPv4 loopback mapped into IPv6
+   bool isLoopback(const sockaddr_storage& addr)
+   {
+      if(addr.ss_family == AF_INET)
+      {
+         const auto& in = reinterpret_cast<const sockaddr_in&>(addr);
+         return (ntohl(in.sin_addr.s_addr) >> 24) == 127;
+      }
+      if(addr.ss_family == AF_INET6)
+      {
+         const auto& in6 = reinterpret_cast<const sockaddr_in6&>(addr);
+         if(IN6_IS_ADDR_LOOPBACK(&in6.sin6_addr))
+         {
+            return true;
+         }
+         return IN6_IS_ADDR_V4MAPPED(&in6.sin6_addr) && in6.sin6_addr.s6_addr[12] == 127;
+      }
+      return false;
+   }
+
+   // Compares secrets without returning early on the first differing byte
+   bool sameSecret(const std::string& a, const std::string& b)
+   {
+      unsigned char diff = a.size() == b.size() ? 0 : 1;
+      for(size_t i = 0; i < a.size(); ++i)
+      {
+         diff |= static_cast<unsigned char>(a[i] ^ b[i % std::max<size_t>(1, b.size())]);
+      }
+      return diff == 0;
+   }
+}
+
+/**
+ * @brief Constructs the server for an already loaded model
+ *
+ * @param model The model requests are served from
+ * @param host Address to bind, e.g. "127.0.0.1"
+ * @param port TCP port to listen on
+ */
+HttpServer::HttpServer(ModelInterface* model, std::string host, uint16_t port) :
+ m_model(model),
+ m_fallbackModel(nullptr),
+ m_cascade(nullptr),
+ m_host(std::move(host)),
+ m_port(port),
+ m_listenFd(-1),
+ m_running(false),
+ m_nextCompletionId(1),
+ m_stateBytes(0),
+ m_stoppingTasks(false)
+{
+   m_wakePipe[0] = -1;
+   m_wakePipe[1] = -1;
+}
+
+/**
+ * @brief Closes the listening socket and every open connection
+ */
+HttpServer::~HttpServer()
+{
+   if(m_taskThread.joinable())
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_taskMutex);
+         m_stoppingTasks = true;
+      }
+      m_taskWake.notify_one();
+      m_taskThread.join();
+   }
+   while(!m_connections.empty())
+   {
+      closeConnection(m_connections.begin()->first);
+   }
+   if(m_listenFd != -1)
+   {
+      close(m_listenFd);
+   }
+   if(m_wakePipe[0] != -1)
+   {
+      close(m_wakePipe[0]);
+      close(m_wakePipe[1]);
+   }
+}
+
+/**
+ * @brief Creates the listening socket
+ *
+ * @return bool True if the socket is bound and listening
+ */
+bool HttpServer::listen()
+{
+   if(pipe(m_wakePipe) == -1 || !setNonBlocking(m_wakePipe[0]) || !setNonBlocking(m_wakePipe[1]))
+   {
+      std::cerr << "Error : failed to create the server wake pipe" << std::endl;
+      return false;
+   }
+
+   addrinfo hints{};
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE;
+   addrinfo* addrs = nullptr;
+   const std::string port = std::to_string(m_port);
+   if(getaddrinfo(m_host.c_str(), port.c_str(), &hints, &addrs) != 0)
+   {
+      std::cerr << "Error : could not resolve " << m_host << std::endl;
+      return false;
+   }
+
+   for(addrinfo* ai = addrs; ai != nullptr; ai = ai->ai_next)
+   {
+      int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if(fd == -1)
+      {
+         continue;
+      }
+      int yes = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+      if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, SOMAXCONN) == 0 && setNonBlocking(fd))
+      {
+         m_listenFd = fd;
+         break;
+      }
+      close(fd);
+   }
+   freeaddrinfo(addrs);
+
+   if(m_listenFd == -1)
+   {
+      std::cerr << "Error : failed to listen on " << m_host << ":" << m_port << std::endl;
+      return false;
+   }
+   return true;
+}
+
+/**
+ * @brief Runs the event loop until stop() is called
+ */
+void HttpServer::run()
+{
+   m_running = true;
+   std::vector<pollfd> fds;
+   std::vector<int> toClose;
+   m_stoppingTasks = false;
+   m_taskThread = std::thread(&HttpServer::runTasks, this);
+
+   while(m_running)
+   {
+      fds.clear();
+      fds.push_back({m_listenFd, POLLIN, 0});
+      fds.push_back({m_wakePipe[0], POLLIN, 0});
+      for(auto& [fd, conn] : m_connections)
+      {
+         // Input is left in the socket once the buffer holds all we would take, and a peer that has
+         // shut down its side has nothing more to send
+         short events = 0;
+         admitBody(*conn);
+         if(!conn->peerClosed && (conn->closeAfterWrite || conn->inBuf.size() < inputLimit(*conn)))
+         {
+            events |= POLLIN;
+         }
+         {
+            std::lock_guard<std::mutex> lock(conn->outMutex);
+            if(!conn->outBuf.empty())
+            {
+               events |= POLLOUT;
+            }
+         }
+         fds.push_back({fd, events, 0});
+      }
+
+      if(poll(fds.data(), fds.size(), -1) == -1)
+      {
+         if(errno == EINTR)
+         {
+            continue;
+         }
+         std::cerr << "Error : poll failed - " << std::strerror(errno) << std::endl;
+         break;
+      }
+
+      if(fds[1].revents & POLLIN)
+      {
+         // Drain the wake pipe - the actual work is picked up below
+         char drain[256];
+         while(read(m_wakePipe[0], drain, sizeof(drain)) > 0)
+         {
+         }
+      }
+      if(fds[0].revents & POLLIN)
+      {
+         acceptConnections();
+      }
+
+      toClose.clear();
+      for(size_t i = 2; i < fds.size(); ++i)
+      {
+         auto iter = m_connections.find(fds[i].fd);
+         if(iter == m_connections.end())
+         {
+            continue;
+         }
+         Connection& conn = *iter->second;
+         if(fds[i].revents & (POLLHUP | POLLERR))
+         {
+            toClose.push_back(conn.fd);
+         }
+         else if(fds[i].revents & POLLIN)
+         {
+            if(!readConnection(conn))
+            {
+               toClose.push_back(conn.fd);
+            }
+         }
+      }
+      for(int fd : toClose)
+      {
+         closeConnection(fd);
+      }
+
+      // Dispatch new requests, push out whatever the worker produced and retire finished connections
+      toClose.clear();
+      for(auto& [fd, conn] : m_connections)
+      {
+         if(!conn->busy && !conn->inBuf.empty())
+         {
+            processInput(conn);
+         }
+         if(!flushConnection(*conn))
+         {
+            toClose.push_back(fd);
+            continue;
+         }
+         if((conn->closeAfterWrite || conn->peerClosed) && !conn->busy)
+         {
+            std::lock_guard<std::mutex> lock(conn->outMutex);
+            if(conn->outBuf.empty())
+            {
+               toClose.push_back(fd);
+            }
+         }
+      }
+      for(int fd : toClose)
+      {
+         closeConnection(fd);
+      }
+   }
+
+   // The caller unloads the model next, a state transfer still running must not race it
+   {
+      std::lock_guard<std::mutex> lock(m_taskMutex);
+      m_stoppingTasks = true;
+   }
+   m_taskWake.notify_one();
+   m_taskThread.join();
+}
+
+/**
+ * @brief Asks the event loop to exit; safe to call from a signal handler
+ */
+void HttpServer::stop()
+{
+   m_running = false;
+   wake();
+}
+
+// Accepts every pending connection on the listening socket
+void HttpServer::acceptConnections()
+{
+   while(true)
+   {
+      sockaddr_storage peer{};
+      socklen_t peerLength = sizeof(peer);
+      const int fd = accept(m_listenFd, reinterpret_cast<sockaddr*>(&peer), &peerLength);
+      if(fd == -1)
+      {
+         return; // EAGAIN - nothing left to accept
+      }
+      if(!setNonBlocking(fd))
+      {
+         close(fd);
+         continue;
+      }
+      // Token streams are many tiny writes, don't let Nagle hold them back
+      int yes = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+      auto conn = std::make_shared<Connection>();
+      conn->fd = fd;
+      conn->loopback = isLoopback(peer);
+      m_connections[fd] = conn;
+   }
+}
+
+// Reads available bytes from a connection up to its input limit, returns false on a read error
+bool HttpServer::readConnection(Connection& conn)
+{
+   char buf[16384];
+   size_t limit = inputLimit(conn);
+   while(true)
+   {
+      // A connection that is being closed has its input drained and dropped
+      size_t wanted = sizeof(buf);
+      if(!conn.closeAfterWrite)
+      {
+         if(conn.inBuf.size() >= limit)
+         {
+            // The head may have completed in the meantime, which moves the limit out to its body
+            limit = inputLimit(conn);
+            if(conn.inBuf.size() >= limit)
+            {
+               return true;
+            }
+         }
+         wanted = std::min(wanted, limit - conn.inBuf.size());
+      }
+
+      const ssize_t n = read(conn.fd, buf, wanted);
+      if(n > 0)
+      {
+         if(!conn.closeAfterWrite)
+         {
+            conn.inBuf.append(buf, n);
+         }
+         continue;
+      }
+      if(n == 0)
+      {
+         // A half-closed peer still reads - requests already received are answered before closing
+         conn.peerClosed = true;
+         return true;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+   }
+}
+
+// Returns how far the input buffer may grow: the header cap while the head is incomplete, the end
+// of the declared body plus room for the next head once it is, nothing more for a malformed head
+size_t HttpServer::inputLimit(const Connection& conn) const
+{
+   HttpRequest head;
+   size_t bodyStart = 0;
+   size_t bodyLength = 0;
+   const int parsed = parseHead(conn, head, bodyStart, bodyLength);
+   if(parsed == 0)
+   {
+      // One byte past the cap so that parseHead gets to reject the head
+      return MAX_HEADER_SIZE + 1;
+   }
+   if(parsed < 0)
+   {
+      return conn.inBuf.size();
+   }
+   // A state body stays in the socket until the shared budget has room for all of it
+   if(bodyLength > MAX_BODY_SIZE && conn.admitted < bodyLength)
+   {
+      return bodyStart;
+   }
+   return bodyStart + bodyLength + MAX_HEADER_SIZE + 1;
+}
+
+// Reserves room in the shared budget for a state body the connection has announced; false while
+// other imports hold too much of it
+bool HttpServer::admitBody(Connection& conn)
+{
+   if(conn.admitted > 0 || conn.closeAfterWrite)
+   {
+      return true;
+   }
+   HttpRequest head;
+   size_t bodyStart = 0;
+   size_t bodyLength = 0;
+   if(parseHead(conn, head, bodyStart, bodyLength) <= 0 || bodyLength <= MAX_BODY_SIZE)
+   {
+      return true;
+   }
+   size_t held = m_stateBytes;
+   do
+   {
+      if(held + bodyLength > MAX_STATE_BUFFERED)
+      {
+         return false;
+      }
+   }
+   while(!m_stateBytes.compare_exchange_weak(held, held + bodyLength));
+   conn.admitted = bodyLength;
+   return true;
+}
+
+// Writes as much buffered output as the socket accepts, returns false on error
+bool HttpServer::flushConnection(Connection& conn)
+{
+   std::lock_guard<std::mutex> lock(conn.outMutex);
+   size_t written = 0;
+   while(written < conn.outBuf.size())
+   {
+      const ssize_t n = write(conn.fd, conn.outBuf.data() + written, conn.outBuf.size() - written);
+      if(n > 0)
+      {
+         written += n;
+         continue;
+      }
+      if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      {
+         break;
+      }
+      return false;
+   }
+   conn.outBuf.erase(0, written);
+   return true;
+}
+
+// Parses and dispatches complete requests sitting in the input buffer
+void HttpServer::processInput(const std::shared_ptr<Connection>& conn)
+{
+   // One request at a time per connection - pipelined requests wait for the previous response
+   while(!conn->busy && !conn->closeAfterWrite && !conn->inBuf.empty())
+   {
+      HttpRequest request;
+      const int parsed = parseRequest(*conn, request);
+      if(parsed == 0)
+      {
+         return;
+      }
+      if(parsed < 0)
+      {
+         sendError(*conn, 400, "Malformed HTTP request", false);
+         conn->inBuf.clear();
+         return;
+      }
+      // Handlers check the types of what they read; a request that slips past them is still the
+      // client's fault and must not take the server down
+      try
+      {
+         dispatch(conn, request);
+      }
+      catch(const nlohmann::json::exception& e)
+      {
+         if(!conn->busy)
+         {
+            sendError(*conn, 400, std::string("Malformed request body - ") + e.what(), request.keepAlive);
+         }
+      }
+      // A state body nobody took over is dropped with the request
+      m_stateBytes -= request.admitted;
+   }
+}
+
+// Attempts to parse a single request off the front of the input buffer
+int HttpServer::parseRequest(Connection& conn, HttpRequest& request)
+{
+   size_t bodyStart = 0;
+   size_t contentLength = 0;
+   const int parsed = parseHead(conn, request, bodyStart, contentLength);
+   if(parsed <= 0)
+   {
+      return parsed;
+   }
+   if(conn.inBuf.size() < bodyStart + contentLength)
+   {
+      return 0;
+   }
+
+   request.body = conn.inBuf.substr(bodyStart, contentLength);
+   conn.inBuf.erase(0, bodyStart + contentLength);
+   request.admitted = conn.admitted;
+   conn.admitted = 0;
+   return 1;
+}
+
+// Parses the request line and headers at the front of the input buffer, checking the declared body
+// length against what the endpoint accepts
+int HttpServer::parseHead(const Connection& conn, HttpRequest& request, size_t& bodyStart, size_t& contentLength) const
+{
+   const size_t headerEnd = conn.inBuf.find("\r\n\r\n");
+   if(headerEnd == std::string::npos || headerEnd > MAX_HEADER_SIZE)
+   {
+      return conn.inBuf.size() > MAX_HEADER_SIZE ? -1 : 0;
+   }
+
+   // Request line
+   const size_t lineEnd = conn.inBuf.find("\r\n");
+   const std::string requestLine = conn.inBuf.substr(0, lineEnd);
+   const size_t sp1 = requestLine.find(' ');
+   const size_t sp2 = requestLine.find(' ', sp1 + 1);
+   if(sp1 == std::string::npos || sp2 == std::string::npos)
+   {
+      return -1;
+   }
+   request.method = requestLine.substr(0, sp1);
+   request.path = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+   const std::string version = requestLine.substr(sp2 + 1);
+   request.keepAlive = version != "HTTP/1.0";
+
+   // Strip any query string, no endpoint uses one
+   const size_t query = request.path.find('?');
+   if(query != std::string::npos)
+   {
+      request.path.resize(query);
+   }
+
+   // Headers
+   size_t pos = lineEnd + 2;
+   while(pos < headerEnd)
+   {
+      const size_t end = conn.inBuf.find("\r\n", pos);
+      const std::string line = conn.inBuf.substr(pos, end - pos);
+      const size_t colon = line.find(':');
+      if(colon != std::string::npos)
+      {
+         request.headers[toLower(trim(line.substr(0, colon)))] = trim(line.substr(colon + 1));
+      }
+      pos = end + 2;
+   }
+
+   auto connHeader = request.headers.find("connection");
+   if(connHeader != request.headers.end())
+   {
+      const std::string value = toLower(connHeader->second);
+      if(value == "close")
+      {
+         request.keepAlive = false;
+      }
+      else if(value == "keep-alive")
+      {
+         request.keepAlive = true;
+      }
+   }
+
+   contentLength = 0;
+   auto lengthHeader = request.headers.find("content-length");
+   if(lengthHeader != request.headers.end())
+   {
+      try
+      {
+         contentLength = std::stoul(lengthHeader->second);
+      }
+      catch(const std::exception&)
+      {
+         return -1;
+      }
+   }
+   const bool stateImport = request.method == "PUT" && request.path.starts_with(CONVERSATIONS_PATH);
+   if(contentLength > (stateImport ? MAX_STATE_SIZE : MAX_BODY_SIZE))
+   {
+      return -1;
+   }
+   // Nobody without access to the state endpoints gets to park a state body in memory
+   if(contentLength > MAX_BODY_SIZE && !authorized(conn, request))
+   {
+      return -1;
+   }
+   bodyStart = headerEnd + 4;
+   return 1;
+}
+
+// Routes a parsed request to its handler
+void HttpServer::dispatch(const std::shared_ptr<Connection>& conn, HttpRequest& request)
+{
+   if(request.path == "/health")
+   {
+      sendResponse(*conn, 200, "application/json", "{\"status\":\"ok\"}", request.keepAlive);
+      return;
+   }
+
+   if(request.path == "/metrics")
+   {
+      InferenceEngine* engine = m_model->getEngine();
+      const PrefixCacheStats cache = engine ? engine->getPrefixCacheStats() : PrefixCacheStats();
+      const BlockStoreStats blocks = engine ? engine->getBlockStoreStats() : BlockStoreStats();
+      auto queueWait = [engine](RequestPriority priority)
+      {
+         const QueueWaitStats wait = engine ? engine->getQueueWaitStats(priority) : QueueWaitStats();
+         return nlohmann::json{
+            {"requests", wait.requests},
+            {"mean_ms", wait.requests > 0 ? wait.totalMs / wait.requests : 0.0},
+            {"max_ms", wait.maxMs}
+         };
+      };
+      const ThroughputEstimate throughput = engine ? engine->getThroughput() : ThroughputEstimate();
+      nlohmann::json body = {
+         {"queue_depth", engine ? engine->getQueueDepth() : 0},
+         {"throughput", {
+            {"prefill_tokens_per_sec", throughput.prefillTokensPerSec},
+            {"decode_tokens_per_sec", throughput.decodeTokensPerSec},
+            {"samples", throughput.samples}
+         }},
+         {"queue_wait", {
+            {"interactive", queueWait(RequestPriority::Interactive)},
+            {"background", queueWait(RequestPriority::Background)}
+         }},
+         {"prefix_cache", {
+            {"lookups", cache.lookups},
+            {"hits", cache.hits},
+            {"hit_rate", cache.lookups > 0 ? static_cast<double>(cache.hits) / cache.lookups : 0.0},
+            {"saved_prefill_tokens", cache.savedPrefillTokens},
+            {"resident_tokens", cache.residentTokens},
+            {"evicted_tokens", cache.evictedTokens}
+         }},
+         {"block_store", {
+            {"blocks", blocks.blocks},
+            {"bytes", blocks.bytes},
+            {"hits", blocks.hits},
+            {"misses", blocks.misses},
+            {"spliced_tokens", blocks.splicedTokens},
+            {"splice_ms", blocks.spliceMs},
+            {"block_prefill_ms", blocks.blockPrefillMs}
+         }}
+      };
+      const std::vector<RpcNodeStats> rpcNodes = m_model->getRpcStats();
+      if(!rpcNodes.empty())
+      {
+         nlohmann::json nodes = nlohmann::json::array();
+         for(const auto& node : rpcNodes)
+         {
+            nodes.push_back({
+               {"endpoint", node.endpoint},
+               {"free_bytes", node.freeBytes},
+               {"total_bytes", node.totalBytes},
+               {"layer_share", node.layerShare},
+               {"compute_ms", node.computeMs},
+               {"transfer_ms", node.transferMs},
+               {"evaluated", node.evaluated}
+            });
+         }
+         body["rpc_nodes"] = nodes;
+      }
+      if(m_cascade != nullptr)
+      {
+         const CascadeStats routed = m_cascade->getStats();
+         body["cascade"] = {
+            {"requests", routed.requests},
+            {"answered_small", routed.answeredSmall},
+            {"escalated", routed.escalated},
+            {"escalation_rate", routed.requests > 0 ? static_cast<double>(routed.escalated) / routed.requests : 0.0},
+            {"escalated_by", {
+               {"log_prob", routed.escalatedLogProb},
+               {"entropy", routed.escalatedEntropy},
+               {"stop_reason", routed.escalatedStopReason}
+            }},
+            {"reused_prompts", routed.reusedPrompts},
+            {"kept_for_deadline", routed.keptForDeadline},
+            {"small_ms", routed.smallMs},
+            {"large_ms", routed.largeMs},
+            {"saved_ms", routed.savedMs}
+         };
+      }
+      sendResponse(*conn, 200, "application/json", dumpJson(body), request.keepAlive);
+      return;
+   }
+
+   // Both read and replace KV state of other callers' conversations
+   if((request.path.starts_with("/debug/") || request.path.starts_with(CONVERSATIONS_PATH)) && !authorized(*conn, request))
+   {
+      sendError(*conn, 403, "Not allowed to use " + request.path, request.keepAlive);
+      return;
+   }
+
+   if(request.path == "/debug/splice-check")
+   {
+      if(request.method != "POST")
+      {
+         sendError(*conn, 405, "Use POST for /debug/splice-check", request.keepAlive);
+         return;
+      }
+      handleSpliceCheck(conn, request);
+      return;
+   }
+
+   if(request.path == "/v1/models")
+   {
+      if(request.method != "GET")
+      {
+         sendError(*conn, 405, "Use GET for /v1/models", request.keepAlive);
+         return;
+      }
+      nlohmann::json body = {
+         {"object", "list"},
+         {"data", nlohmann::json::array({
+            {{"id", m_model->getModelName()}, {"object", "model"}, {"owned_by", "smart-agent"}}
+         })}
+      };
+      sendResponse(*conn, 200, "application/json", dumpJson(body), request.keepAlive);
+      return;
+   }
+
+   if(request.path.starts_with(CONVERSATIONS_PATH))
+   {
+      handleConversation(conn, request);
+      return;
+   }
+
+   if(request.path == "/v1/chat/completions")
+   {
+      if(request.method != "POST")
+      {
+         sendError(*conn, 405, "Use POST for /v1/chat/completions", request.keepAlive);
+         return;
+      }
+      handleChatCompletion(conn, request);
+      return;
+   }
+
+   sendError(*conn, 404, "Unknown endpoint " + request.path, request.keepAlive);
+}
+
+// Handles POST /v1/chat/completions
+void HttpServer::handleChatCompletion(const std::shared_ptr<Connection>& conn, const HttpRequest& request)
+{
+   nlohmann::json body = nlohmann::json::parse(request.body, nullptr, false);
+   if(body.is_discarded() || !body.is_object() || !body.contains("messages") || !body["messages"].is_array())
+   {
+      sendError(*conn, 400, "Request body must be a JSON object with a 'messages' array", request.keepAlive);
+      return;
+   }
+
+   // Collect the messages - content may be a plain string or an array of text parts
+   std::vector<std::string> roles;
+   std::vector<std::string> contents;
+   for(const auto& msg : body["messages"])
+   {
+      if(!msg.is_object() || !msg.contains("role") || !msg["role"].is_string())
+      {
+         sendError(*conn, 400, "Every message needs a 'role'", request.keepAlive);
+         return;
+      }
+      std::string content;
+      if(msg.contains("content") && msg["content"].is_string())
+      {
+         content = msg["content"].get<std::string>();
+      }
+      else if(msg.contains("content") && msg["content"].is_array())
+      {
+         for(const auto& part : msg["content"])
+         {
+            if(!part.is_object() || !part.contains("type") || !part["type"].is_string())
+            {
+               sendError(*conn, 400, "Every content part needs a 'type'", request.keepAlive);
+               return;
+            }
+            // Parts other than text, e.g. images, are left out
+            if(part["type"].get<std::string>() == "text" && part.contains("text") && part["text"].is_string())
+            {
+               content += part["text"].get<std::string>();
+            }
+         }
+      }
+      else if(msg.contains("content") && !msg["content"].is_null())
+      {
+         sendError(*conn, 400, "A message's 'content' must be a string or an array of parts", request.keepAlive);
+         return;
+      }
+      roles.push_back(msg["role"].get<std::string>());
+      contents.push_back(std::move(content));
+   }
+   std::vector<llama_chat_message> messages;
+   for(size_t i = 0; i < roles.size(); ++i)
+   {
+      messages.push_back({roles[i].c_str(), contents[i].c_str()});
+   }
+
+   // Token budget and latency objective - "deadline_ms" counts from arrival and is an extension
+   // to the OpenAI schema
+   GenerationBudget budget;
+   if(body.contains("max_completion_tokens") && body["max_completion_tokens"].is_number_integer())
+   {
+      budget.maxTokens = body["max_completion_tokens"].get<int32_t>();
+   }
+   else if(body.contains("max_tokens") && body["max_tokens"].is_number_integer())
+   {
+      budget.maxTokens = body["max_tokens"].get<int32_t>();
+   }
+   if(body.contains("deadline_ms") && body["deadline_ms"].is_number() && body["deadline_ms"].get<double>() > 0.0)
+   {
+      budget.deadline = std::chrono::steady_clock::now() +
+                        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                           std::chrono::duration<double, std::milli>(body["deadline_ms"].get<double>()));
+   }
+
+   // A request the main model is not expected to answer in time goes to the resident fallback model
+   ModelInterface* model = m_model;
+   if(budget.hasDeadline() && m_fallbackModel != nullptr && m_fallbackModel->getEngine() != nullptr)
+   {
+      std::string text;
+      for(const auto& content : contents)
+      {
+         text += content;
+      }
+      const double mainMs = m_model->estimateTurnMs(text, {}, budget);
+      if(mainMs > budget.remainingMs() && m_fallbackModel->estimateTurnMs(text, {}, budget) < mainMs)
+      {
+         model = m_fallbackModel;
+      }
+   }
+
+   // Everything else tries the cascade's small model first; it tokenizes the prompt for both models
+   const bool cascade = m_cascade != nullptr && model == m_model;
+
+   InferenceEngine* engine = model->getEngine();
+   if(engine == nullptr)
+   {
+      sendError(*conn, 503, "No model is loaded", request.keepAlive);
+      return;
+   }
+
+   GenerationRequest genRequest;
+   // "conversation_id" is an extension - turns of one conversation keep their KV sequence resident
+   // between requests, and the conversation can be exported to another host
+   if(body.contains("conversation_id") && body["conversation_id"].is_string() && !cascade)
+   {
+      genRequest.sessionId = conversationSession(body["conversation_id"].get<std::string>());
+   }
+   if(!cascade)
+   {
+      auto formatted = model->applyChatTemplate(messages, true);
+      if(!formatted.has_value())
+      {
+         sendError(*conn, 400, "Could not apply the model's chat template", request.keepAlive);
+         return;
+      }
+      auto tokens = model->tokenize(formatted.value(), true);
+      if(!tokens.has_value())
+      {
+         sendError(*conn, 400, "Could not tokenize the prompt", request.keepAlive);
+         return;
+      }
+      genRequest.promptTokens = std::move(tokens.value());
+   }
+   genRequest.maxTokens = budget.maxTokens;
+   genRequest.deadline = budget.deadline;
+   // Fair queuing and rate limits are per end user; anonymous requests share one tenant
+   if(body.contains("user") && body["user"].is_string())
+   {
+      genRequest.clientId = static_cast<uint32_t>(std::hash<std::string>()(body["user"].get<std::string>()));
+   }
+   // The flex tier trades latency for throughput - batch jobs, ingestion and the like
+   if(body.contains("service_tier") && body["service_tier"].is_string() && body["service_tier"].get<std::string>() == "flex")
+   {
+      genRequest.priority = RequestPriority::Background;
+   }
+   if(body.contains("temperature") && body["temperature"].is_number())
+   {
+      genRequest.sampling.temperature = body["temperature"].get<float>();
+   }
+   if(body.contains("top_p") && body["top_p"].is_number())
+   {
+      genRequest.sampling.topP = body["top_p"].get<float>();
+   }
+   if(body.contains("top_k") && body["top_k"].is_number_integer())
+   {
+      genRequest.sampling.topK = body["top_k"].get<int32_t>();
+   }
+   if(body.contains("seed") && body["seed"].is_number_integer())
+   {
+      genRequest.sampling.seed = body["seed"].get<uint32_t>();
+   }
+
+   if(body.contains("stream") && !body["stream"].is_null() && !body["stream"].is_boolean())
+   {
+      sendError(*conn, 400, "'stream' must be a boolean", request.keepAlive);
+      return;
+   }
+   const bool stream = body.contains("stream") && body["stream"].is_boolean() && body["stream"].get<bool>();
+   const bool keepAlive = request.keepAlive && !stream;
+   const std::string id = "chatcmpl-" + std::to_string(m_nextCompletionId++);
+   const int64_t created = static_cast<int64_t>(std::time(nullptr));
+   const std::string modelName = model->getModelName();
+
+   conn->busy = true;
+
+   // Non-streamed response writer, given the name of the model that produced the reply
+   std::function<void(const GenerationResult&, const std::string&)> respond;
+   if(stream)
+   {
+      // Server-sent events: headers go out now, one event per generated piece
+      queueOutput(*conn, "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: text/event-stream\r\n"
+                         "Cache-Control: no-cache\r\n"
+                         "Connection: close\r\n\r\n");
+      nlohmann::json first = {
+         {"id", id}, {"object", "chat.completion.chunk"}, {"created", created}, {"model", modelName},
+         {"choices", nlohmann::json::array({
+            {{"index", 0}, {"delta", {{"role", "assistant"}, {"content", ""}}}, {"finish_reason", nullptr}}
+         })}
+      };
+      queueOutput(*conn, "data: " + dumpJson(first) + "\n\n");
+
+      auto makeChunk = [id, created, modelName](const std::string& text, const nlohmann::json& finish)
+      {
+         nlohmann::json chunk = {
+            {"id", id}, {"object", "chat.completion.chunk"}, {"created", created}, {"model", modelName},
+            {"choices", nlohmann::json::array({
+               {{"index", 0}, {"delta", text.empty() ? nlohmann::json::object() : nlohmann::json{{"content", text}}},
+                {"finish_reason", finish}}
+            })}
+         };
+         return "data: " + dumpJson(chunk) + "\n\n";
+      };
+
+      genRequest.onToken = [this, conn, makeChunk](const std::string& piece)
+      {
+         if(conn->closed)
+         {
+            return false;
+         }
+         // Never split a UTF-8 character across two events
+         std::string text = conn->pendingUtf8 + piece;
+         const size_t complete = completeUtf8Length(text);
+         conn->pendingUtf8 = text.substr(complete);
+         text.resize(complete);
+         if(!text.empty())
+         {
+            queueOutput(*conn, makeChunk(text, nullptr));
+         }
+         return true;
+      };
+      genRequest.onComplete = [this, conn, makeChunk](const GenerationResult& result)
+      {
+         std::string tail;
+         tail.swap(conn->pendingUtf8);
+         queueOutput(*conn, makeChunk(tail, finishReason(result.stopReason)) + "data: [DONE]\n\n");
+         conn->closeAfterWrite = true;
+         conn->busy = false;
+         wake();
+      };
+   }
+   else
+   {
+      genRequest.onToken = [conn](const std::string&)
+      {
+         return !conn->closed;
+      };
+      // Named at completion - behind a cascade the reply may come from either model
+      respond = [this, conn, id, created, keepAlive](const GenerationResult& result, const std::string& modelName)
+      {
+         if(result.stopReason == GenerationStopReason::DecodeError)
+         {
+            sendError(*conn, 500, "Generation failed", keepAlive);
+         }
+         else
+         {
+            nlohmann::json response = {
+               {"id", id}, {"object", "chat.completion"}, {"created", created}, {"model", modelName},
+               {"choices", nlohmann::json::array({
+                  {{"index", 0},
+                   {"message", {{"role", "assistant"}, {"content", result.text}}},
+                   {"finish_reason", finishReason(result.stopReason)}}
+               })},
+               {"usage", {
+                  {"prompt_tokens", result.promptTokens},
+                  {"completion_tokens", result.generatedTokens},
+                  {"total_tokens", result.promptTokens + result.generatedTokens}
+               }},
+               {"truncated", result.truncated}
+            };
+            sendResponse(*conn, 200, "application/json", dumpJson(response), keepAlive);
+         }
+         conn->busy = false;
+         wake();
+      };
+      genRequest.onComplete = [respond, modelName](const GenerationResult& result)
+      {
+         respond(result, modelName);
+      };
+   }
+
+   if(cascade)
+   {
+      std::vector<std::pair<std::string, std::string>> conversation;
+      for(size_t i = 0; i < roles.size(); ++i)
+      {
+         conversation.emplace_back(roles[i], contents[i]);
+      }
+      auto onComplete = genRequest.onComplete;
+      const bool accepted = m_cascade->submit(conversation, std::move(genRequest),
+         [onComplete, respond](const GenerationResult& result, ModelInterface* answeredBy)
+         {
+            // Streamed chunks keep the name they were started with
+            if(respond)
+            {
+               respond(result, answeredBy->getModelName());
+            }
+            else
+            {
+               onComplete(result);
+            }
+         });
+      if(!accepted)
+      {
+         // Stream headers may already be queued, so fail the way a broken generation would
+         GenerationResult failed;
+         failed.stopReason = GenerationStopReason::DecodeError;
+         onComplete(failed);
+      }
+      return;
+   }
+
+   engine->submit(std::move(genRequest));
+}
+
+// True if the request may use the conversation state and debug endpoints
+bool HttpServer::authorized(const Connection& conn, const HttpRequest& request) const
+{
+   if(m_adminToken.empty())
+   {
+      return conn.loopback;
+   }
+   auto header = request.headers.find("authorization");
+   return header != request.headers.end() && sameSecret(header->second, "Bearer " + m_adminToken);
+}
+
+// Handles POST /debug/splice-check
+void HttpServer::handleSpliceCheck(const std::shared_ptr<Connection>& conn, const HttpRequest& request)
+{
+   // Compares a prompt whose chunks come from stored KV blocks against prefilling it in order
+   nlohmann::json body = nlohmann::json::parse(request.body, nullptr, false);
+   if(!body.is_object() || !body.contains("prompt") || !body["prompt"].is_string() ||
+      !body.contains("chunks") || !body["chunks"].is_array())
+   {
+      sendError(*conn, 400, "Request body must be a JSON object with a 'prompt' string and a 'chunks' array", request.keepAlive);
+      return;
+   }
+   std::vector<std::string> chunks;
+   for(const auto& chunk : body["chunks"])
+   {
+      if(chunk.is_string())
+      {
+         chunks.push_back(chunk.get<std::string>());
+      }
+   }
+
+   queueTask(conn, [this, conn, prompt = body["prompt"].get<std::string>(), chunks = std::move(chunks),
+                    keepAlive = request.keepAlive]()
+   {
+      auto quality = m_model->checkChunkSplice(prompt, chunks);
+      if(!quality.has_value())
+      {
+         sendError(*conn, 500, "Splice check failed", keepAlive);
+         return;
+      }
+      const SpliceQuality& q = quality.value();
+      nlohmann::json response = {
+         {"top1_match", q.top1Match},
+         {"kl_divergence", q.klDivergence},
+         {"max_logit_delta", q.maxLogitDelta},
+         {"full_prefill_ms", q.fullPrefillMs},
+         {"spliced_prefill_ms", q.splicedPrefillMs},
+         {"spliced_tokens", q.splicedTokens}
+      };
+      sendResponse(*conn, 200, "application/json", dumpJson(response), keepAlive);
+   });
+}
+
+// Handles /v1/conversations/<id>[/state] - export, import and release of a conversation's KV state
+void HttpServer::handleConversation(const std::shared_ptr<Connection>& conn, HttpRequest& request)
+{
+   std::string conversationId = request.path.substr(CONVERSATIONS_PATH.size());
+   const bool state = conversationId.ends_with(STATE_SUFFIX);
+   if(state)
+   {
+      conversationId.resize(conversationId.size() - STATE_SUFFIX.size());
+   }
+   InferenceEngine* engine = m_model->getEngine();
+   if(conversationId.empty() || conversationId.find('/') != std::string::npos)
+   {
+      sendError(*conn, 404, "Unknown endpoint " + request.path, request.keepAlive);
+      return;
+   }
+   if(engine == nullptr)
+   {
+      sendError(*conn, 503, "No model is loaded", request.keepAlive);
+      return;
+   }
+   const int32_t sessionId = conversationSession(conversationId);
+
+   if(!state)
+   {
+      if(request.method != "DELETE")
+      {
+         sendError(*conn, 405, "Use DELETE for " + request.path, request.keepAlive);
+         return;
+      }
+      engine->releaseSession(sessionId);
+      sendResponse(*conn, 200, "application/json", "{\"released\":true}", request.keepAlive);
+      return;
+   }
+
+   // Both directions go through a file and wait for the worker to reach a step boundary, so they run
+   // on the task thread
+   const bool keepAlive = request.keepAlive;
+   if(request.method == "GET")
+   {
+      queueTask(conn, [this, conn, engine, sessionId, keepAlive]()
+      {
+         const std::string path = stateFilePath();
+         std::error_code ec;
+         std::string bytes;
+         if(engine->saveSession(sessionId, path))
+         {
+            std::ifstream file(path, std::ios::binary);
+            bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+         }
+         std::filesystem::remove(path, ec);
+         if(bytes.empty())
+         {
+            sendError(*conn, 409, "Conversation is not resident or has a request in flight", keepAlive);
+            return;
+         }
+         sendResponse(*conn, 200, "application/octet-stream", bytes, keepAlive);
+      });
+      return;
+   }
+   if(request.method == "PUT")
+   {
+      // The body's share of the state budget goes with it
+      const size_t admitted = request.admitted;
+      request.admitted = 0;
+      queueTask(conn, [this, conn, engine, sessionId, keepAlive, body = std::move(request.body)]() mutable
+      {
+         const std::string path = stateFilePath();
+         std::error_code ec;
+         bool written = false;
+         {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            file.write(body.data(), static_cast<std::streamsize>(body.size()));
+            written = static_cast<bool>(file.flush());
+         }
+         std::string().swap(body);
+         const bool restored = written && engine->restoreSession(sessionId, path);
+         std::filesystem::remove(path, ec);
+         if(!restored)
+         {
+            sendError(*conn, 409, "Conversation state could not be restored", keepAlive);
+            return;
+         }
+         sendResponse(*conn, 200, "application/json", "{\"restored\":true}", keepAlive);
+      }, admitted);
+      return;
+   }
+   sendError(*conn, 405, "Use GET or PUT for " + request.path, request.keepAlive);
+}
+
+// Runs work that waits on the engine on the task thread; the connection stays busy until it replies
+void HttpServer::queueTask(const std::shared_ptr<Connection>& conn, std::function<void()> task, size_t admitted /* 0 */)
+{
+   conn->busy = true;
+   {
+      std::lock_guard<std::mutex> lock(m_taskMutex);
+      m_tasks.push_back([this, conn, task = std::move(task), admitted]()
+      {
+         if(!conn->closed)
+         {
+            task();
+         }
+         m_stateBytes -= admitted;
+         conn->busy = false;
+         wake();
+      });
+   }
+   m_taskWake.notify_one();
+}
+
+// Task thread body
+void HttpServer::runTasks()
+{
+   while(true)
+   {
+      std::function<void()> task;
+      {
+         std::unique_lock<std::mutex> lock(m_taskMutex);
+         m_taskWake.wait(lock, [this]() { return m_stoppingTasks || !m_tasks.empty(); });
+         if(m_stoppingTasks)
+         {
+            return;
+         }
+         task = std::move(m_tasks.front());
+         m_tasks.pop_front();
+      }
+      task();
+   }
+}
+
+// Queues a complete response on a connection
+void HttpServer::sendResponse(Connection& conn, int status, const std::string& contentType,
+                              const std::string& body, bool keepAlive)
+{
+   std::string response = "HTTP/1.1 " + std::to_string(status) + " " + statusText(status) + "\r\n";
+   response += "Content-Type: " + contentType + "\r\n";
+   response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+   response += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+   response += body;
+   if(!keepAlive)
+   {
+      conn.closeAfterWrite = true;
+   }
+   queueOutput(conn, response);
+}
+
+// Queues an OpenAI style error object
+void HttpServer::sendError(Connection& conn, int status, const std::string& message, bool keepAlive)
+{
+   nlohmann::json body = {
+      {"error", {{"message", message}, {"type", status >= 500 ? "server_error" : "invalid_request_error"}}}
+   };
+   sendResponse(conn, status, "application/json", dumpJson(body), keepAlive);
+}
+
+// Appends bytes to a connection's output from any thread and wakes the loop
+void HttpServer::queueOutput(Connection& conn, const std::string& data)
+{
+   {
+      std::lock_guard<std::mutex> lock(conn.outMutex);
+      conn.outBuf += data;
+   }
+   wake();
+}
+
+// Wakes the event loop from another thread
+void HttpServer::wake()
+{
+   if(m_wakePipe[1] != -1)
+   {
+      const char byte = 1;
+      // A full pipe already guarantees a wake-up, so EAGAIN is fine to ignore
+      if(write(m_wakePipe[1], &byte, 1) == -1)
+      {
+      }
+   }
+}
+
+// Closes and forgets a connection
+void HttpServer::closeConnection(int fd)
+{
+   auto iter = m_connections.find(fd);
+   if(iter == m_connections.end())
+   {
+      return;
+   }
+   // Any generation still running for this connection cancels itself on its next token
+   iter->second->closed = true;
+   m_stateBytes -= iter->second->admitted;
+   iter->second->admitted = 0;
+   close(fd);
+   m_connections.erase(iter);
+}
@@ -0,0 +1,213 @@
+/**
+ * @file HttpServer.h
+ * @brief Headless HTTP front end exposing the loaded model through an OpenAI compatible
+ *        chat-completions endpoint. A single poll() driven loop services every connection and
+ *        hands generation straight to the model's InferenceEngine.
+ */
+#ifndef HTTP_SERVER_H
+#define HTTP_SERVER_H
+
+#include "ModelInterface.h"
+#include "ModelCascade.h"
+#include <nlohmann/json.hpp>
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+class HttpServer
+{
+public:
+   /**
+    * @brief Constructs the server for an already loaded model
+    *
+    * @param model The model requests are served from
+    * @param host Address to bind, e.g. "127.0.0.1"
+    * @param port TCP port to listen on
+    */
+   HttpServer(ModelInterface* model, std::string host, uint16_t port);
+
+   /**
+    * @brief Closes the listening socket and every open connection
+    */
+   ~HttpServer();
+
+   /**
+    * @brief Creates the listening socket
+    *
+    * @return bool True if the socket is bound and listening
+    */
+   bool listen();
+
+   /**
+    * @brief Runs the event loop until stop() is called
+    */
+   void run();
+
+   /**
+    * @brief Asks the event loop to exit; safe to call from a signal handler
+    */
+   void stop();
+
+   /**
+    * @brief Sets a smaller resident model for requests the main one cannot answer by their deadline
+    *
+    * @param model Loaded fallback model, nullptr to disable the fallback
+    */
+   inline void setFallbackModel(ModelInterface* model)
+   {
+      m_fallbackModel = model;
+   }
+
+   /**
+    * @brief Routes requests without a deadline through a small-to-large cascade
+    *
+    * @param cascade Cascade whose large model is the main model, nullptr to disable it
+    */
+   inline void setCascade(ModelCascade* cascade)
+   {
+      m_cascade = cascade;
+   }
+
+   /**
+    * @brief Requires "Authorization: Bearer <token>" on the conversation state and debug endpoints
+    *
+    * Without a token those endpoints only answer connections from the loopback interface.
+    *
+    * @param token Shared secret, empty for loopback-only access
+    */
+   inline void setAdminToken(std::string token)
+   {
+      m_adminToken = std::move(token);
+   }
+
+private:
+   // A parsed HTTP request
+   struct HttpRequest
+   {
+      std::string method;
+      std::string path;
+      std::map<std::string, std::string> headers;
+      std::string body;
+      bool keepAlive = true;
+      // Share of the state body budget the body holds until whoever takes it releases it
+      size_t admitted = 0;
+   };
+
+   // Per connection state. The inference worker appends to the output buffer from its own thread,
+   // everything else is only touched by the event loop.
+   struct Connection
+   {
+      int fd = -1;
+      std::string inBuf;
+      std::mutex outMutex;
+      std::string outBuf;
+      // Bytes of a multi-byte UTF-8 sequence that has not been completed yet
+      std::string pendingUtf8;
+      // A generation request is in flight for this connection
+      std::atomic<bool> busy{false};
+      // Close once the output buffer has drained
+      std::atomic<bool> closeAfterWrite{false};
+      // The peer shut down its sending side, close once every request it sent has been answered
+      bool peerClosed = false;
+      // The socket has gone away - the worker should cancel generation
+      std::atomic<bool> closed{false};
+      // The peer connected from the loopback interface
+      bool loopback = false;
+      // Share of the state body budget reserved for the request at the front of the input
+      size_t admitted = 0;
+   };
+
+   // Accepts every pending connection on the listening socket
+   void acceptConnections();
+
+   // Reads available bytes from a connection up to its input limit, returns false on a read error
+   bool readConnection(Connection& conn);
+
+   // Returns how far a connection's input buffer may grow before the rest is left in the socket
+   size_t inputLimit(const Connection& conn) const;
+
+   // Reserves room in the shared budget for a state body the connection has announced; false while
+   // other imports hold too much of it
+   bool admitBody(Connection& conn);
+
+   // Writes as much buffered output as the socket accepts, returns false on error
+   bool flushConnection(Connection& conn);
+
+   // Parses and dispatches complete requests sitting in the input buffer
+   void processInput(const std::shared_ptr<Connection>& conn);
+
+   // Attempts to parse a single request off the front of the input buffer
+   // Returns 1 when a request was parsed, 0 when more data is needed, -1 on a malformed request
+   int parseRequest(Connection& conn, HttpRequest& request);
+
+   // Parses the request line and headers, reporting where the body starts and how long it is
+   // Returns 1 when the head is complete and acceptable, 0 when more data is needed, -1 when malformed
+   int parseHead(const Connection& conn, HttpRequest& request, size_t& bodyStart, size_t& contentLength) const;
+
+   // Routes a parsed request to its handler
+   void dispatch(const std::shared_ptr<Connection>& conn, HttpRequest& request);
+
+   // True if the request may use the conversation state and debug endpoints
+   bool authorized(const Connection& conn, const HttpRequest& request) const;
+
+   // Handles POST /v1/chat/completions
+   void handleChatCompletion(const std::shared_ptr<Connection>& conn, const HttpRequest& request);
+
+   // Handles POST /debug/splice-check
+   void handleSpliceCheck(const std::shared_ptr<Connection>& conn, const HttpRequest& request);
+
+   // Handles /v1/conversations/<id>[/state] - export, import and release of a conversation's KV state
+   void handleConversation(const std::shared_ptr<Connection>& conn, HttpRequest& request);
+
+   // Runs work that waits on the engine on the task thread; the connection stays busy until it replies.
+   // admitted is the share of the state budget released once the task is done.
+   void queueTask(const std::shared_ptr<Connection>& conn, std::function<void()> task, size_t admitted = 0);
+
+   // Task thread body
+   void runTasks();
+
+   // Queues a complete response on a connection
+   void sendResponse(Connection& conn, int status, const std::string& contentType,
+                     const std::string& body, bool keepAlive);
+
+   // Queues an OpenAI style error object
+   void sendError(Connection& conn, int status, const std::string& message, bool keepAlive);
+
+   // Appends bytes to a connection's output from any thread and wakes the loop
+   void queueOutput(Connection& conn, const std::string& data);
+
+   // Wakes the event loop from another thread
+   void wake();
+
+   // Closes and forgets a connection
+   void closeConnection(int fd);
+
+   ModelInterface* m_model;
+   ModelInterface* m_fallbackModel;
+   ModelCascade* m_cascade;
+   std::string m_host;
+   uint16_t m_port;
+   int m_listenFd;
+   int m_wakePipe[2];
+   std::atomic<bool> m_running;
+   uint64_t m_nextCompletionId;
+   std::map<int, std::shared_ptr<Connection>> m_connections;
+   std::string m_adminToken;
+   // State bodies admitted for reading and not yet released by their import
+   std::atomic<size_t> m_stateBytes;
+   // State transfers and diagnostics run here so the event loop never waits on the engine
+   std::thread m_taskThread;
+   std::mutex m_taskMutex;
+   std::condition_variable m_taskWake;
+   std::deque<std::function<void()>> m_tasks;
+   bool m_stoppingTasks;
+};
+
+#endif
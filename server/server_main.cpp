@@ -0,0 +1,171 @@
+/**
+ * @file server_main.cpp
+ * @brief Entry point for smart-agent-server, a headless OpenAI compatible HTTP front end over the
+ *        ModelManager / ModelInterface inference stack.
+ */
+#include "HttpServer.h"
+#include "ModelManager.h"
+#include <iostream>
+#include <string>
+#include <csignal>
+#include <cstdlib>
+
+namespace
+{
+   HttpServer* g_server = nullptr;
+
+   void handleSignal(int)
+   {
+      if(g_server)
+      {
+         g_server->stop();
+      }
+   }
+
+   void printUsage(const char* argv0)
+   {
+      std::cerr << "Usage: " << argv0 << " --models-dir <dir> --model <file.gguf> [options]\n"
+                << "  --host <addr>     Address to bind (default 127.0.0.1)\n"
+                << "  --port <port>     Port to listen on (default 8080)\n"
+                << "  --slots <n>       Concurrent sequences decoded per batch (default 8)\n"
+                << "  --prefix-cache <n> Tokens of shared prompt prefixes kept resident (default 8192, 0 disables)\n"
+                << "  --client-rate <n> Prompt plus generated tokens per second per user (default 0, unlimited)\n"
+                << "  --rpc <host:port,...> Split models across llama.cpp rpc-server processes by free memory\n"
+                << "  --rpc-profile     Time compute and transfer per RPC node (slows decoding)\n"
+                << "  --fallback-model <file.gguf> Smaller model for requests whose deadline_ms the main model would miss\n"
+                << "  --cascade         Answer with the fallback model first, escalating unsure replies to the main model\n"
+                << "  --cascade-min-logprob <x> Escalate below this mean token log-probability (default -1.0)\n"
+                << "  --cascade-max-spikes <x> Escalate above this fraction of high-entropy tokens (default 0.15)\n"
+                << "Conversation state and /debug endpoints need \"Authorization: Bearer $SMART_AGENT_ADMIN_TOKEN\"\n"
+                << "when that variable is set, and are limited to loopback clients otherwise.\n";
+   }
+}
+
+int main(int argc, char** argv)
+{
+   std::string modelsDir;
+   std::string modelName;
+   std::string fallbackName;
+   std::string host = "127.0.0.1";
+   int port = 8080;
+   int slots = 8;
+   int prefixCache = 8192;
+   std::string rpcEndpoints;
+   bool rpcProfile = false;
+   double clientRate = 0.0;
+   bool cascade = false;
+   CascadePolicy cascadePolicy;
+
+   for(int i = 1; i < argc; ++i)
+   {
+      const std::string arg = argv[i];
+      const bool hasValue = i + 1 < argc;
+      if(arg == "--models-dir" && hasValue)      modelsDir = argv[++i];
+      else if(arg == "--model" && hasValue)      modelName = argv[++i];
+      else if(arg == "--fallback-model" && hasValue) fallbackName = argv[++i];
+      else if(arg == "--host" && hasValue)       host = argv[++i];
+      else if(arg == "--port" && hasValue)       port = std::atoi(argv[++i]);
+      else if(arg == "--slots" && hasValue)      slots = std::atoi(argv[++i]);
+      else if(arg == "--prefix-cache" && hasValue) prefixCache = std::atoi(argv[++i]);
+      else if(arg == "--rpc" && hasValue)        rpcEndpoints = argv[++i];
+      else if(arg == "--rpc-profile")            rpcProfile = true;
+      else if(arg == "--client-rate" && hasValue) clientRate = std::atof(argv[++i]);
+      else if(arg == "--cascade")                cascade = true;
+      else if(arg == "--cascade-min-logprob" && hasValue) cascadePolicy.minMeanLogProb = std::atof(argv[++i]);
+      else if(arg == "--cascade-max-spikes" && hasValue)  cascadePolicy.maxEntropySpikeRate = std::atof(argv[++i]);
+      else
+      {
+         printUsage(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+   if(modelsDir.empty() || modelName.empty() || port <= 0 || port > 65535 || slots <= 0 || prefixCache < 0 || clientRate < 0.0 ||
+      (cascade && fallbackName.empty()))
+   {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   ModelManager* manager = ModelManager::getInstance();
+   manager->setModelDirectory(modelsDir);
+   manager->setSequenceSlots(static_cast<uint32_t>(slots));
+   // Conversations opening with the same system prompt / files share its KV cells
+   manager->setPrefixCacheCells(static_cast<uint32_t>(prefixCache));
+   #ifdef SMART_AGENT_RPC
+      manager->setRpcEndpoints(RpcCluster::parseEndpoints(rpcEndpoints), rpcProfile);
+   #else
+      if(!rpcEndpoints.empty() || rpcProfile)
+      {
+         std::cerr << "Error : --rpc and --rpc-profile need a build with GGML_RPC on" << std::endl;
+         return EXIT_FAILURE;
+      }
+   #endif
+   auto loadResp = manager->loadModel(modelName);
+   if(!loadResp.has_value())
+   {
+      std::cerr << "Error : failed to load model " << modelName << std::endl;
+      return EXIT_FAILURE;
+   }
+   ModelInterface* fallback = nullptr;
+   if(!fallbackName.empty())
+   {
+      auto fallbackResp = manager->loadFallbackModel(fallbackName);
+      if(!fallbackResp.has_value())
+      {
+         std::cerr << "Error : failed to load fallback model " << fallbackName << std::endl;
+         manager->unloadModel();
+         return EXIT_FAILURE;
+      }
+      fallback = fallbackResp.value();
+   }
+   for(ModelInterface* model : {loadResp.value(), fallback})
+   {
+      if(model != nullptr && model->getEngine() != nullptr)
+      {
+         // Requests are accounted to their "user" field, so one caller cannot starve the rest
+         ClientLimits limits;
+         limits.tokensPerSecond = clientRate;
+         model->getEngine()->setDefaultClientLimits(limits);
+      }
+   }
+
+   // Writes to clients that went away are handled through the return value instead
+   std::signal(SIGPIPE, SIG_IGN);
+
+   int status = EXIT_SUCCESS;
+   {
+      HttpServer server(loadResp.value(), host, static_cast<uint16_t>(port));
+      server.setFallbackModel(fallback);
+      // Taken from the environment so the secret does not show up in the process list
+      const char* adminToken = std::getenv("SMART_AGENT_ADMIN_TOKEN");
+      server.setAdminToken(adminToken != nullptr ? adminToken : "");
+      if(cascade)
+      {
+         auto cascadeResp = manager->enableCascade(cascadePolicy);
+         if(!cascadeResp.has_value())
+         {
+            std::cerr << "Error : could not route between " << fallbackName << " and " << modelName << std::endl;
+            status = EXIT_FAILURE;
+         }
+         server.setCascade(cascadeResp.value_or(nullptr));
+      }
+      if(status == EXIT_SUCCESS && server.listen())
+      {
+         g_server = &server;
+         std::signal(SIGINT, handleSignal);
+         std::signal(SIGTERM, handleSignal);
+         std::cout << "smart-agent-server listening on " << host << ":" << port
+                   << " with " << modelName << " (" << slots << " slots)" << std::endl;
+         server.run();
+         g_server = nullptr;
+      }
+      else
+      {
+         status = EXIT_FAILURE;
+      }
+      // Stop the worker while the server (which its callbacks reference) is still alive
+      manager->unloadModel();
+   }
+
+   return status;
+}
@@ -0,0 +1,413 @@
+/**
+ * @file worker_main.cpp
+ * @brief Entry point for smart-agent-worker, the process a ModelWorker launches to host a model.
+ *        Reads prompts from the supervisor's request ring, streams pieces back through the
+ *        response ring and snapshots the conversation and its KV cache after every completed turn.
+ */
+#include "ModelInterface.h"
+#include "ModelWorker.h"
+#include "DaemonProtocol.h"
+#include "ShmRing.h"
+#include <iostream>
+#include <filesystem>
+#include <string>
+#include <cstdlib>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <csignal>
+#endif
+
+using WorkerProtocol::Record;
+
+namespace
+{
+   // How often an idle worker checks that its supervisor is still around
+   const std::chrono::milliseconds IDLE_INTERVAL(500);
+
+   // How long a piece may wait for room before the supervisor is presumed gone
+   const std::chrono::milliseconds PIECE_TIMEOUT(10000);
+
+   void printUsage(const char* argv0)
+   {
+      std::cerr << "Usage: " << argv0 << " --model <path> --slots <n> [--prefix-cache <n>] --requests <ring> --responses <ring> --checkpoint <path>\n"
+                << "  Launched by smart-agent front ends, not meant to be run by hand.\n";
+   }
+
+   bool writeRecord(ShmRing& ring, const std::string& record)
+   {
+      return ring.write(record.data(), static_cast<uint32_t>(record.size()), PIECE_TIMEOUT);
+   }
+
+   bool writeTag(ShmRing& ring, Record tag)
+   {
+      const uint8_t byte = static_cast<uint8_t>(tag);
+      return ring.write(&byte, 1, PIECE_TIMEOUT);
+   }
+
+   // Hands the chunks of a Prefetch record, tag already read, to the model
+   void prefetch(ModelInterface& model, WireReader& reader)
+   {
+      uint32_t count = 0;
+      if(!reader.u32(count))
+      {
+         return;
+      }
+      std::vector<std::string> chunks(count);
+      for(auto& chunk : chunks)
+      {
+         if(!reader.str(chunk))
+         {
+            return;
+         }
+      }
+      model.prefetchChunks(chunks);
+   }
+}
+
+int main(int argc, char** argv)
+{
+   std::string modelPath;
+   std::string requestRing;
+   std::string responseRing;
+   std::string checkpointPath;
+   int slots = 1;
+   int prefixCache = 0;
+
+   for(int i = 1; i < argc; ++i)
+   {
+      const std::string arg = argv[i];
+      const bool hasValue = i + 1 < argc;
+      if(arg == "--model" && hasValue)           modelPath = argv[++i];
+      else if(arg == "--slots" && hasValue)      slots = std::atoi(argv[++i]);
+      else if(arg == "--prefix-cache" && hasValue) prefixCache = std::atoi(argv[++i]);
+      else if(arg == "--requests" && hasValue)   requestRing = argv[++i];
+      else if(arg == "--responses" && hasValue)  responseRing = argv[++i];
+      else if(arg == "--checkpoint" && hasValue) checkpointPath = argv[++i];
+      else
+      {
+         printUsage(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+   if(modelPath.empty() || requestRing.empty() || responseRing.empty() || checkpointPath.empty() || slots <= 0 || prefixCache < 0)
+   {
+      printUsage(argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   #ifdef __linux__
+      // Never outlive the supervisor
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+   #endif
+   const pid_t supervisor = getppid();
+
+   auto requestsOpened = ShmRing::open(requestRing);
+   auto responsesOpened = ShmRing::open(responseRing);
+   if(!requestsOpened.has_value() || !responsesOpened.has_value())
+   {
+      std::cerr << "Error : worker could not open its rings" << std::endl;
+      return EXIT_FAILURE;
+   }
+   ShmRing& requests = *requestsOpened.value();
+   ShmRing& responses = *responsesOpened.value();
+
+   ModelInterface model(modelPath, static_cast<uint32_t>(slots), static_cast<uint32_t>(prefixCache));
+   if(!model.load())
+   {
+      writeTag(responses, Record::LoadFailed);
+      return EXIT_FAILURE;
+   }
+   writeTag(responses, Record::Ready);
+
+   std::string record;
+   while(true)
+   {
+      if(!requests.read(record, IDLE_INTERVAL))
+      {
+         // A corrupted ring is not recovered from here; the supervisor restarts the worker
+         if(requests.isBroken() || getppid() != supervisor)
+         {
+            break;
+         }
+         continue;
+      }
+      if(record.empty())
+      {
+         continue;
+      }
+
+      WireReader reader(record);
+      uint8_t tag = 0;
+      reader.u8(tag);
+      const Record kind = static_cast<Record>(tag);
+
+      if(kind == Record::Shutdown)
+      {
+         break;
+      }
+
+      if(kind == Record::Prefetch)
+      {
+         prefetch(model, reader);
+         continue;
+      }
+
+      if(kind == Record::Close)
+      {
+         int32_t conversation = 0;
+         if(reader.i32(conversation))
+         {
+            model.closeConversation(conversation);
+         }
+         continue;
+      }
+
+      if(kind == Record::Restore)
+      {
+         int32_t conversation = 0;
+         uint32_t count = 0;
+         std::vector<std::pair<std::string, std::string>> messages;
+         bool valid = reader.i32(conversation) && reader.u32(count);
+         for(uint32_t i = 0; valid && i < count; ++i)
+         {
+            std::string role, content;
+            valid = reader.str(role) && reader.str(content);
+            messages.emplace_back(std::move(role), std::move(content));
+         }
+         if(!valid)
+         {
+            continue;
+         }
+         // Without a usable checkpoint the next turn simply prefills the whole history
+         const std::string checkpoint = WorkerProtocol::checkpointFile(checkpointPath, conversation);
+         std::error_code ec;
+         if(std::filesystem::exists(checkpoint, ec) && !model.restoreSnapshot(checkpoint, conversation))
+         {
+            std::cerr << "Warning : worker could not restore " << checkpoint << std::endl;
+         }
+         // The supervisor's history wins over the checkpoint's should they ever differ
+         model.restoreConversation(messages, conversation);
+         continue;
+      }
+
+      if(kind == Record::Keep)
+      {
+         int32_t conversation = 0;
+         uint32_t variant = 0;
+         if(!reader.i32(conversation) || !reader.u32(variant))
+         {
+            continue;
+         }
+         const bool kept = model.keepVariant(variant, conversation);
+         if(kept)
+         {
+            model.saveSnapshot(WorkerProtocol::checkpointFile(checkpointPath, conversation), conversation);
+         }
+         WireWriter ack;
+         ack.u8(static_cast<uint8_t>(Record::Kept)).u8(kept ? 1 : 0);
+         if(!writeRecord(responses, ack.data()))
+         {
+            break;
+         }
+         continue;
+      }
+
+      if(kind == Record::FanOut)
+      {
+         std::string systemPrompt;
+         uint32_t count = 0;
+         int32_t maxTokens = -1;
+         bool valid = reader.str(systemPrompt) && reader.u32(count);
+         std::vector<std::string> prompts(valid ? count : 0);
+         for(auto& prompt : prompts)
+         {
+            valid = valid && reader.str(prompt);
+         }
+         if(!valid || !reader.i32(maxTokens))
+         {
+            continue;
+         }
+
+         // Stateless - nothing to checkpoint
+         const std::vector<GenerationResult> results = model.fanOut(systemPrompt, prompts, maxTokens);
+         bool supervisorGone = false;
+         for(uint32_t index = 0; index < results.size() && !supervisorGone; ++index)
+         {
+            const GenerationResult& result = results[index];
+            WireWriter done;
+            done.u8(static_cast<uint8_t>(Record::TaskDone))
+                .u32(index)
+                .str(result.text)
+                .u8(static_cast<uint8_t>(result.stopReason))
+                .i32(result.promptTokens)
+                .i32(result.cachedTokens)
+                .i32(result.generatedTokens)
+                .f64(result.queueMs)
+                .f64(result.prefillMs)
+                .f64(result.decodeMs);
+            supervisorGone = !writeRecord(responses, done.data());
+         }
+         if(supervisorGone || !writeTag(responses, Record::Done))
+         {
+            break;
+         }
+         continue;
+      }
+
+      if(kind == Record::Variants)
+      {
+         int32_t conversation = 0;
+         uint32_t count = 0;
+         std::string role, text;
+         uint32_t chunkCount = 0;
+         if(!reader.i32(conversation) || !reader.u32(count) || !reader.str(role) || !reader.str(text) ||
+            !reader.u32(chunkCount))
+         {
+            continue;
+         }
+         std::vector<std::string> chunks(chunkCount);
+         bool valid = true;
+         for(auto& chunk : chunks)
+         {
+            valid = valid && reader.str(chunk);
+         }
+         if(!valid)
+         {
+            continue;
+         }
+
+         // One cancel stops every variant; pieces of all variants arrive from the engine's thread
+         bool cancelled = false;
+         bool supervisorGone = false;
+         std::vector<GenerationResult> results = model.sendPromptVariants(text, role, count,
+            [&](uint32_t variant, const std::string& piece)
+         {
+            std::string control;
+            if(!cancelled && requests.tryRead(control) && !control.empty() &&
+               static_cast<Record>(static_cast<uint8_t>(control[0])) == Record::Cancel)
+            {
+               cancelled = true;
+            }
+            if(cancelled || supervisorGone)
+            {
+               return false;
+            }
+            WireWriter out;
+            out.u8(static_cast<uint8_t>(Record::VariantPiece)).u32(variant);
+            std::string bytes = out.data();
+            bytes += piece;
+            supervisorGone = !writeRecord(responses, bytes);
+            return !supervisorGone;
+         }, chunks, conversation);
+         if(supervisorGone)
+         {
+            break;
+         }
+
+         // No checkpoint until a variant is kept - the conversation has no reply yet
+         for(uint32_t variant = 0; variant < results.size() && !supervisorGone; ++variant)
+         {
+            const GenerationResult& result = results[variant];
+            WireWriter done;
+            done.u8(static_cast<uint8_t>(Record::VariantDone))
+                .u32(variant)
+                .u8(static_cast<uint8_t>(result.stopReason))
+                .i32(result.promptTokens)
+                .i32(result.cachedTokens)
+                .i32(result.generatedTokens)
+                .f64(result.queueMs)
+                .f64(result.prefillMs)
+                .f64(result.decodeMs);
+            supervisorGone = !writeRecord(responses, done.data());
+         }
+         if(supervisorGone || !writeTag(responses, Record::Done))
+         {
+            break;
+         }
+         continue;
+      }
+
+      if(kind != Record::Prompt)
+      {
+         continue;
+      }
+      int32_t conversation = 0;
+      std::string role, text;
+      uint32_t chunkCount = 0;
+      if(!reader.i32(conversation) || !reader.str(role) || !reader.str(text) || !reader.u32(chunkCount))
+      {
+         continue;
+      }
+      std::vector<std::string> chunks(chunkCount);
+      bool valid = true;
+      for(auto& chunk : chunks)
+      {
+         valid = valid && reader.str(chunk);
+      }
+      GenerationBudget budget;
+      double deadlineMs = -1.0;
+      if(!valid || !reader.i32(budget.maxTokens) || !reader.f64(deadlineMs))
+      {
+         continue;
+      }
+      if(deadlineMs >= 0.0)
+      {
+         budget.deadline = std::chrono::steady_clock::now() +
+                           std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(deadlineMs));
+      }
+
+      bool supervisorGone = false;
+      GenerationResult result = model.sendPrompt(text, role, [&](const std::string& piece)
+      {
+         // A cancel or chunks to prefetch are all that can arrive mid-turn
+         std::string control;
+         if(requests.tryRead(control) && !control.empty())
+         {
+            WireReader controlReader(control);
+            uint8_t controlTag = 0;
+            controlReader.u8(controlTag);
+            if(static_cast<Record>(controlTag) == Record::Cancel)
+            {
+               return false;
+            }
+            if(static_cast<Record>(controlTag) == Record::Prefetch)
+            {
+               prefetch(model, controlReader);
+            }
+         }
+         std::string out(1, static_cast<char>(Record::Piece));
+         out += piece;
+         if(!writeRecord(responses, out))
+         {
+            supervisorGone = true;
+            return false;
+         }
+         return true;
+      }, chunks, budget, conversation);
+      if(supervisorGone)
+      {
+         break;
+      }
+
+      // Checkpoint before acknowledging so a crash after Done never loses the turn
+      model.saveSnapshot(WorkerProtocol::checkpointFile(checkpointPath, conversation), conversation);
+
+      WireWriter done;
+      done.u8(static_cast<uint8_t>(Record::Done))
+          .u8(static_cast<uint8_t>(result.stopReason))
+          .i32(result.promptTokens)
+          .i32(result.cachedTokens)
+          .i32(result.generatedTokens)
+          .f64(result.queueMs)
+          .f64(result.prefillMs)
+          .f64(result.decodeMs);
+      if(!writeRecord(responses, done.data()))
+      {
+         break;
+      }
+   }
+
+   model.unload();
+   return EXIT_SUCCESS;
+}